@@ -0,0 +1,1089 @@
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#define DS_VM_IMPLEMENTATION
+#define DS_VM_STATIC
+#define DS_VM_THREADS
+#include "ds_vm.h"
+
+// ------------------------------------------------------------------
+// Benchmark suite
+// Writes all results as JSON to stdout or to the file passed as
+// first argument. --quick reduces the number of iterations.
+// ------------------------------------------------------------------
+
+typedef std::chrono::high_resolution_clock bm_clock;
+
+static double elapsed_ns(bm_clock::time_point start) {
+	return std::chrono::duration<double, std::nano>(bm_clock::now() - start).count();
+}
+
+static int bm_scale = 1;
+
+// the result is written into this to keep the compiler from removing the work
+static volatile float bm_sink = 0.0f;
+
+// ------------------------------------------------------------------
+// minimal JSON writer
+// ------------------------------------------------------------------
+struct bm_json {
+	FILE* file;
+	int depth;
+	int first[16];
+};
+
+static void json_separator(bm_json* json) {
+	if (!json->first[json->depth]) {
+		fprintf(json->file, ",");
+	}
+	json->first[json->depth] = 0;
+	fprintf(json->file, "\n%*s", json->depth * 2, "");
+}
+
+static void json_key(bm_json* json, const char* key) {
+	json_separator(json);
+	if (key) {
+		fprintf(json->file, "\"%s\": ", key);
+	}
+}
+
+static void json_begin(bm_json* json, const char* key, char bracket) {
+	if (json->depth > 0) {
+		json_key(json, key);
+	}
+	fprintf(json->file, "%c", bracket);
+	json->first[++json->depth] = 1;
+}
+
+static void json_end(bm_json* json, char bracket) {
+	--json->depth;
+	fprintf(json->file, "\n%*s%c", json->depth * 2, "", bracket);
+}
+
+static void json_number(bm_json* json, const char* key, double value) {
+	json_key(json, key);
+	fprintf(json->file, "%.6g", value);
+}
+
+static void json_int(bm_json* json, const char* key, int value) {
+	json_key(json, key);
+	fprintf(json->file, "%d", value);
+}
+
+static void json_string(bm_json* json, const char* key, const char* value) {
+	json_key(json, key);
+	fprintf(json->file, "\"%s\"", value);
+}
+
+// ------------------------------------------------------------------
+// generated corpus
+// ------------------------------------------------------------------
+static unsigned int bm_seed = 12345;
+
+static unsigned int bm_random(unsigned int n) {
+	bm_seed = bm_seed * 1664525 + 1013904223;
+	return (bm_seed >> 8) % n;
+}
+
+// writes a random expression of the given depth using num_variables variables
+static int generate_expression(char* out, int depth, int num_variables) {
+	static const char* binary[] = { " + ", " - ", " * ", " / " };
+	static const char* unary[] = { "sin", "cos", "abs", "-" };
+	if (depth == 0) {
+		if (bm_random(3) == 0) {
+			return sprintf(out, "%d.%d", bm_random(100), bm_random(10));
+		}
+		return sprintf(out, "V%d", bm_random(num_variables));
+	}
+	int len = 0;
+	switch (bm_random(6)) {
+		case 0: case 1: case 2:
+			len += sprintf(out + len, "(");
+			len += generate_expression(out + len, depth - 1, num_variables);
+			len += sprintf(out + len, "%s", binary[bm_random(4)]);
+			len += generate_expression(out + len, depth - 1, num_variables);
+			len += sprintf(out + len, ")");
+			break;
+		case 3:
+			len += sprintf(out + len, "%s(", unary[bm_random(4)]);
+			len += generate_expression(out + len, depth - 1, num_variables);
+			len += sprintf(out + len, ")");
+			break;
+		case 4:
+			len += sprintf(out + len, "pow(");
+			len += generate_expression(out + len, depth - 1, num_variables);
+			len += sprintf(out + len, ", %d)", 1 + bm_random(3));
+			break;
+		default:
+			len += sprintf(out + len, "lerp(");
+			len += generate_expression(out + len, depth - 1, num_variables);
+			len += sprintf(out + len, ", ");
+			len += generate_expression(out + len, depth - 1, num_variables);
+			len += sprintf(out + len, ", 0.%d)", bm_random(10));
+			break;
+	}
+	return len;
+}
+
+// ------------------------------------------------------------------
+// parse throughput and run latency on the generated corpus
+// ------------------------------------------------------------------
+void benchmark_corpus(bm_json* json) {
+	const int num_expressions = 64;
+	const int capacity = 4096;
+	const int depths[] = { 2, 4, 6, 8 };
+	const int variables[] = { 1, 4, 16 };
+	json_begin(json, "corpus", '[');
+	for (int d = 0; d < 4; ++d) {
+		for (int v = 0; v < 3; ++v) {
+			vm_context* ctx = vm_create_context();
+			char name[16];
+			for (int i = 0; i < variables[v]; ++i) {
+				sprintf(name, "V%d", i);
+				vm_add_variable(ctx, name, 0.5f + i);
+			}
+			char* sources[num_expressions];
+			int bytes = 0;
+			for (int i = 0; i < num_expressions; ++i) {
+				char buffer[16384];
+				int len = generate_expression(buffer, depths[d], variables[v]);
+				sources[i] = (char*)malloc(len + 1);
+				memcpy(sources[i], buffer, len + 1);
+				bytes += len;
+			}
+			vm_token* tokens = (vm_token*)malloc(num_expressions * capacity * sizeof(vm_token));
+			int counts[num_expressions];
+			int num_tokens = 0;
+			for (int i = 0; i < num_expressions; ++i) {
+				counts[i] = vm_parse(ctx, sources[i], tokens + i * capacity, capacity);
+				num_tokens += counts[i];
+			}
+			int iterations = 20000 / (depths[d] * depths[d]) / bm_scale + 1;
+			bm_clock::time_point start = bm_clock::now();
+			for (int k = 0; k < iterations; ++k) {
+				for (int i = 0; i < num_expressions; ++i) {
+					vm_parse(ctx, sources[i], tokens + i * capacity, capacity);
+				}
+			}
+			double parse = elapsed_ns(start) / iterations;
+			iterations *= 10;
+			start = bm_clock::now();
+			for (int k = 0; k < iterations; ++k) {
+				for (int i = 0; i < num_expressions; ++i) {
+					float r = 0.0f;
+					vm_run(ctx, tokens + i * capacity, counts[i], &r);
+					bm_sink = r;
+				}
+			}
+			double run = elapsed_ns(start) / iterations;
+			json_begin(json, 0, '{');
+			json_int(json, "depth", depths[d]);
+			json_int(json, "variables", variables[v]);
+			json_int(json, "expressions", num_expressions);
+			json_int(json, "bytes", bytes);
+			json_int(json, "tokens", num_tokens);
+			json_number(json, "parse_expressions_per_s", num_expressions / parse * 1e9);
+			json_number(json, "parse_bytes_per_s", bytes / parse * 1e9);
+			json_number(json, "run_ns_per_expression", run / num_expressions);
+			json_number(json, "run_ns_per_token", run / num_tokens);
+			json_end(json, '}');
+			free(tokens);
+			for (int i = 0; i < num_expressions; ++i) {
+				free(sources[i]);
+			}
+			vm_destroy_context(ctx);
+		}
+	}
+	json_end(json, ']');
+}
+
+// ------------------------------------------------------------------
+// cost per operator: the difference between a chain of 64 and a
+// chain of 32 operations divided by 32
+// ------------------------------------------------------------------
+static void bm_method(vm_stack* stack) {
+	float a = VM_POP(stack);
+	float b = VM_POP(stack);
+	VM_PUSH(stack, a * 0.5f + b);
+}
+
+// binary operators: X op Y op Y ...
+// functions (prefixed with f): f(f(f(X, ...), ...), ...)
+static void build_chain(char* out, const char* op, int n) {
+	int len = 0;
+	if (op[0] != 'f') {
+		len += sprintf(out, "X");
+		for (int i = 0; i < n; ++i) {
+			len += sprintf(out + len, " %s Y", op);
+		}
+		return;
+	}
+	const char* name = op + 1;
+	const char* args = ")";
+	if (strcmp(name, "pow") == 0 || strcmp(name, "FOO") == 0) {
+		args = ", Y)";
+	}
+	else if (strcmp(name, "lerp") == 0) {
+		args = ", Y, Z)";
+	}
+	for (int i = 0; i < n; ++i) {
+		len += sprintf(out + len, "%s(", name);
+	}
+	len += sprintf(out + len, "X");
+	for (int i = 0; i < n; ++i) {
+		len += sprintf(out + len, "%s", args);
+	}
+}
+
+static double time_chain(vm_context* ctx, const char* op, int n, int iterations) {
+	char source[4096];
+	vm_token tokens[512];
+	int num = 0;
+	if (strcmp(op, "f-") == 0) {
+		// the optimizer removes - - x so the bytecode is built directly
+		tokens[num].type = TOK_VARIABLE;
+		tokens[num++].id = vm_get_variable_handle(ctx, "X");
+		for (int i = 0; i < n; ++i) {
+			tokens[num].type = TOK_NEG;
+			tokens[num++].id = 0;
+		}
+	}
+	else {
+		build_chain(source, op, n);
+		num = vm_parse(ctx, source, tokens, 512);
+	}
+	bm_clock::time_point start = bm_clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		float r = 0.0f;
+		vm_run(ctx, tokens, num, &r);
+		bm_sink = r;
+	}
+	return elapsed_ns(start) / iterations;
+}
+
+void benchmark_operators(bm_json* json) {
+	const char* names[] = { "add", "sub", "mul", "div", "neg", "abs", "sin", "cos", "tan", "pow", "lerp", "call" };
+	const char* ops[] = { "+", "-", "*", "/", "f-", "fabs", "fsin", "fcos", "ftan", "fpow", "flerp", "fFOO" };
+	const int iterations = 200000 / bm_scale;
+	vm_context* ctx = vm_create_context();
+	vm_add_variable(ctx, "X", 0.5f);
+	vm_add_variable(ctx, "Y", 0.25f);
+	vm_add_variable(ctx, "Z", 0.75f);
+	vm_add_function(ctx, "FOO", bm_method, 17, 2);
+	json_begin(json, "operator_ns", '{');
+	for (int i = 0; i < 12; ++i) {
+		double a = time_chain(ctx, ops[i], 32, iterations);
+		double b = time_chain(ctx, ops[i], 64, iterations);
+		json_number(json, names[i], (b - a) / 32.0);
+	}
+	json_end(json, '}');
+	vm_destroy_context(ctx);
+}
+
+// ------------------------------------------------------------------
+// symbol lookup cost for growing symbol tables
+// ------------------------------------------------------------------
+void benchmark_symbol_lookup(bm_json* json) {
+	const int iterations = 1000000 / bm_scale;
+	json_begin(json, "symbol_lookup", '[');
+	for (int n = 8; n <= 4096; n *= 2) {
+		vm_context* ctx = vm_create_context();
+		char (*names)[16] = (char(*)[16])malloc(n * 16);
+		int* handles = (int*)malloc(n * sizeof(int));
+		for (int i = 0; i < n; ++i) {
+			sprintf(names[i], "VAR_%d", i);
+			handles[i] = vm_add_variable(ctx, names[i], (float)i);
+		}
+		unsigned int seed = 12345;
+		bm_clock::time_point start = bm_clock::now();
+		for (int i = 0; i < iterations; ++i) {
+			seed = seed * 1664525 + 1013904223;
+			vm_set_variable(ctx, names[seed % n], (float)i);
+		}
+		double by_name = elapsed_ns(start) / iterations;
+		start = bm_clock::now();
+		for (int i = 0; i < iterations; ++i) {
+			seed = seed * 1664525 + 1013904223;
+			vm_set_variable_by_handle(ctx, handles[seed % n], (float)i);
+		}
+		double by_handle = elapsed_ns(start) / iterations;
+		char source[64];
+		vm_token tokens[16];
+		start = bm_clock::now();
+		for (int i = 0; i < iterations / 10; ++i) {
+			seed = seed * 1664525 + 1013904223;
+			sprintf(source, "%s * 2 + %s", names[seed % n], names[(seed >> 8) % n]);
+			vm_parse(ctx, source, tokens, 16);
+		}
+		double parse = elapsed_ns(start) / (iterations / 10);
+		json_begin(json, 0, '{');
+		json_int(json, "symbols", n);
+		json_number(json, "set_by_name_ns", by_name);
+		json_number(json, "set_by_handle_ns", by_handle);
+		json_number(json, "parse_ns", parse);
+		json_end(json, '}');
+		free(handles);
+		free(names);
+		vm_destroy_context(ctx);
+	}
+	json_end(json, ']');
+}
+
+// ------------------------------------------------------------------
+// parse cost of a long expression
+// ------------------------------------------------------------------
+void benchmark_parse_long(bm_json* json) {
+	const int iterations = 20000 / bm_scale;
+	char source[4096];
+	int len = 0;
+	vm_context* ctx = vm_create_context();
+	vm_add_variable(ctx, "TIMER", 1.0f);
+	for (int i = 0; len < 3000; ++i) {
+		len += sprintf(source + len, "%s%d.5 * cos(TIMER * -%d.0) + abs(TIMER - %d)", i > 0 ? " + " : "", i, i + 1, i);
+	}
+	vm_token* tokens = (vm_token*)malloc(len * sizeof(vm_token));
+	void* scratch = malloc(vm_parse_scratch_size(source));
+	bm_clock::time_point start = bm_clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		vm_parse(ctx, source, tokens, len);
+	}
+	double parse = elapsed_ns(start) / iterations;
+	start = bm_clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		vm_parse_with_scratch(ctx, source, tokens, len, scratch, vm_parse_scratch_size(source));
+	}
+	double scratch_parse = elapsed_ns(start) / iterations;
+	json_begin(json, "parse_long", '{');
+	json_int(json, "bytes", len);
+	json_number(json, "parse_us", parse / 1000.0);
+	json_number(json, "parse_bytes_per_s", len / parse * 1e9);
+	json_number(json, "parse_with_scratch_us", scratch_parse / 1000.0);
+	json_number(json, "parse_with_scratch_bytes_per_s", len / scratch_parse * 1e9);
+	json_end(json, '}');
+	free(scratch);
+	free(tokens);
+	vm_destroy_context(ctx);
+}
+
+// ------------------------------------------------------------------
+// scaling of vm_eval_many from one thread to all cores
+// ------------------------------------------------------------------
+void benchmark_eval_many(bm_json* json) {
+	const char* expressions[] = {
+		"15.0 * cos(TIMER * -6.0) + 240.0",
+		"lerp(sin(TIMER), X, 0.25) * pow(abs(X), 2)",
+		"abs(sin(X * 2) - cos(TIMER)) / (1 + X * X)",
+		"pow(TIMER, 2) + tan(X / 8) * 4 - lerp(X, TIMER, 0.5)"
+	};
+	const int count = 50000;
+	const int iterations = 50 / bm_scale;
+	vm_context* ctx = vm_create_context();
+	vm_program* programs[4];
+	for (int i = 0; i < 4; ++i) {
+		programs[i] = vm_compile(ctx, expressions[i], 0);
+	}
+	vm_env* envs = (vm_env*)malloc(count * sizeof(vm_env));
+	float* values = (float*)malloc(count * 2 * sizeof(float));
+	vm_job* jobs = (vm_job*)malloc(count * sizeof(vm_job));
+	float* results = (float*)malloc(count * sizeof(float));
+	for (int i = 0; i < count; ++i) {
+		const vm_program* p = programs[i % 4];
+		envs[i].values = values + i * 2;
+		envs[i].num_values = p->num_slots;
+		for (int j = 0; j < p->num_slots; ++j) {
+			envs[i].values[j] = (i % 1000) * 0.01f + j;
+		}
+		jobs[i].program = p;
+		jobs[i].env = &envs[i];
+	}
+	vm_pool* all = vm_create_pool(0);
+	int cores = vm_pool_size(all);
+	vm_destroy_pool(all);
+	json_begin(json, "eval_many", '[');
+	double single = 0.0;
+	for (int n = 1; n <= cores; n = n < cores && n * 2 > cores ? cores : n * 2) {
+		vm_pool* pool = vm_create_pool(n);
+		vm_eval_many(pool, jobs, count, results, 0, 0);
+		bm_clock::time_point start = bm_clock::now();
+		for (int i = 0; i < iterations; ++i) {
+			vm_eval_many(pool, jobs, count, results, 0, 0);
+		}
+		double tick = elapsed_ns(start) / iterations;
+		if (n == 1) {
+			single = tick;
+		}
+		json_begin(json, 0, '{');
+		json_int(json, "threads", n);
+		json_int(json, "jobs", count);
+		json_number(json, "tick_us", tick / 1000.0);
+		json_number(json, "speedup", single / tick);
+		json_end(json, '}');
+		vm_destroy_pool(pool);
+	}
+	json_end(json, ']');
+	for (int i = 0; i < 4; ++i) {
+		vm_destroy_program(programs[i]);
+	}
+	free(results);
+	free(jobs);
+	free(values);
+	free(envs);
+	vm_destroy_context(ctx);
+}
+
+// ------------------------------------------------------------------
+// cold start: compiling a set of expressions from text compared to
+// loading the same programs from a program file
+// ------------------------------------------------------------------
+void benchmark_program_file(bm_json* json) {
+	const int count = 2000;
+	const int iterations = 20 / bm_scale + 1;
+	const char* path = "ds_vm_benchmark_programs.bin";
+	char* sources = (char*)malloc(count * 1024);
+	vm_program** programs = (vm_program**)malloc(count * sizeof(vm_program*));
+	for (int i = 0; i < count; ++i) {
+		generate_expression(sources + i * 1024, 4, 4);
+	}
+	vm_context* ctx = vm_create_context();
+	bm_clock::time_point start = bm_clock::now();
+	for (int n = 0; n < iterations; ++n) {
+		for (int i = 0; i < count; ++i) {
+			programs[i] = vm_compile(ctx, sources + i * 1024, 0);
+		}
+		if (n + 1 < iterations) {
+			for (int i = 0; i < count; ++i) {
+				vm_destroy_program(programs[i]);
+			}
+		}
+	}
+	double compile = elapsed_ns(start) / iterations;
+	vm_save_programs(path, (const vm_program**)programs, 0, count);
+	start = bm_clock::now();
+	for (int n = 0; n < iterations; ++n) {
+		vm_program_file* file = vm_load_programs(ctx, path, 0);
+		bm_sink = bm_sink + (float)vm_num_programs(file);
+		vm_close_programs(file);
+	}
+	double load = elapsed_ns(start) / iterations;
+	json_begin(json, "program_file", '{');
+	json_int(json, "programs", count);
+	json_number(json, "compile_ms", compile / 1e6);
+	json_number(json, "load_ms", load / 1e6);
+	json_number(json, "speedup", compile / load);
+	json_end(json, '}');
+	for (int i = 0; i < count; ++i) {
+		vm_destroy_program(programs[i]);
+	}
+	remove(path);
+	free(programs);
+	free(sources);
+	vm_destroy_context(ctx);
+}
+
+// ------------------------------------------------------------------
+// loading a file of definitions with vm_define_text on a growing
+// number of threads compared to calling vm_define for every line
+// ------------------------------------------------------------------
+void benchmark_define_file(bm_json* json) {
+	const int count = 4000;
+	const int iterations = 10 / bm_scale + 1;
+	char* lines = (char*)malloc(count * 1024);
+	char* text = (char*)malloc(count * 1024);
+	int length = 0;
+	for (int i = 0; i < count; ++i) {
+		char* line = lines + i * 1024;
+		int n = generate_expression(line, 5, 16);
+		sprintf(line + n, " + D%d", (i + 1) / 2);
+		length += sprintf(text + length, "D%d = %s\n", i + 1, line);
+	}
+	char name[32];
+	bm_clock::time_point start = bm_clock::now();
+	for (int n = 0; n < iterations; ++n) {
+		vm_context* ctx = vm_create_context();
+		for (int i = 0; i < count; ++i) {
+			sprintf(name, "D%d", i + 1);
+			vm_define(ctx, name, lines + i * 1024);
+		}
+		vm_destroy_context(ctx);
+	}
+	double sequential = elapsed_ns(start) / iterations;
+	vm_pool* all = vm_create_pool(0);
+	int cores = vm_pool_size(all);
+	vm_destroy_pool(all);
+	json_begin(json, "define_file", '{');
+	json_int(json, "lines", count);
+	json_number(json, "define_ms", sequential / 1e6);
+	json_begin(json, "threads", '[');
+	for (int n = 1; n <= cores; n = n < cores && n * 2 > cores ? cores : n * 2) {
+		vm_pool* pool = vm_create_pool(n);
+		start = bm_clock::now();
+		for (int it = 0; it < iterations; ++it) {
+			vm_context* ctx = vm_create_context();
+			bm_sink = (float)vm_define_text(ctx, pool, text, length, 0, 0);
+			vm_destroy_context(ctx);
+		}
+		double load = elapsed_ns(start) / iterations;
+		json_begin(json, 0, '{');
+		json_int(json, "threads", n);
+		json_number(json, "load_ms", load / 1e6);
+		json_number(json, "speedup", sequential / load);
+		json_end(json, '}');
+		vm_destroy_pool(pool);
+	}
+	json_end(json, ']');
+	json_end(json, '}');
+	free(text);
+	free(lines);
+}
+
+#ifdef DS_VM_COMPILE_TIME
+// ------------------------------------------------------------------
+// compile time expressions compared to the interpreter
+// ------------------------------------------------------------------
+template<typename E>
+static void time_compiled(bm_json* json, const char* name, const E& e, const char* source) {
+	const int iterations = 2000000 / bm_scale;
+	const char* names[] = { "TIMER", "X", "Y" };
+	vm_context* ctx = vm_create_context();
+	vm_add_function(ctx, "FOO", bm_method, 17, 2);
+	vm_token tokens[64];
+	int num = vm_parse(ctx, source, tokens, 64);
+	float values[8] = { 0.0f };
+	for (int i = 0; i < 3; ++i) {
+		int index = E::find_variable(names[i]);
+		if (index != -1) {
+			values[index] = 0.5f + i;
+			vm_set_variable(ctx, names[i], values[index]);
+		}
+	}
+	// the first variable changes in every iteration
+	int first = vm_get_variable_handle(ctx, names[0]) != -1 ? vm_get_variable_handle(ctx, names[0]) : vm_get_variable_handle(ctx, names[1]);
+	bm_clock::time_point start = bm_clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		vm_set_variable_by_handle(ctx, first, (i & 1023) * 0.001f);
+		float r = 0.0f;
+		vm_run(ctx, tokens, num, &r);
+		bm_sink = r;
+	}
+	double run = elapsed_ns(start) / iterations;
+	start = bm_clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		values[0] = (i & 1023) * 0.001f;
+		bm_sink = e(values);
+	}
+	double compiled = elapsed_ns(start) / iterations;
+	json_begin(json, 0, '{');
+	json_string(json, "expression", name);
+	json_number(json, "vm_run_ns", run);
+	json_number(json, "compiled_ns", compiled);
+	json_end(json, '}');
+	vm_destroy_context(ctx);
+}
+
+#define BM_COMPILED(name, source) time_compiled(json, name, ds_vm::compile<source, ds_vm::function<"FOO", 2>>(bm_method), source)
+
+void benchmark_compile_time(bm_json* json) {
+	json_begin(json, "compile_time", '[');
+	BM_COMPILED("wave", "15.0 * cos(TIMER * -6.0) + 240.0");
+	BM_COMPILED("arithmetic", "X * 4 + 2 * X - X / 2 + 7 - Y * (X - 1)");
+	BM_COMPILED("mixed", "lerp(sin(X), Y, 0.25) * pow(abs(X), 2) - FOO(X, Y)");
+	json_end(json, ']');
+}
+#endif
+
+// ------------------------------------------------------------------
+// verified programs compared to the checked interpreter
+// ------------------------------------------------------------------
+void benchmark_verified(bm_json* json) {
+	const char* expressions[] = {
+		"15.0 * cos(TIMER * -6.0) + 240.0",
+		"X * 4 + 2 * X - X / 2 + 7 - Y * (X - 1)",
+		"lerp(sin(X), Y, 0.25) * pow(abs(X), 2) - (X + (Y + (X + (Y * 2))))"
+	};
+	const int iterations = 2000000 / bm_scale;
+	vm_context* ctx = vm_create_context();
+	json_begin(json, "verified", '[');
+	for (int i = 0; i < 3; ++i) {
+		vm_program* p = vm_compile(ctx, expressions[i], 0);
+		vm_program checked = *p;
+		checked.max_stack = 0;
+		vm_env* env = vm_create_env(p);
+		bm_clock::time_point start = bm_clock::now();
+		for (int j = 0; j < iterations; ++j) {
+			float r = 0.0f;
+			vm_run_env(&checked, env, &r);
+			bm_sink = r;
+		}
+		double run_checked = elapsed_ns(start) / iterations;
+		start = bm_clock::now();
+		for (int j = 0; j < iterations; ++j) {
+			float r = 0.0f;
+			vm_run_env(p, env, &r);
+			bm_sink = r;
+		}
+		double run_verified = elapsed_ns(start) / iterations;
+		json_begin(json, 0, '{');
+		json_string(json, "expression", expressions[i]);
+		json_int(json, "max_stack", p->max_stack);
+		json_number(json, "checked_ns", run_checked);
+		json_number(json, "verified_ns", run_verified);
+		json_end(json, '}');
+		vm_destroy_env(env);
+		vm_destroy_program(p);
+	}
+	json_end(json, ']');
+	vm_destroy_context(ctx);
+}
+
+// ------------------------------------------------------------------
+// packed bytecode compared to token arrays
+// ------------------------------------------------------------------
+void benchmark_packed(bm_json* json) {
+	const int count = 200;
+	const int iterations = 5000 / bm_scale + 1;
+	vm_context* ctx = vm_create_context();
+	char name[16];
+	for (int i = 0; i < 4; ++i) {
+		sprintf(name, "V%d", i);
+		vm_add_variable(ctx, name, 0.5f + i);
+	}
+	vm_token* tokens = (vm_token*)malloc(count * 256 * sizeof(vm_token));
+	int* num = (int*)malloc(count * sizeof(int));
+	vm_packed** packed = (vm_packed**)malloc(count * sizeof(vm_packed*));
+	int token_bytes = 0;
+	int packed_bytes = 0;
+	char source[1024];
+	for (int i = 0; i < count; ++i) {
+		generate_expression(source, 4, 4);
+		num[i] = vm_parse(ctx, source, tokens + i * 256, 256);
+		packed[i] = vm_pack(ctx, tokens + i * 256, num[i], 0);
+		token_bytes += num[i] * (int)sizeof(vm_token);
+		packed_bytes += packed[i]->size;
+	}
+	bm_clock::time_point start = bm_clock::now();
+	for (int n = 0; n < iterations; ++n) {
+		vm_set_variable(ctx, "V0", (n & 1023) * 0.001f);
+		for (int i = 0; i < count; ++i) {
+			float r = 0.0f;
+			vm_run(ctx, tokens + i * 256, num[i], &r);
+			bm_sink = r;
+		}
+	}
+	double run_tokens = elapsed_ns(start) / ((double)iterations * count);
+	start = bm_clock::now();
+	for (int n = 0; n < iterations; ++n) {
+		vm_set_variable(ctx, "V0", (n & 1023) * 0.001f);
+		for (int i = 0; i < count; ++i) {
+			float r = 0.0f;
+			vm_run_packed(ctx, packed[i], &r);
+			bm_sink = r;
+		}
+	}
+	double run_packed = elapsed_ns(start) / ((double)iterations * count);
+	json_begin(json, "packed", '{');
+	json_int(json, "programs", count);
+	json_int(json, "token_bytes", token_bytes);
+	json_int(json, "packed_bytes", packed_bytes);
+	json_number(json, "ratio", (double)token_bytes / packed_bytes);
+	json_number(json, "tokens_ns", run_tokens);
+	json_number(json, "packed_ns", run_packed);
+	json_end(json, '}');
+	for (int i = 0; i < count; ++i) {
+		vm_destroy_packed(packed[i]);
+	}
+	free(packed);
+	free(num);
+	free(tokens);
+	vm_destroy_context(ctx);
+}
+
+// ------------------------------------------------------------------
+// lookup tables compared to running the program
+// ------------------------------------------------------------------
+void benchmark_lut(bm_json* json) {
+	const char* source = "15.0 * cos(TIMER * -6.0) + 240.0 + abs(sin(TIMER)) * 4";
+	const int iterations = 2000000 / bm_scale;
+	vm_context* ctx = vm_create_context();
+	vm_program* p = vm_compile(ctx, source, 0);
+	vm_env* env = vm_create_env(p);
+	int slot = vm_get_slot(p, "TIMER");
+	bm_clock::time_point start = bm_clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		float r = 0.0f;
+		env->values[slot] = (i & 1023) * 0.001f;
+		vm_run_env(p, env, &r);
+		bm_sink = r;
+	}
+	double run = elapsed_ns(start) / iterations;
+	json_begin(json, "lut", '[');
+	for (int interpolation = VM_LUT_LINEAR; interpolation <= VM_LUT_CUBIC; ++interpolation) {
+		start = bm_clock::now();
+		vm_lut* lut = vm_create_lut(p, "TIMER", 0.0f, 1.024f, 0.001f, interpolation, 0);
+		double create = elapsed_ns(start);
+		start = bm_clock::now();
+		for (int i = 0; i < iterations; ++i) {
+			bm_sink = vm_lut_eval(lut, (i & 1023) * 0.001f);
+		}
+		double eval = elapsed_ns(start) / iterations;
+		json_begin(json, 0, '{');
+		json_string(json, "interpolation", interpolation == VM_LUT_LINEAR ? "linear" : "cubic");
+		json_int(json, "size", lut->size);
+		json_number(json, "error", lut->error);
+		json_number(json, "create_us", create / 1e3);
+		json_number(json, "run_ns", run);
+		json_number(json, "lut_ns", eval);
+		json_end(json, '}');
+		vm_destroy_lut(lut);
+	}
+	json_end(json, ']');
+	vm_destroy_env(env);
+	vm_destroy_program(p);
+	vm_destroy_context(ctx);
+}
+
+// ------------------------------------------------------------------
+// accuracy and speed of the precision modes against libm in double
+// precision. The error in ulp is relative to the float spacing of
+// the reference value.
+// ------------------------------------------------------------------
+static double bm_ulp(double reference) {
+	float f = (float)fabs(reference);
+	float next = nextafterf(f, 3.4e38f);
+	return f < 1.17549435e-38f ? 1.4e-45 : (double)(next - f);
+}
+
+void benchmark_precision(bm_json* json) {
+	const char* sources[] = { "sin(X)", "cos(X)", "tan(X)", "exp(X)", "pow(X, Y)" };
+	const char* modes[] = { "exact", "fast", "approx" };
+	const int samples = 1000000 / bm_scale;
+	json_begin(json, "precision", '[');
+	for (int mode = VM_PRECISION_EXACT; mode <= VM_PRECISION_APPROX; ++mode) {
+		vm_context* ctx = vm_create_context_ex(mode);
+		int x = vm_add_variable(ctx, "X", 0.0f);
+		int y = vm_add_variable(ctx, "Y", 0.0f);
+		for (int f = 0; f < 5; ++f) {
+			vm_token tokens[16];
+			int num = vm_parse(ctx, sources[f], tokens, 16);
+			double max_ulp = 0.0;
+			double max_abs = 0.0;
+			double max_rel = 0.0;
+			bm_seed = 12345;
+			for (int i = 0; i < samples; ++i) {
+				double u = bm_random(1 << 20) / (double)(1 << 20);
+				double v = bm_random(1 << 20) / (double)(1 << 20);
+				// sin, cos, tan in [-100, 100], exp in [-87, 88], pow with
+				// bases in [0.001, 1000] and exponents in [-4, 4]
+				float a = f < 3 ? (float)(u * 200.0 - 100.0) : (f == 3 ? (float)(u * 175.0 - 87.0) : (float)pow(10.0, u * 6.0 - 3.0));
+				float b = (float)(v * 8.0 - 4.0);
+				double reference = f == 0 ? sin((double)a) : f == 1 ? cos((double)a) : f == 2 ? tan((double)a) : f == 3 ? exp((double)a) : pow((double)a, (double)b);
+				vm_set_variable_by_handle(ctx, x, a);
+				vm_set_variable_by_handle(ctx, y, b);
+				float r = 0.0f;
+				vm_run(ctx, tokens, num, &r);
+				double e = fabs(r - reference);
+				if (e > max_abs) max_abs = e;
+				if (e / bm_ulp(reference) > max_ulp) max_ulp = e / bm_ulp(reference);
+				if (fabs(reference) > 1e-3 && e / fabs(reference) > max_rel) max_rel = e / fabs(reference);
+			}
+			bm_clock::time_point start = bm_clock::now();
+			for (int i = 0; i < samples; ++i) {
+				vm_set_variable_by_handle(ctx, x, (i & 1023) * 0.01f + 0.5f);
+				float r = 0.0f;
+				vm_run(ctx, tokens, num, &r);
+				bm_sink = r;
+			}
+			double ns = elapsed_ns(start) / samples;
+			json_begin(json, 0, '{');
+			json_string(json, "mode", modes[mode]);
+			json_string(json, "expression", sources[f]);
+			json_number(json, "max_ulp", max_ulp);
+			json_number(json, "max_abs", max_abs);
+			json_number(json, "max_rel", max_rel);
+			json_number(json, "ns", ns);
+			json_end(json, '}');
+		}
+		vm_destroy_context(ctx);
+	}
+	json_end(json, ']');
+}
+
+// ------------------------------------------------------------------
+// the same custom function registered as vm_stack function, as
+// typed function and with an array variant. vm_run per value and
+// vm_run_batch per value.
+// ------------------------------------------------------------------
+static float bm_typed(float a, float b) {
+	return b * 0.5f + a;
+}
+
+static void bm_typed_array(const float* const* args, float* out, int n) {
+	for (int i = 0; i < n; ++i) {
+		out[i] = args[1][i] * 0.5f + args[0][i];
+	}
+}
+
+void benchmark_typed_functions(bm_json* json) {
+	const char* kinds[] = { "stack", "typed", "array" };
+	const int count = 4096;
+	const int iterations = 1000 / bm_scale;
+	float* values = (float*)malloc(count * sizeof(float));
+	float* results = (float*)malloc(count * sizeof(float));
+	for (int i = 0; i < count; ++i) {
+		values[i] = i * 0.001f;
+	}
+	json_begin(json, "typed_functions", '[');
+	for (int kind = 0; kind < 3; ++kind) {
+		vm_context* ctx = vm_create_context();
+		int x = vm_add_variable(ctx, "X", 0.0f);
+		if (kind == 0) {
+			vm_add_function(ctx, "F", bm_method, 17, 2);
+		}
+		else {
+			vm_add_function_2(ctx, "F", bm_typed, 0);
+		}
+		if (kind == 2) {
+			vm_set_array_function(ctx, "F", bm_typed_array);
+		}
+		vm_token tokens[64];
+		int num = vm_parse(ctx, "F(F(F(X, 2), X), 3) * 0.5", tokens, 64);
+		bm_clock::time_point start = bm_clock::now();
+		for (int it = 0; it < iterations; ++it) {
+			for (int i = 0; i < count; ++i) {
+				float r = 0.0f;
+				vm_set_variable_by_handle(ctx, x, values[i]);
+				vm_run(ctx, tokens, num, &r);
+				bm_sink = r;
+			}
+		}
+		double run = elapsed_ns(start) / ((double)iterations * count);
+		const float* columns[1] = { values };
+		start = bm_clock::now();
+		for (int it = 0; it < iterations; ++it) {
+			vm_run_batch(ctx, tokens, num, columns, results, count);
+			bm_sink = results[it % count];
+		}
+		double batch = elapsed_ns(start) / ((double)iterations * count);
+		json_begin(json, 0, '{');
+		json_string(json, "kind", kinds[kind]);
+		json_number(json, "run_ns", run);
+		json_number(json, "batch_ns", batch);
+		json_end(json, '}');
+		vm_destroy_context(ctx);
+	}
+	json_end(json, ']');
+	free(values);
+	free(results);
+}
+
+// ------------------------------------------------------------------
+// a conditional only evaluates the costly branch for half of the
+// values while the lerp form evaluates both branches every time
+// ------------------------------------------------------------------
+void benchmark_conditionals(bm_json* json) {
+	const char* names[] = { "ternary", "lerp" };
+	const char* sources[] = {
+		"X > 0.5 ? X * 2 : pow(sin(X), 2) + cos(X) * tan(X) + exp(-X)",
+		"lerp(pow(sin(X), 2) + cos(X) * tan(X) + exp(-X), X * 2, X > 0.5)"
+	};
+	const int count = 4096;
+	const int iterations = 1000 / bm_scale;
+	float* values = (float*)malloc(count * sizeof(float));
+	float* results = (float*)malloc(count * sizeof(float));
+	for (int i = 0; i < count; ++i) {
+		values[i] = (float)i / count;
+	}
+	json_begin(json, "conditionals", '[');
+	for (int kind = 0; kind < 2; ++kind) {
+		vm_context* ctx = vm_create_context();
+		int x = vm_add_variable(ctx, "X", 0.0f);
+		vm_token tokens[64];
+		int num = vm_parse(ctx, sources[kind], tokens, 64);
+		bm_clock::time_point start = bm_clock::now();
+		for (int it = 0; it < iterations; ++it) {
+			for (int i = 0; i < count; ++i) {
+				float r = 0.0f;
+				vm_set_variable_by_handle(ctx, x, values[i]);
+				vm_run(ctx, tokens, num, &r);
+				bm_sink = r;
+			}
+		}
+		double run = elapsed_ns(start) / ((double)iterations * count);
+		const float* columns[1] = { values };
+		start = bm_clock::now();
+		for (int it = 0; it < iterations; ++it) {
+			vm_run_batch(ctx, tokens, num, columns, results, count);
+			bm_sink = results[it % count];
+		}
+		double batch = elapsed_ns(start) / ((double)iterations * count);
+		json_begin(json, 0, '{');
+		json_string(json, "kind", names[kind]);
+		json_number(json, "run_ns", run);
+		json_number(json, "batch_ns", batch);
+		json_end(json, '}');
+		vm_destroy_context(ctx);
+	}
+	json_end(json, ']');
+	free(values);
+	free(results);
+}
+
+// ------------------------------------------------------------------
+// sum of an expression over a column: vm_run_batch into a buffer and
+// a second pass compared to vm_reduce with and without threads
+// ------------------------------------------------------------------
+void benchmark_reduce(bm_json* json) {
+	const char* kinds[] = { "two_pass", "fused", "fused_kahan", "fused_parallel" };
+	const int count = 1 << 20;
+	const int iterations = 100 / bm_scale;
+	vm_context* ctx = vm_create_context();
+	vm_program* p = vm_compile(ctx, "X * X * 0.5 - 3 * X + 1", 0);
+	float* values = (float*)malloc(count * sizeof(float));
+	float* results = (float*)malloc(count * sizeof(float));
+	for (int i = 0; i < count; ++i) {
+		values[i] = (i % 1000) * 0.001f;
+	}
+	const float* columns[1] = { values };
+	vm_pool* pool = vm_create_pool(0);
+	vm_token tokens[64];
+	int num = vm_parse(ctx, "X * X * 0.5 - 3 * X + 1", tokens, 64);
+	json_begin(json, "reduce", '[');
+	for (int kind = 0; kind < 4; ++kind) {
+		bm_clock::time_point start = bm_clock::now();
+		for (int it = 0; it < iterations; ++it) {
+			float r = 0.0f;
+			if (kind == 0) {
+				vm_run_batch(ctx, tokens, num, columns, results, count);
+				for (int i = 0; i < count; ++i) {
+					r += results[i];
+				}
+			}
+			else {
+				vm_reduce(kind == 3 ? pool : 0, p, 0, columns, count, kind == 2 ? VM_REDUCE_SUM | VM_REDUCE_KAHAN : VM_REDUCE_SUM, &r);
+			}
+			bm_sink = r;
+		}
+		double ns = elapsed_ns(start) / ((double)iterations * count);
+		json_begin(json, 0, '{');
+		json_string(json, "kind", kinds[kind]);
+		json_number(json, "ns_per_element", ns);
+		json_int(json, "threads", kind == 3 ? vm_pool_size(pool) : 1);
+		json_end(json, '}');
+	}
+	json_end(json, ']');
+	vm_destroy_pool(pool);
+	vm_destroy_program(p);
+	vm_destroy_context(ctx);
+	free(values);
+	free(results);
+}
+
+// ------------------------------------------------------------------
+// read latency of snapshots: vm_run on the context compared to pin,
+// vm_run_snapshot and unpin, alone and with a thread publishing
+// ------------------------------------------------------------------
+void benchmark_snapshots(bm_json* json) {
+	const char* kinds[] = { "run", "pin_unpin", "snapshot_run", "snapshot_run_writer" };
+	const int iterations = 2000000 / bm_scale;
+	vm_context* ctx = vm_create_context();
+	char name[16];
+	for (int i = 0; i < 256; ++i) {
+		sprintf(name, "V%d", i);
+		vm_add_variable(ctx, name, (float)i);
+	}
+	vm_token tokens[64];
+	int num = vm_parse(ctx, "15.0 * cos(V1 * -6.0) + V2 * V3", tokens, 64);
+	vm_enable_snapshots(ctx, 1);
+	json_begin(json, "snapshots", '[');
+	for (int kind = 0; kind < 4; ++kind) {
+		std::atomic<int> done(0);
+		std::atomic<int> publishes(0);
+		std::thread writer;
+		if (kind == 3) {
+			writer = std::thread([&]() {
+				while (!done.load()) {
+					vm_set_variable_by_handle(ctx, 1, (float)publishes.load());
+					vm_publish(ctx);
+					++publishes;
+				}
+			});
+		}
+		bm_clock::time_point start = bm_clock::now();
+		for (int it = 0; it < iterations; ++it) {
+			float r = 0.0f;
+			if (kind == 0) {
+				vm_run(ctx, tokens, num, &r);
+			}
+			else {
+				const vm_snapshot* s = vm_pin_snapshot(ctx, 0);
+				if (kind == 1) {
+					r = s->values[1];
+				}
+				else {
+					vm_run_snapshot(ctx, s, tokens, num, &r);
+				}
+				vm_unpin_snapshot(ctx, 0);
+			}
+			bm_sink = r;
+		}
+		double ns = elapsed_ns(start) / iterations;
+		done = 1;
+		if (kind == 3) {
+			writer.join();
+		}
+		json_begin(json, 0, '{');
+		json_string(json, "kind", kinds[kind]);
+		json_number(json, "read_ns", ns);
+		json_int(json, "publishes", publishes.load());
+		json_end(json, '}');
+	}
+	json_end(json, ']');
+	vm_destroy_context(ctx);
+}
+
+int main(int argc, char** argv) {
+	const char* path = 0;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--quick") == 0) {
+			bm_scale = 10;
+		}
+		else {
+			path = argv[i];
+		}
+	}
+	bm_json json;
+	memset(&json, 0, sizeof(json));
+	json.file = path ? fopen(path, "w") : stdout;
+	if (!json.file) {
+		fprintf(stderr, "cannot open %s\n", path);
+		return 1;
+	}
+	json_begin(&json, 0, '{');
+	json_string(&json, "version", "1.0");
+	json_string(&json, "simd", VM_SIMD_WIDTH == 8 ? "avx2" : VM_SIMD_WIDTH == 4 ? "sse2" : "scalar");
+	benchmark_corpus(&json);
+	benchmark_operators(&json);
+	benchmark_symbol_lookup(&json);
+	benchmark_parse_long(&json);
+	benchmark_eval_many(&json);
+	benchmark_program_file(&json);
+	benchmark_define_file(&json);
+	benchmark_verified(&json);
+	benchmark_packed(&json);
+	benchmark_lut(&json);
+	benchmark_precision(&json);
+	benchmark_typed_functions(&json);
+	benchmark_conditionals(&json);
+	benchmark_reduce(&json);
+	benchmark_snapshots(&json);
+#ifdef DS_VM_COMPILE_TIME
+	benchmark_compile_time(&json);
+#endif
+	json_end(&json, '}');
+	fprintf(json.file, "\n");
+	if (path) {
+		fclose(json.file);
+	}
+	return 0;
+}
@@ -66,7 +66,58 @@ extern "C" {
 
 	typedef void(*vmFunction)(vm_stack*);
 
-	typedef enum { TOK_EMPTY, TOK_NUMBER, TOK_FUNCTION, TOK_VARIABLE, TOK_LEFT_PARENTHESIS, TOK_RIGHT_PARENTHESIS } vm_token_type;
+	// typed functions get their parameters directly
+	typedef float(*vmFunction1)(float);
+	typedef float(*vmFunction2)(float, float);
+	typedef float(*vmFunction3)(float, float, float);
+	typedef float(*vmFunction4)(float, float, float, float);
+
+	typedef union {
+		vmFunction1 f1;
+		vmFunction2 f2;
+		vmFunction3 f3;
+		vmFunction4 f4;
+	} vm_native;
+
+	// array variant of a function used by vm_run_batch. args holds one
+	// array of n values per parameter and the results go to out.
+	typedef void(*vmArrayFunction)(const float* const* args, float* out, int n);
+
+	// the function always returns the same result for the same parameters
+	// and has no side effects, so calls with constant parameters are folded
+	#define VM_FUNCTION_PURE 1
+
+	// precision of the built-in sin, cos, tan, pow and exp
+	// libm in double precision
+	#define VM_PRECISION_EXACT 0
+	// single precision polynomials within 3 ulp
+	#define VM_PRECISION_FAST 1
+	// cheaper polynomials with an error of about 1e-4
+	#define VM_PRECISION_APPROX 2
+
+	typedef enum {
+		TOK_EMPTY, TOK_NUMBER, TOK_FUNCTION, TOK_VARIABLE, TOK_LEFT_PARENTHESIS, TOK_RIGHT_PARENTHESIS,
+		// built-in operators (id is the function id)
+		TOK_ADD, TOK_SUB, TOK_MUL, TOK_DIV, TOK_NEG, TOK_ABS, TOK_SIN, TOK_COS, TOK_TAN, TOK_POW, TOK_LERP, TOK_EXP,
+		// the same operators for VM_PRECISION_FAST and VM_PRECISION_APPROX
+		TOK_SIN_FAST, TOK_COS_FAST, TOK_TAN_FAST, TOK_POW_FAST, TOK_EXP_FAST,
+		TOK_SIN_APPROX, TOK_COS_APPROX, TOK_TAN_APPROX, TOK_POW_APPROX, TOK_EXP_APPROX,
+		// duplicates the top of the stack
+		TOK_DUP,
+		// superinstructions: CONST op (value is the constant)
+		TOK_ADD_CONST, TOK_SUB_CONST, TOK_MUL_CONST, TOK_DIV_CONST,
+		// superinstructions: VAR CONST op (id is the variable, the next token holds the constant)
+		TOK_VAR_ADD_CONST, TOK_VAR_SUB_CONST, TOK_VAR_MUL_CONST, TOK_VAR_DIV_CONST,
+		// multi output programs (id is the temporary or the output)
+		TOK_STORE, TOK_LOAD, TOK_OUTPUT,
+		// comparisons push 1.0 or 0.0, BOOL maps every value except 0.0 to 1.0
+		TOK_LT, TOK_LE, TOK_GT, TOK_GE, TOK_EQ, TOK_NE, TOK_MIN, TOK_MAX, TOK_CLAMP, TOK_BOOL, TOK_SELECT,
+		// jumps (id is the forward offset to the target)
+		TOK_JUMP, TOK_JUMP_IF_FALSE, TOK_AND_JUMP, TOK_OR_JUMP,
+		// the target of a jump, only used while parsing
+		TOK_LABEL,
+		TOK_NUM_TYPES
+	} vm_token_type;
 
 	struct vm_token_t {
 		vm_token_type type;
@@ -80,557 +131,8122 @@ extern "C" {
 
 	struct vm_variable_t {
 		int hash;
-		float value;
 		const char* name;
+		int length;
 	};
 
 	typedef struct vm_variable_t vm_variable;
 
 	struct vm_function_t {
 		int hash;
+		// 0 for typed functions which are called through native
 		vmFunction function;
+		vm_native native;
+		vmArrayFunction array;
 		int precedence;
 		int num_parameters;
 		const char* name;
+		vm_token_type opcode;
+		int flags;
+		int length;
 	};
 
 	typedef struct vm_function_t vm_function;
 
+	// open addressing hash index over the names of a symbol table
+	struct vm_symbol_slot_t {
+		int hash;
+		int id;
+	};
+
+	typedef struct vm_symbol_slot_t vm_symbol_slot;
+
+	struct vm_symbol_index_t {
+		vm_symbol_slot* slots;
+		int capacity;
+	};
+
+	typedef struct vm_symbol_index_t vm_symbol_index;
+
+	struct vm_cache_t;
+
+	struct vm_graph_t;
+
+	struct vm_profile_t;
+
 	struct vm_context_t {
 
 		int num_variables;
-		vm_variable variables[32];
-		vm_function functions[32];
+		int variables_capacity;
+		vm_variable* variables;
+		// the values are kept apart from the names so that the
+		// interpreter reads a plain float array
+		float* values;
+		vm_symbol_index variable_index;
 		int num_functions;
+		int functions_capacity;
+		vm_function* functions;
+		vm_symbol_index function_index;
+		struct vm_cache_t* cache;
+		struct vm_graph_t* graph;
+		struct vm_profile_t* profile;
+		struct vm_snapshots_t* snapshots;
+		int precision;
 
 	};
 
 	typedef struct vm_context_t vm_context;
 
+	// compiled bytecode. Programs returned by vm_compile_cached are
+	// bound to their context (context is set) and run with
+	// vm_run_program. Programs returned by vm_compile are standalone:
+	// variables are resolved into slots of a vm_env and the used
+	// functions are copied, so they never touch a context again.
+	struct vm_program_t {
+		vm_token* tokens;
+		int num_tokens;
+		const struct vm_context_t* context;
+		int num_slots;
+		const char** slot_names;
+		float* slot_defaults;
+		int num_functions;
+		vm_function* functions;
+		// exact stack depth found by the verifier, 0 if not verified
+		int max_stack;
+	};
+
+	typedef struct vm_program_t vm_program;
+
+	// value frame for a standalone program, one value per slot
+	struct vm_env_t {
+		float* values;
+		int num_values;
+	};
+
+	typedef struct vm_env_t vm_env;
+
+	// one independent evaluation for vm_eval_many
+	struct vm_job_t {
+		const vm_program* program;
+		const vm_env* env;
+	};
+
+	typedef struct vm_job_t vm_job;
+
+	// a line of a definition file which could not be defined
+	struct vm_line_error_t {
+		// 1 based line and column
+		int line;
+		int column;
+		int code;
+	};
+
+	typedef struct vm_line_error_t vm_line_error;
+
+	typedef struct vm_pool_t vm_pool;
+
+	typedef struct vm_program_file_t vm_program_file;
+
+	// the values of all variables published by vm_publish
+	struct vm_snapshot_t {
+		const float* values;
+		int num_values;
+		// increases with every vm_publish
+		long long epoch;
+	};
+
+	typedef struct vm_snapshot_t vm_snapshot;
+
+	// reductions of vm_reduce
+	#define VM_REDUCE_SUM 0
+	#define VM_REDUCE_MIN 1
+	#define VM_REDUCE_MAX 2
+	#define VM_REDUCE_MEAN 3
+	// flag for compensated (Kahan) summation in VM_REDUCE_SUM and VM_REDUCE_MEAN
+	#define VM_REDUCE_KAHAN 4
+
+	// interpolation of a lookup table
+	#define VM_LUT_LINEAR 0
+	#define VM_LUT_CUBIC 1
+
+	// a program of one variable tabulated over [min, max]
+	struct vm_lut_t {
+		float min;
+		float max;
+		// intervals per unit of the variable
+		float scale;
+		// number of intervals
+		int size;
+		int interpolation;
+		// largest error found while checking the table
+		float error;
+		float* values;
+	};
+
+	typedef struct vm_lut_t vm_lut;
+
+	struct vm_cache_stats_t {
+		int hits;
+		int misses;
+		int evictions;
+		int invalidations;
+		int num_entries;
+		int bytes;
+	};
+
+	typedef struct vm_cache_stats_t vm_cache_stats;
+
+	struct vm_profile_stats_t {
+		unsigned long long count;
+		unsigned long long cycles;
+	};
+
+	typedef struct vm_profile_stats_t vm_profile_stats;
+
 	DSDEF vm_context* vm_create_context();
 
+	DSDEF vm_context* vm_create_context_ex(int precision);
+
 	DSDEF int vm_add_variable(vm_context* ctx, const char* name, float value);
 
 	DSDEF void vm_set_variable(vm_context* ctx, const char* name, float value);
 
+	DSDEF int vm_get_variable_handle(vm_context* ctx, const char* name);
+
+	DSDEF void vm_set_variable_by_handle(vm_context* ctx, int handle, float value);
+
+	DSDEF float vm_get_variable(vm_context* ctx, const char* name);
+
+	DSDEF float vm_get_variable_by_handle(vm_context* ctx, int handle);
+
 	DSDEF void vm_add_function(vm_context* ctx, const char* name, vmFunction func, int precedence, int num_params);
 
+	DSDEF void vm_add_function_ex(vm_context* ctx, const char* name, vmFunction func, int precedence, int num_params, int flags);
+
+	DSDEF void vm_add_function_1(vm_context* ctx, const char* name, vmFunction1 func, int flags);
+
+	DSDEF void vm_add_function_2(vm_context* ctx, const char* name, vmFunction2 func, int flags);
+
+	DSDEF void vm_add_function_3(vm_context* ctx, const char* name, vmFunction3 func, int flags);
+
+	DSDEF void vm_add_function_4(vm_context* ctx, const char* name, vmFunction4 func, int flags);
+
+	DSDEF int vm_set_array_function(vm_context* ctx, const char* name, vmArrayFunction func);
+
 	DSDEF int vm_parse(vm_context* ctx, const char* source, vm_token* tokens, int capacity);
 
+	DSDEF int vm_parse_scratch_size(const char* source);
+
+	DSDEF int vm_parse_with_scratch(vm_context* ctx, const char* source, vm_token* tokens, int capacity, void* scratch, int scratch_size);
+
 	DSDEF int vm_run(vm_context* ctx, vm_token* byteCode, int capacity, float* ret);
 
-	DSDEF void vm_debug(vm_token* tokens, int num);
+	DSDEF int vm_parse_many(vm_context* ctx, const char** sources, int num_sources, vm_token* tokens, int capacity);
 
-	DSDEF void vm_destroy_context(vm_context* ctx);
+	DSDEF int vm_run_many(vm_context* ctx, vm_token* byteCode, int capacity, float* outputs, int num_outputs);
 
-	DSDEF const char* vm_get_error(int code);
+	DSDEF int vm_run_batch(vm_context* ctx, vm_token* byteCode, int capacity, const float** columns, float* results, int count);
 
-#ifdef __cplusplus
-}
-#endif
+	DSDEF const vm_program* vm_compile_cached(vm_context* ctx, const char* source);
 
-#endif
+	DSDEF void vm_release_cached(vm_context* ctx, const vm_program* program);
 
-#ifdef DS_VM_IMPLEMENTATION
+	DSDEF int vm_run_program(vm_context* ctx, const vm_program* program, float* ret);
 
-struct vm_error_code_t {
-	int code;
-	const char* message;
-};
+	DSDEF void vm_set_cache_limit(vm_context* ctx, int max_bytes);
 
-typedef struct vm_error_code_t vm_error_code;
+	DSDEF void vm_get_cache_stats(vm_context* ctx, vm_cache_stats* stats);
 
-const static vm_error_code ERRORS[] = {
-	{0,"Success"},
-	{1,"No return value on stack"},
-	{2,"Requested number of parameters not found on stack"}
-};
+	DSDEF int vm_define(vm_context* ctx, const char* name, const char* source);
 
-const char* TOKEN_NAMES[] = { "TOK_EMPTY", "TOK_NUMBER", "TOK_FUNCTION", "TOK_VARIABLE", "TOK_LEFT_PARENTHESIS", "TOK_RIGHT_PARENTHESIS" };
+	DSDEF int vm_update(vm_context* ctx);
 
-const int FNV_Prime = 0x01000193; //   16777619
-const int FNV_Seed = 0x811C9DC5; // 2166136261
+	DSDEF int vm_define_text(vm_context* ctx, vm_pool* pool, const char* text, int length, vm_line_error* errors, int max_errors);
 
-// ------------------------------------------------------------------
-// internal method to generate hash
-// ------------------------------------------------------------------
-static inline int vm__fnv1a(const char* text) {
-	const unsigned char* ptr = (const unsigned char*)text;
-	int hash = FNV_Seed;
-	while (*ptr) {
-		hash = (*ptr++ ^ hash) * FNV_Prime;
-	}
-	return hash;
-}
+	DSDEF int vm_define_file(vm_context* ctx, vm_pool* pool, const char* path, vm_line_error* errors, int max_errors);
 
-// ------------------------------------------------------------------
-// get error message by code
-// ------------------------------------------------------------------
-DSDEF const char* vm_get_error(int code) {
-	return ERRORS[code].message;
-}
+	DSDEF vm_program* vm_compile(vm_context* ctx, const char* source, int* error);
 
-#ifndef VM_PUSH
-#define VM_PUSH(stack,value) vm__push(stack,value)
-#define VM_POP(stack)        vm__pop(stack)
-#endif
+	DSDEF int vm_get_slot(const vm_program* program, const char* name);
 
-static float vm__pop(vm_stack* stack) { return stack->data[--stack->size]; }
-static void vm__push(vm_stack* stack, float f) { stack->data[stack->size++] = f; }
+	DSDEF void vm_destroy_program(vm_program* program);
 
-// ------------------------------------------------------------------
-// internal method to build hash from string
-// ------------------------------------------------------------------
-static int vm__build_hash(const char* v, int len) {
-	int l = 0;
-	char tmp[256];
-	for (int i = 0; i < len; ++i) {
-		tmp[l++] = v[i];
-	}
-	tmp[l] = '\0';
-	int r = vm__fnv1a(tmp);
-	return r;
-}
+	DSDEF vm_env* vm_create_env(const vm_program* program);
 
-// ------------------------------------------------------------------
-// add new variable to vm_context
-// ------------------------------------------------------------------
-DSDEF int vm_add_variable(vm_context* ctx, const char* name, float value) {
-	vm_variable* v = &ctx->variables[ctx->num_variables++];
-	v->hash = vm__fnv1a(name);
-	v->value = value;
-	v->name = name;
-	return  ctx->num_variables - 1;
-}
+	DSDEF void vm_reset_env(const vm_program* program, vm_env* env);
 
-// ------------------------------------------------------------------
-// set value of variable
-// ------------------------------------------------------------------
-DSDEF void vm_set_variable(vm_context* ctx, const char* name, float value) {
-	int h = vm__fnv1a(name);
-	for (int i = 0; i < ctx->num_variables; ++i) {
-		if (ctx->variables[i].hash == h) {
-			ctx->variables[i].value = value;
-		}
-	}
-}
+	DSDEF void vm_destroy_env(vm_env* env);
 
-// ------------------------------------------------------------------
-// internal method to add a new variable
-// ------------------------------------------------------------------
-static int vm__add_variable(vm_context* ctx, const char* name, int length, float value) {
-	vm_variable* v = &ctx->variables[ctx->num_variables++];
-	v->hash = vm__build_hash(name, length);
-	v->value = value;
-	v->name = name;
-	return  ctx->num_variables - 1;
-}
+	DSDEF int vm_run_env(const vm_program* program, const vm_env* env, float* ret);
 
-// ------------------------------------------------------------------
-// add function to vm_context
-// ------------------------------------------------------------------
-DSDEF void vm_add_function(vm_context* ctx, const char* name, vmFunction func, int precedence, int num_params) {
-	vm_function* f = &ctx->functions[ctx->num_functions++];
-	f->hash = vm__fnv1a(name);
-	f->function = func;
-	f->precedence = precedence;
-	f->num_parameters = num_params;
-	f->name = name;
-}
+	DSDEF int vm_save_programs(const char* path, const vm_program** programs, const char** names, int count);
 
-// ------------------------------------------------------------------
-// all supported functions
-// ------------------------------------------------------------------
-static void vm_no_op(vm_stack* stack) {}
+	DSDEF vm_program_file* vm_load_programs(vm_context* ctx, const char* path, int* error);
 
-static void vm_add(vm_stack* stack) {
-	VM_PUSH(stack, VM_POP(stack) + VM_POP(stack));
-}
+	DSDEF int vm_num_programs(const vm_program_file* file);
 
-static void vm_sub(vm_stack* stack) {
-	float a = VM_POP(stack);
-	float b = VM_POP(stack);
-	VM_PUSH(stack,b - a);
-}
+	DSDEF const vm_program* vm_get_program(const vm_program_file* file, int index);
 
-static void vm_mul(vm_stack* stack) {
-	VM_PUSH(stack, VM_POP(stack) * VM_POP(stack));
-}
+	DSDEF int vm_find_program(const vm_program_file* file, const char* name);
 
-static void vm_div(vm_stack* stack) {
-	float a = VM_POP(stack);
-	float b = VM_POP(stack);
-	VM_PUSH(stack, b / a);
-}
+	DSDEF void vm_close_programs(vm_program_file* file);
 
-static void vm_pow(vm_stack* stack) {
-	float a = VM_POP(stack);
-	float b = VM_POP(stack);
-	VM_PUSH(stack, pow(b,a));
-}
+	DSDEF int vm_map_file(const char* path, void** data, size_t* size);
 
-static void vm_sin(vm_stack* stack) {
-	VM_PUSH(stack, sin(VM_POP(stack)));
-}
+	DSDEF void vm_unmap_file(void* data, size_t size);
 
-static void vm_cos(vm_stack* stack) {
-	VM_PUSH(stack, cos(VM_POP(stack)));
-}
+	DSDEF vm_lut* vm_create_lut(const vm_program* program, const char* variable, float min, float max, float max_error, int interpolation, int* error);
 
-static void vm_tan(vm_stack* stack) {
-	VM_PUSH(stack, tan(VM_POP(stack)));
-}
+	DSDEF float vm_lut_eval(const vm_lut* lut, float x);
 
-static void vm_abs(vm_stack* stack) {
-	VM_PUSH(stack, abs(VM_POP(stack)));
-}
+	DSDEF void vm_lut_eval_batch(const vm_lut* lut, const float* x, float* results, int count);
 
-static void vm_lerp(vm_stack* stack) {
-	float t = VM_POP(stack); 
-	float a = VM_POP(stack); 
-	float b = VM_POP(stack); 
-	VM_PUSH(stack,(1.0f - t) * b + t * a);
-}
+	DSDEF void vm_destroy_lut(vm_lut* lut);
 
-// ------------------------------------------------------------------
-// create new vm_context
-// ------------------------------------------------------------------
-DSDEF vm_context* vm_create_context() {
-	vm_context* ctx = (vm_context*)VM_MALLOC(sizeof(vm_context));
-	ctx->num_variables = 0;
-	ctx->num_functions = 0;
-	vm_add_function(ctx, ",", vm_no_op, 1, 0);
-	vm_add_function(ctx, "+", vm_add, 12, 2);
-	vm_add_function(ctx, "-", vm_sub, 12, 2);
-	vm_add_function(ctx, "*", vm_mul, 13, 2);
-	vm_add_function(ctx, "/", vm_div, 13, 2);
-	vm_add_function(ctx, "u-", vm_abs, 16, 1);
-	vm_add_function(ctx, "u+", vm_no_op, 1, 0);
-	vm_add_function(ctx, "sin", vm_sin, 17, 1);
-	vm_add_function(ctx, "cos", vm_cos, 17, 1);
-	vm_add_function(ctx, "abs", vm_abs, 17, 1);
-	vm_add_function(ctx, "lerp", vm_lerp, 17, 1);
-	vm_add_function(ctx, "pow", vm_pow, 17, 2);
-	vm_add_function(ctx, "exp", vm_lerp, 17, 1);
-	vm_add_function(ctx, "tan", vm_tan, 17, 1);
-	return ctx;
-}
+	DSDEF vm_pool* vm_create_pool(int num_threads);
 
-// ------------------------------------------------------------------
-// destroy vm_context
-// ------------------------------------------------------------------
-DSDEF void vm_destroy_context(vm_context* ctx) {
-	VM_FREE(ctx);
-}
+	DSDEF int vm_pool_size(vm_pool* pool);
 
-// ------------------------------------------------------------------
-// internal method to find a variable
-// ------------------------------------------------------------------
-static int vm__find_variable(const char *s, int len, vm_context* ctx) {
-	int h = vm__build_hash(s, len);
-	for (int i = 0; i < ctx->num_variables; ++i) {
-		if ( ctx->variables[i].hash == h) {
-			return i;
-		}
-	}
-	return -1;
-}
+	DSDEF int vm_eval_many(vm_pool* pool, const vm_job* jobs, int count, float* results, int* codes, int grain);
 
-// ------------------------------------------------------------------
-// internal method to find a function
-// ------------------------------------------------------------------
-static int vm__find_function(vm_context* ctx, const char *s, int len) {
-	int h = vm__build_hash(s, len);
-	for (int i = 0; i < ctx->num_functions; ++i) {
-		if ( h == ctx->functions[i].hash) {
-			return i;
-		}
-	}
-	return -1;
-}
+	DSDEF void vm_destroy_pool(vm_pool* pool);
 
-// ------------------------------------------------------------------
-// is numeric
-// ------------------------------------------------------------------
-static int vm__is_numeric(const char c) {
-	if ((c >= '0' && c <= '9')) {
-		return 1;
-	}
-	return 0;
-}
+	DSDEF int vm_reduce(vm_pool* pool, const vm_program* program, const vm_env* env, const float** columns, int count, int reduction, float* result);
 
-// ------------------------------------------------------------------
-// is whitespace
-// ------------------------------------------------------------------
-static int vm__is_whitespace(const char c) {
-	if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
-		return 1;
-	}
-	return 0;
-}
+	DSDEF void vm_enable_snapshots(vm_context* ctx, int max_readers);
 
-// ------------------------------------------------------------------
-// get token for identifier
-// ------------------------------------------------------------------
-static vm_token vm__token_for_identifier(vm_context* ctx, const char *identifier, unsigned len) {
-	int i;
-	if ((i = vm__find_variable(identifier, len, ctx)) != -1) {
-		vm_token t;
-		t.type = TOK_VARIABLE;
-		t.id = i;
-		return t;
-	}
-	else if ((i = vm__find_function(ctx, identifier, len)) != -1) {
-		vm_token t;
-		t.type = TOK_FUNCTION;
-		t.id = i;
-		return t;
-	}
-	else {
-		int l = 0;
-		const char* p = identifier;
-		while (!vm__is_whitespace(*p)) {
-			++l;
-			++p;
-		}
-		i = vm__add_variable(ctx, identifier, l, 0.0f);
-		vm_token t;
-		t.type = TOK_VARIABLE;
-		t.id = i;
-		return t;
-	}
-}
+	DSDEF long long vm_publish(vm_context* ctx);
 
-static vm_token vm__token_for_identifier2(vm_context* ctx, const char *identifier) {
-	return vm__token_for_identifier(ctx, identifier, strlen(identifier));
-}
+	DSDEF const vm_snapshot* vm_pin_snapshot(vm_context* ctx, int reader);
 
-// ------------------------------------------------------------------
-// internal method to check wether there is a known function
-// ------------------------------------------------------------------
-static int vm__has_function(vm_context* ctx, char * identifier) {
-	if (vm__find_function(ctx, identifier, strlen(identifier)) != -1) {
-		return 1;
-	}
-	return 0;
-}
+	DSDEF void vm_unpin_snapshot(vm_context* ctx, int reader);
 
+	DSDEF int vm_run_snapshot(vm_context* ctx, const vm_snapshot* snapshot, vm_token* byteCode, int capacity, float* ret);
 
+	// compact bytecode: one byte per opcode followed by 1 or 2 byte
+	// operands, the literals are stored once in the constant pool
+	struct vm_packed_t {
+		const unsigned char* code;
+		int code_size;
+		const float* constants;
+		int num_constants;
+		int max_stack;
+		// bytes used by the program including this header
+		int size;
+	};
+
+	typedef struct vm_packed_t vm_packed;
+
+	DSDEF vm_packed* vm_pack(vm_context* ctx, const vm_token* tokens, int num, int* error);
+
+	DSDEF int vm_run_packed(vm_context* ctx, const vm_packed* packed, float* ret);
+
+	DSDEF void vm_destroy_packed(vm_packed* packed);
+
+	typedef struct vm_jit_t vm_jit;
+
+	DSDEF vm_jit* vm_jit_compile(vm_context* ctx, vm_token* byteCode, int capacity);
+
+	DSDEF int vm_jit_call(vm_jit* jit, vm_context* ctx, float* ret);
+
+	DSDEF int vm_jit_is_native(vm_jit* jit);
+
+	DSDEF void vm_jit_free(vm_jit* jit);
+
+	DSDEF int vm_get_profile(vm_context* ctx, const char* name, vm_profile_stats* stats);
+
+	DSDEF int vm_get_program_profile(vm_context* ctx, const vm_token* tokens, int num, vm_profile_stats* stats);
+
+	DSDEF void vm_profile_report(vm_context* ctx);
+
+	DSDEF void vm_profile_reset(vm_context* ctx);
+
+	DSDEF void vm_debug(vm_context* ctx, vm_token* tokens, int num);
+
+	DSDEF void vm_destroy_context(vm_context* ctx);
+
+	DSDEF const char* vm_get_error(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+// ------------------------------------------------------------------
+// Compile time expressions (C++20)
+// ds_vm::compile turns a string literal into a callable while the
+// C++ code is compiled. The tokenizer and the shunting-yard mirror
+// vm_parse and the rewrites of the optimizer are applied as well,
+// so the results match vm_run. The callable evaluates the tree
+// directly without bytecode or a stack. Variables are numbered in
+// the order of their first appearance like the slots of a
+// vm_program. Custom functions are declared with ds_vm::function
+// and their implementations are passed to compile in the same order.
+//
+// constexpr auto wave = ds_vm::compile<"15.0 * cos(TIMER * -6.0) + 240.0">();
+// float r = wave(1.5f);
+// auto foo = ds_vm::compile<"2 + FOO(X, 3)", ds_vm::function<"FOO", 2>>(foo_method);
+// float values[foo.num_variables];
+// values[foo.variable<"X">()] = 4.0f;
+// r = foo(values);
+// ------------------------------------------------------------------
+#if defined(__cplusplus) && (__cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)) && !defined(DS_VM_NO_COMPILE_TIME)
+#ifndef DS_VM_COMPILE_TIME_H
+#define DS_VM_COMPILE_TIME_H
+#define DS_VM_COMPILE_TIME
+#include <math.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace ds_vm {
+
+	template<int N>
+	struct fixed_string {
+		char text[N];
+		constexpr fixed_string(const char(&s)[N]) : text() {
+			for (int i = 0; i < N; ++i) {
+				text[i] = s[i];
+			}
+		}
+		constexpr int length() const { return N - 1; }
+	};
+
+	// declares a custom function (see vm_add_function_ex)
+	template<fixed_string Name, int NumParameters, int Flags = 0, int Precedence = 17>
+	struct function {
+		static constexpr fixed_string name = Name;
+		static constexpr int num_parameters = NumParameters;
+		static constexpr int flags = Flags;
+		static constexpr int precedence = Precedence;
+		using pointer = vmFunction;
+	};
+
+	namespace detail {
+
+		// float(*)(float, ...) with N parameters
+		template<int N, typename... Args>
+		struct typed_pointer {
+			using type = typename typed_pointer<N - 1, float, Args...>::type;
+		};
+
+		template<typename... Args>
+		struct typed_pointer<0, Args...> {
+			using type = float(*)(Args...);
+		};
+
+	}
+
+	// declares a typed custom function (see vm_add_function_1)
+	template<fixed_string Name, int NumParameters, int Flags = 0>
+	struct typed_function {
+		static constexpr fixed_string name = Name;
+		static constexpr int num_parameters = NumParameters;
+		static constexpr int flags = Flags;
+		static constexpr int precedence = 17;
+		using pointer = typename detail::typed_pointer<NumParameters>::type;
+	};
+
+	namespace detail {
+
+		struct symbol {
+			const char* name;
+			int length;
+			int precedence;
+			int num_parameters;
+			int flags;
+			// TOK_EMPTY is removed
+			vm_token_type opcode;
+		};
+
+		// same as the built-in functions of vm_create_context
+		inline constexpr symbol builtins[] = {
+			{ ",", 1, 1, 0, VM_FUNCTION_PURE, TOK_EMPTY },
+			{ "+", 1, 12, 2, VM_FUNCTION_PURE, TOK_ADD },
+			{ "-", 1, 12, 2, VM_FUNCTION_PURE, TOK_SUB },
+			{ "*", 1, 13, 2, VM_FUNCTION_PURE, TOK_MUL },
+			{ "/", 1, 13, 2, VM_FUNCTION_PURE, TOK_DIV },
+			{ "u-", 2, 16, 1, VM_FUNCTION_PURE, TOK_NEG },
+			{ "u+", 2, 1, 0, VM_FUNCTION_PURE, TOK_EMPTY },
+			{ "sin", 3, 17, 1, VM_FUNCTION_PURE, TOK_SIN },
+			{ "cos", 3, 17, 1, VM_FUNCTION_PURE, TOK_COS },
+			{ "abs", 3, 17, 1, VM_FUNCTION_PURE, TOK_ABS },
+			{ "lerp", 4, 17, 3, VM_FUNCTION_PURE, TOK_LERP },
+			{ "pow", 3, 17, 2, VM_FUNCTION_PURE, TOK_POW },
+			{ "exp", 3, 17, 1, VM_FUNCTION_PURE, TOK_EXP },
+			{ "tan", 3, 17, 1, VM_FUNCTION_PURE, TOK_TAN },
+			{ "<", 1, 10, 2, VM_FUNCTION_PURE, TOK_LT },
+			{ "<=", 2, 10, 2, VM_FUNCTION_PURE, TOK_LE },
+			{ ">", 1, 10, 2, VM_FUNCTION_PURE, TOK_GT },
+			{ ">=", 2, 10, 2, VM_FUNCTION_PURE, TOK_GE },
+			{ "==", 2, 8, 2, VM_FUNCTION_PURE, TOK_EQ },
+			{ "!=", 2, 8, 2, VM_FUNCTION_PURE, TOK_NE },
+			{ "&&", 2, 5, 2, VM_FUNCTION_PURE, TOK_AND_JUMP },
+			{ "||", 2, 4, 2, VM_FUNCTION_PURE, TOK_OR_JUMP },
+			{ "?", 1, 3, 0, VM_FUNCTION_PURE, TOK_JUMP_IF_FALSE },
+			{ ":", 1, 3, 0, VM_FUNCTION_PURE, TOK_JUMP },
+			{ "min", 3, 17, 2, VM_FUNCTION_PURE, TOK_MIN },
+			{ "max", 3, 17, 2, VM_FUNCTION_PURE, TOK_MAX },
+			{ "clamp", 5, 17, 3, VM_FUNCTION_PURE, TOK_CLAMP },
+			{ "select", 6, 17, 3, VM_FUNCTION_PURE, TOK_SELECT }
+		};
+
+		inline constexpr int num_builtins = sizeof(builtins) / sizeof(builtins[0]);
+
+		struct node {
+			vm_token_type type;
+			float value;
+			// variable or custom function
+			int id;
+			// the children are stored in program::operands
+			int first;
+			int count;
+			int pure;
+		};
+
+		template<int N>
+		struct program {
+			node nodes[N];
+			int operands[N];
+			int num_nodes;
+			int num_operands;
+			int root;
+			// zero terminated copies of the variable names
+			char names[2 * N];
+			int names_size;
+			int max_name_length;
+			int name_offsets[N];
+			int num_variables;
+			int error;
+		};
+
+		struct operator_item {
+			const symbol* function;
+			int id;
+			int precedence;
+			int par_level;
+			// commas of a call with an open parenthesis, -1 otherwise
+			int args;
+		};
+
+		struct rpn_item {
+			vm_token_type type;
+			float value;
+			int id;
+		};
+
+		constexpr int is_identifier(char c, int first) {
+			return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || (!first && c >= '0' && c <= '9');
+		}
+
+		constexpr int same_name(const char* a, int a_len, const char* b, int b_len) {
+			if (a_len != b_len) {
+				return 0;
+			}
+			for (int i = 0; i < a_len; ++i) {
+				if (a[i] != b[i]) {
+					return 0;
+				}
+			}
+			return 1;
+		}
+
+		// custom functions come first and get their index as id
+		constexpr int find_symbol(const symbol* custom, int num_custom, const char* name, int len) {
+			for (int i = 0; i < num_custom; ++i) {
+				if (same_name(custom[i].name, custom[i].length, name, len)) {
+					return i;
+				}
+			}
+			for (int i = 0; i < num_builtins; ++i) {
+				if (same_name(builtins[i].name, builtins[i].length, name, len)) {
+					return num_custom + i;
+				}
+			}
+			return -1;
+		}
+
+		template<int N>
+		constexpr int find_variable(const program<N>& p, const char* name, int len) {
+			for (int i = 0; i < p.num_variables; ++i) {
+				const char* v = p.names + p.name_offsets[i];
+				int v_len = 0;
+				while (v[v_len]) {
+					++v_len;
+				}
+				if (same_name(v, v_len, name, len)) {
+					return i;
+				}
+			}
+			return -1;
+		}
+
+		template<int N>
+		constexpr int add_variable(program<N>& p, const char* name, int len) {
+			int i = find_variable(p, name, len);
+			if (i != -1) {
+				return i;
+			}
+			p.name_offsets[p.num_variables] = p.names_size;
+			p.max_name_length = len > p.max_name_length ? len : p.max_name_length;
+			for (int j = 0; j < len; ++j) {
+				p.names[p.names_size++] = name[j];
+			}
+			p.names[p.names_size++] = 0;
+			return p.num_variables++;
+		}
+
+		// same as vm__strtof for a literal starting with a digit
+		constexpr float parse_number(const char* s, int* pos) {
+			int i = *pos;
+			float value = 0.0f;
+			while (s[i] >= '0' && s[i] <= '9') {
+				value *= 10.0f;
+				value = value + (s[i] - '0');
+				++i;
+			}
+			if (s[i] == '.') {
+				++i;
+				float dec = 1.0f;
+				float frac = 0.0f;
+				while (s[i] >= '0' && s[i] <= '9') {
+					frac *= 10.0f;
+					frac = frac + (s[i] - '0');
+					dec *= 10.0f;
+					++i;
+				}
+				value = value + (frac / dec);
+			}
+			*pos = i;
+			return value;
+		}
+
+		// a ternary is a TOK_JUMP node with the condition and both branches,
+		// && and || are TOK_AND_JUMP and TOK_OR_JUMP nodes
+		constexpr int arity(vm_token_type type, const symbol* custom, int id) {
+			switch (type) {
+				case TOK_ADD: case TOK_SUB: case TOK_MUL: case TOK_DIV: case TOK_POW: return 2;
+				case TOK_LT: case TOK_LE: case TOK_GT: case TOK_GE: case TOK_EQ: case TOK_NE: case TOK_MIN: case TOK_MAX: return 2;
+				case TOK_AND_JUMP: case TOK_OR_JUMP: return 2;
+				case TOK_LERP: case TOK_CLAMP: case TOK_SELECT: case TOK_JUMP: return 3;
+				case TOK_FUNCTION: return custom[id].num_parameters;
+				default: return 1;
+			}
+		}
+
+		template<int N>
+		constexpr int add_node(program<N>& p, vm_token_type type, float value, int id, const int* args, int count, int pure) {
+			node& n = p.nodes[p.num_nodes];
+			n.type = type;
+			n.value = value;
+			n.id = id;
+			n.first = p.num_operands;
+			n.count = count;
+			n.pure = pure;
+			for (int i = 0; i < count; ++i) {
+				p.operands[p.num_operands++] = args[i];
+			}
+			return p.num_nodes++;
+		}
+
+		template<int N>
+		constexpr int add_number(program<N>& p, float value) {
+			return add_node(p, TOK_NUMBER, value, 0, 0, 0, 1);
+		}
+
+		// folds the operators which can be evaluated in a constant
+		// expression, the other ones are left to the compiler
+		constexpr int fold(vm_token_type type, const float* v, float* ret) {
+			switch (type) {
+				case TOK_ADD: *ret = v[0] + v[1]; return 1;
+				case TOK_SUB: *ret = v[0] - v[1]; return 1;
+				case TOK_MUL: *ret = v[0] * v[1]; return 1;
+				case TOK_DIV: *ret = v[0] / v[1]; return v[1] != 0.0f;
+				case TOK_NEG: *ret = -v[0]; return 1;
+				case TOK_ABS: *ret = v[0] < 0.0f ? -v[0] : (v[0] == 0.0f ? 0.0f : v[0]); return 1;
+				case TOK_LERP: *ret = (1.0f - v[2]) * v[0] + v[2] * v[1]; return 1;
+				case TOK_LT: *ret = v[0] < v[1] ? 1.0f : 0.0f; return 1;
+				case TOK_LE: *ret = v[0] <= v[1] ? 1.0f : 0.0f; return 1;
+				case TOK_GT: *ret = v[0] > v[1] ? 1.0f : 0.0f; return 1;
+				case TOK_GE: *ret = v[0] >= v[1] ? 1.0f : 0.0f; return 1;
+				case TOK_EQ: *ret = v[0] == v[1] ? 1.0f : 0.0f; return 1;
+				case TOK_NE: *ret = v[0] != v[1] ? 1.0f : 0.0f; return 1;
+				case TOK_MIN: *ret = v[0] < v[1] ? v[0] : v[1]; return 1;
+				case TOK_MAX: *ret = v[0] > v[1] ? v[0] : v[1]; return 1;
+				case TOK_CLAMP: *ret = v[0] > v[1] ? v[0] : v[1]; *ret = *ret < v[2] ? *ret : v[2]; return 1;
+				case TOK_BOOL: *ret = v[0] != 0.0f ? 1.0f : 0.0f; return 1;
+				case TOK_SELECT: *ret = v[0] != 0.0f ? v[1] : v[2]; return 1;
+				default: return 0;
+			}
+		}
+
+		// the same rewrites as vm__optimize on the tree
+		template<int N>
+		constexpr int reduce(program<N>& p, vm_token_type type, int id, const symbol* custom, const int* args, int count) {
+			if ((type == TOK_JUMP || type == TOK_AND_JUMP || type == TOK_OR_JUMP) && p.nodes[args[0]].type == TOK_NUMBER) {
+				// only the branch which is taken is left
+				int truth = p.nodes[args[0]].value != 0.0f;
+				if (type == TOK_JUMP) {
+					return args[truth ? 1 : 2];
+				}
+				if (truth == (type == TOK_OR_JUMP)) {
+					return add_number(p, truth ? 1.0f : 0.0f);
+				}
+				return reduce(p, TOK_BOOL, 0, custom, args + 1, 1);
+			}
+			int pure = type != TOK_FUNCTION || (custom[id].flags & VM_FUNCTION_PURE);
+			int all_const = pure;
+			int all_pure = pure;
+			float values[3] = {};
+			for (int i = 0; i < count; ++i) {
+				const node& n = p.nodes[args[i]];
+				all_const = all_const && n.type == TOK_NUMBER;
+				all_pure = all_pure && n.pure;
+				if (i < 3) {
+					values[i] = n.value;
+				}
+			}
+			float v = 0.0f;
+			if (all_const && count <= 3 && fold(type, values, &v)) {
+				return add_number(p, v);
+			}
+			if (count == 2 && p.nodes[args[1]].type == TOK_NUMBER) {
+				const node& a = p.nodes[args[0]];
+				float c = p.nodes[args[1]].value;
+				if (((type == TOK_ADD || type == TOK_SUB) && c == 0.0f) || ((type == TOK_MUL || type == TOK_DIV || type == TOK_POW) && c == 1.0f)) {
+					return args[0];
+				}
+				if (((type == TOK_MUL && c == 0.0f) || (type == TOK_POW && c == 0.0f)) && a.pure) {
+					return add_number(p, type == TOK_MUL ? 0.0f : 1.0f);
+				}
+				if (type == TOK_POW && c == 2.0f) {
+					int square[2] = { args[0], args[0] };
+					return add_node(p, TOK_MUL, 0.0f, 0, square, 2, all_pure);
+				}
+			}
+			else if (count == 2 && p.nodes[args[0]].type == TOK_NUMBER) {
+				float c = p.nodes[args[0]].value;
+				if ((type == TOK_ADD && c == 0.0f) || (type == TOK_MUL && c == 1.0f)) {
+					return args[1];
+				}
+				if (type == TOK_MUL && c == 0.0f && p.nodes[args[1]].pure) {
+					return add_number(p, 0.0f);
+				}
+			}
+			else if (type == TOK_NEG && p.nodes[args[0]].type == TOK_NEG) {
+				return p.operands[p.nodes[args[0]].first];
+			}
+			return add_node(p, type, 0.0f, id, args, count, all_pure);
+		}
+
+		// moves an operator into the RPN, an open '?' has no ':'
+		constexpr int pop_operator(const operator_item& top, int num_custom, rpn_item* rpn, int* num_rpn) {
+			if (top.function->opcode == TOK_JUMP_IF_FALSE) {
+				return 17;
+			}
+			rpn[(*num_rpn)++] = { top.id < num_custom ? TOK_FUNCTION : top.function->opcode, 0.0f, top.id };
+			return 0;
+		}
+
+		// the shunting-yard of vm__parse followed by building the tree
+		template<int N>
+		constexpr program<N> parse(const char(&s)[N], const symbol* custom, int num_custom) {
+			program<N> p = {};
+			rpn_item rpn[N] = {};
+			operator_item ops[N] = {};
+			int num_rpn = 0;
+			int num_ops = 0;
+			int par_level = 0;
+			int binary = 0;
+			vm_token_type prev = TOK_EMPTY;
+			int i = 0;
+			while (s[i] != 0) {
+				vm_token_type type = TOK_EMPTY;
+				float value = 0.0f;
+				int id = -1;
+				int call = 0;
+				int comma = s[i] == ',';
+				if (s[i] >= '0' && s[i] <= '9') {
+					type = TOK_NUMBER;
+					value = parse_number(s, &i);
+					binary = 1;
+				}
+				else if (is_identifier(s[i], 1)) {
+					int start = i;
+					while (is_identifier(s[i], 0)) {
+						++i;
+					}
+					id = find_symbol(custom, num_custom, s + start, i - start);
+					type = id != -1 ? TOK_FUNCTION : TOK_VARIABLE;
+					if (id == -1) {
+						id = add_variable(p, s + start, i - start);
+					}
+					binary = 1;
+					int next = i;
+					while (s[next] == ' ' || s[next] == '\t' || s[next] == '\n' || s[next] == '\r') {
+						++next;
+					}
+					call = s[next] == '(';
+				}
+				else {
+					switch (s[i]) {
+						case '(': type = TOK_LEFT_PARENTHESIS; binary = 0; break;
+						case ')': type = TOK_RIGHT_PARENTHESIS; binary = 1; break;
+						case ' ': case '\t': case '\n': case '\r': break;
+						case '-': type = TOK_FUNCTION; id = find_symbol(custom, num_custom, binary ? "-" : "u-", binary ? 1 : 2); binary = 0; break;
+						case '+': type = TOK_FUNCTION; id = find_symbol(custom, num_custom, binary ? "+" : "u+", binary ? 1 : 2); binary = 0; break;
+						default: {
+							type = TOK_FUNCTION;
+							if (s[i + 1] && (id = find_symbol(custom, num_custom, s + i, 2)) != -1) {
+								++i;
+							}
+							else if ((id = find_symbol(custom, num_custom, s + i, 1)) == -1) {
+								type = TOK_VARIABLE;
+								id = add_variable(p, s + i, 1);
+							}
+							binary = 0;
+							break;
+						}
+					}
+					++i;
+				}
+				if (type == TOK_NUMBER || type == TOK_VARIABLE) {
+					rpn[num_rpn++] = { type, value, id };
+				}
+				else if (type == TOK_LEFT_PARENTHESIS) {
+					++par_level;
+				}
+				else if (type == TOK_RIGHT_PARENTHESIS) {
+					--par_level;
+					int k = num_ops - 1;
+					while (k >= 0 && ops[k].par_level > par_level) {
+						--k;
+					}
+					if (k >= 0 && ops[k].par_level == par_level && ops[k].args >= 0) {
+						int args = prev == TOK_LEFT_PARENTHESIS ? 0 : ops[k].args + 1;
+						if (args != ops[k].function->num_parameters) {
+							p.error = 15;
+							return p;
+						}
+						ops[k].args = -1;
+					}
+				}
+				else if (type == TOK_FUNCTION) {
+					const symbol* f = id < num_custom ? &custom[id] : &builtins[id - num_custom];
+					operator_item item = { f, id, f->precedence, par_level, call ? 0 : -1 };
+					int prefix = prev != TOK_NUMBER && prev != TOK_VARIABLE && prev != TOK_RIGHT_PARENTHESIS;
+					if (f->opcode == TOK_JUMP) {
+						// ':' replaces the innermost '?' of this level
+						while (num_ops > 0 && (ops[num_ops - 1].par_level != par_level || ops[num_ops - 1].function->opcode != TOK_JUMP_IF_FALSE)) {
+							if (ops[num_ops - 1].par_level < par_level) {
+								p.error = 17;
+								return p;
+							}
+							if ((p.error = pop_operator(ops[--num_ops], num_custom, rpn, &num_rpn)) != 0) {
+								return p;
+							}
+						}
+						if (num_ops == 0) {
+							p.error = 17;
+							return p;
+						}
+						--num_ops;
+					}
+					else {
+						// '?' is right associative
+						int right = f->opcode == TOK_JUMP_IF_FALSE;
+						while (!prefix && num_ops > 0) {
+							const operator_item& top = ops[num_ops - 1];
+							int c = top.par_level != item.par_level ? top.par_level - item.par_level : top.precedence - item.precedence;
+							if (c < right) {
+								break;
+							}
+							--num_ops;
+							if ((p.error = pop_operator(top, num_custom, rpn, &num_rpn)) != 0) {
+								return p;
+							}
+						}
+					}
+					ops[num_ops++] = item;
+					if (comma) {
+						int k = num_ops - 1;
+						while (k >= 0 && ops[k].par_level >= par_level) {
+							--k;
+						}
+						if (k >= 0 && ops[k].par_level == par_level - 1 && ops[k].args >= 0) {
+							++ops[k].args;
+						}
+					}
+				}
+				if (type != TOK_EMPTY) {
+					prev = type;
+				}
+			}
+			while (num_ops > 0) {
+				if ((p.error = pop_operator(ops[--num_ops], num_custom, rpn, &num_rpn)) != 0) {
+					return p;
+				}
+			}
+			int stack[N] = {};
+			int sp = 0;
+			for (int r = 0; r < num_rpn; ++r) {
+				const rpn_item& t = rpn[r];
+				if (t.type == TOK_EMPTY) {
+					continue;
+				}
+				if (t.type == TOK_NUMBER) {
+					stack[sp++] = add_number(p, t.value);
+					continue;
+				}
+				if (t.type == TOK_VARIABLE) {
+					stack[sp++] = add_node(p, TOK_VARIABLE, 0.0f, t.id, 0, 0, 1);
+					continue;
+				}
+				int count = arity(t.type, custom, t.id);
+				if (sp < count) {
+					p.error = 2;
+					return p;
+				}
+				sp -= count;
+				stack[sp] = reduce(p, t.type, t.id, custom, stack + sp, count);
+				++sp;
+			}
+			if (sp != 1) {
+				p.error = sp == 0 ? 1 : 12;
+				return p;
+			}
+			p.root = stack[0];
+			return p;
+		}
+
+		// the variable names of a program, one row per name
+		template<int V, int L>
+		struct name_table {
+			char names[V][L];
+		};
+
+		template<int V, int L, int N>
+		constexpr name_table<V, L> copy_names(const program<N>& p) {
+			name_table<V, L> table = {};
+			for (int i = 0; i < p.num_variables; ++i) {
+				const char* name = p.names + p.name_offsets[i];
+				for (int j = 0; name[j]; ++j) {
+					table.names[i][j] = name[j];
+				}
+			}
+			return table;
+		}
+
+		template<typename T>
+		using function_pointer = typename T::pointer;
+
+	}
+
+	template<fixed_string Source, typename... Functions>
+	class expression {
+
+		static constexpr detail::symbol symbols[] = {
+			detail::symbol{ Functions::name.text, Functions::name.length(), Functions::precedence, Functions::num_parameters, Functions::flags, TOK_FUNCTION }...,
+			detail::symbol{ "", 0, 0, 0, 0, TOK_EMPTY }
+		};
+
+		static constexpr detail::program<sizeof(Source.text)> program = detail::parse(Source.text, symbols, sizeof...(Functions));
+
+		static_assert(program.error != 1, "ds_vm: the expression has no value");
+		static_assert(program.error != 2, "ds_vm: an operator or function has not enough parameters");
+		static_assert(program.error != 12, "ds_vm: values left on the stack");
+		static_assert(program.error != 15, "ds_vm: wrong number of arguments in a function call");
+		static_assert(program.error != 17, "ds_vm: unmatched ? or :");
+
+		static constexpr detail::name_table<program.num_variables + 1, program.max_name_length + 1> names = detail::copy_names<program.num_variables + 1, program.max_name_length + 1>(program);
+
+	public:
+		static constexpr int num_variables = program.num_variables;
+
+		constexpr explicit expression(detail::function_pointer<Functions>... functions) : functions{ functions... } {}
+
+		// index of a variable in the values, unknown names do not compile
+		template<fixed_string Name>
+		static constexpr int variable() {
+			constexpr int index = detail::find_variable(program, Name.text, Name.length());
+			static_assert(index != -1, "ds_vm: unknown variable");
+			return index;
+		}
+
+		// index of a variable or -1
+		static constexpr int find_variable(const char* name) {
+			int len = 0;
+			while (name[len]) {
+				++len;
+			}
+			return detail::find_variable(program, name, len);
+		}
+
+		static constexpr const char* variable_name(int index) {
+			return names.names[index];
+		}
+
+		float operator()(const float* values) const {
+			return eval<program.root>(values);
+		}
+
+		template<typename... Args, typename = std::enable_if_t<sizeof...(Args) == num_variables && (std::is_arithmetic_v<Args> && ...)>>
+		float operator()(Args... args) const {
+			const float values[] = { (float)args..., 0.0f };
+			return eval<program.root>(values);
+		}
+
+	private:
+		std::tuple<detail::function_pointer<Functions>...> functions;
+
+		template<int I, int K>
+		float operand(const float* values) const {
+			return eval<program.operands[program.nodes[I].first + K]>(values);
+		}
+
+		// typed functions get the operands directly, the braces keep
+		// the order of evaluation
+		template<int I, typename F, int... K>
+		float call(F func, const float* values, std::integer_sequence<int, K...>) const {
+			const float args[] = { operand<I, K>(values)... };
+			return func(args[K]...);
+		}
+
+		template<int I, int K>
+		void push(vm_stack* stack, const float* values) const {
+			if constexpr (K > 0) {
+				push<I, K - 1>(stack, values);
+				float v = operand<I, K - 1>(values);
+				stack->data[stack->size++] = v;
+			}
+		}
+
+		// the operands are always evaluated from left to right
+		template<int I>
+		float eval(const float* values) const {
+			constexpr detail::node n = program.nodes[I];
+			if constexpr (n.type == TOK_NUMBER) {
+				return n.value;
+			}
+			else if constexpr (n.type == TOK_VARIABLE) {
+				return values[n.id];
+			}
+			else if constexpr (n.type == TOK_FUNCTION) {
+				auto func = std::get<n.id>(functions);
+				if constexpr (std::is_same_v<decltype(func), vmFunction>) {
+					float data[32];
+					vm_stack stack = { data, 0, 32 };
+					push<I, n.count>(&stack, values);
+					func(&stack);
+					return stack.size > 0 ? data[stack.size - 1] : 0.0f;
+				}
+				else {
+					return call<I>(func, values, std::make_integer_sequence<int, n.count>());
+				}
+			}
+			else if constexpr (n.type == TOK_MUL && program.operands[n.first] == program.operands[n.first + 1]) {
+				float a = operand<I, 0>(values);
+				return a * a;
+			}
+			// conditionals only evaluate the branch which is taken
+			else if constexpr (n.type == TOK_JUMP) {
+				return operand<I, 0>(values) != 0.0f ? operand<I, 1>(values) : operand<I, 2>(values);
+			}
+			else if constexpr (n.type == TOK_AND_JUMP) {
+				return operand<I, 0>(values) != 0.0f && operand<I, 1>(values) != 0.0f ? 1.0f : 0.0f;
+			}
+			else if constexpr (n.type == TOK_OR_JUMP) {
+				return operand<I, 0>(values) != 0.0f || operand<I, 1>(values) != 0.0f ? 1.0f : 0.0f;
+			}
+			else if constexpr (n.count == 1) {
+				float a = operand<I, 0>(values);
+				if constexpr (n.type == TOK_NEG) return -a;
+				else if constexpr (n.type == TOK_ABS) return fabsf(a);
+				else if constexpr (n.type == TOK_SIN) return (float)::sin(a);
+				else if constexpr (n.type == TOK_COS) return (float)::cos(a);
+				else if constexpr (n.type == TOK_TAN) return (float)::tan(a);
+				else if constexpr (n.type == TOK_BOOL) return a != 0.0f ? 1.0f : 0.0f;
+				else return (float)::exp(a);
+			}
+			else if constexpr (n.count == 2) {
+				float a = operand<I, 0>(values);
+				float b = operand<I, 1>(values);
+				if constexpr (n.type == TOK_ADD) return a + b;
+				else if constexpr (n.type == TOK_SUB) return a - b;
+				else if constexpr (n.type == TOK_MUL) return a * b;
+				else if constexpr (n.type == TOK_DIV) return a / b;
+				else if constexpr (n.type == TOK_LT) return a < b ? 1.0f : 0.0f;
+				else if constexpr (n.type == TOK_LE) return a <= b ? 1.0f : 0.0f;
+				else if constexpr (n.type == TOK_GT) return a > b ? 1.0f : 0.0f;
+				else if constexpr (n.type == TOK_GE) return a >= b ? 1.0f : 0.0f;
+				else if constexpr (n.type == TOK_EQ) return a == b ? 1.0f : 0.0f;
+				else if constexpr (n.type == TOK_NE) return a != b ? 1.0f : 0.0f;
+				else if constexpr (n.type == TOK_MIN) return a < b ? a : b;
+				else if constexpr (n.type == TOK_MAX) return a > b ? a : b;
+				else return (float)::pow(a, b);
+			}
+			else {
+				float a = operand<I, 0>(values);
+				float b = operand<I, 1>(values);
+				float t = operand<I, 2>(values);
+				if constexpr (n.type == TOK_CLAMP) {
+					a = a > b ? a : b;
+					return a < t ? a : t;
+				}
+				else if constexpr (n.type == TOK_SELECT) return a != 0.0f ? b : t;
+				else return (1.0f - t) * a + t * b;
+			}
+		}
+	};
+
+	template<fixed_string Source, typename... Functions>
+	constexpr expression<Source, Functions...> compile(detail::function_pointer<Functions>... functions) {
+		return expression<Source, Functions...>(functions...);
+	}
+
+}
+
+#endif
+#endif
+
+#ifdef DS_VM_IMPLEMENTATION
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+struct vm_error_code_t {
+	int code;
+	const char* message;
+};
+
+typedef struct vm_error_code_t vm_error_code;
+
+const static vm_error_code ERRORS[] = {
+	{0,"Success"},
+	{1,"No return value on stack"},
+	{2,"Requested number of parameters not found on stack"},
+	{3,"Stack overflow"},
+	{4,"Bytecode capacity exceeded"},
+	{5,"Unknown identifier"},
+	{6,"Scratch memory too small"},
+	{7,"Program does not match the environment"},
+	{8,"Cyclic dependency"},
+	{9,"Invalid output or temporary"},
+	{10,"Cannot open file"},
+	{11,"Invalid program file"},
+	{12,"Values left on the stack"},
+	{13,"Lookup table does not meet the error bound"},
+	{14,"Invalid range for the lookup table"},
+	{15,"Wrong number of arguments"},
+	{16,"Expected name = expression"},
+	{17,"Unmatched ? or :"},
+	{18,"Invalid jump"},
+	{19,"Mean of zero elements"}
+};
+
+static void vm__clear_cache(vm_context* ctx, int destroy);
+
+static void vm__graph_touch(vm_context* ctx, int id);
+
+static void vm__destroy_graph(vm_context* ctx);
+
+#ifdef DS_VM_PROFILE
+static void vm__create_profile(vm_context* ctx);
+#endif
+
+static void vm__destroy_profile(vm_context* ctx);
+
+static void vm__destroy_snapshots(vm_context* ctx);
+
+#ifdef DS_VM_PROFILE
+#define VM__PROFILE_PARAM , struct vm_profile_t* profile
+#define VM__PROFILE_ARG(p) , p
+#else
+#define VM__PROFILE_PARAM
+#define VM__PROFILE_ARG(p)
+#endif
+
+static int vm__execute(const vm_token* byteCode, int capacity, const float* values, const vm_function* functions, float* ret, float* outputs, int num_outputs VM__PROFILE_PARAM);
+
+const char* TOKEN_NAMES[] = { "TOK_EMPTY", "TOK_NUMBER", "TOK_FUNCTION", "TOK_VARIABLE", "TOK_LEFT_PARENTHESIS", "TOK_RIGHT_PARENTHESIS",
+	"TOK_ADD", "TOK_SUB", "TOK_MUL", "TOK_DIV", "TOK_NEG", "TOK_ABS", "TOK_SIN", "TOK_COS", "TOK_TAN", "TOK_POW", "TOK_LERP", "TOK_EXP",
+	"TOK_SIN_FAST", "TOK_COS_FAST", "TOK_TAN_FAST", "TOK_POW_FAST", "TOK_EXP_FAST",
+	"TOK_SIN_APPROX", "TOK_COS_APPROX", "TOK_TAN_APPROX", "TOK_POW_APPROX", "TOK_EXP_APPROX",
+	"TOK_DUP", "TOK_ADD_CONST", "TOK_SUB_CONST", "TOK_MUL_CONST", "TOK_DIV_CONST",
+	"TOK_VAR_ADD_CONST", "TOK_VAR_SUB_CONST", "TOK_VAR_MUL_CONST", "TOK_VAR_DIV_CONST",
+	"TOK_STORE", "TOK_LOAD", "TOK_OUTPUT",
+	"TOK_LT", "TOK_LE", "TOK_GT", "TOK_GE", "TOK_EQ", "TOK_NE", "TOK_MIN", "TOK_MAX", "TOK_CLAMP", "TOK_BOOL", "TOK_SELECT",
+	"TOK_JUMP", "TOK_JUMP_IF_FALSE", "TOK_AND_JUMP", "TOK_OR_JUMP", "TOK_LABEL" };
+
+// ------------------------------------------------------------------
+// internal method to map the precision variants of an operator to
+// the VM_PRECISION_EXACT opcode, all other opcodes are returned as is
+// ------------------------------------------------------------------
+static inline vm_token_type vm__exact_opcode(vm_token_type type) {
+	static const vm_token_type exact[] = { TOK_SIN, TOK_COS, TOK_TAN, TOK_POW, TOK_EXP };
+	if (type >= TOK_SIN_FAST && type <= TOK_EXP_APPROX) {
+		return exact[(type - TOK_SIN_FAST) % 5];
+	}
+	return type;
+}
+
+const unsigned int FNV_Prime = 0x01000193; //   16777619
+const unsigned int FNV_Seed = 0x811C9DC5; // 2166136261
+
+// ------------------------------------------------------------------
+// internal method to generate hash
+// ------------------------------------------------------------------
+static inline int vm__fnv1a(const char* text) {
+	const unsigned char* ptr = (const unsigned char*)text;
+	unsigned int hash = FNV_Seed;
+	while (*ptr) {
+		hash = (*ptr++ ^ hash) * FNV_Prime;
+	}
+	return (int)hash;
+}
+
+// ------------------------------------------------------------------
+// get error message by code
+// ------------------------------------------------------------------
+DSDEF const char* vm_get_error(int code) {
+	return ERRORS[code].message;
+}
+
+#ifndef VM_PUSH
+#define VM_PUSH(stack,value) vm__push(stack,value)
+#define VM_POP(stack)        vm__pop(stack)
+#endif
+
+static float vm__pop(vm_stack* stack) { return stack->data[--stack->size]; }
+static void vm__push(vm_stack* stack, float f) { stack->data[stack->size++] = f; }
+
+// ------------------------------------------------------------------
+// internal method to generate hash from a string with length
+// ------------------------------------------------------------------
+static inline int vm__fnv1a_len(const char* text, int len) {
+	const unsigned char* ptr = (const unsigned char*)text;
+	unsigned int hash = FNV_Seed;
+	for (int i = 0; i < len; ++i) {
+		hash = (ptr[i] ^ hash) * FNV_Prime;
+	}
+	return (int)hash;
+}
+
+// ------------------------------------------------------------------
+// internal method to copy a name into owned memory
+// ------------------------------------------------------------------
+static const char* vm__copy_name(const char* name, int len) {
+	char* copy = (char*)VM_MALLOC(len + 1);
+	memcpy(copy, name, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+// ------------------------------------------------------------------
+// internal method to grow an array
+// ------------------------------------------------------------------
+static void* vm__grow(void* data, int num, int* capacity, int size) {
+	int c = *capacity < 16 ? 16 : *capacity * 2;
+	void* p = VM_MALLOC(c * size);
+	if (data) {
+		memcpy(p, data, num * size);
+		VM_FREE(data);
+	}
+	*capacity = c;
+	return p;
+}
+
+// ------------------------------------------------------------------
+// internal method to insert an id into a symbol index. The index
+// is rebuilt with the double size once it is half full.
+// ------------------------------------------------------------------
+static void vm__index_insert(vm_symbol_index* index, int hash, int id, int count) {
+	if ((count + 1) * 2 > index->capacity) {
+		vm_symbol_slot* old = index->slots;
+		int old_capacity = index->capacity;
+		index->capacity = index->capacity < 16 ? 32 : index->capacity * 2;
+		index->slots = (vm_symbol_slot*)VM_MALLOC(index->capacity * sizeof(vm_symbol_slot));
+		for (int i = 0; i < index->capacity; ++i) {
+			index->slots[i].id = -1;
+		}
+		for (int i = 0; i < old_capacity; ++i) {
+			if (old[i].id != -1) {
+				vm__index_insert(index, old[i].hash, old[i].id, 0);
+			}
+		}
+		if (old) {
+			VM_FREE(old);
+		}
+	}
+	unsigned int mask = (unsigned int)index->capacity - 1;
+	unsigned int slot = (unsigned int)hash & mask;
+	while (index->slots[slot].id != -1) {
+		slot = (slot + 1) & mask;
+	}
+	index->slots[slot].hash = hash;
+	index->slots[slot].id = id;
+}
+
+// ------------------------------------------------------------------
+// internal method to find a variable
+// ------------------------------------------------------------------
+static int vm__find_variable(const char *s, int len, vm_context* ctx) {
+	if (ctx->variable_index.capacity == 0) {
+		return -1;
+	}
+	int h = vm__fnv1a_len(s, len);
+	unsigned int mask = (unsigned int)ctx->variable_index.capacity - 1;
+	for (unsigned int slot = (unsigned int)h & mask; ctx->variable_index.slots[slot].id != -1; slot = (slot + 1) & mask) {
+		const vm_symbol_slot* e = &ctx->variable_index.slots[slot];
+		if (e->hash == h) {
+			const vm_variable* v = &ctx->variables[e->id];
+			if (v->length == len && memcmp(v->name, s, len) == 0) {
+				return e->id;
+			}
+		}
+	}
+	return -1;
+}
+
+// ------------------------------------------------------------------
+// internal method to find a function
+// ------------------------------------------------------------------
+static int vm__find_function(vm_context* ctx, const char *s, int len) {
+	if (ctx->function_index.capacity == 0) {
+		return -1;
+	}
+	int h = vm__fnv1a_len(s, len);
+	unsigned int mask = (unsigned int)ctx->function_index.capacity - 1;
+	for (unsigned int slot = (unsigned int)h & mask; ctx->function_index.slots[slot].id != -1; slot = (slot + 1) & mask) {
+		const vm_symbol_slot* e = &ctx->function_index.slots[slot];
+		if (e->hash == h) {
+			const vm_function* f = &ctx->functions[e->id];
+			if (f->length == len && memcmp(f->name, s, len) == 0) {
+				return e->id;
+			}
+		}
+	}
+	return -1;
+}
+
+// ------------------------------------------------------------------
+// internal method to add a new variable or to update an existing one
+// ------------------------------------------------------------------
+static int vm__add_variable(vm_context* ctx, const char* name, int length, float value) {
+	int id = vm__find_variable(name, length, ctx);
+	if (id == -1) {
+		if (ctx->num_variables == ctx->variables_capacity) {
+			int capacity = ctx->variables_capacity;
+			ctx->values = (float*)vm__grow(ctx->values, ctx->num_variables, &capacity, sizeof(float));
+			ctx->variables = (vm_variable*)vm__grow(ctx->variables, ctx->num_variables, &ctx->variables_capacity, sizeof(vm_variable));
+		}
+		id = ctx->num_variables++;
+		vm_variable* v = &ctx->variables[id];
+		v->hash = vm__fnv1a_len(name, length);
+		v->name = vm__copy_name(name, length);
+		v->length = length;
+		vm__index_insert(&ctx->variable_index, v->hash, id, id);
+	}
+	ctx->values[id] = value;
+	if (ctx->graph) {
+		vm__graph_touch(ctx, id);
+	}
+	return id;
+}
+
+// ------------------------------------------------------------------
+// add new variable to vm_context. If the variable already exists
+// the value is updated. Returns the handle of the variable.
+// ------------------------------------------------------------------
+DSDEF int vm_add_variable(vm_context* ctx, const char* name, float value) {
+	return vm__add_variable(ctx, name, (int)strlen(name), value);
+}
+
+// ------------------------------------------------------------------
+// set value of variable
+// ------------------------------------------------------------------
+DSDEF void vm_set_variable(vm_context* ctx, const char* name, float value) {
+	int id = vm__find_variable(name, (int)strlen(name), ctx);
+	if (id != -1) {
+		vm_set_variable_by_handle(ctx, id, value);
+	}
+}
+
+// ------------------------------------------------------------------
+// get handle of variable or -1 if there is no such variable.
+// The handle stays valid for the lifetime of the context.
+// ------------------------------------------------------------------
+DSDEF int vm_get_variable_handle(vm_context* ctx, const char* name) {
+	return vm__find_variable(name, (int)strlen(name), ctx);
+}
+
+// ------------------------------------------------------------------
+// set value of variable by handle
+// ------------------------------------------------------------------
+DSDEF void vm_set_variable_by_handle(vm_context* ctx, int handle, float value) {
+	ctx->values[handle] = value;
+	if (ctx->graph) {
+		vm__graph_touch(ctx, handle);
+	}
+}
+
+// ------------------------------------------------------------------
+// get value of variable or 0 if there is no such variable
+// ------------------------------------------------------------------
+DSDEF float vm_get_variable(vm_context* ctx, const char* name) {
+	int id = vm__find_variable(name, (int)strlen(name), ctx);
+	return id != -1 ? ctx->values[id] : 0.0f;
+}
+
+// ------------------------------------------------------------------
+// get value of variable by handle
+// ------------------------------------------------------------------
+DSDEF float vm_get_variable_by_handle(vm_context* ctx, int handle) {
+	return ctx->values[handle];
+}
+
+// ------------------------------------------------------------------
+// add function to vm_context
+// ------------------------------------------------------------------
+static int vm__find_function(vm_context* ctx, const char *s, int len);
+
+// ------------------------------------------------------------------
+// internal method to add a function. A function with the same name
+// is replaced and keeps its id.
+// ------------------------------------------------------------------
+static int vm__add_function(vm_context* ctx, const char* name, vmFunction func, int precedence, int num_params, int flags) {
+	if (ctx->cache) {
+		// the same source might compile differently now
+		vm__clear_cache(ctx, 0);
+	}
+	int length = (int)strlen(name);
+	int id = vm__find_function(ctx, name, length);
+	if (id == -1) {
+		if (ctx->num_functions == ctx->functions_capacity) {
+			ctx->functions = (vm_function*)vm__grow(ctx->functions, ctx->num_functions, &ctx->functions_capacity, sizeof(vm_function));
+		}
+		id = ctx->num_functions++;
+		vm_function* f = &ctx->functions[id];
+		f->hash = vm__fnv1a_len(name, length);
+		f->name = vm__copy_name(name, length);
+		f->length = length;
+		vm__index_insert(&ctx->function_index, f->hash, id, id);
+	}
+	vm_function* f = &ctx->functions[id];
+	f->function = func;
+	memset(&f->native, 0, sizeof(vm_native));
+	f->array = 0;
+	f->precedence = precedence;
+	f->num_parameters = num_params;
+	f->opcode = TOK_FUNCTION;
+	f->flags = flags;
+	return id;
+}
+
+DSDEF void vm_add_function(vm_context* ctx, const char* name, vmFunction func, int precedence, int num_params) {
+	vm_add_function_ex(ctx, name, func, precedence, num_params, 0);
+}
+
+// ------------------------------------------------------------------
+// add function with flags (VM_FUNCTION_PURE) to vm_context
+// ------------------------------------------------------------------
+DSDEF void vm_add_function_ex(vm_context* ctx, const char* name, vmFunction func, int precedence, int num_params, int flags) {
+	vm__add_function(ctx, name, func, precedence, num_params, flags);
+}
+
+// ------------------------------------------------------------------
+// add typed functions. The parameters are passed directly instead
+// of through a vm_stack and calls with a different number of
+// arguments are rejected by the parser.
+// ------------------------------------------------------------------
+DSDEF void vm_add_function_1(vm_context* ctx, const char* name, vmFunction1 func, int flags) {
+	int id = vm__add_function(ctx, name, 0, 17, 1, flags);
+	ctx->functions[id].native.f1 = func;
+}
+
+DSDEF void vm_add_function_2(vm_context* ctx, const char* name, vmFunction2 func, int flags) {
+	int id = vm__add_function(ctx, name, 0, 17, 2, flags);
+	ctx->functions[id].native.f2 = func;
+}
+
+DSDEF void vm_add_function_3(vm_context* ctx, const char* name, vmFunction3 func, int flags) {
+	int id = vm__add_function(ctx, name, 0, 17, 3, flags);
+	ctx->functions[id].native.f3 = func;
+}
+
+DSDEF void vm_add_function_4(vm_context* ctx, const char* name, vmFunction4 func, int flags) {
+	int id = vm__add_function(ctx, name, 0, 17, 4, flags);
+	ctx->functions[id].native.f4 = func;
+}
+
+// ------------------------------------------------------------------
+// set the array variant of a custom function. vm_run_batch calls it
+// once per batch instead of once per value.
+// Returns 0 or 5 if there is no such custom function.
+// ------------------------------------------------------------------
+DSDEF int vm_set_array_function(vm_context* ctx, const char* name, vmArrayFunction func) {
+	int id = vm__find_function(ctx, name, (int)strlen(name));
+	if (id == -1 || ctx->functions[id].opcode != TOK_FUNCTION) {
+		return 5;
+	}
+	ctx->functions[id].array = func;
+	return 0;
+}
+
+// ------------------------------------------------------------------
+// internal method to call a typed function on the top of the stack.
+// Returns the new top of the stack.
+// ------------------------------------------------------------------
+static inline float* vm__call_native(const vm_function* f, float* sp) {
+	switch (f->num_parameters) {
+		case 1: sp[-1] = f->native.f1(sp[-1]); return sp;
+		case 2: sp[-2] = f->native.f2(sp[-2], sp[-1]); return sp - 1;
+		case 3: sp[-3] = f->native.f3(sp[-3], sp[-2], sp[-1]); return sp - 2;
+		default: sp[-4] = f->native.f4(sp[-4], sp[-3], sp[-2], sp[-1]); return sp - 3;
+	}
+}
+
+// ------------------------------------------------------------------
+// internal method to add a built-in function with its own opcode
+// TOK_EMPTY marks functions which are removed from the bytecode
+// ------------------------------------------------------------------
+static void vm__add_builtin(vm_context* ctx, const char* name, vmFunction func, int precedence, int num_params, vm_token_type opcode) {
+	int id = vm__add_function(ctx, name, func, precedence, num_params, VM_FUNCTION_PURE);
+	ctx->functions[id].opcode = opcode;
+}
+
+// ------------------------------------------------------------------
+// all supported functions
+// ------------------------------------------------------------------
+static void vm_no_op(vm_stack* stack) {}
+
+static void vm_add(vm_stack* stack) {
+	VM_PUSH(stack, VM_POP(stack) + VM_POP(stack));
+}
+
+static void vm_sub(vm_stack* stack) {
+	float a = VM_POP(stack);
+	float b = VM_POP(stack);
+	VM_PUSH(stack,b - a);
+}
+
+static void vm_mul(vm_stack* stack) {
+	VM_PUSH(stack, VM_POP(stack) * VM_POP(stack));
+}
+
+static void vm_div(vm_stack* stack) {
+	float a = VM_POP(stack);
+	float b = VM_POP(stack);
+	VM_PUSH(stack, b / a);
+}
+
+static void vm_pow(vm_stack* stack) {
+	float a = VM_POP(stack);
+	float b = VM_POP(stack);
+	VM_PUSH(stack, pow(b,a));
+}
+
+static void vm_sin(vm_stack* stack) {
+	VM_PUSH(stack, sin(VM_POP(stack)));
+}
+
+static void vm_cos(vm_stack* stack) {
+	VM_PUSH(stack, cos(VM_POP(stack)));
+}
+
+static void vm_tan(vm_stack* stack) {
+	VM_PUSH(stack, tan(VM_POP(stack)));
+}
+
+static void vm_neg(vm_stack* stack) {
+	VM_PUSH(stack, -VM_POP(stack));
+}
+
+static void vm_abs(vm_stack* stack) {
+	VM_PUSH(stack, fabsf(VM_POP(stack)));
+}
+
+static void vm_lerp(vm_stack* stack) {
+	float t = VM_POP(stack); 
+	float a = VM_POP(stack); 
+	float b = VM_POP(stack); 
+	VM_PUSH(stack,(1.0f - t) * b + t * a);
+}
+
+static void vm_exp(vm_stack* stack) {
+	VM_PUSH(stack, exp(VM_POP(stack)));
+}
+
+static void vm_lt(vm_stack* stack) {
+	float a = VM_POP(stack);
+	float b = VM_POP(stack);
+	VM_PUSH(stack, b < a ? 1.0f : 0.0f);
+}
+
+static void vm_le(vm_stack* stack) {
+	float a = VM_POP(stack);
+	float b = VM_POP(stack);
+	VM_PUSH(stack, b <= a ? 1.0f : 0.0f);
+}
+
+static void vm_gt(vm_stack* stack) {
+	float a = VM_POP(stack);
+	float b = VM_POP(stack);
+	VM_PUSH(stack, b > a ? 1.0f : 0.0f);
+}
+
+static void vm_ge(vm_stack* stack) {
+	float a = VM_POP(stack);
+	float b = VM_POP(stack);
+	VM_PUSH(stack, b >= a ? 1.0f : 0.0f);
+}
+
+static void vm_eq(vm_stack* stack) {
+	float a = VM_POP(stack);
+	float b = VM_POP(stack);
+	VM_PUSH(stack, b == a ? 1.0f : 0.0f);
+}
+
+static void vm_ne(vm_stack* stack) {
+	float a = VM_POP(stack);
+	float b = VM_POP(stack);
+	VM_PUSH(stack, b != a ? 1.0f : 0.0f);
+}
+
+// min and max return the second value if one of them is NaN (like minss and maxss)
+static void vm_min(vm_stack* stack) {
+	float a = VM_POP(stack);
+	float b = VM_POP(stack);
+	VM_PUSH(stack, b < a ? b : a);
+}
+
+static void vm_max(vm_stack* stack) {
+	float a = VM_POP(stack);
+	float b = VM_POP(stack);
+	VM_PUSH(stack, b > a ? b : a);
+}
+
+static void vm_clamp(vm_stack* stack) {
+	float hi = VM_POP(stack);
+	float lo = VM_POP(stack);
+	float x = VM_POP(stack);
+	x = x > lo ? x : lo;
+	VM_PUSH(stack, x < hi ? x : hi);
+}
+
+static void vm_select(vm_stack* stack) {
+	float b = VM_POP(stack);
+	float a = VM_POP(stack);
+	float c = VM_POP(stack);
+	VM_PUSH(stack, c != 0.0f ? a : b);
+}
+
+// ------------------------------------------------------------------
+// Precision kernels
+// VM_PRECISION_FAST uses the Cephes single precision polynomials for
+// sin, cos and tan (the same as the SIMD kernels of vm_run_batch).
+// exp and pow are evaluated as 2^t with t computed in double
+// precision which keeps them within 1 ulp. VM_PRECISION_APPROX uses
+// minimax polynomials of degree 3 to 5 with an error of about 1e-4
+// (absolute for sin and cos, relative for the others). Inputs which
+// the polynomials do not cover are passed on to libm.
+// ------------------------------------------------------------------
+#define VM_PI_A 0.78515625f
+#define VM_PI_B 2.4187564849853515625e-4f
+#define VM_PI_C 3.77489497744594108e-8f
+
+// reduces |x| by multiples of pi/4, j is the (even) multiple
+static inline float vm__reduce_fast(float ax, int* j) {
+	*j = ((int)(ax * 1.27323954473516f) + 1) & ~1;
+	float y = (float)*j;
+	return ((ax - y * VM_PI_A) - y * VM_PI_B) - y * VM_PI_C;
+}
+
+static float vm__sincos_fast(float x, int cosine) {
+	float ax = fabsf(x);
+	if (!(ax <= 8192.0f)) {
+		return cosine ? (float)cos(x) : (float)sin(x);
+	}
+	int j;
+	float r = vm__reduce_fast(ax, &j);
+	float z = r * r;
+	float ps = ((-1.9515295891E-4f * z + 8.3321608736E-3f) * z - 1.6666654611E-1f) * z * r + r;
+	float pc = ((2.443315711809948E-005f * z - 1.388731625493765E-003f) * z + 4.166664568298827E-002f) * z * z - 0.5f * z + 1.0f;
+	// select the polynomial and the sign without branches
+	unsigned int bs, bc, bx;
+	memcpy(&bs, &ps, sizeof(float));
+	memcpy(&bc, &pc, sizeof(float));
+	memcpy(&bx, &x, sizeof(float));
+	unsigned int swap = 0u - (unsigned int)((j >> 1) & 1);
+	unsigned int sign;
+	if (cosine) {
+		bs ^= (bs ^ bc) & ~swap;
+		sign = ((unsigned int)(j + 2) & 4) << 29;
+	}
+	else {
+		bs ^= (bs ^ bc) & swap;
+		sign = (((unsigned int)j & 4) << 29) ^ (bx & 0x80000000u);
+	}
+	bs ^= sign;
+	float v;
+	memcpy(&v, &bs, sizeof(float));
+	return v;
+}
+
+static float vm__tan_fast(float x) {
+	float ax = fabsf(x);
+	if (!(ax <= 8192.0f)) {
+		return (float)tan(x);
+	}
+	int j;
+	float r = vm__reduce_fast(ax, &j);
+	float z = r * r;
+	float t = r;
+	if (z > 1.0e-8f) {
+		t = (((((9.38540185543E-3f * z + 3.11992232697E-3f) * z + 2.44301354525E-2f) * z + 5.34112807005E-2f) * z + 1.33387994085E-1f) * z + 3.33331568548E-1f) * z * r + r;
+	}
+	if (j & 2) {
+		t = -1.0f / t;
+	}
+	return x < 0.0f ? -t : t;
+}
+
+// 2^t in double precision, results outside of the float range are
+// clamped to 0 or infinity
+static double vm__exp2_fast(double t) {
+	if (!(t < 200.0)) {
+		return t == t ? HUGE_VAL : t;
+	}
+	if (t < -200.0) {
+		return 0.0;
+	}
+	// adding 1.5 * 2^52 rounds to an integer which ends up in the
+	// low bits of the mantissa
+	double k = t + 6755399441055744.0;
+	unsigned long long bits;
+	memcpy(&bits, &k, sizeof(double));
+	double f = (t - (k - 6755399441055744.0)) * 0.6931471805599453;
+	double p = 1.0 + f * (1.0 + f * (1.0 / 2.0 + f * (1.0 / 6.0 + f * (1.0 / 24.0 + f * (1.0 / 120.0 + f * (1.0 / 720.0 + f * (1.0 / 5040.0)))))));
+	bits = (bits + 1023) << 52;
+	double scale;
+	memcpy(&scale, &bits, sizeof(double));
+	return p * scale;
+}
+
+static float vm__exp_fast(float x) {
+	return (float)vm__exp2_fast(x * 1.4426950408889634);
+}
+
+static float vm__pow_fast(float b, float a) {
+	// zero, negative and non finite bases and non finite exponents
+	if (!(b > 0.0f) || b - b != 0.0f || a - a != 0.0f) {
+		return (float)pow(b, a);
+	}
+	double d = b;
+	unsigned long long bits;
+	memcpy(&bits, &d, sizeof(double));
+	int e = (int)(bits >> 52) - 1023;
+	bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+	double m;
+	memcpy(&m, &bits, sizeof(double));
+	if (m > 1.4142135623730951) {
+		m *= 0.5;
+		++e;
+	}
+	// ln(m) = 2 atanh(s)
+	double s = (m - 1.0) / (m + 1.0);
+	double z = s * s;
+	double l = 2.0 * s * (1.0 + z * (1.0 / 3.0 + z * (1.0 / 5.0 + z * (1.0 / 7.0 + z * (1.0 / 9.0 + z * (1.0 / 11.0))))));
+	return (float)vm__exp2_fast((double)a * (e + l * 1.4426950408889634));
+}
+
+// rounds to the nearest integer, |x| must fit into an int
+static inline int vm__round_approx(float x) {
+	return (int)(x < 0.0f ? x - 0.5f : x + 0.5f);
+}
+
+static inline float vm__sin_poly_approx(float r) {
+	float z = r * r;
+	return r * (0.99969691f + z * (-0.16567326f + z * 0.0075144322f));
+}
+
+static float vm__sin_approx(float x) {
+	if (!(fabsf(x) < 100000.0f)) {
+		return (float)sin(x);
+	}
+	int k = vm__round_approx(x * 0.31830988618f);
+	float v = vm__sin_poly_approx((x - (float)k * 3.140625f) - (float)k * 9.67653589793e-4f);
+	return (k & 1) ? -v : v;
+}
+
+static float vm__cos_approx(float x) {
+	if (!(fabsf(x) < 100000.0f)) {
+		return (float)cos(x);
+	}
+	// cos(x) = -sin(x - (k + 0.5) pi) for odd k
+	int k = vm__round_approx(x * 0.31830988618f - 0.5f);
+	float h = (float)k + 0.5f;
+	float v = vm__sin_poly_approx((x - h * 3.140625f) - h * 9.67653589793e-4f);
+	return (k & 1) ? v : -v;
+}
+
+static float vm__tan_approx(float x) {
+	return vm__sin_approx(x) / vm__cos_approx(x);
+}
+
+// 2^t, results below the normal range are flushed to 0
+static float vm__exp2_approx(float t) {
+	if (!(t < 128.0f)) {
+		return t == t ? HUGE_VALF : t;
+	}
+	if (t < -126.0f) {
+		return 0.0f;
+	}
+	int n = (int)t;
+	if ((float)n > t) {
+		--n;
+	}
+	float f = t - (float)n;
+	float p = 0.99992524f + f * (0.69583317f + f * (0.22606823f + f * 0.078023765f));
+	unsigned int bits = (unsigned int)(n + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(float));
+	return p * scale;
+}
+
+static float vm__exp_approx(float x) {
+	return vm__exp2_approx(x * 1.44269504f);
+}
+
+static float vm__pow_approx(float b, float a) {
+	// zero, negative, subnormal and non finite bases
+	if (!(b >= 1.17549435e-38f) || b - b != 0.0f || a - a != 0.0f) {
+		return (float)pow(b, a);
+	}
+	unsigned int bits;
+	memcpy(&bits, &b, sizeof(float));
+	int e = (int)(bits >> 23) - 127;
+	bits = (bits & 0x007fffff) | 0x3f800000;
+	float m;
+	memcpy(&m, &bits, sizeof(float));
+	if (m > 1.41421356f) {
+		m *= 0.5f;
+		++e;
+	}
+	float s = (m - 1.0f) / (m + 1.0f);
+	float l = (float)e + s * (2.8852286f + s * s * 0.98353253f);
+	return vm__exp2_approx(a * l);
+}
+
+#define VM_UNARY_KERNEL(name, f) static void name(vm_stack* stack) { VM_PUSH(stack, f(VM_POP(stack))); }
+#define VM_BINARY_KERNEL(name, f) static void name(vm_stack* stack) { float a = VM_POP(stack); float b = VM_POP(stack); VM_PUSH(stack, f(b, a)); }
+
+static float vm__sin_fast(float x) { return vm__sincos_fast(x, 0); }
+static float vm__cos_fast(float x) { return vm__sincos_fast(x, 1); }
+
+VM_UNARY_KERNEL(vm_sin_fast, vm__sin_fast)
+VM_UNARY_KERNEL(vm_cos_fast, vm__cos_fast)
+VM_UNARY_KERNEL(vm_tan_fast, vm__tan_fast)
+VM_UNARY_KERNEL(vm_exp_fast, vm__exp_fast)
+VM_BINARY_KERNEL(vm_pow_fast, vm__pow_fast)
+VM_UNARY_KERNEL(vm_sin_approx, vm__sin_approx)
+VM_UNARY_KERNEL(vm_cos_approx, vm__cos_approx)
+VM_UNARY_KERNEL(vm_tan_approx, vm__tan_approx)
+VM_UNARY_KERNEL(vm_exp_approx, vm__exp_approx)
+VM_BINARY_KERNEL(vm_pow_approx, vm__pow_approx)
+
+// ------------------------------------------------------------------
+// create new vm_context using the libm built-ins
+// ------------------------------------------------------------------
+DSDEF vm_context* vm_create_context() {
+	return vm_create_context_ex(VM_PRECISION_EXACT);
+}
+
+// ------------------------------------------------------------------
+// create new vm_context with the given precision of the built-in
+// sin, cos, tan, pow and exp (see VM_PRECISION_EXACT)
+// ------------------------------------------------------------------
+DSDEF vm_context* vm_create_context_ex(int precision) {
+	vm_context* ctx = (vm_context*)VM_MALLOC(sizeof(vm_context));
+	memset(ctx, 0, sizeof(vm_context));
+	ctx->precision = precision;
+	vm__add_builtin(ctx, ",", vm_no_op, 1, 0, TOK_EMPTY);
+	vm__add_builtin(ctx, "+", vm_add, 12, 2, TOK_ADD);
+	vm__add_builtin(ctx, "-", vm_sub, 12, 2, TOK_SUB);
+	vm__add_builtin(ctx, "*", vm_mul, 13, 2, TOK_MUL);
+	vm__add_builtin(ctx, "/", vm_div, 13, 2, TOK_DIV);
+	vm__add_builtin(ctx, "u-", vm_neg, 16, 1, TOK_NEG);
+	vm__add_builtin(ctx, "u+", vm_no_op, 1, 0, TOK_EMPTY);
+	vm__add_builtin(ctx, "sin", vm_sin, 17, 1, TOK_SIN);
+	vm__add_builtin(ctx, "cos", vm_cos, 17, 1, TOK_COS);
+	vm__add_builtin(ctx, "abs", vm_abs, 17, 1, TOK_ABS);
+	vm__add_builtin(ctx, "lerp", vm_lerp, 17, 3, TOK_LERP);
+	vm__add_builtin(ctx, "pow", vm_pow, 17, 2, TOK_POW);
+	vm__add_builtin(ctx, "exp", vm_exp, 17, 1, TOK_EXP);
+	vm__add_builtin(ctx, "tan", vm_tan, 17, 1, TOK_TAN);
+	vm__add_builtin(ctx, "<", vm_lt, 10, 2, TOK_LT);
+	vm__add_builtin(ctx, "<=", vm_le, 10, 2, TOK_LE);
+	vm__add_builtin(ctx, ">", vm_gt, 10, 2, TOK_GT);
+	vm__add_builtin(ctx, ">=", vm_ge, 10, 2, TOK_GE);
+	vm__add_builtin(ctx, "==", vm_eq, 8, 2, TOK_EQ);
+	vm__add_builtin(ctx, "!=", vm_ne, 8, 2, TOK_NE);
+	// the short-circuit operators only exist as jumps in the bytecode
+	vm__add_builtin(ctx, "&&", vm_no_op, 5, 2, TOK_AND_JUMP);
+	vm__add_builtin(ctx, "||", vm_no_op, 4, 2, TOK_OR_JUMP);
+	vm__add_builtin(ctx, "?", vm_no_op, 3, 0, TOK_JUMP_IF_FALSE);
+	vm__add_builtin(ctx, ":", vm_no_op, 3, 0, TOK_JUMP);
+	vm__add_builtin(ctx, "min", vm_min, 17, 2, TOK_MIN);
+	vm__add_builtin(ctx, "max", vm_max, 17, 2, TOK_MAX);
+	vm__add_builtin(ctx, "clamp", vm_clamp, 17, 3, TOK_CLAMP);
+	vm__add_builtin(ctx, "select", vm_select, 17, 3, TOK_SELECT);
+	if (precision == VM_PRECISION_FAST) {
+		vm__add_builtin(ctx, "sin", vm_sin_fast, 17, 1, TOK_SIN_FAST);
+		vm__add_builtin(ctx, "cos", vm_cos_fast, 17, 1, TOK_COS_FAST);
+		vm__add_builtin(ctx, "tan", vm_tan_fast, 17, 1, TOK_TAN_FAST);
+		vm__add_builtin(ctx, "pow", vm_pow_fast, 17, 2, TOK_POW_FAST);
+		vm__add_builtin(ctx, "exp", vm_exp_fast, 17, 1, TOK_EXP_FAST);
+	}
+	else if (precision == VM_PRECISION_APPROX) {
+		vm__add_builtin(ctx, "sin", vm_sin_approx, 17, 1, TOK_SIN_APPROX);
+		vm__add_builtin(ctx, "cos", vm_cos_approx, 17, 1, TOK_COS_APPROX);
+		vm__add_builtin(ctx, "tan", vm_tan_approx, 17, 1, TOK_TAN_APPROX);
+		vm__add_builtin(ctx, "pow", vm_pow_approx, 17, 2, TOK_POW_APPROX);
+		vm__add_builtin(ctx, "exp", vm_exp_approx, 17, 1, TOK_EXP_APPROX);
+	}
+#ifdef DS_VM_PROFILE
+	vm__create_profile(ctx);
+#endif
+	return ctx;
+}
+
+// ------------------------------------------------------------------
+// destroy vm_context
+// ------------------------------------------------------------------
+DSDEF void vm_destroy_context(vm_context* ctx) {
+	if (ctx->cache) {
+		vm__clear_cache(ctx, 1);
+		VM_FREE(ctx->cache);
+	}
+	if (ctx->graph) {
+		vm__destroy_graph(ctx);
+	}
+	if (ctx->profile) {
+		vm__destroy_profile(ctx);
+	}
+	if (ctx->snapshots) {
+		vm__destroy_snapshots(ctx);
+	}
+	for (int i = 0; i < ctx->num_variables; ++i) {
+		VM_FREE((void*)ctx->variables[i].name);
+	}
+	for (int i = 0; i < ctx->num_functions; ++i) {
+		VM_FREE((void*)ctx->functions[i].name);
+	}
+	if (ctx->variables) {
+		VM_FREE(ctx->variables);
+		VM_FREE(ctx->values);
+		VM_FREE(ctx->variable_index.slots);
+	}
+	if (ctx->functions) {
+		VM_FREE(ctx->functions);
+		VM_FREE(ctx->function_index.slots);
+	}
+	VM_FREE(ctx);
+}
+
+// ------------------------------------------------------------------
+// is numeric
+// ------------------------------------------------------------------
+static int vm__is_numeric(const char c) {
+	if ((c >= '0' && c <= '9')) {
+		return 1;
+	}
+	return 0;
+}
+
+// ------------------------------------------------------------------
+// is whitespace
+// ------------------------------------------------------------------
+static int vm__is_whitespace(const char c) {
+	if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+		return 1;
+	}
+	return 0;
+}
+
+// ------------------------------------------------------------------
+// variable slots collected while compiling a standalone program.
+// The names point into the source until the program is created.
+// ------------------------------------------------------------------
+struct vm__slot_t {
+	const char* name;
+	int length;
+	float value;
+};
+
+typedef struct vm__slot_t vm__slot;
+
+struct vm__slot_table_t {
+	vm__slot* slots;
+	int count;
+	int capacity;
+};
+
+typedef struct vm__slot_table_t vm__slot_table;
+
+// ------------------------------------------------------------------
+// internal method to find or add a slot. Programs only use a few
+// variables so a linear search is fine here.
+// ------------------------------------------------------------------
+static int vm__slot_for(vm__slot_table* table, const char* name, int len, float value) {
+	for (int i = 0; i < table->count; ++i) {
+		if (table->slots[i].length == len && memcmp(table->slots[i].name, name, len) == 0) {
+			return i;
+		}
+	}
+	if (table->count == table->capacity) {
+		table->slots = (vm__slot*)vm__grow(table->slots, table->count, &table->capacity, sizeof(vm__slot));
+	}
+	vm__slot* slot = &table->slots[table->count];
+	slot->name = name;
+	slot->length = len;
+	slot->value = value;
+	return table->count++;
+}
+
+// ------------------------------------------------------------------
+// get token for identifier. If slots is set variables are resolved
+// into program slots and the context is left untouched.
+// ------------------------------------------------------------------
+static vm_token vm__token_for_identifier_ex(vm_context* ctx, const char *identifier, unsigned len, int add_variables, vm__slot_table* slots) {
+	int i;
+	if ((i = vm__find_variable(identifier, len, ctx)) != -1) {
+		vm_token t;
+		t.type = TOK_VARIABLE;
+		t.id = slots ? vm__slot_for(slots, identifier, (int)len, ctx->values[i]) : i;
+		return t;
+	}
+	else if ((i = vm__find_function(ctx, identifier, len)) != -1) {
+		vm_token t;
+		t.type = TOK_FUNCTION;
+		t.id = i;
+		return t;
+	}
+	else if (slots) {
+		vm_token t;
+		t.type = TOK_VARIABLE;
+		t.id = vm__slot_for(slots, identifier, (int)len, 0.0f);
+		return t;
+	}
+	else if (add_variables) {
+		i = vm__add_variable(ctx, identifier, (int)len, 0.0f);
+		vm_token t;
+		t.type = TOK_VARIABLE;
+		t.id = i;
+		return t;
+	}
+	else {
+		vm_token t;
+		t.type = TOK_EMPTY;
+		t.id = -1;
+		return t;
+	}
+}
+
+static vm_token vm__token_for_identifier(vm_context* ctx, const char *identifier, unsigned len) {
+	return vm__token_for_identifier_ex(ctx, identifier, len, 1, 0);
+}
+
+static vm_token vm__token_for_identifier2(vm_context* ctx, const char *identifier) {
+	return vm__token_for_identifier(ctx, identifier, strlen(identifier));
+}
+
+// ------------------------------------------------------------------
+// internal method to check wether there is a known function
+// ------------------------------------------------------------------
+static int vm__has_function(vm_context* ctx, char * identifier) {
+	if (vm__find_function(ctx, identifier, strlen(identifier)) != -1) {
+		return 1;
+	}
+	return 0;
+}
+
+
+
+// ------------------------------------------------------------------
+// strtof
+// ------------------------------------------------------------------
+static float vm__strtof(const char* p, char** endPtr) {
+	while (vm__is_whitespace(*p)) {
+		++p;
+	}
+	float sign = 1.0f;
+	if (*p == '-') {
+		sign = -1.0f;
+		++p;
+	}
+	else if (*p == '+') {
+		++p;
+	}
+	float value = 0.0f;
+	while (vm__is_numeric(*p)) {
+		value *= 10.0f;
+		value = value + (*p - '0');
+		++p;
+	}
+	if (*p == '.') {
+		++p;
+		float dec = 1.0f;
+		float frac = 0.0f;
+		while (vm__is_numeric(*p)) {
+			frac *= 10.0f;
+			frac = frac + (*p - '0');
+			dec *= 10.0f;
+			++p;
+		}
+		value = value + (frac / dec);
+	}
+	if (endPtr) {
+		*endPtr = (char *)(p);
+	}
+	return value * sign;
+}
+
+// ------------------------------------------------------------------
+// Function stack item
+// ------------------------------------------------------------------
+struct FunctionVMStackItem_t {
+	vm_token token;
+	int precedence;
+	int par_level;
+	// commas seen so far for a call with an open parenthesis, -1 otherwise
+	int args;
+};
+
+typedef struct FunctionVMStackItem_t FunctionVMStackItem;
+
+static int cmp(FunctionVMStackItem t,FunctionVMStackItem f) {
+	if (t.par_level != f.par_level) return t.par_level - f.par_level;
+	return t.precedence - f.precedence;
+}
+
+// ------------------------------------------------------------------
+// internal method to create a token
+// ------------------------------------------------------------------
+vm_token vm__create_token(vm_token_type type) {
+	vm_token t;
+	t.type = type;
+	t.value = 0.0f;
+	return t;
+}
+
+// ------------------------------------------------------------------
+// internal method to create a token
+// ------------------------------------------------------------------
+vm_token vm__create_token_with_value(vm_token_type type, float value) {
+	vm_token t;
+	t.type = type;
+	t.value = value;
+	return t;
+}
+// ------------------------------------------------------------------
+// internal method to check for a binary arithmetic opcode
+// ------------------------------------------------------------------
+static int vm__is_arithmetic(vm_token_type type) {
+	return type == TOK_ADD || type == TOK_SUB || type == TOK_MUL || type == TOK_DIV;
+}
+
+// ------------------------------------------------------------------
+// internal method to get the number of values a token pops
+// returns -1 for tokens which only push a value
+// ------------------------------------------------------------------
+static int vm__token_arity(vm_context* ctx, vm_token t) {
+	switch (vm__exact_opcode(t.type)) {
+		case TOK_NUMBER: case TOK_VARIABLE: return -1;
+		case TOK_ADD: case TOK_SUB: case TOK_MUL: case TOK_DIV: case TOK_POW: return 2;
+		case TOK_LERP: case TOK_CLAMP: case TOK_SELECT: return 3;
+		case TOK_LT: case TOK_LE: case TOK_GT: case TOK_GE: case TOK_EQ: case TOK_NE: case TOK_MIN: case TOK_MAX: return 2;
+		case TOK_FUNCTION: return ctx->functions[t.id].num_parameters;
+		default: return 1;
+	}
+}
+
+// ------------------------------------------------------------------
+// internal method to check for a jump opcode
+// ------------------------------------------------------------------
+static int vm__is_jump(vm_token_type type) {
+	return type >= TOK_JUMP && type <= TOK_OR_JUMP;
+}
+
+#ifndef VM_MAX_JUMPS
+#define VM_MAX_JUMPS 64
+#endif
+
+// ------------------------------------------------------------------
+// the target of a forward jump which has not been reached yet
+// ------------------------------------------------------------------
+struct vm__jump_target_t {
+	int target;
+	// the stack depth at the target
+	int depth;
+	// the position of the offset in native code
+	int fixup;
+};
+
+typedef struct vm__jump_target_t vm__jump_target;
+
+// ------------------------------------------------------------------
+// internal method to add a jump target. The targets are sorted so
+// that the nearest one is the last. Returns the new number of
+// targets.
+// ------------------------------------------------------------------
+static int vm__add_jump_target(vm__jump_target* targets, int num, int target, int depth, int fixup) {
+	int i = num;
+	while (i > 0 && targets[i - 1].target < target) {
+		targets[i] = targets[i - 1];
+		--i;
+	}
+	targets[i].target = target;
+	targets[i].depth = depth;
+	targets[i].fixup = fixup;
+	return num + 1;
+}
+
+// ------------------------------------------------------------------
+// internal method to verify a program statically. Every opcode must
+// find its operands on the stack and exactly one value must be left
+// at the end. Custom functions must pop their parameters and push
+// one value. Jumps must go forward to the start of an instruction,
+// every path must reach a target with the same stack depth and every
+// instruction must be reachable. Stores the maximum stack depth in
+// max_stack.
+// Returns 0 or an error code.
+// ------------------------------------------------------------------
+static int vm__verify(const vm_token* byteCode, int num, const vm_function* functions, int* max_stack) {
+	vm__jump_target targets[VM_MAX_JUMPS];
+	int num_targets = 0;
+	int reachable = 1;
+	int depth = 0;
+	int max_depth = 0;
+	for (int i = 0; i <= num; ++i) {
+		while (num_targets > 0 && targets[num_targets - 1].target == i) {
+			--num_targets;
+			if (reachable && depth != targets[num_targets].depth) {
+				return 2;
+			}
+			depth = targets[num_targets].depth;
+			reachable = 1;
+		}
+		if (num_targets > 0 && targets[num_targets - 1].target < i) {
+			// the target is the constant of a superinstruction
+			return 18;
+		}
+		if (i == num) {
+			break;
+		}
+		if (!reachable) {
+			return 18;
+		}
+		vm_token_type type = byteCode[i].type;
+		int pops = 0;
+		int pushes = 1;
+		switch (type) {
+			case TOK_EMPTY: case TOK_LEFT_PARENTHESIS: case TOK_RIGHT_PARENTHESIS: pushes = 0; break;
+			case TOK_NUMBER: case TOK_VARIABLE: break;
+			case TOK_VAR_ADD_CONST: case TOK_VAR_SUB_CONST: case TOK_VAR_MUL_CONST: case TOK_VAR_DIV_CONST:
+				if (++i == num) {
+					return 2;
+				}
+				break;
+			case TOK_ADD: case TOK_SUB: case TOK_MUL: case TOK_DIV: case TOK_POW: case TOK_POW_FAST: case TOK_POW_APPROX: pops = 2; break;
+			case TOK_LT: case TOK_LE: case TOK_GT: case TOK_GE: case TOK_EQ: case TOK_NE: case TOK_MIN: case TOK_MAX: pops = 2; break;
+			case TOK_LERP: case TOK_CLAMP: case TOK_SELECT: pops = 3; break;
+			case TOK_DUP: pops = 1; pushes = 2; break;
+			case TOK_FUNCTION: pops = functions[byteCode[i].id].num_parameters; break;
+			case TOK_JUMP: case TOK_JUMP_IF_FALSE: case TOK_AND_JUMP: case TOK_OR_JUMP: {
+				int offset = byteCode[i].id;
+				if (offset <= 0 || offset > num - i || num_targets == VM_MAX_JUMPS) {
+					return 18;
+				}
+				if (type != TOK_JUMP && depth < 1) {
+					return 2;
+				}
+				// the value of a short-circuit operator stays on the stack if it jumps
+				num_targets = vm__add_jump_target(targets, num_targets, i + offset, depth - (type == TOK_JUMP_IF_FALSE), 0);
+				pops = type != TOK_JUMP;
+				pushes = 0;
+				reachable = type != TOK_JUMP;
+				break;
+			}
+			// temporaries and outputs only exist in multi output programs
+			case TOK_STORE: case TOK_LOAD: case TOK_OUTPUT: return 9;
+			case TOK_LABEL: return 18;
+			default: pops = 1; break;
+		}
+		if (depth < pops) {
+			return 2;
+		}
+		depth += pushes - pops;
+		if (depth > max_depth) {
+			max_depth = depth;
+		}
+	}
+	if (depth == 0) {
+		return 1;
+	}
+	if (depth > 1) {
+		return 12;
+	}
+	*max_stack = max_depth;
+	return 0;
+}
+
+// ------------------------------------------------------------------
+// Optimizer value stack item
+// ------------------------------------------------------------------
+struct vm_fold_item_t {
+	int start;
+	int is_const;
+	int pure;
+	float value;
+};
+
+typedef struct vm_fold_item_t vm_fold_item;
+
+#ifndef VM_MAX_FOLD_DEPTH
+#define VM_MAX_FOLD_DEPTH 64
+#endif
+
+// ------------------------------------------------------------------
+// Optimizer conditional: the opener (JUMP_IF_FALSE, AND_JUMP or
+// OR_JUMP, a ternary becomes JUMP at its ':') and the positions of
+// its jumps in the rewritten bytecode
+// ------------------------------------------------------------------
+struct vm_fold_branch_t {
+	vm_token_type kind;
+	int pos;
+	int jump_pos;
+	// number of values below the open branch
+	int floor;
+};
+
+typedef struct vm_fold_branch_t vm_fold_branch;
+
+// ------------------------------------------------------------------
+// internal method to remove one token from the bytecode
+// ------------------------------------------------------------------
+static int vm__remove_token(vm_token* byteCode, int num, int index) {
+	memmove(byteCode + index, byteCode + index + 1, (num - index - 1) * sizeof(vm_token));
+	return num - 1;
+}
+
+// ------------------------------------------------------------------
+// internal method to fold constant subexpressions and to rewrite
+// identities: x*1, 1*x, x/1, x+0, 0+x, x-0, x*0, pow(x,1), pow(x,0),
+// pow(x,2) -> x*x and - - x. x*0 and pow(x,0) only drop x if it is
+// pure, they do not preserve NaN or infinity in x. Conditionals with
+// a constant condition are replaced by the branch which is taken.
+// Expects lowered opcodes with labels and rewrites the bytecode in
+// place.
+// ------------------------------------------------------------------
+static int vm__optimize(vm_context* ctx, vm_token* byteCode, int num) {
+	// verify the stack usage first so that the rewrite never fails. The
+	// condition of a ternary and its branches stay on the value stack
+	// until the label, every branch must push exactly one value.
+	vm_fold_branch branches[VM_MAX_FOLD_DEPTH];
+	int num_branches = 0;
+	int depth = 0;
+	for (int i = 0; i < num; ++i) {
+		vm_token_type type = byteCode[i].type;
+		int floor = num_branches > 0 ? branches[num_branches - 1].floor : 0;
+		if (type == TOK_JUMP_IF_FALSE || type == TOK_AND_JUMP || type == TOK_OR_JUMP) {
+			if (depth <= floor || num_branches == VM_MAX_FOLD_DEPTH) {
+				return num;
+			}
+			branches[num_branches].kind = type;
+			branches[num_branches++].floor = depth;
+			continue;
+		}
+		if (type == TOK_JUMP || type == TOK_LABEL) {
+			if (num_branches == 0 || depth != floor + 1) {
+				return num;
+			}
+			vm_fold_branch* b = &branches[num_branches - 1];
+			if (type == TOK_JUMP) {
+				if (b->kind != TOK_JUMP_IF_FALSE) {
+					return num;
+				}
+				b->kind = TOK_JUMP;
+				++b->floor;
+				continue;
+			}
+			if (b->kind == TOK_JUMP_IF_FALSE) {
+				return num;
+			}
+			depth -= b->kind == TOK_JUMP ? 2 : 1;
+			--num_branches;
+			continue;
+		}
+		int arity = vm__token_arity(ctx, byteCode[i]);
+		if (arity > depth - floor) {
+			return num;
+		}
+		depth += arity == -1 ? 1 : 1 - arity;
+		if (depth > VM_MAX_FOLD_DEPTH) {
+			return num;
+		}
+	}
+	if (num_branches > 0) {
+		return num;
+	}
+	vm_fold_item items[VM_MAX_FOLD_DEPTH];
+	int num_items = 0;
+	int w = 0;
+	for (int r = 0; r < num; ++r) {
+		vm_token t = byteCode[r];
+		if (t.type == TOK_JUMP_IF_FALSE || t.type == TOK_AND_JUMP || t.type == TOK_OR_JUMP) {
+			branches[num_branches].kind = t.type;
+			branches[num_branches++].pos = w;
+			byteCode[w++] = t;
+			continue;
+		}
+		if (t.type == TOK_JUMP) {
+			branches[num_branches - 1].kind = TOK_JUMP;
+			branches[num_branches - 1].jump_pos = w;
+			byteCode[w++] = t;
+			continue;
+		}
+		if (t.type == TOK_LABEL) {
+			vm_fold_branch* b = &branches[--num_branches];
+			int ternary = b->kind == TOK_JUMP;
+			num_items -= ternary ? 3 : 2;
+			vm_fold_item* cond = &items[num_items];
+			vm_fold_item result = *cond;
+			if (cond->is_const) {
+				int truth = cond->value != 0.0f;
+				int from = ternary ? (truth ? b->pos + 1 : b->jump_pos + 1) : b->pos + 1;
+				int to = ternary && truth ? b->jump_pos : w;
+				if (!ternary && truth == (b->kind == TOK_OR_JUMP)) {
+					// the condition is the value, the BOOL behind the label follows
+					w = b->pos;
+				}
+				else {
+					// keep only the tokens of the branch which is taken
+					memmove(byteCode + cond->start, byteCode + from, (to - from) * sizeof(vm_token));
+					w = cond->start + to - from;
+					result = items[num_items + (ternary ? 2 - truth : 1)];
+					result.start = cond->start;
+				}
+			}
+			else {
+				byteCode[w++] = t;
+				result.pure = cond[0].pure && cond[1].pure && (!ternary || cond[2].pure);
+			}
+			items[num_items++] = result;
+			continue;
+		}
+		int arity = vm__token_arity(ctx, t);
+		if (arity == -1) {
+			vm_fold_item* item = &items[num_items++];
+			item->start = w;
+			item->is_const = t.type == TOK_NUMBER;
+			item->pure = 1;
+			item->value = t.value;
+			byteCode[w++] = t;
+			continue;
+		}
+		int pure = t.type != TOK_FUNCTION || (ctx->functions[t.id].flags & VM_FUNCTION_PURE);
+		int all_const = pure;
+		int all_pure = pure;
+		for (int i = num_items - arity; i < num_items; ++i) {
+			all_const &= items[i].is_const;
+			all_pure &= items[i].pure;
+		}
+		num_items -= arity;
+		vm_fold_item* a = &items[num_items];
+		vm_fold_item* b = &items[num_items + 1];
+		int start = arity > 0 ? a->start : w;
+		if (all_const) {
+			vm_token tmp[4];
+			for (int i = 0; i < arity; ++i) {
+				tmp[i] = vm__create_token_with_value(TOK_NUMBER, items[num_items + i].value);
+			}
+			tmp[arity] = t;
+			float v = 0.0f;
+			if (arity <= 3 && vm__execute(tmp, arity + 1, ctx->values, ctx->functions, &v, 0, 0 VM__PROFILE_ARG(0)) == 0) {
+				w = start;
+				byteCode[w++] = vm__create_token_with_value(TOK_NUMBER, v);
+				vm_fold_item* item = &items[num_items++];
+				item->start = start;
+				item->is_const = 1;
+				item->pure = 1;
+				item->value = v;
+				continue;
+			}
+		}
+		vm_fold_item result;
+		result.start = start;
+		result.is_const = 0;
+		result.pure = all_pure;
+		result.value = 0.0f;
+		int emit = 1;
+		if (arity == 2 && b->is_const) {
+			float c = b->value;
+			if (((t.type == TOK_ADD || t.type == TOK_SUB) && c == 0.0f) || ((t.type == TOK_MUL || t.type == TOK_DIV || vm__exact_opcode(t.type) == TOK_POW) && c == 1.0f)) {
+				// drop the constant and the operator
+				w = b->start;
+				result.is_const = a->is_const;
+				result.value = a->value;
+				emit = 0;
+			}
+			else if (((t.type == TOK_MUL && c == 0.0f) || (vm__exact_opcode(t.type) == TOK_POW && c == 0.0f)) && a->pure) {
+				w = start;
+				byteCode[w++] = vm__create_token_with_value(TOK_NUMBER, t.type == TOK_MUL ? 0.0f : 1.0f);
+				result.is_const = 1;
+				result.value = t.type == TOK_MUL ? 0.0f : 1.0f;
+				emit = 0;
+			}
+			else if (vm__exact_opcode(t.type) == TOK_POW && c == 2.0f) {
+				w = b->start;
+				byteCode[w++] = vm__create_token(TOK_DUP);
+				t.type = TOK_MUL;
+				t.id = vm__find_function(ctx, "*", 1);
+			}
+		}
+		else if (arity == 2 && a->is_const) {
+			float c = a->value;
+			if ((t.type == TOK_ADD && c == 0.0f) || (t.type == TOK_MUL && c == 1.0f)) {
+				w = vm__remove_token(byteCode, w, a->start);
+				emit = 0;
+			}
+			else if (t.type == TOK_MUL && c == 0.0f && b->pure) {
+				w = start;
+				byteCode[w++] = vm__create_token_with_value(TOK_NUMBER, 0.0f);
+				result.is_const = 1;
+				emit = 0;
+			}
+		}
+		else if (t.type == TOK_NEG && w > start && byteCode[w - 1].type == TOK_NEG) {
+			--w;
+			emit = 0;
+		}
+		if (emit) {
+			byteCode[w++] = t;
+		}
+		items[num_items++] = result;
+	}
+	return w;
+}
+
+// ------------------------------------------------------------------
+// internal method to fuse common sequences into superinstructions
+// ------------------------------------------------------------------
+static int vm__fuse(vm_token* byteCode, int n) {
+	int r = 0;
+	int w = 0;
+	while (r < n) {
+		vm_token* t = &byteCode[r];
+		int left = n - r;
+		// VAR CONST op
+		if (left >= 3 && t[0].type == TOK_VARIABLE && t[1].type == TOK_NUMBER && vm__is_arithmetic(t[2].type)) {
+			vm_token_type op = t[2].type;
+			byteCode[w].type = (vm_token_type)(TOK_VAR_ADD_CONST + (op - TOK_ADD));
+			byteCode[w].id = t[0].id;
+			byteCode[w + 1] = t[1];
+			w += 2;
+			r += 3;
+		}
+		// CONST VAR op for the commutative operators
+		else if (left >= 3 && t[0].type == TOK_NUMBER && t[1].type == TOK_VARIABLE && (t[2].type == TOK_ADD || t[2].type == TOK_MUL)) {
+			vm_token c = t[0];
+			byteCode[w].type = t[2].type == TOK_ADD ? TOK_VAR_ADD_CONST : TOK_VAR_MUL_CONST;
+			byteCode[w].id = t[1].id;
+			byteCode[w + 1] = c;
+			w += 2;
+			r += 3;
+		}
+		// CONST op
+		else if (left >= 2 && t[0].type == TOK_NUMBER && vm__is_arithmetic(t[1].type)) {
+			byteCode[w].type = (vm_token_type)(TOK_ADD_CONST + (t[1].type - TOK_ADD));
+			byteCode[w].value = t[0].value;
+			++w;
+			r += 2;
+		}
+		else {
+			byteCode[w++] = byteCode[r++];
+		}
+	}
+	return w;
+}
+
+// ------------------------------------------------------------------
+// internal method to remove the labels and to store the offsets of
+// the jumps. The open jumps are chained through their ids.
+// Returns the number of tokens or -1 if a label has no jump.
+// ------------------------------------------------------------------
+static int vm__link(vm_token* byteCode, int n) {
+	int open = -1;
+	int w = 0;
+	for (int r = 0; r < n; ++r) {
+		vm_token t = byteCode[r];
+		if (t.type == TOK_LABEL || t.type == TOK_JUMP) {
+			if (open == -1) {
+				return -1;
+			}
+			// the jump of a ternary closes the condition and jumps over the else branch
+			int target = t.type == TOK_JUMP ? w + 1 : w;
+			int opener = open;
+			open = byteCode[opener].id;
+			byteCode[opener].id = target - opener;
+			if (t.type == TOK_LABEL) {
+				continue;
+			}
+		}
+		if (vm__is_jump(t.type)) {
+			t.id = open;
+			open = w;
+		}
+		byteCode[w++] = t;
+	}
+	return open == -1 ? w : -1;
+}
+
+// ------------------------------------------------------------------
+// internal method to append a token to the bytecode. Built-in
+// functions are replaced by their opcodes.
+// ------------------------------------------------------------------
+static int vm__emit(vm_context* ctx, vm_token t, vm_token* byteCode, int* num, int capacity) {
+	if (t.type == TOK_FUNCTION) {
+		t.type = ctx->functions[t.id].opcode;
+		if (t.type == TOK_EMPTY) {
+			return 1;
+		}
+	}
+	if (*num == capacity) {
+		return 0;
+	}
+	byteCode[(*num)++] = t;
+	return 1;
+}
+
+// ------------------------------------------------------------------
+// internal method to emit an operator taken from the function stack.
+// Conditionals end with a label, && and || also convert their value
+// to 0 or 1. A '?' without ':' is an error.
+// Returns 0 or an error code.
+// ------------------------------------------------------------------
+static int vm__emit_operator(vm_context* ctx, vm_token t, vm_token* byteCode, int* num, int capacity) {
+	vm_token_type opcode = ctx->functions[t.id].opcode;
+	if (opcode == TOK_JUMP_IF_FALSE) {
+		return 17;
+	}
+	if (vm__is_jump(opcode)) {
+		t = vm__create_token(TOK_LABEL);
+	}
+	if (!vm__emit(ctx, t, byteCode, num, capacity)) {
+		return 4;
+	}
+	if ((opcode == TOK_AND_JUMP || opcode == TOK_OR_JUMP) && !vm__emit(ctx, vm__create_token(TOK_BOOL), byteCode, num, capacity)) {
+		return 4;
+	}
+	return 0;
+}
+
+// ------------------------------------------------------------------
+// internal method to get the number of tokens vm__parse needs for a
+// source of the given length. Every token consumes at least one
+// character, only the labels of the conditionals (one per '?' ':'
+// or '&&' and '||') do not.
+// ------------------------------------------------------------------
+static int vm__token_capacity(int length) {
+	return length + 1 + length / 2;
+}
+
+// ------------------------------------------------------------------
+// internal method to parse and compile in a single pass. The lexer
+// feeds the shunting-yard directly and the operators are kept in
+// function_stack. Unknown identifiers become new variables if
+// add_variables is set, otherwise they are an error. If slots is
+// set all variables are resolved into slots instead.
+// Returns the number of tokens or a negative error code. If error_at
+// is set it receives the start of the token where the error was
+// found or the end of the source for errors of the whole expression.
+// ------------------------------------------------------------------
+static int vm__parse(vm_context* ctx, const char* source, vm_token* byteCode, int capacity, FunctionVMStackItem* function_stack, int stack_capacity, int add_variables, vm__slot_table* slots, const char** error_at) {
+	int binary = 0;
+	const char* p = source;
+	int num_rpl = 0;
+	int num_function_stack = 0;
+	int par_level = 0;
+	vm_token_type prev = TOK_EMPTY;
+	const char* position = 0;
+	if (!error_at) {
+		error_at = &position;
+	}
+	while (*p != 0) {
+		vm_token token;
+		token.type = TOK_EMPTY;
+		*error_at = p;
+		int known = 1;
+		int call = 0;
+		int comma = *p == ',';
+		if (*p >= '0' && *p <= '9') {
+			char *out;
+			token = vm__create_token_with_value(TOK_NUMBER, vm__strtof(p, &out));
+			p = out;
+			binary = 1;
+		}
+		else if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p == '_')) {
+			const char *identifier = p;
+			while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p == '_') || (*p >= '0' && *p <= '9'))
+				p++;
+			token = vm__token_for_identifier_ex(ctx, identifier, (unsigned)(p - identifier), add_variables, slots);
+			known = token.type != TOK_EMPTY;
+			binary = 1;
+			const char* next = p;
+			while (*next == ' ' || *next == '\t' || *next == '\n' || *next == '\r') {
+				++next;
+			}
+			call = *next == '(';
+		}
+		else {
+			switch (*p) {
+				case '(': token = vm__create_token(TOK_LEFT_PARENTHESIS); binary = 0; break;
+				case ')': token = vm__create_token(TOK_RIGHT_PARENTHESIS); binary = 1; break;
+				case ' ': case '\t': case '\n': case '\r': break;
+				case '-': token = vm__token_for_identifier2(ctx, binary == 1 ? "-" : "u-"); binary = 0; break;
+				case '+': token = vm__token_for_identifier2(ctx, binary == 1 ? "+" : "u+"); binary = 0; break;
+				default: {
+					char s1[2] = { *p,0 };
+					char s2[3] = { *p, *(p + 1), 0 };
+					if (s2[1] && vm__has_function(ctx, s2)) {
+						token = vm__token_for_identifier(ctx, s2,2);
+						++p;
+					}
+					else {
+						token = vm__token_for_identifier_ex(ctx, s1, 1, add_variables, slots);
+						known = token.type != TOK_EMPTY;
+					}
+					binary = 0;
+					break;
+				}
+			}
+			++p;
+		}
+		if (!known) {
+			return -5;
+		}
+		switch (token.type) {
+			case TOK_NUMBER:
+			case TOK_VARIABLE:
+				if (!vm__emit(ctx, token, byteCode, &num_rpl, capacity)) {
+					return -4;
+				}
+				break;
+			case TOK_LEFT_PARENTHESIS:
+				++par_level;
+				break;
+			case TOK_RIGHT_PARENTHESIS: {
+				--par_level;
+				// the innermost item at this level is the call which is closed now
+				int i = num_function_stack - 1;
+				while (i >= 0 && function_stack[i].par_level > par_level) {
+					--i;
+				}
+				if (i >= 0 && function_stack[i].par_level == par_level && function_stack[i].args >= 0) {
+					int args = prev == TOK_LEFT_PARENTHESIS ? 0 : function_stack[i].args + 1;
+					if (args != ctx->functions[function_stack[i].token.id].num_parameters) {
+						return -15;
+					}
+					function_stack[i].args = -1;
+				}
+				break;
+			}
+			case TOK_FUNCTION: {
+				FunctionVMStackItem f;
+				f.token = token;
+				f.precedence = ctx->functions[token.id].precedence;
+				f.par_level = par_level;
+				f.args = call ? 0 : -1;
+				vm_token_type opcode = ctx->functions[token.id].opcode;
+				// prefix operators and function calls have no left operand to finish
+				int prefix = prev != TOK_NUMBER && prev != TOK_VARIABLE && prev != TOK_RIGHT_PARENTHESIS;
+				if (opcode == TOK_JUMP) {
+					// ':' finishes the then branch and replaces the innermost '?' of this level
+					while (num_function_stack > 0 && (function_stack[num_function_stack - 1].par_level != par_level || ctx->functions[function_stack[num_function_stack - 1].token.id].opcode != TOK_JUMP_IF_FALSE)) {
+						if (function_stack[num_function_stack - 1].par_level < par_level) {
+							return -17;
+						}
+						int code = vm__emit_operator(ctx, function_stack[--num_function_stack].token, byteCode, &num_rpl, capacity);
+						if (code != 0) {
+							return -code;
+						}
+					}
+					if (num_function_stack == 0) {
+						return -17;
+					}
+					--num_function_stack;
+				}
+				else {
+					// '?' is right associative
+					int right = opcode == TOK_JUMP_IF_FALSE;
+					while (!prefix && num_function_stack > 0 && cmp(function_stack[num_function_stack - 1], f) >= right) {
+						int code = vm__emit_operator(ctx, function_stack[--num_function_stack].token, byteCode, &num_rpl, capacity);
+						if (code != 0) {
+							return -code;
+						}
+					}
+				}
+				if (num_function_stack == stack_capacity) {
+					return -6;
+				}
+				function_stack[num_function_stack++] = f;
+				if (vm__is_jump(opcode) && !vm__emit(ctx, vm__create_token(opcode), byteCode, &num_rpl, capacity)) {
+					return -4;
+				}
+				if (comma) {
+					int i = num_function_stack - 1;
+					while (i >= 0 && function_stack[i].par_level >= par_level) {
+						--i;
+					}
+					if (i >= 0 && function_stack[i].par_level == par_level - 1 && function_stack[i].args >= 0) {
+						++function_stack[i].args;
+					}
+				}
+				break;
+			}
+			default:
+				break;
+		}
+		if (token.type != TOK_EMPTY) {
+			prev = token.type;
+		}
+	}
+	*error_at = p;
+	while (num_function_stack > 0) {
+		int code = vm__emit_operator(ctx, function_stack[--num_function_stack].token, byteCode, &num_rpl, capacity);
+		if (code != 0) {
+			return -code;
+		}
+	}
+	num_rpl = vm__optimize(ctx, byteCode, num_rpl);
+	num_rpl = vm__fuse(byteCode, num_rpl);
+	num_rpl = vm__link(byteCode, num_rpl);
+	if (num_rpl < 0) {
+		return -18;
+	}
+	int max_stack = 0;
+	int code = vm__verify(byteCode, num_rpl, ctx->functions, &max_stack);
+	return code == 0 ? num_rpl : -code;
+}
+
+// ------------------------------------------------------------------
+// upper bound of the bytes vm_parse_with_scratch needs for source.
+// The parser needs one stack item per pending operator and every
+// operator consumes at least one character.
+// ------------------------------------------------------------------
+DSDEF int vm_parse_scratch_size(const char* source) {
+	return (int)((strlen(source) + 1) * sizeof(FunctionVMStackItem));
+}
+
+// ------------------------------------------------------------------
+// parse without touching the heap. vm_parse_scratch_size(source)
+// bytes of scratch memory are always enough, a smaller buffer works
+// as long as it holds all operators pending at the same time. All
+// identifiers must be known, unknown identifiers are reported as
+// error. Returns the number of tokens or a negative error code.
+// ------------------------------------------------------------------
+DSDEF int vm_parse_with_scratch(vm_context* ctx, const char* source, vm_token* byteCode, int capacity, void* scratch, int scratch_size) {
+	return vm__parse(ctx, source, byteCode, capacity, (FunctionVMStackItem*)scratch, scratch_size / (int)sizeof(FunctionVMStackItem), 0, 0, 0);
+}
+
+// ------------------------------------------------------------------
+// parse
+// Returns the number of tokens or a negative error code.
+// ------------------------------------------------------------------
+DSDEF int vm_parse(vm_context* ctx, const char * source, vm_token * byteCode, int capacity) {
+	FunctionVMStackItem function_stack[64];
+	int size = vm_parse_scratch_size(source);
+	if (size <= (int)sizeof(function_stack)) {
+		return vm__parse(ctx, source, byteCode, capacity, function_stack, 64, 1, 0, 0);
+	}
+	FunctionVMStackItem* scratch = (FunctionVMStackItem*)VM_MALLOC(size);
+	int ret = vm__parse(ctx, source, byteCode, capacity, scratch, size / (int)sizeof(FunctionVMStackItem), 1, 0, 0);
+	VM_FREE(scratch);
+	return ret;
+}
+
+// ------------------------------------------------------------------
+// Multi output programs
+// vm_parse_many parses every source and merges equal subexpressions
+// across all sources (value numbering on the RPN). A subexpression
+// used more than once is stored in a temporary after it has been
+// computed the first time and loaded afterwards. Every source ends
+// with TOK_OUTPUT which moves its value into the output array.
+// ------------------------------------------------------------------
+#ifndef VM_MAX_TEMPS
+#define VM_MAX_TEMPS 32
+#endif
+
+struct vm__cse_node_t {
+	vm_token token;
+	int arity;
+	int children[3];
+	int uses;
+	int temp;
+};
+
+typedef struct vm__cse_node_t vm__cse_node;
+
+struct vm__cse_t {
+	vm__cse_node* nodes;
+	int num_nodes;
+	int* table;
+	int table_capacity;
+	vm_token* byteCode;
+	int num;
+	int capacity;
+	int num_temps;
+};
+
+typedef struct vm__cse_t vm__cse;
+
+// ------------------------------------------------------------------
+// internal method to expand superinstructions into plain RPN
+// ------------------------------------------------------------------
+static int vm__unfuse(vm_context* ctx, const vm_token* byteCode, int num, vm_token* plain) {
+	static const char* ops[] = { "+", "-", "*", "/" };
+	int n = 0;
+	for (int i = 0; i < num; ++i) {
+		vm_token t = byteCode[i];
+		if (t.type >= TOK_VAR_ADD_CONST && t.type <= TOK_VAR_DIV_CONST) {
+			int k = t.type - TOK_VAR_ADD_CONST;
+			plain[n].type = TOK_VARIABLE;
+			plain[n++].id = t.id;
+			plain[n++] = byteCode[++i];
+			plain[n].type = (vm_token_type)(TOK_ADD + k);
+			plain[n++].id = vm__find_function(ctx, ops[k], 1);
+		}
+		else if (t.type >= TOK_ADD_CONST && t.type <= TOK_DIV_CONST) {
+			int k = t.type - TOK_ADD_CONST;
+			plain[n++] = vm__create_token_with_value(TOK_NUMBER, t.value);
+			plain[n].type = (vm_token_type)(TOK_ADD + k);
+			plain[n++].id = vm__find_function(ctx, ops[k], 1);
+		}
+		else {
+			plain[n++] = t;
+		}
+	}
+	return n;
+}
+
+// ------------------------------------------------------------------
+// internal method to find or create the node of a token. Calls of
+// functions which are not pure always create a new node.
+// ------------------------------------------------------------------
+static int vm__cse_find(vm_context* ctx, vm__cse* cse, vm_token t, int arity, const int* children) {
+	int pure = t.type != TOK_FUNCTION || (ctx->functions[t.id].flags & VM_FUNCTION_PURE);
+	unsigned int h = (unsigned int)vm__fnv1a_len((const char*)&t.id, sizeof(int)) ^ (unsigned int)t.type;
+	for (int i = 0; i < arity; ++i) {
+		h = (h ^ (unsigned int)children[i]) * FNV_Prime;
+	}
+	unsigned int mask = (unsigned int)cse->table_capacity - 1;
+	unsigned int slot = h & mask;
+	if (pure) {
+		for (; cse->table[slot] != -1; slot = (slot + 1) & mask) {
+			const vm__cse_node* n = &cse->nodes[cse->table[slot]];
+			if (n->token.type == t.type && n->token.id == t.id && n->arity == arity && memcmp(n->children, children, arity * sizeof(int)) == 0) {
+				return cse->table[slot];
+			}
+		}
+	}
+	int id = cse->num_nodes++;
+	vm__cse_node* n = &cse->nodes[id];
+	n->token = t;
+	n->arity = arity;
+	memcpy(n->children, children, arity * sizeof(int));
+	n->uses = 0;
+	n->temp = -1;
+	if (pure) {
+		cse->table[slot] = id;
+	}
+	return id;
+}
+
+// ------------------------------------------------------------------
+// internal method to append a token
+// ------------------------------------------------------------------
+static int vm__cse_append(vm__cse* cse, vm_token_type type, vm_token t) {
+	if (cse->num == cse->capacity) {
+		return 0;
+	}
+	t.type = type;
+	cse->byteCode[cse->num++] = t;
+	return 1;
+}
+
+// ------------------------------------------------------------------
+// internal method to emit the code of a node
+// ------------------------------------------------------------------
+static int vm__cse_emit(vm__cse* cse, int id) {
+	vm__cse_node* n = &cse->nodes[id];
+	vm_token t;
+	if (n->temp != -1) {
+		t.id = n->temp;
+		return vm__cse_append(cse, TOK_LOAD, t);
+	}
+	for (int i = 0; i < n->arity; ++i) {
+		int ok = i > 0 && n->children[i] == n->children[i - 1] ? vm__cse_append(cse, TOK_DUP, vm__create_token(TOK_DUP)) : vm__cse_emit(cse, n->children[i]);
+		if (!ok) {
+			return 0;
+		}
+	}
+	if (!vm__cse_append(cse, n->token.type, n->token)) {
+		return 0;
+	}
+	// numbers and variables are as cheap as loading a temporary
+	if (n->uses > 1 && n->arity > 0 && cse->num_temps < VM_MAX_TEMPS) {
+		n->temp = cse->num_temps++;
+		t.id = n->temp;
+		return vm__cse_append(cse, TOK_STORE, t);
+	}
+	return 1;
+}
+
+// ------------------------------------------------------------------
+// internal method to build the nodes of one source. Returns the
+// root node or -1 if the stack usage is not known.
+// ------------------------------------------------------------------
+static int vm__cse_source(vm_context* ctx, vm__cse* cse, const vm_token* plain, int num, int* stack) {
+	int depth = 0;
+	for (int i = 0; i < num; ++i) {
+		vm_token t = plain[i];
+		if (t.type == TOK_DUP) {
+			if (depth == 0) {
+				return -1;
+			}
+			stack[depth] = stack[depth - 1];
+			++depth;
+			continue;
+		}
+		int arity = vm__token_arity(ctx, t);
+		if (arity == -1) {
+			arity = 0;
+		}
+		// the branches of a conditional are not merged
+		if (arity > depth || arity > 3 || vm__is_jump(t.type)) {
+			return -1;
+		}
+		depth -= arity;
+		stack[depth] = vm__cse_find(ctx, cse, t, arity, stack + depth);
+		++depth;
+	}
+	return depth == 1 ? stack[0] : -1;
+}
+
+// ------------------------------------------------------------------
+// parse several sources into one program with one output per
+// source. Shared subexpressions are only evaluated once per run.
+// Returns the number of tokens or a negative error code.
+// ------------------------------------------------------------------
+DSDEF int vm_parse_many(vm_context* ctx, const char** sources, int num_sources, vm_token* byteCode, int capacity) {
+	int total = 0;
+	for (int i = 0; i < num_sources; ++i) {
+		total += (int)strlen(sources[i]) + 1;
+	}
+	// every token expands to at most three plain tokens
+	vm_token* parsed = (vm_token*)VM_MALLOC(vm__token_capacity(total) * sizeof(vm_token));
+	vm_token* plain = (vm_token*)VM_MALLOC(total * 3 * sizeof(vm_token));
+	int* starts = (int*)VM_MALLOC((num_sources + 1) * 2 * sizeof(int));
+	int* plain_starts = starts + num_sources + 1;
+	int num_parsed = 0;
+	int num_plain = 0;
+	int ret = 0;
+	for (int i = 0; i < num_sources; ++i) {
+		int num = vm_parse(ctx, sources[i], parsed + num_parsed, vm__token_capacity(total) - num_parsed);
+		if (num < 0) {
+			ret = num;
+			break;
+		}
+		starts[i] = num_parsed;
+		plain_starts[i] = num_plain;
+		num_plain += vm__unfuse(ctx, parsed + num_parsed, num, plain + num_plain);
+		num_parsed += num;
+	}
+	starts[num_sources] = num_parsed;
+	plain_starts[num_sources] = num_plain;
+	if (ret == 0) {
+		vm__cse cse;
+		cse.nodes = (vm__cse_node*)VM_MALLOC((num_plain + 1) * sizeof(vm__cse_node));
+		cse.num_nodes = 0;
+		cse.table_capacity = 16;
+		while (cse.table_capacity < num_plain * 2) {
+			cse.table_capacity *= 2;
+		}
+		cse.table = (int*)VM_MALLOC(cse.table_capacity * sizeof(int));
+		for (int i = 0; i < cse.table_capacity; ++i) {
+			cse.table[i] = -1;
+		}
+		cse.byteCode = byteCode;
+		cse.num = 0;
+		cse.capacity = capacity;
+		cse.num_temps = 0;
+		int* stack = (int*)VM_MALLOC((num_plain + 1) * sizeof(int));
+		int* roots = (int*)VM_MALLOC((num_sources + 1) * sizeof(int));
+		int valid = 1;
+		for (int i = 0; i < num_sources && valid; ++i) {
+			roots[i] = vm__cse_source(ctx, &cse, plain + plain_starts[i], plain_starts[i + 1] - plain_starts[i], stack);
+			valid = roots[i] != -1;
+		}
+		if (valid) {
+			for (int i = 0; i < cse.num_nodes; ++i) {
+				const vm__cse_node* n = &cse.nodes[i];
+				for (int j = 0; j < n->arity; ++j) {
+					if (j == 0 || n->children[j] != n->children[j - 1]) {
+						++cse.nodes[n->children[j]].uses;
+					}
+				}
+			}
+			for (int i = 0; i < num_sources; ++i) {
+				++cse.nodes[roots[i]].uses;
+			}
+			ret = -4;
+			int ok = 1;
+			for (int i = 0; i < num_sources && ok; ++i) {
+				vm_token t;
+				t.id = i;
+				ok = vm__cse_emit(&cse, roots[i]) && vm__cse_append(&cse, TOK_OUTPUT, t);
+			}
+			if (ok) {
+				ret = vm__fuse(byteCode, cse.num);
+			}
+		}
+		else {
+			// unknown stack usage, keep the sources as they are
+			ret = -4;
+			if (num_parsed + num_sources <= capacity) {
+				ret = 0;
+				for (int i = 0; i < num_sources; ++i) {
+					memcpy(byteCode + ret, parsed + starts[i], (starts[i + 1] - starts[i]) * sizeof(vm_token));
+					ret += starts[i + 1] - starts[i];
+					byteCode[ret].type = TOK_OUTPUT;
+					byteCode[ret++].id = i;
+				}
+			}
+		}
+		VM_FREE(roots);
+		VM_FREE(stack);
+		VM_FREE(cse.table);
+		VM_FREE(cse.nodes);
+	}
+	VM_FREE(starts);
+	VM_FREE(plain);
+	VM_FREE(parsed);
+	return ret;
+}
+
+// ------------------------------------------------------------------
+// Profiling
+// Define DS_VM_PROFILE to count the executions and the cycles of
+// every opcode and function and the totals of every program run by
+// vm_run or vm_run_many. Without it nothing is measured.
+// ------------------------------------------------------------------
+struct vm__profile_program_t {
+	// FNV-1a hash of the bytecode
+	unsigned int key;
+	int num_tokens;
+	int used;
+	vm_profile_stats total;
+};
+
+typedef struct vm__profile_program_t vm__profile_program;
+
+struct vm_profile_t {
+	vm_profile_stats opcodes[TOK_NUM_TYPES];
+	// indexed by function id
+	vm_profile_stats* functions;
+	int functions_capacity;
+	// open addressing by the content of the bytecode
+	vm__profile_program* programs;
+	int num_programs;
+	int programs_capacity;
+};
+
+typedef struct vm_profile_t vm_profile;
+
+#ifdef DS_VM_PROFILE
+static void vm__create_profile(vm_context* ctx) {
+	ctx->profile = (vm_profile*)VM_MALLOC(sizeof(vm_profile));
+	memset(ctx->profile, 0, sizeof(vm_profile));
+}
+#endif
+
+static void vm__destroy_profile(vm_context* ctx) {
+	if (ctx->profile->functions) {
+		VM_FREE(ctx->profile->functions);
+	}
+	if (ctx->profile->programs) {
+		VM_FREE(ctx->profile->programs);
+	}
+	VM_FREE(ctx->profile);
+	ctx->profile = 0;
+}
+
+#ifdef DS_VM_PROFILE
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+static unsigned long long vm__ticks() { return __rdtsc(); }
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static unsigned long long vm__ticks() { return __rdtsc(); }
+#elif defined(_WIN32)
+#include <windows.h>
+static unsigned long long vm__ticks() { LARGE_INTEGER t; QueryPerformanceCounter(&t); return (unsigned long long)t.QuadPart; }
+#else
+#include <time.h>
+static unsigned long long vm__ticks() { struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts); return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec; }
+#endif
+
+// ------------------------------------------------------------------
+// internal method to add the cost of one executed token
+// ------------------------------------------------------------------
+static void vm__profile_op(vm_profile* profile, const vm_token* t, unsigned long long cycles) {
+	vm_profile_stats* e = &profile->opcodes[t->type];
+	if (t->type == TOK_FUNCTION) {
+		if (t->id >= profile->functions_capacity) {
+			int old = profile->functions_capacity;
+			while (t->id >= profile->functions_capacity) {
+				profile->functions = (vm_profile_stats*)vm__grow(profile->functions, old, &profile->functions_capacity, sizeof(vm_profile_stats));
+				memset(profile->functions + old, 0, (profile->functions_capacity - old) * sizeof(vm_profile_stats));
+				old = profile->functions_capacity;
+			}
+		}
+		e = &profile->functions[t->id];
+	}
+	++e->count;
+	e->cycles += cycles;
+}
+
+// ------------------------------------------------------------------
+// internal method to get the key of a program. Programs are told
+// apart by their bytecode, not by where it is stored, so a buffer
+// reused for another program gets a new entry and the keys are the
+// same in every run.
+// ------------------------------------------------------------------
+static unsigned int vm__profile_key(const vm_token* tokens, int num) {
+	return (unsigned int)vm__fnv1a_len((const char*)tokens, num * (int)sizeof(vm_token));
+}
+
+// ------------------------------------------------------------------
+// internal method to find the entry of a program or the free slot
+// ------------------------------------------------------------------
+static vm__profile_program* vm__profile_slot(vm_profile* profile, unsigned int key, int num) {
+	unsigned int mask = (unsigned int)profile->programs_capacity - 1;
+	unsigned int slot = key * 2654435761u & mask;
+	while (profile->programs[slot].used && (profile->programs[slot].key != key || profile->programs[slot].num_tokens != num)) {
+		slot = (slot + 1) & mask;
+	}
+	return &profile->programs[slot];
+}
+
+// ------------------------------------------------------------------
+// internal method to add the total cost of one run of a program.
+// The table is rebuilt with the double size once it is half full.
+// ------------------------------------------------------------------
+static void vm__profile_run(vm_profile* profile, const vm_token* tokens, int num, unsigned long long cycles) {
+	if ((profile->num_programs + 1) * 2 > profile->programs_capacity) {
+		vm__profile_program* old = profile->programs;
+		int old_capacity = profile->programs_capacity;
+		profile->programs_capacity = old_capacity < 16 ? 32 : old_capacity * 2;
+		profile->programs = (vm__profile_program*)VM_MALLOC(profile->programs_capacity * sizeof(vm__profile_program));
+		memset(profile->programs, 0, profile->programs_capacity * sizeof(vm__profile_program));
+		for (int i = 0; i < old_capacity; ++i) {
+			if (old[i].used) {
+				*vm__profile_slot(profile, old[i].key, old[i].num_tokens) = old[i];
+			}
+		}
+		if (old) {
+			VM_FREE(old);
+		}
+	}
+	unsigned int key = vm__profile_key(tokens, num);
+	vm__profile_program* p = vm__profile_slot(profile, key, num);
+	if (!p->used) {
+		p->key = key;
+		p->num_tokens = num;
+		p->used = 1;
+		++profile->num_programs;
+	}
+	++p->total.count;
+	p->total.cycles += cycles;
+}
+
+#define VM__PROFILE_TICK() if (profile) { unsigned long long now = vm__ticks(); if (prof_ip) vm__profile_op(profile, prof_ip, now - prof_last); prof_ip = ip; prof_last = now; }
+#else
+#define VM__PROFILE_TICK()
+#endif
+
+// ------------------------------------------------------------------
+// internal method to get the name of a profiled opcode. Built-in
+// operators use the name of their function.
+// ------------------------------------------------------------------
+static const char* vm__opcode_name(vm_context* ctx, int type) {
+	for (int i = 0; i < ctx->num_functions; ++i) {
+		if ((int)ctx->functions[i].opcode == type && type != TOK_FUNCTION && type != TOK_EMPTY) {
+			return ctx->functions[i].name;
+		}
+	}
+	return TOKEN_NAMES[type];
+}
+
+// ------------------------------------------------------------------
+// get the profile of a function (or built-in operator) by name or
+// of an opcode by its token name. Returns 0 if there is no data.
+// ------------------------------------------------------------------
+DSDEF int vm_get_profile(vm_context* ctx, const char* name, vm_profile_stats* stats) {
+	vm_profile* profile = ctx->profile;
+	if (!profile) {
+		return 0;
+	}
+	int id = vm__find_function(ctx, name, (int)strlen(name));
+	if (id != -1 && ctx->functions[id].opcode == TOK_FUNCTION) {
+		if (id >= profile->functions_capacity) {
+			return 0;
+		}
+		*stats = profile->functions[id];
+		return 1;
+	}
+	for (int i = 0; i < TOK_NUM_TYPES; ++i) {
+		if (strcmp(vm__opcode_name(ctx, i), name) == 0 || strcmp(TOKEN_NAMES[i], name) == 0) {
+			*stats = profile->opcodes[i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// ------------------------------------------------------------------
+// get the profile of a program by its bytecode. Returns 0 if there
+// is no data.
+// ------------------------------------------------------------------
+DSDEF int vm_get_program_profile(vm_context* ctx, const vm_token* tokens, int num, vm_profile_stats* stats) {
+#ifdef DS_VM_PROFILE
+	vm_profile* profile = ctx->profile;
+	if (!profile || profile->programs_capacity == 0) {
+		return 0;
+	}
+	const vm__profile_program* p = vm__profile_slot(profile, vm__profile_key(tokens, num), num);
+	if (!p->used) {
+		return 0;
+	}
+	*stats = p->total;
+	return 1;
+#else
+	(void)ctx;
+	(void)tokens;
+	(void)num;
+	(void)stats;
+	return 0;
+#endif
+}
+
+struct vm__profile_line_t {
+	const char* name;
+	vm_profile_stats stats;
+	unsigned int key;
+	int num_tokens;
+};
+
+typedef struct vm__profile_line_t vm__profile_line;
+
+static int vm__profile_compare(const void* a, const void* b) {
+	unsigned long long ca = ((const vm__profile_line*)a)->stats.cycles;
+	unsigned long long cb = ((const vm__profile_line*)b)->stats.cycles;
+	return ca < cb ? 1 : (ca > cb ? -1 : 0);
+}
+
+// ------------------------------------------------------------------
+// print all profiled opcodes, functions and programs sorted by cost
+// ------------------------------------------------------------------
+DSDEF void vm_profile_report(vm_context* ctx) {
+	vm_profile* profile = ctx->profile;
+	if (!profile) {
+		printf("profile: not available, define DS_VM_PROFILE\n");
+		return;
+	}
+	int capacity = TOK_NUM_TYPES + profile->functions_capacity + profile->programs_capacity;
+	vm__profile_line* lines = (vm__profile_line*)VM_MALLOC(capacity * sizeof(vm__profile_line));
+	int num = 0;
+	for (int i = 0; i < TOK_NUM_TYPES; ++i) {
+		if (profile->opcodes[i].count > 0) {
+			lines[num].name = vm__opcode_name(ctx, i);
+			lines[num++].stats = profile->opcodes[i];
+		}
+	}
+	for (int i = 0; i < profile->functions_capacity && i < ctx->num_functions; ++i) {
+		if (profile->functions[i].count > 0) {
+			lines[num].name = ctx->functions[i].name;
+			lines[num++].stats = profile->functions[i];
+		}
+	}
+	qsort(lines, num, sizeof(vm__profile_line), vm__profile_compare);
+	printf("profile: %-22s %12s %14s %10s\n", "name", "count", "cycles", "per call");
+	for (int i = 0; i < num; ++i) {
+		printf("         %-22s %12llu %14llu %10.1f\n", lines[i].name, lines[i].stats.count, lines[i].stats.cycles, (double)lines[i].stats.cycles / lines[i].stats.count);
+	}
+	num = 0;
+	for (int i = 0; i < profile->programs_capacity; ++i) {
+		if (profile->programs[i].used) {
+			lines[num].key = profile->programs[i].key;
+			lines[num].num_tokens = profile->programs[i].num_tokens;
+			lines[num++].stats = profile->programs[i].total;
+		}
+	}
+	qsort(lines, num, sizeof(vm__profile_line), vm__profile_compare);
+	printf("programs: %-21s %12s %14s %10s\n", "bytecode", "runs", "cycles", "per run");
+	for (int i = 0; i < num; ++i) {
+		printf("         %08x (%3d tokens)  %12llu %14llu %10.1f\n", lines[i].key, lines[i].num_tokens, lines[i].stats.count, lines[i].stats.cycles, (double)lines[i].stats.cycles / lines[i].stats.count);
+	}
+	VM_FREE(lines);
+}
+
+// ------------------------------------------------------------------
+// clear all profile data
+// ------------------------------------------------------------------
+DSDEF void vm_profile_reset(vm_context* ctx) {
+	vm_profile* profile = ctx->profile;
+	if (profile) {
+		memset(profile->opcodes, 0, sizeof(profile->opcodes));
+		if (profile->functions) {
+			memset(profile->functions, 0, profile->functions_capacity * sizeof(vm_profile_stats));
+		}
+		if (profile->programs) {
+			memset(profile->programs, 0, profile->programs_capacity * sizeof(vm__profile_program));
+		}
+		profile->num_programs = 0;
+	}
+}
+
+// ------------------------------------------------------------------
+// run
+// Uses direct threading (computed goto) when the compiler supports
+// it. Define DS_VM_NO_COMPUTED_GOTO to force the switch dispatch.
+// ------------------------------------------------------------------
+#if defined(__GNUC__) && !defined(DS_VM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO
+#endif
+
+// verified programs skip the checks: with computed goto they jump
+// to the VM_FAST label behind the checks of every opcode
+#ifdef VM_COMPUTED_GOTO
+#define VM_CASE(op) vm_op_##op:
+#define VM_FAST(op) vm_fast_##op:
+#define VM_NEXT() do { VM__PROFILE_TICK(); if (ip >= end) goto vm_done; goto *dispatch[ip->type]; } while (0)
+#define VM__CHECK(failed, code) if (failed) return code
+#else
+#define VM_CASE(op) case op:
+#define VM_FAST(op)
+#define VM_NEXT() continue
+#define VM__CHECK(failed, code) if (!verified && (failed)) return code
+#endif
+
+#define VM__NEED(n) VM__CHECK(sp - stack_data < (n), 2)
+#define VM__ROOM(n) VM__CHECK(stack_end - sp < (n), 3)
+
+// ------------------------------------------------------------------
+// internal interpreter shared by vm_run, vm_run_many and vm_run_env.
+// It only writes to ret and outputs and keeps all other state on
+// the stack. If verified is set the program has passed vm__verify
+// and the stack holds at least its maximum depth, so the stack
+// checks are skipped.
+// ------------------------------------------------------------------
+static int vm__execute_on(const vm_token* byteCode, int capacity, const float* values, const vm_function* functions, float* ret, float* outputs, int num_outputs, float* stack_data, int stack_size, int verified VM__PROFILE_PARAM) {
+	float temps[VM_MAX_TEMPS];
+	float* sp = stack_data;
+	float* stack_end = stack_data + stack_size;
+	const vm_token* ip = byteCode;
+	const vm_token* end = byteCode + capacity;
+#ifdef DS_VM_PROFILE
+	// the token which is currently measured
+	const vm_token* prof_ip = 0;
+	unsigned long long prof_last = 0;
+#endif
+#ifdef VM_COMPUTED_GOTO
+	// must follow the order of vm_token_type
+	static const void* labels[TOK_NUM_TYPES] = {
+		&&vm_op_TOK_EMPTY, &&vm_op_TOK_NUMBER, &&vm_op_TOK_FUNCTION, &&vm_op_TOK_VARIABLE, &&vm_op_TOK_EMPTY, &&vm_op_TOK_EMPTY,
+		&&vm_op_TOK_ADD, &&vm_op_TOK_SUB, &&vm_op_TOK_MUL, &&vm_op_TOK_DIV, &&vm_op_TOK_NEG, &&vm_op_TOK_ABS,
+		&&vm_op_TOK_SIN, &&vm_op_TOK_COS, &&vm_op_TOK_TAN, &&vm_op_TOK_POW, &&vm_op_TOK_LERP, &&vm_op_TOK_EXP,
+		&&vm_op_TOK_SIN_FAST, &&vm_op_TOK_COS_FAST, &&vm_op_TOK_TAN_FAST, &&vm_op_TOK_POW_FAST, &&vm_op_TOK_EXP_FAST,
+		&&vm_op_TOK_SIN_APPROX, &&vm_op_TOK_COS_APPROX, &&vm_op_TOK_TAN_APPROX, &&vm_op_TOK_POW_APPROX, &&vm_op_TOK_EXP_APPROX, &&vm_op_TOK_DUP,
+		&&vm_op_TOK_ADD_CONST, &&vm_op_TOK_SUB_CONST, &&vm_op_TOK_MUL_CONST, &&vm_op_TOK_DIV_CONST,
+		&&vm_op_TOK_VAR_ADD_CONST, &&vm_op_TOK_VAR_SUB_CONST, &&vm_op_TOK_VAR_MUL_CONST, &&vm_op_TOK_VAR_DIV_CONST,
+		&&vm_op_TOK_STORE, &&vm_op_TOK_LOAD, &&vm_op_TOK_OUTPUT,
+		&&vm_op_TOK_LT, &&vm_op_TOK_LE, &&vm_op_TOK_GT, &&vm_op_TOK_GE, &&vm_op_TOK_EQ, &&vm_op_TOK_NE,
+		&&vm_op_TOK_MIN, &&vm_op_TOK_MAX, &&vm_op_TOK_CLAMP, &&vm_op_TOK_BOOL, &&vm_op_TOK_SELECT,
+		&&vm_op_TOK_JUMP, &&vm_op_TOK_JUMP_IF_FALSE, &&vm_op_TOK_AND_JUMP, &&vm_op_TOK_OR_JUMP, &&vm_op_TOK_LABEL
+	};
+	static const void* fast_labels[TOK_NUM_TYPES] = {
+		&&vm_fast_TOK_EMPTY, &&vm_fast_TOK_NUMBER, &&vm_fast_TOK_FUNCTION, &&vm_fast_TOK_VARIABLE, &&vm_fast_TOK_EMPTY, &&vm_fast_TOK_EMPTY,
+		&&vm_fast_TOK_ADD, &&vm_fast_TOK_SUB, &&vm_fast_TOK_MUL, &&vm_fast_TOK_DIV, &&vm_fast_TOK_NEG, &&vm_fast_TOK_ABS,
+		&&vm_fast_TOK_SIN, &&vm_fast_TOK_COS, &&vm_fast_TOK_TAN, &&vm_fast_TOK_POW, &&vm_fast_TOK_LERP, &&vm_fast_TOK_EXP,
+		&&vm_fast_TOK_SIN_FAST, &&vm_fast_TOK_COS_FAST, &&vm_fast_TOK_TAN_FAST, &&vm_fast_TOK_POW_FAST, &&vm_fast_TOK_EXP_FAST,
+		&&vm_fast_TOK_SIN_APPROX, &&vm_fast_TOK_COS_APPROX, &&vm_fast_TOK_TAN_APPROX, &&vm_fast_TOK_POW_APPROX, &&vm_fast_TOK_EXP_APPROX, &&vm_fast_TOK_DUP,
+		&&vm_fast_TOK_ADD_CONST, &&vm_fast_TOK_SUB_CONST, &&vm_fast_TOK_MUL_CONST, &&vm_fast_TOK_DIV_CONST,
+		&&vm_fast_TOK_VAR_ADD_CONST, &&vm_fast_TOK_VAR_SUB_CONST, &&vm_fast_TOK_VAR_MUL_CONST, &&vm_fast_TOK_VAR_DIV_CONST,
+		&&vm_fast_TOK_STORE, &&vm_fast_TOK_LOAD, &&vm_fast_TOK_OUTPUT,
+		&&vm_fast_TOK_LT, &&vm_fast_TOK_LE, &&vm_fast_TOK_GT, &&vm_fast_TOK_GE, &&vm_fast_TOK_EQ, &&vm_fast_TOK_NE,
+		&&vm_fast_TOK_MIN, &&vm_fast_TOK_MAX, &&vm_fast_TOK_CLAMP, &&vm_fast_TOK_BOOL, &&vm_fast_TOK_SELECT,
+		&&vm_fast_TOK_JUMP, &&vm_fast_TOK_JUMP_IF_FALSE, &&vm_fast_TOK_AND_JUMP, &&vm_fast_TOK_OR_JUMP, &&vm_op_TOK_LABEL
+	};
+	const void* const* dispatch = verified ? fast_labels : labels;
+	VM_NEXT();
+#else
+	for (;;) {
+		VM__PROFILE_TICK();
+		if (ip >= end) {
+			goto vm_done;
+		}
+		switch (ip->type) {
+		default:
+#endif
+	VM_CASE(TOK_EMPTY)
+	VM_FAST(TOK_EMPTY)
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_NUMBER)
+		VM__ROOM(1);
+	VM_FAST(TOK_NUMBER)
+		*sp++ = ip->value;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_VARIABLE)
+		VM__ROOM(1);
+	VM_FAST(TOK_VARIABLE)
+		*sp++ = values[ip->id];
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_FUNCTION)
+		VM__NEED(functions[ip->id].num_parameters);
+	VM_FAST(TOK_FUNCTION) {
+		const vm_function* f = &functions[ip->id];
+		if (f->function) {
+			vm_stack stack = { stack_data, (int)(sp - stack_data), stack_size };
+			(f->function)(&stack);
+			// the stack is sized for the declared number of parameters
+			if (stack.size != (int)(sp - stack_data) - f->num_parameters + 1) {
+				return 2;
+			}
+			sp = stack_data + stack.size;
+		}
+		else {
+			sp = vm__call_native(f, sp);
+		}
+		++ip;
+		VM_NEXT();
+	}
+	VM_CASE(TOK_ADD)
+		VM__NEED(2);
+	VM_FAST(TOK_ADD)
+		--sp;
+		sp[-1] = sp[-1] + sp[0];
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_SUB)
+		VM__NEED(2);
+	VM_FAST(TOK_SUB)
+		--sp;
+		sp[-1] = sp[-1] - sp[0];
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_MUL)
+		VM__NEED(2);
+	VM_FAST(TOK_MUL)
+		--sp;
+		sp[-1] = sp[-1] * sp[0];
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_DIV)
+		VM__NEED(2);
+	VM_FAST(TOK_DIV)
+		--sp;
+		sp[-1] = sp[-1] / sp[0];
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_NEG)
+		VM__NEED(1);
+	VM_FAST(TOK_NEG)
+		sp[-1] = -sp[-1];
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_ABS)
+		VM__NEED(1);
+	VM_FAST(TOK_ABS)
+		sp[-1] = fabsf(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_SIN)
+		VM__NEED(1);
+	VM_FAST(TOK_SIN)
+		sp[-1] = sin(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_COS)
+		VM__NEED(1);
+	VM_FAST(TOK_COS)
+		sp[-1] = cos(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_TAN)
+		VM__NEED(1);
+	VM_FAST(TOK_TAN)
+		sp[-1] = tan(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_POW)
+		VM__NEED(2);
+	VM_FAST(TOK_POW)
+		--sp;
+		sp[-1] = pow(sp[-1], sp[0]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_LERP)
+		VM__NEED(3);
+	VM_FAST(TOK_LERP) {
+		sp -= 2;
+		float t = sp[1];
+		sp[-1] = (1.0f - t) * sp[-1] + t * sp[0];
+		++ip;
+		VM_NEXT();
+	}
+	VM_CASE(TOK_EXP)
+		VM__NEED(1);
+	VM_FAST(TOK_EXP)
+		sp[-1] = exp(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_SIN_FAST)
+		VM__NEED(1);
+	VM_FAST(TOK_SIN_FAST)
+		sp[-1] = vm__sin_fast(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_COS_FAST)
+		VM__NEED(1);
+	VM_FAST(TOK_COS_FAST)
+		sp[-1] = vm__cos_fast(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_TAN_FAST)
+		VM__NEED(1);
+	VM_FAST(TOK_TAN_FAST)
+		sp[-1] = vm__tan_fast(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_POW_FAST)
+		VM__NEED(2);
+	VM_FAST(TOK_POW_FAST)
+		--sp;
+		sp[-1] = vm__pow_fast(sp[-1], sp[0]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_EXP_FAST)
+		VM__NEED(1);
+	VM_FAST(TOK_EXP_FAST)
+		sp[-1] = vm__exp_fast(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_SIN_APPROX)
+		VM__NEED(1);
+	VM_FAST(TOK_SIN_APPROX)
+		sp[-1] = vm__sin_approx(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_COS_APPROX)
+		VM__NEED(1);
+	VM_FAST(TOK_COS_APPROX)
+		sp[-1] = vm__cos_approx(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_TAN_APPROX)
+		VM__NEED(1);
+	VM_FAST(TOK_TAN_APPROX)
+		sp[-1] = vm__tan_approx(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_POW_APPROX)
+		VM__NEED(2);
+	VM_FAST(TOK_POW_APPROX)
+		--sp;
+		sp[-1] = vm__pow_approx(sp[-1], sp[0]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_EXP_APPROX)
+		VM__NEED(1);
+	VM_FAST(TOK_EXP_APPROX)
+		sp[-1] = vm__exp_approx(sp[-1]);
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_DUP)
+		VM__NEED(1);
+		VM__ROOM(1);
+	VM_FAST(TOK_DUP)
+		*sp = sp[-1];
+		++sp;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_ADD_CONST)
+		VM__NEED(1);
+	VM_FAST(TOK_ADD_CONST)
+		sp[-1] = sp[-1] + ip->value;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_SUB_CONST)
+		VM__NEED(1);
+	VM_FAST(TOK_SUB_CONST)
+		sp[-1] = sp[-1] - ip->value;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_MUL_CONST)
+		VM__NEED(1);
+	VM_FAST(TOK_MUL_CONST)
+		sp[-1] = sp[-1] * ip->value;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_DIV_CONST)
+		VM__NEED(1);
+	VM_FAST(TOK_DIV_CONST)
+		sp[-1] = sp[-1] / ip->value;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_VAR_ADD_CONST)
+		VM__ROOM(1);
+	VM_FAST(TOK_VAR_ADD_CONST)
+		*sp++ = values[ip->id] + ip[1].value;
+		ip += 2;
+		VM_NEXT();
+	VM_CASE(TOK_VAR_SUB_CONST)
+		VM__ROOM(1);
+	VM_FAST(TOK_VAR_SUB_CONST)
+		*sp++ = values[ip->id] - ip[1].value;
+		ip += 2;
+		VM_NEXT();
+	VM_CASE(TOK_VAR_MUL_CONST)
+		VM__ROOM(1);
+	VM_FAST(TOK_VAR_MUL_CONST)
+		*sp++ = values[ip->id] * ip[1].value;
+		ip += 2;
+		VM_NEXT();
+	VM_CASE(TOK_VAR_DIV_CONST)
+		VM__ROOM(1);
+	VM_FAST(TOK_VAR_DIV_CONST)
+		*sp++ = values[ip->id] / ip[1].value;
+		ip += 2;
+		VM_NEXT();
+	VM_CASE(TOK_STORE)
+		VM__NEED(1);
+	VM_FAST(TOK_STORE)
+		if ((unsigned)ip->id >= VM_MAX_TEMPS) {
+			return 9;
+		}
+		temps[ip->id] = sp[-1];
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_LOAD)
+		VM__ROOM(1);
+	VM_FAST(TOK_LOAD)
+		if ((unsigned)ip->id >= VM_MAX_TEMPS) {
+			return 9;
+		}
+		*sp++ = temps[ip->id];
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_OUTPUT)
+		VM__NEED(1);
+	VM_FAST(TOK_OUTPUT)
+		if ((unsigned)ip->id >= (unsigned)num_outputs) {
+			return 9;
+		}
+		outputs[ip->id] = *--sp;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_LT)
+		VM__NEED(2);
+	VM_FAST(TOK_LT)
+		--sp;
+		sp[-1] = sp[-1] < sp[0] ? 1.0f : 0.0f;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_LE)
+		VM__NEED(2);
+	VM_FAST(TOK_LE)
+		--sp;
+		sp[-1] = sp[-1] <= sp[0] ? 1.0f : 0.0f;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_GT)
+		VM__NEED(2);
+	VM_FAST(TOK_GT)
+		--sp;
+		sp[-1] = sp[-1] > sp[0] ? 1.0f : 0.0f;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_GE)
+		VM__NEED(2);
+	VM_FAST(TOK_GE)
+		--sp;
+		sp[-1] = sp[-1] >= sp[0] ? 1.0f : 0.0f;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_EQ)
+		VM__NEED(2);
+	VM_FAST(TOK_EQ)
+		--sp;
+		sp[-1] = sp[-1] == sp[0] ? 1.0f : 0.0f;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_NE)
+		VM__NEED(2);
+	VM_FAST(TOK_NE)
+		--sp;
+		sp[-1] = sp[-1] != sp[0] ? 1.0f : 0.0f;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_MIN)
+		VM__NEED(2);
+	VM_FAST(TOK_MIN)
+		--sp;
+		sp[-1] = sp[-1] < sp[0] ? sp[-1] : sp[0];
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_MAX)
+		VM__NEED(2);
+	VM_FAST(TOK_MAX)
+		--sp;
+		sp[-1] = sp[-1] > sp[0] ? sp[-1] : sp[0];
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_CLAMP)
+		VM__NEED(3);
+	VM_FAST(TOK_CLAMP) {
+		sp -= 2;
+		float x = sp[-1] > sp[0] ? sp[-1] : sp[0];
+		sp[-1] = x < sp[1] ? x : sp[1];
+		++ip;
+		VM_NEXT();
+	}
+	VM_CASE(TOK_BOOL)
+		VM__NEED(1);
+	VM_FAST(TOK_BOOL)
+		sp[-1] = sp[-1] != 0.0f ? 1.0f : 0.0f;
+		++ip;
+		VM_NEXT();
+	VM_CASE(TOK_SELECT)
+		VM__NEED(3);
+	VM_FAST(TOK_SELECT)
+		sp -= 2;
+		sp[-1] = sp[-1] != 0.0f ? sp[0] : sp[1];
+		++ip;
+		VM_NEXT();
+	// the offsets of unverified programs must stay inside the bytecode
+	VM_CASE(TOK_JUMP)
+		VM__CHECK(ip->id <= 0 || ip->id > end - ip, 18);
+	VM_FAST(TOK_JUMP)
+		ip += ip->id;
+		VM_NEXT();
+	VM_CASE(TOK_JUMP_IF_FALSE)
+		VM__NEED(1);
+		VM__CHECK(ip->id <= 0 || ip->id > end - ip, 18);
+	VM_FAST(TOK_JUMP_IF_FALSE)
+		ip += *--sp == 0.0f ? ip->id : 1;
+		VM_NEXT();
+	// && and || keep the value which decides the result
+	VM_CASE(TOK_AND_JUMP)
+		VM__NEED(1);
+		VM__CHECK(ip->id <= 0 || ip->id > end - ip, 18);
+	VM_FAST(TOK_AND_JUMP)
+		if (sp[-1] == 0.0f) {
+			ip += ip->id;
+		}
+		else {
+			--sp;
+			++ip;
+		}
+		VM_NEXT();
+	VM_CASE(TOK_OR_JUMP)
+		VM__NEED(1);
+		VM__CHECK(ip->id <= 0 || ip->id > end - ip, 18);
+	VM_FAST(TOK_OR_JUMP)
+		if (sp[-1] != 0.0f) {
+			ip += ip->id;
+		}
+		else {
+			--sp;
+			++ip;
+		}
+		VM_NEXT();
+	VM_CASE(TOK_LABEL)
+		return 18;
+#ifndef VM_COMPUTED_GOTO
+		}
+	}
+#endif
+vm_done:
+	if (sp > stack_data) {
+		*ret = sp[-1];
+		return 0;
+	}
+	return 1;
+}
+
+static int vm__execute(const vm_token* byteCode, int capacity, const float* values, const vm_function* functions, float* ret, float* outputs, int num_outputs VM__PROFILE_PARAM) {
+	float stack_data[32];
+	return vm__execute_on(byteCode, capacity, values, functions, ret, outputs, num_outputs, stack_data, 32, 0 VM__PROFILE_ARG(profile));
+}
+
+// ------------------------------------------------------------------
+// internal method to run a verified program with a stack of
+// exactly its maximum depth
+// ------------------------------------------------------------------
+static int vm__execute_verified(const vm_token* byteCode, int capacity, const float* values, const vm_function* functions, int max_stack, float* ret VM__PROFILE_PARAM) {
+	float stack_data[64];
+	if (max_stack <= 64) {
+		return vm__execute_on(byteCode, capacity, values, functions, ret, 0, 0, stack_data, max_stack, 1 VM__PROFILE_ARG(profile));
+	}
+	float* heap = (float*)VM_MALLOC(max_stack * sizeof(float));
+	int code = vm__execute_on(byteCode, capacity, values, functions, ret, 0, 0, heap, max_stack, 1 VM__PROFILE_ARG(profile));
+	VM_FREE(heap);
+	return code;
+}
+
+DSDEF int vm_run(vm_context* ctx, vm_token* byteCode, int capacity, float* ret) {
+#ifdef DS_VM_PROFILE
+	unsigned long long start = vm__ticks();
+	int code = vm__execute(byteCode, capacity, ctx->values, ctx->functions, ret, 0, 0, ctx->profile);
+	vm__profile_run(ctx->profile, byteCode, capacity, vm__ticks() - start);
+	return code;
+#else
+	return vm__execute(byteCode, capacity, ctx->values, ctx->functions, ret, 0, 0);
+#endif
+}
+
+// ------------------------------------------------------------------
+// run a program created by vm_parse_many. outputs receives one
+// value per source.
+// ------------------------------------------------------------------
+DSDEF int vm_run_many(vm_context* ctx, vm_token* byteCode, int capacity, float* outputs, int num_outputs) {
+	float ret = 0.0f;
+#ifdef DS_VM_PROFILE
+	unsigned long long start = vm__ticks();
+	int code = vm__execute(byteCode, capacity, ctx->values, ctx->functions, &ret, outputs, num_outputs, ctx->profile);
+	vm__profile_run(ctx->profile, byteCode, capacity, vm__ticks() - start);
+#else
+	int code = vm__execute(byteCode, capacity, ctx->values, ctx->functions, &ret, outputs, num_outputs);
+#endif
+	// all values have been moved into the outputs
+	return code == 1 ? 0 : code;
+}
+
+// ------------------------------------------------------------------
+// Packed bytecode
+// Every instruction starts with the opcode byte. Bit VM_PACKED_WIDE
+// marks 2 byte (little endian) operands, otherwise the operands use
+// 1 byte. Operands by opcode:
+// NUMBER, ADD_CONST .. DIV_CONST: constant index
+// VARIABLE: variable id, FUNCTION: function id
+// VAR_ADD_CONST .. VAR_DIV_CONST: variable id, constant index
+// JUMP .. OR_JUMP: byte offset from the opcode to the target, always wide
+// ------------------------------------------------------------------
+#define VM_PACKED_WIDE 0x80
+#define VM_PACKED_OPCODE 0x7f
+
+// ------------------------------------------------------------------
+// internal method to add a literal to the constant pool
+// ------------------------------------------------------------------
+static unsigned int vm__pack_constant(float* constants, int* num, float value) {
+	for (int i = 0; i < *num; ++i) {
+		if (memcmp(&constants[i], &value, sizeof(float)) == 0) {
+			return (unsigned int)i;
+		}
+	}
+	constants[*num] = value;
+	return (unsigned int)(*num)++;
+}
+
+// ------------------------------------------------------------------
+// internal method to write one instruction. Returns the number of
+// bytes or 0 if an operand does not fit into 2 bytes.
+// ------------------------------------------------------------------
+static int vm__pack_op(unsigned char* out, vm_token_type type, const unsigned int* operands, int count) {
+	int wide = 0;
+	for (int i = 0; i < count; ++i) {
+		if (operands[i] > 0xffff) {
+			return 0;
+		}
+		wide |= operands[i] > 0xff;
+	}
+	int n = 0;
+	out[n++] = (unsigned char)(type | (wide ? VM_PACKED_WIDE : 0));
+	for (int i = 0; i < count; ++i) {
+		out[n++] = (unsigned char)(operands[i] & 0xff);
+		if (wide) {
+			out[n++] = (unsigned char)(operands[i] >> 8);
+		}
+	}
+	return n;
+}
+
+// ------------------------------------------------------------------
+// pack bytecode created by vm_parse. The program is verified first,
+// so vm_run_packed needs no stack checks. Returns 0 and stores the
+// error code in error (if set) if the bytecode cannot be packed.
+// ------------------------------------------------------------------
+DSDEF vm_packed* vm_pack(vm_context* ctx, const vm_token* tokens, int num, int* error) {
+	int max_stack = 0;
+	int code = vm__verify(tokens, num, ctx->functions, &max_stack);
+	if (code != 0) {
+		if (error) {
+			*error = code;
+		}
+		return 0;
+	}
+	// at most 5 bytes per instruction
+	unsigned char* bytes = (unsigned char*)VM_MALLOC(num * 5 + 1);
+	float* constants = (float*)VM_MALLOC((num + 1) * sizeof(float));
+	// the byte position of every token for the jump offsets
+	int* positions = (int*)VM_MALLOC((num + 1) * sizeof(int));
+	int num_constants = 0;
+	int size = 0;
+	for (int i = 0; i < num && code == 0; ++i) {
+		vm_token t = tokens[i];
+		unsigned int operands[2];
+		int count = 0;
+		positions[i] = size;
+		if (t.type == TOK_EMPTY || t.type == TOK_LEFT_PARENTHESIS || t.type == TOK_RIGHT_PARENTHESIS) {
+			continue;
+		}
+		if (vm__is_jump(t.type)) {
+			// patched below
+			bytes[size++] = (unsigned char)(t.type | VM_PACKED_WIDE);
+			size += 2;
+			continue;
+		}
+		if (t.type == TOK_NUMBER || (t.type >= TOK_ADD_CONST && t.type <= TOK_DIV_CONST)) {
+			operands[count++] = vm__pack_constant(constants, &num_constants, t.value);
+		}
+		else if (t.type == TOK_VARIABLE || t.type == TOK_FUNCTION) {
+			operands[count++] = (unsigned int)t.id;
+		}
+		else if (t.type >= TOK_VAR_ADD_CONST && t.type <= TOK_VAR_DIV_CONST) {
+			operands[count++] = (unsigned int)t.id;
+			operands[count++] = vm__pack_constant(constants, &num_constants, tokens[++i].value);
+		}
+		int n = vm__pack_op(bytes + size, t.type, operands, count);
+		if (n == 0) {
+			code = 4;
+		}
+		size += n;
+	}
+	positions[num] = size;
+	for (int i = 0; i < num && code == 0; ++i) {
+		if (vm__is_jump(tokens[i].type)) {
+			int offset = positions[i + tokens[i].id] - positions[i];
+			if (offset > 0xffff) {
+				code = 4;
+			}
+			bytes[positions[i] + 1] = (unsigned char)(offset & 0xff);
+			bytes[positions[i] + 2] = (unsigned char)(offset >> 8);
+		}
+		else if (tokens[i].type >= TOK_VAR_ADD_CONST && tokens[i].type <= TOK_VAR_DIV_CONST) {
+			++i;
+		}
+	}
+	VM_FREE(positions);
+	vm_packed* packed = 0;
+	if (code == 0) {
+		int total = (int)(sizeof(vm_packed) + num_constants * sizeof(float)) + size;
+		packed = (vm_packed*)VM_MALLOC(total);
+		float* pool = (float*)(packed + 1);
+		unsigned char* copy = (unsigned char*)(pool + num_constants);
+		memcpy(pool, constants, num_constants * sizeof(float));
+		memcpy(copy, bytes, size);
+		packed->code = copy;
+		packed->code_size = size;
+		packed->constants = pool;
+		packed->num_constants = num_constants;
+		packed->max_stack = max_stack;
+		packed->size = total;
+	}
+	VM_FREE(constants);
+	VM_FREE(bytes);
+	if (error) {
+		*error = code;
+	}
+	return packed;
+}
+
+// reads operand i of the current instruction
+#define VM__OPERAND(i) (wide ? (unsigned int)(ip[1 + 2 * (i)] | (ip[2 + 2 * (i)] << 8)) : (unsigned int)ip[1 + (i)])
+
+#ifdef VM_COMPUTED_GOTO
+#define VM__PACKED_NEXT() do { if (ip >= end) goto vm_done; wide = *ip & VM_PACKED_WIDE; goto *labels[*ip & VM_PACKED_OPCODE]; } while (0)
+#else
+#define VM__PACKED_NEXT() continue
+#endif
+
+// ------------------------------------------------------------------
+// internal interpreter for packed bytecode. The program has been
+// verified and the stack holds max_stack values.
+// ------------------------------------------------------------------
+static int vm__execute_packed(const vm_packed* packed, const float* values, const vm_function* functions, float* stack_data, float* ret) {
+	const unsigned char* ip = packed->code;
+	const unsigned char* end = ip + packed->code_size;
+	const float* k = packed->constants;
+	float* sp = stack_data;
+	int wide = 0;
+#ifdef VM_COMPUTED_GOTO
+	// must follow the order of vm_token_type, vm_pack only writes
+	// valid opcodes and never the multi output ones
+	static const void* labels[TOK_NUM_TYPES] = {
+		&&vm_invalid, &&vm_op_TOK_NUMBER, &&vm_op_TOK_FUNCTION, &&vm_op_TOK_VARIABLE, &&vm_invalid, &&vm_invalid,
+		&&vm_op_TOK_ADD, &&vm_op_TOK_SUB, &&vm_op_TOK_MUL, &&vm_op_TOK_DIV, &&vm_op_TOK_NEG, &&vm_op_TOK_ABS,
+		&&vm_op_TOK_SIN, &&vm_op_TOK_COS, &&vm_op_TOK_TAN, &&vm_op_TOK_POW, &&vm_op_TOK_LERP, &&vm_op_TOK_EXP,
+		&&vm_op_TOK_SIN_FAST, &&vm_op_TOK_COS_FAST, &&vm_op_TOK_TAN_FAST, &&vm_op_TOK_POW_FAST, &&vm_op_TOK_EXP_FAST,
+		&&vm_op_TOK_SIN_APPROX, &&vm_op_TOK_COS_APPROX, &&vm_op_TOK_TAN_APPROX, &&vm_op_TOK_POW_APPROX, &&vm_op_TOK_EXP_APPROX, &&vm_op_TOK_DUP,
+		&&vm_op_TOK_ADD_CONST, &&vm_op_TOK_SUB_CONST, &&vm_op_TOK_MUL_CONST, &&vm_op_TOK_DIV_CONST,
+		&&vm_op_TOK_VAR_ADD_CONST, &&vm_op_TOK_VAR_SUB_CONST, &&vm_op_TOK_VAR_MUL_CONST, &&vm_op_TOK_VAR_DIV_CONST,
+		&&vm_invalid, &&vm_invalid, &&vm_invalid,
+		&&vm_op_TOK_LT, &&vm_op_TOK_LE, &&vm_op_TOK_GT, &&vm_op_TOK_GE, &&vm_op_TOK_EQ, &&vm_op_TOK_NE,
+		&&vm_op_TOK_MIN, &&vm_op_TOK_MAX, &&vm_op_TOK_CLAMP, &&vm_op_TOK_BOOL, &&vm_op_TOK_SELECT,
+		&&vm_op_TOK_JUMP, &&vm_op_TOK_JUMP_IF_FALSE, &&vm_op_TOK_AND_JUMP, &&vm_op_TOK_OR_JUMP, &&vm_invalid
+	};
+	VM__PACKED_NEXT();
+#else
+	for (;;) {
+		if (ip >= end) {
+			goto vm_done;
+		}
+		wide = *ip & VM_PACKED_WIDE;
+		switch (*ip & VM_PACKED_OPCODE) {
+		default:
+			goto vm_invalid;
+#endif
+	VM_CASE(TOK_NUMBER)
+		*sp++ = k[VM__OPERAND(0)];
+		ip += wide ? 3 : 2;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_VARIABLE)
+		*sp++ = values[VM__OPERAND(0)];
+		ip += wide ? 3 : 2;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_FUNCTION) {
+		const vm_function* f = &functions[VM__OPERAND(0)];
+		if (f->function) {
+			vm_stack stack = { stack_data, (int)(sp - stack_data), packed->max_stack };
+			(f->function)(&stack);
+			if (stack.size != (int)(sp - stack_data) - f->num_parameters + 1) {
+				return 2;
+			}
+			sp = stack_data + stack.size;
+		}
+		else {
+			sp = vm__call_native(f, sp);
+		}
+		ip += wide ? 3 : 2;
+		VM__PACKED_NEXT();
+	}
+	VM_CASE(TOK_ADD)
+		--sp;
+		sp[-1] = sp[-1] + sp[0];
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_SUB)
+		--sp;
+		sp[-1] = sp[-1] - sp[0];
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_MUL)
+		--sp;
+		sp[-1] = sp[-1] * sp[0];
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_DIV)
+		--sp;
+		sp[-1] = sp[-1] / sp[0];
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_NEG)
+		sp[-1] = -sp[-1];
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_ABS)
+		sp[-1] = fabsf(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_SIN)
+		sp[-1] = sin(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_COS)
+		sp[-1] = cos(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_TAN)
+		sp[-1] = tan(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_POW)
+		--sp;
+		sp[-1] = pow(sp[-1], sp[0]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_LERP) {
+		sp -= 2;
+		float t = sp[1];
+		sp[-1] = (1.0f - t) * sp[-1] + t * sp[0];
+		++ip;
+		VM__PACKED_NEXT();
+	}
+	VM_CASE(TOK_EXP)
+		sp[-1] = exp(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_SIN_FAST)
+		sp[-1] = vm__sin_fast(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_COS_FAST)
+		sp[-1] = vm__cos_fast(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_TAN_FAST)
+		sp[-1] = vm__tan_fast(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_POW_FAST)
+		--sp;
+		sp[-1] = vm__pow_fast(sp[-1], sp[0]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_EXP_FAST)
+		sp[-1] = vm__exp_fast(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_SIN_APPROX)
+		sp[-1] = vm__sin_approx(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_COS_APPROX)
+		sp[-1] = vm__cos_approx(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_TAN_APPROX)
+		sp[-1] = vm__tan_approx(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_POW_APPROX)
+		--sp;
+		sp[-1] = vm__pow_approx(sp[-1], sp[0]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_EXP_APPROX)
+		sp[-1] = vm__exp_approx(sp[-1]);
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_DUP)
+		*sp = sp[-1];
+		++sp;
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_ADD_CONST)
+		sp[-1] = sp[-1] + k[VM__OPERAND(0)];
+		ip += wide ? 3 : 2;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_SUB_CONST)
+		sp[-1] = sp[-1] - k[VM__OPERAND(0)];
+		ip += wide ? 3 : 2;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_MUL_CONST)
+		sp[-1] = sp[-1] * k[VM__OPERAND(0)];
+		ip += wide ? 3 : 2;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_DIV_CONST)
+		sp[-1] = sp[-1] / k[VM__OPERAND(0)];
+		ip += wide ? 3 : 2;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_VAR_ADD_CONST)
+		*sp++ = values[VM__OPERAND(0)] + k[VM__OPERAND(1)];
+		ip += wide ? 5 : 3;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_VAR_SUB_CONST)
+		*sp++ = values[VM__OPERAND(0)] - k[VM__OPERAND(1)];
+		ip += wide ? 5 : 3;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_VAR_MUL_CONST)
+		*sp++ = values[VM__OPERAND(0)] * k[VM__OPERAND(1)];
+		ip += wide ? 5 : 3;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_VAR_DIV_CONST)
+		*sp++ = values[VM__OPERAND(0)] / k[VM__OPERAND(1)];
+		ip += wide ? 5 : 3;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_LT)
+		--sp;
+		sp[-1] = sp[-1] < sp[0] ? 1.0f : 0.0f;
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_LE)
+		--sp;
+		sp[-1] = sp[-1] <= sp[0] ? 1.0f : 0.0f;
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_GT)
+		--sp;
+		sp[-1] = sp[-1] > sp[0] ? 1.0f : 0.0f;
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_GE)
+		--sp;
+		sp[-1] = sp[-1] >= sp[0] ? 1.0f : 0.0f;
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_EQ)
+		--sp;
+		sp[-1] = sp[-1] == sp[0] ? 1.0f : 0.0f;
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_NE)
+		--sp;
+		sp[-1] = sp[-1] != sp[0] ? 1.0f : 0.0f;
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_MIN)
+		--sp;
+		sp[-1] = sp[-1] < sp[0] ? sp[-1] : sp[0];
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_MAX)
+		--sp;
+		sp[-1] = sp[-1] > sp[0] ? sp[-1] : sp[0];
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_CLAMP) {
+		sp -= 2;
+		float x = sp[-1] > sp[0] ? sp[-1] : sp[0];
+		sp[-1] = x < sp[1] ? x : sp[1];
+		++ip;
+		VM__PACKED_NEXT();
+	}
+	VM_CASE(TOK_BOOL)
+		sp[-1] = sp[-1] != 0.0f ? 1.0f : 0.0f;
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_SELECT)
+		sp -= 2;
+		sp[-1] = sp[-1] != 0.0f ? sp[0] : sp[1];
+		++ip;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_JUMP)
+		ip += VM__OPERAND(0);
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_JUMP_IF_FALSE)
+		ip += *--sp == 0.0f ? VM__OPERAND(0) : 3;
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_AND_JUMP)
+		if (sp[-1] == 0.0f) {
+			ip += VM__OPERAND(0);
+		}
+		else {
+			--sp;
+			ip += 3;
+		}
+		VM__PACKED_NEXT();
+	VM_CASE(TOK_OR_JUMP)
+		if (sp[-1] != 0.0f) {
+			ip += VM__OPERAND(0);
+		}
+		else {
+			--sp;
+			ip += 3;
+		}
+		VM__PACKED_NEXT();
+#ifndef VM_COMPUTED_GOTO
+		}
+	}
+#endif
+vm_invalid:
+	return 9;
+vm_done:
+	*ret = sp[-1];
+	return 0;
+}
+
+// ------------------------------------------------------------------
+// run packed bytecode
+// ------------------------------------------------------------------
+DSDEF int vm_run_packed(vm_context* ctx, const vm_packed* packed, float* ret) {
+	float stack_data[64];
+	if (packed->max_stack <= 64) {
+		return vm__execute_packed(packed, ctx->values, ctx->functions, stack_data, ret);
+	}
+	float* heap = (float*)VM_MALLOC(packed->max_stack * sizeof(float));
+	int code = vm__execute_packed(packed, ctx->values, ctx->functions, heap, ret);
+	VM_FREE(heap);
+	return code;
+}
+
+// ------------------------------------------------------------------
+// destroy packed bytecode
+// ------------------------------------------------------------------
+DSDEF void vm_destroy_packed(vm_packed* packed) {
+	VM_FREE(packed);
+}
+
+#undef VM__OPERAND
+#undef VM__PACKED_NEXT
+#undef VM_CASE
+#undef VM_FAST
+#undef VM_NEXT
+#undef VM__CHECK
+#undef VM__NEED
+#undef VM__ROOM
+
+// ------------------------------------------------------------------
+// SIMD abstraction used by the batch evaluator
+// Define DS_VM_NO_SIMD to force the scalar kernels.
+// ------------------------------------------------------------------
+#ifndef VM_BATCH_SIZE
+#define VM_BATCH_SIZE 64
+#endif
+
+#ifndef VM_BATCH_STACK
+#define VM_BATCH_STACK 32
+#endif
+
+#if !defined(DS_VM_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define VM_SIMD_WIDTH 8
+typedef __m256 vm__vf;
+typedef __m256i vm__vi;
+#define vm__vset1(x)      _mm256_set1_ps(x)
+#define vm__vload(p)      _mm256_loadu_ps(p)
+#define vm__vstore(p,v)   _mm256_storeu_ps(p,v)
+#define vm__vadd(a,b)     _mm256_add_ps(a,b)
+#define vm__vsub(a,b)     _mm256_sub_ps(a,b)
+#define vm__vmul(a,b)     _mm256_mul_ps(a,b)
+#define vm__vdiv(a,b)     _mm256_div_ps(a,b)
+#define vm__vmax(a,b)     _mm256_max_ps(a,b)
+#define vm__vmin(a,b)     _mm256_min_ps(a,b)
+#define vm__vand(a,b)     _mm256_and_ps(a,b)
+#define vm__vandnot(a,b)  _mm256_andnot_ps(a,b)
+#define vm__vor(a,b)      _mm256_or_ps(a,b)
+#define vm__vxor(a,b)     _mm256_xor_ps(a,b)
+#define vm__vcmplt(a,b)   _mm256_cmp_ps(a,b,_CMP_LT_OQ)
+#define vm__vcmpgt(a,b)   _mm256_cmp_ps(a,b,_CMP_GT_OQ)
+#define vm__vcmple(a,b)   _mm256_cmp_ps(a,b,_CMP_LE_OQ)
+#define vm__vcmpeq(a,b)   _mm256_cmp_ps(a,b,_CMP_EQ_OQ)
+#define vm__vcmpneq(a,b)  _mm256_cmp_ps(a,b,_CMP_NEQ_UQ)
+#define vm__vmovemask(a)  _mm256_movemask_ps(a)
+#define vm__vtoi(a)       _mm256_cvttps_epi32(a)
+#define vm__vtof(a)       _mm256_cvtepi32_ps(a)
+#define vm__vasf(a)       _mm256_castsi256_ps(a)
+#define vm__vasi(a)       _mm256_castps_si256(a)
+#define vm__viset1(x)     _mm256_set1_epi32(x)
+#define vm__viadd(a,b)    _mm256_add_epi32(a,b)
+#define vm__visub(a,b)    _mm256_sub_epi32(a,b)
+#define vm__viand(a,b)    _mm256_and_si256(a,b)
+#define vm__viandnot(a,b) _mm256_andnot_si256(a,b)
+#define vm__vicmpeq(a,b)  _mm256_cmpeq_epi32(a,b)
+#define vm__visll(a,n)    _mm256_slli_epi32(a,n)
+#define vm__visrl(a,n)    _mm256_srli_epi32(a,n)
+#define VM_SIMD_ALL       0xFF
+#elif !defined(DS_VM_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define VM_SIMD_WIDTH 4
+typedef __m128 vm__vf;
+typedef __m128i vm__vi;
+#define vm__vset1(x)      _mm_set1_ps(x)
+#define vm__vload(p)      _mm_loadu_ps(p)
+#define vm__vstore(p,v)   _mm_storeu_ps(p,v)
+#define vm__vadd(a,b)     _mm_add_ps(a,b)
+#define vm__vsub(a,b)     _mm_sub_ps(a,b)
+#define vm__vmul(a,b)     _mm_mul_ps(a,b)
+#define vm__vdiv(a,b)     _mm_div_ps(a,b)
+#define vm__vmax(a,b)     _mm_max_ps(a,b)
+#define vm__vmin(a,b)     _mm_min_ps(a,b)
+#define vm__vand(a,b)     _mm_and_ps(a,b)
+#define vm__vandnot(a,b)  _mm_andnot_ps(a,b)
+#define vm__vor(a,b)      _mm_or_ps(a,b)
+#define vm__vxor(a,b)     _mm_xor_ps(a,b)
+#define vm__vcmplt(a,b)   _mm_cmplt_ps(a,b)
+#define vm__vcmpgt(a,b)   _mm_cmpgt_ps(a,b)
+#define vm__vcmple(a,b)   _mm_cmple_ps(a,b)
+#define vm__vcmpeq(a,b)   _mm_cmpeq_ps(a,b)
+#define vm__vcmpneq(a,b)  _mm_cmpneq_ps(a,b)
+#define vm__vmovemask(a)  _mm_movemask_ps(a)
+#define vm__vtoi(a)       _mm_cvttps_epi32(a)
+#define vm__vtof(a)       _mm_cvtepi32_ps(a)
+#define vm__vasf(a)       _mm_castsi128_ps(a)
+#define vm__vasi(a)       _mm_castps_si128(a)
+#define vm__viset1(x)     _mm_set1_epi32(x)
+#define vm__viadd(a,b)    _mm_add_epi32(a,b)
+#define vm__visub(a,b)    _mm_sub_epi32(a,b)
+#define vm__viand(a,b)    _mm_and_si128(a,b)
+#define vm__viandnot(a,b) _mm_andnot_si128(a,b)
+#define vm__vicmpeq(a,b)  _mm_cmpeq_epi32(a,b)
+#define vm__visll(a,n)    _mm_slli_epi32(a,n)
+#define vm__visrl(a,n)    _mm_srli_epi32(a,n)
+#define VM_SIMD_ALL       0xF
+#else
+#define VM_SIMD_WIDTH 1
+#endif
+
+#if VM_SIMD_WIDTH > 1
+
+#define vm__vsel(m,a,b) vm__vor(vm__vand(m,a), vm__vandnot(m,b))
+
+// ------------------------------------------------------------------
+// vectorized sin/cos (Cephes single precision polynomials)
+// valid for |x| <= 8192, the caller patches all other lanes
+// ------------------------------------------------------------------
+static void vm__vsincos(vm__vf x, vm__vf* s, vm__vf* c) {
+	vm__vf sign_mask = vm__vset1(-0.0f);
+	vm__vf sign_sin = vm__vand(x, sign_mask);
+	x = vm__vandnot(sign_mask, x);
+	vm__vi j = vm__vtoi(vm__vmul(x, vm__vset1(1.27323954473516f)));
+	j = vm__viadd(j, vm__viset1(1));
+	j = vm__viand(j, vm__viset1(~1));
+	vm__vf y = vm__vtof(j);
+	vm__vf swap_sin = vm__vasf(vm__visll(vm__viand(j, vm__viset1(4)), 29));
+	vm__vf sign_cos = vm__vasf(vm__visll(vm__viandnot(vm__visub(j, vm__viset1(2)), vm__viset1(4)), 29));
+	vm__vf poly_mask = vm__vasf(vm__vicmpeq(vm__viand(j, vm__viset1(2)), vm__viset1(0)));
+	sign_sin = vm__vxor(sign_sin, swap_sin);
+	x = vm__vadd(x, vm__vmul(y, vm__vset1(-0.78515625f)));
+	x = vm__vadd(x, vm__vmul(y, vm__vset1(-2.4187564849853515625e-4f)));
+	x = vm__vadd(x, vm__vmul(y, vm__vset1(-3.77489497744594108e-8f)));
+	vm__vf z = vm__vmul(x, x);
+	vm__vf yc = vm__vset1(2.443315711809948E-005f);
+	yc = vm__vadd(vm__vmul(yc, z), vm__vset1(-1.388731625493765E-003f));
+	yc = vm__vadd(vm__vmul(yc, z), vm__vset1(4.166664568298827E-002f));
+	yc = vm__vmul(vm__vmul(yc, z), z);
+	yc = vm__vsub(yc, vm__vmul(z, vm__vset1(0.5f)));
+	yc = vm__vadd(yc, vm__vset1(1.0f));
+	vm__vf ys = vm__vset1(-1.9515295891E-4f);
+	ys = vm__vadd(vm__vmul(ys, z), vm__vset1(8.3321608736E-3f));
+	ys = vm__vadd(vm__vmul(ys, z), vm__vset1(-1.6666654611E-1f));
+	ys = vm__vadd(vm__vmul(vm__vmul(ys, z), x), x);
+	*s = vm__vxor(vm__vsel(poly_mask, ys, yc), sign_sin);
+	*c = vm__vxor(vm__vsel(poly_mask, yc, ys), sign_cos);
+}
+
+// ------------------------------------------------------------------
+// vectorized natural logarithm for positive normal inputs
+// ------------------------------------------------------------------
+static vm__vf vm__vlog(vm__vf x) {
+	vm__vi e = vm__visub(vm__visrl(vm__vasi(x), 23), vm__viset1(0x7f));
+	x = vm__vand(x, vm__vasf(vm__viset1(~0x7f800000)));
+	x = vm__vor(x, vm__vset1(0.5f));
+	vm__vf fe = vm__vadd(vm__vtof(e), vm__vset1(1.0f));
+	vm__vf mask = vm__vcmplt(x, vm__vset1(0.707106781186547524f));
+	vm__vf tmp = vm__vand(x, mask);
+	x = vm__vsub(x, vm__vset1(1.0f));
+	fe = vm__vsub(fe, vm__vand(vm__vset1(1.0f), mask));
+	x = vm__vadd(x, tmp);
+	vm__vf z = vm__vmul(x, x);
+	vm__vf y = vm__vset1(7.0376836292E-2f);
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(-1.1514610310E-1f));
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(1.1676998740E-1f));
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(-1.2420140846E-1f));
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(1.4249322787E-1f));
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(-1.6668057665E-1f));
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(2.0000714765E-1f));
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(-2.4999993993E-1f));
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(3.3333331174E-1f));
+	y = vm__vmul(vm__vmul(y, x), z);
+	y = vm__vadd(y, vm__vmul(fe, vm__vset1(-2.12194440e-4f)));
+	y = vm__vsub(y, vm__vmul(z, vm__vset1(0.5f)));
+	x = vm__vadd(x, y);
+	return vm__vadd(x, vm__vmul(fe, vm__vset1(0.693359375f)));
+}
+
+// ------------------------------------------------------------------
+// vectorized exp for inputs inside [-87,88]
+// ------------------------------------------------------------------
+static vm__vf vm__vexp(vm__vf x) {
+	vm__vf one = vm__vset1(1.0f);
+	vm__vf fx = vm__vadd(vm__vmul(x, vm__vset1(1.44269504088896341f)), vm__vset1(0.5f));
+	vm__vf t = vm__vtof(vm__vtoi(fx));
+	fx = vm__vsub(t, vm__vand(vm__vcmpgt(t, fx), one));
+	x = vm__vsub(x, vm__vmul(fx, vm__vset1(0.693359375f)));
+	x = vm__vsub(x, vm__vmul(fx, vm__vset1(-2.12194440e-4f)));
+	vm__vf z = vm__vmul(x, x);
+	vm__vf y = vm__vset1(1.9875691500E-4f);
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(1.3981999507E-3f));
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(8.3334519073E-3f));
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(4.1665795894E-2f));
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(1.6666665459E-1f));
+	y = vm__vadd(vm__vmul(y, x), vm__vset1(5.0000001201E-1f));
+	y = vm__vadd(vm__vadd(vm__vmul(y, z), x), one);
+	vm__vi n = vm__visll(vm__viadd(vm__vtoi(fx), vm__viset1(0x7f)), 23);
+	return vm__vmul(y, vm__vasf(n));
+}
+
+#endif
+
+// ------------------------------------------------------------------
+// batch kernels - every kernel works on one lane block and writes
+// the result into the first operand. The scalar versions use the
+// very same expressions as the stack functions above.
+// ------------------------------------------------------------------
+static void vm__batch_fill(float* a, float v, int n) {
+	for (int i = 0; i < n; ++i) {
+		a[i] = v;
+	}
+}
+
+#if VM_SIMD_WIDTH > 1
+#define VM_BATCH_BINARY(name, vop, sop) \
+	static void name(float* a, const float* b, int n) { \
+		for (int i = 0; i < n; i += VM_SIMD_WIDTH) { \
+			vm__vf x = vm__vload(a + i); \
+			vm__vf y = vm__vload(b + i); \
+			vm__vstore(a + i, vop(x, y)); \
+		} \
+	}
+#else
+#define VM_BATCH_BINARY(name, vop, sop) \
+	static void name(float* a, const float* b, int n) { \
+		for (int i = 0; i < n; ++i) { \
+			a[i] = a[i] sop b[i]; \
+		} \
+	}
+#endif
+
+VM_BATCH_BINARY(vm__batch_add, vm__vadd, +)
+VM_BATCH_BINARY(vm__batch_sub, vm__vsub, -)
+VM_BATCH_BINARY(vm__batch_mul, vm__vmul, *)
+VM_BATCH_BINARY(vm__batch_div, vm__vdiv, /)
+
+static void vm__batch_abs(float* a, int n) {
+#if VM_SIMD_WIDTH > 1
+	vm__vf sign_mask = vm__vset1(-0.0f);
+	for (int i = 0; i < n; i += VM_SIMD_WIDTH) {
+		vm__vstore(a + i, vm__vandnot(sign_mask, vm__vload(a + i)));
+	}
+#else
+	for (int i = 0; i < n; ++i) {
+		a[i] = fabsf(a[i]);
+	}
+#endif
+}
+
+static void vm__batch_neg(float* a, int n) {
+#if VM_SIMD_WIDTH > 1
+	vm__vf sign_mask = vm__vset1(-0.0f);
+	for (int i = 0; i < n; i += VM_SIMD_WIDTH) {
+		vm__vstore(a + i, vm__vxor(sign_mask, vm__vload(a + i)));
+	}
+#else
+	for (int i = 0; i < n; ++i) {
+		a[i] = -a[i];
+	}
+#endif
+}
+
+static void vm__batch_lerp(float* b, const float* a, const float* t, int n) {
+#if VM_SIMD_WIDTH > 1
+	vm__vf one = vm__vset1(1.0f);
+	for (int i = 0; i < n; i += VM_SIMD_WIDTH) {
+		vm__vf vt = vm__vload(t + i);
+		vm__vf r = vm__vadd(vm__vmul(vm__vsub(one, vt), vm__vload(b + i)), vm__vmul(vt, vm__vload(a + i)));
+		vm__vstore(b + i, r);
+	}
+#else
+	for (int i = 0; i < n; ++i) {
+		b[i] = (1.0f - t[i]) * b[i] + t[i] * a[i];
+	}
+#endif
+}
+
+// 0 = sin, 1 = cos, 2 = tan
+static void vm__batch_trig(float* a, int n, int mode) {
+#if VM_SIMD_WIDTH > 1
+	vm__vf limit = vm__vset1(8192.0f);
+	vm__vf sign_mask = vm__vset1(-0.0f);
+	for (int i = 0; i < n; i += VM_SIMD_WIDTH) {
+		vm__vf x = vm__vload(a + i);
+		vm__vf s, c;
+		vm__vsincos(x, &s, &c);
+		vm__vstore(a + i, mode == 0 ? s : (mode == 1 ? c : vm__vdiv(s, c)));
+		int valid = vm__vmovemask(vm__vcmple(vm__vandnot(sign_mask, x), limit));
+		if (valid != VM_SIMD_ALL) {
+			float tmp[VM_SIMD_WIDTH];
+			vm__vstore(tmp, x);
+			for (int l = 0; l < VM_SIMD_WIDTH; ++l) {
+				if (!(valid & (1 << l))) {
+					a[i + l] = mode == 0 ? sin(tmp[l]) : (mode == 1 ? cos(tmp[l]) : tan(tmp[l]));
+				}
+			}
+		}
+	}
+#else
+	for (int i = 0; i < n; ++i) {
+		a[i] = mode == 0 ? sin(a[i]) : (mode == 1 ? cos(a[i]) : tan(a[i]));
+	}
+#endif
+}
+
+static void vm__batch_exp(float* a, int n) {
+#if VM_SIMD_WIDTH > 1
+	for (int i = 0; i < n; i += VM_SIMD_WIDTH) {
+		vm__vf x = vm__vload(a + i);
+		vm__vf good = vm__vand(vm__vcmple(x, vm__vset1(88.0f)), vm__vcmple(vm__vset1(-87.0f), x));
+		vm__vstore(a + i, vm__vexp(vm__vand(good, x)));
+		int valid = vm__vmovemask(good);
+		if (valid != VM_SIMD_ALL) {
+			// NaN and out of range lanes
+			float tmp[VM_SIMD_WIDTH];
+			vm__vstore(tmp, x);
+			for (int l = 0; l < VM_SIMD_WIDTH; ++l) {
+				if (!(valid & (1 << l))) {
+					a[i + l] = exp(tmp[l]);
+				}
+			}
+		}
+	}
+#else
+	for (int i = 0; i < n; ++i) {
+		a[i] = exp(a[i]);
+	}
+#endif
+}
+
+static void vm__batch_pow(float* b, const float* a, int n) {
+#if VM_SIMD_WIDTH > 1
+	vm__vf min_norm = vm__vset1(1.17549435e-38f);
+	for (int i = 0; i < n; i += VM_SIMD_WIDTH) {
+		vm__vf x = vm__vload(b + i);
+		vm__vf y = vm__vload(a + i);
+		vm__vf t = vm__vmul(y, vm__vlog(vm__vmax(x, min_norm)));
+		vm__vf good = vm__vand(vm__vcmpgt(x, min_norm), vm__vcmplt(x, vm__vset1(3.40282347e+38f)));
+		good = vm__vand(good, vm__vcmple(t, vm__vset1(88.0f)));
+		good = vm__vand(good, vm__vcmple(vm__vset1(-87.0f), t));
+		vm__vstore(b + i, vm__vexp(vm__vand(good, t)));
+		int valid = vm__vmovemask(good);
+		if (valid != VM_SIMD_ALL) {
+			// zero, negative, non finite or out of range lanes
+			float xs[VM_SIMD_WIDTH];
+			float ys[VM_SIMD_WIDTH];
+			vm__vstore(xs, x);
+			vm__vstore(ys, y);
+			for (int l = 0; l < VM_SIMD_WIDTH; ++l) {
+				if (!(valid & (1 << l))) {
+					b[i + l] = pow(xs[l], ys[l]);
+				}
+			}
+		}
+	}
+#else
+	for (int i = 0; i < n; ++i) {
+		b[i] = pow(b[i], a[i]);
+	}
+#endif
+}
+
+// ------------------------------------------------------------------
+// comparisons, min, max, clamp, bool and select are branchless: the
+// comparisons create a mask which is combined with 1.0 or both values
+// ------------------------------------------------------------------
+static void vm__batch_compare(vm_token_type op, float* a, const float* b, int n) {
+#if VM_SIMD_WIDTH > 1
+	vm__vf one = vm__vset1(1.0f);
+	for (int i = 0; i < n; i += VM_SIMD_WIDTH) {
+		vm__vf x = vm__vload(a + i);
+		vm__vf y = vm__vload(b + i);
+		vm__vf m;
+		switch (op) {
+			case TOK_LT: m = vm__vcmplt(x, y); break;
+			case TOK_LE: m = vm__vcmple(x, y); break;
+			case TOK_GT: m = vm__vcmpgt(x, y); break;
+			case TOK_GE: m = vm__vcmple(y, x); break;
+			case TOK_EQ: m = vm__vcmpeq(x, y); break;
+			default: m = vm__vcmpneq(x, y); break;
+		}
+		vm__vstore(a + i, vm__vand(m, one));
+	}
+#else
+	for (int i = 0; i < n; ++i) {
+		int m;
+		switch (op) {
+			case TOK_LT: m = a[i] < b[i]; break;
+			case TOK_LE: m = a[i] <= b[i]; break;
+			case TOK_GT: m = a[i] > b[i]; break;
+			case TOK_GE: m = a[i] >= b[i]; break;
+			case TOK_EQ: m = a[i] == b[i]; break;
+			default: m = a[i] != b[i]; break;
+		}
+		a[i] = m ? 1.0f : 0.0f;
+	}
+#endif
+}
+
+static void vm__batch_min(float* a, const float* b, int n) {
+#if VM_SIMD_WIDTH > 1
+	for (int i = 0; i < n; i += VM_SIMD_WIDTH) {
+		vm__vstore(a + i, vm__vmin(vm__vload(a + i), vm__vload(b + i)));
+	}
+#else
+	for (int i = 0; i < n; ++i) {
+		a[i] = a[i] < b[i] ? a[i] : b[i];
+	}
+#endif
+}
+
+static void vm__batch_max(float* a, const float* b, int n) {
+#if VM_SIMD_WIDTH > 1
+	for (int i = 0; i < n; i += VM_SIMD_WIDTH) {
+		vm__vstore(a + i, vm__vmax(vm__vload(a + i), vm__vload(b + i)));
+	}
+#else
+	for (int i = 0; i < n; ++i) {
+		a[i] = a[i] > b[i] ? a[i] : b[i];
+	}
+#endif
+}
+
+static void vm__batch_bool(float* a, int n) {
+#if VM_SIMD_WIDTH > 1
+	vm__vf zero = vm__vset1(0.0f);
+	vm__vf one = vm__vset1(1.0f);
+	for (int i = 0; i < n; i += VM_SIMD_WIDTH) {
+		vm__vstore(a + i, vm__vand(vm__vcmpneq(vm__vload(a + i), zero), one));
+	}
+#else
+	for (int i = 0; i < n; ++i) {
+		a[i] = a[i] != 0.0f ? 1.0f : 0.0f;
+	}
+#endif
+}
+
+static void vm__batch_select(float* c, const float* a, const float* b, int n) {
+#if VM_SIMD_WIDTH > 1
+	vm__vf zero = vm__vset1(0.0f);
+	for (int i = 0; i < n; i += VM_SIMD_WIDTH) {
+		vm__vf m = vm__vcmpneq(vm__vload(c + i), zero);
+		vm__vstore(c + i, vm__vsel(m, vm__vload(a + i), vm__vload(b + i)));
+	}
+#else
+	for (int i = 0; i < n; ++i) {
+		c[i] = c[i] != 0.0f ? a[i] : b[i];
+	}
+#endif
+}
+
+// ------------------------------------------------------------------
+// internal method to combine the branches of a conditional at its
+// target: SELECT for a ternary, MIN for && and MAX for || (the first
+// value already is 0 or 1). Returns the new stack size or -1.
+// ------------------------------------------------------------------
+static int vm__batch_merge(vm_token_type op, float (*lanes)[VM_BATCH_SIZE], int size, int w) {
+	if (op == TOK_SELECT) {
+		if (size < 3) {
+			return -1;
+		}
+		vm__batch_select(lanes[size - 3], lanes[size - 2], lanes[size - 1], w);
+		return size - 2;
+	}
+	if (size < 2) {
+		return -1;
+	}
+	vm__batch_bool(lanes[size - 1], w);
+	if (op == TOK_MIN) {
+		vm__batch_min(lanes[size - 2], lanes[size - 1], w);
+	}
+	else {
+		vm__batch_max(lanes[size - 2], lanes[size - 1], w);
+	}
+	return size - 1;
+}
+
+// ------------------------------------------------------------------
+// internal method to run a typed function on the top lanes. The
+// array variant is called once, otherwise the function is called
+// directly for every value.
+// ------------------------------------------------------------------
+static void vm__batch_native(const vm_function* f, float (*lanes)[VM_BATCH_SIZE], int size, int n) {
+	int k = f->num_parameters;
+	float* first = lanes[size - k];
+	if (f->array) {
+		const float* args[VM_BATCH_STACK];
+		float out[VM_BATCH_SIZE];
+		for (int i = 0; i < k; ++i) {
+			args[i] = lanes[size - k + i];
+		}
+		f->array(args, out, n);
+		memcpy(first, out, n * sizeof(float));
+		return;
+	}
+	const float* b = lanes[size - k + (k > 1)];
+	const float* c = lanes[size - k + (k > 2) * 2];
+	const float* d = lanes[size - 1];
+	switch (k) {
+		case 1: for (int l = 0; l < n; ++l) first[l] = f->native.f1(first[l]); break;
+		case 2: for (int l = 0; l < n; ++l) first[l] = f->native.f2(first[l], b[l]); break;
+		case 3: for (int l = 0; l < n; ++l) first[l] = f->native.f3(first[l], b[l], c[l]); break;
+		default: for (int l = 0; l < n; ++l) first[l] = f->native.f4(first[l], b[l], c[l], d[l]); break;
+	}
+}
+
+// ------------------------------------------------------------------
+// internal method to run a user function once per lane
+// returns the new stack size or -1 if the lanes disagree
+// ------------------------------------------------------------------
+static int vm__batch_call(vmFunction func, float (*lanes)[VM_BATCH_SIZE], int size, int n) {
+	float data[VM_BATCH_STACK];
+	int result = -1;
+	for (int l = 0; l < n; ++l) {
+		vm_stack stack = { data, size, VM_BATCH_STACK };
+		for (int s = 0; s < size; ++s) {
+			data[s] = lanes[s][l];
+		}
+		(func)(&stack);
+		if (result != -1 && result != stack.size) {
+			return -1;
+		}
+		result = stack.size;
+		for (int s = 0; s < stack.size; ++s) {
+			lanes[s][l] = data[s];
+		}
+	}
+	return result;
+}
+
+// ------------------------------------------------------------------
+// internal method to apply a binary arithmetic opcode to two lanes
+// ------------------------------------------------------------------
+static void vm__batch_arithmetic(vm_token_type op, float* a, const float* b, int w) {
+	switch (op) {
+		case TOK_ADD: vm__batch_add(a, b, w); break;
+		case TOK_SUB: vm__batch_sub(a, b, w); break;
+		case TOK_MUL: vm__batch_mul(a, b, w); break;
+		default: vm__batch_div(a, b, w); break;
+	}
+}
+
+// ------------------------------------------------------------------
+// internal method to apply a binary arithmetic opcode with a constant
+// second operand to a lane
+// ------------------------------------------------------------------
+static void vm__batch_arithmetic_const(vm_token_type op, float* a, float value, int w) {
+#if VM_SIMD_WIDTH > 1
+	vm__vf y = vm__vset1(value);
+	for (int i = 0; i < w; i += VM_SIMD_WIDTH) {
+		vm__vf x = vm__vload(a + i);
+		switch (op) {
+			case TOK_ADD: x = vm__vadd(x, y); break;
+			case TOK_SUB: x = vm__vsub(x, y); break;
+			case TOK_MUL: x = vm__vmul(x, y); break;
+			default: x = vm__vdiv(x, y); break;
+		}
+		vm__vstore(a + i, x);
+	}
+#else
+	for (int i = 0; i < w; ++i) {
+		switch (op) {
+			case TOK_ADD: a[i] = a[i] + value; break;
+			case TOK_SUB: a[i] = a[i] - value; break;
+			case TOK_MUL: a[i] = a[i] * value; break;
+			default: a[i] = a[i] / value; break;
+		}
+	}
+#endif
+}
+
+// ------------------------------------------------------------------
+// internal method to load a variable for all lanes of a block
+// ------------------------------------------------------------------
+static void vm__batch_variable(const float* values, const float** columns, int id, float* lane, int base, int n, int w) {
+	const float* column = columns ? columns[id] : 0;
+	if (column) {
+		memcpy(lane, column + base, n * sizeof(float));
+		vm__batch_fill(lane + n, 0.0f, w - n);
+	}
+	else {
+		vm__batch_fill(lane, values[id], w);
+	}
+}
+
+// ------------------------------------------------------------------
+// internal method to evaluate the n elements of one block starting
+// at base. functions and values belong to a context or to a
+// standalone program. top receives the lane holding the results.
+// Conditionals do not branch: both sides are evaluated for all lanes
+// and combined at the target of the jumps (see vm__batch_merge).
+// ------------------------------------------------------------------
+static int vm__batch_block(const vm_function* functions, const float* values, const vm_token* byteCode, int capacity, const float** columns, int base, int n, float (*lanes)[VM_BATCH_SIZE], int* top) {
+	// the open conditionals, the innermost target on top
+	int targets[VM_BATCH_STACK];
+	vm_token_type merges[VM_BATCH_STACK];
+	// the kernels always work on complete SIMD registers
+	int w = (n + VM_SIMD_WIDTH - 1) / VM_SIMD_WIDTH * VM_SIMD_WIDTH;
+	int size = 0;
+	int num_targets = 0;
+	for (int i = 0; i <= capacity; ++i) {
+		while (num_targets > 0 && targets[num_targets - 1] == i) {
+			size = vm__batch_merge(merges[--num_targets], lanes, size, w);
+			if (size < 0) {
+				return 2;
+			}
+		}
+		if (num_targets > 0 && targets[num_targets - 1] < i) {
+			return 18;
+		}
+		if (i == capacity) {
+			break;
+		}
+		const vm_token* t = &byteCode[i];
+		vm_token_type op = t->type;
+		if (op == TOK_FUNCTION && functions[t->id].opcode != TOK_FUNCTION) {
+			op = functions[t->id].opcode;
+		}
+		// the SIMD kernels serve all precision modes
+		op = vm__exact_opcode(op);
+		switch (op) {
+			case TOK_NUMBER:
+				if (size == VM_BATCH_STACK) {
+					return 3;
+				}
+				vm__batch_fill(lanes[size++], t->value, w);
+				break;
+			case TOK_VARIABLE:
+				if (size == VM_BATCH_STACK) {
+					return 3;
+				}
+				vm__batch_variable(values, columns, t->id, lanes[size++], base, n, w);
+				break;
+			case TOK_ADD: case TOK_SUB: case TOK_MUL: case TOK_DIV: case TOK_POW:
+				if (size < 2) {
+					return 2;
+				}
+				if (op == TOK_POW) {
+					vm__batch_pow(lanes[size - 2], lanes[size - 1], w);
+				}
+				else {
+					vm__batch_arithmetic(op, lanes[size - 2], lanes[size - 1], w);
+				}
+				--size;
+				break;
+			case TOK_NEG: case TOK_ABS: case TOK_SIN: case TOK_COS: case TOK_TAN: case TOK_EXP:
+				if (size < 1) {
+					return 2;
+				}
+				if (op == TOK_NEG) {
+					vm__batch_neg(lanes[size - 1], w);
+				}
+				else if (op == TOK_ABS) {
+					vm__batch_abs(lanes[size - 1], w);
+				}
+				else if (op == TOK_EXP) {
+					vm__batch_exp(lanes[size - 1], w);
+				}
+				else {
+					vm__batch_trig(lanes[size - 1], w, op - TOK_SIN);
+				}
+				break;
+			case TOK_LERP:
+				if (size < 3) {
+					return 2;
+				}
+				vm__batch_lerp(lanes[size - 3], lanes[size - 2], lanes[size - 1], w);
+				size -= 2;
+				break;
+			case TOK_DUP:
+				if (size < 1) {
+					return 2;
+				}
+				if (size == VM_BATCH_STACK) {
+					return 3;
+				}
+				memcpy(lanes[size], lanes[size - 1], w * sizeof(float));
+				++size;
+				break;
+			case TOK_ADD_CONST: case TOK_SUB_CONST: case TOK_MUL_CONST: case TOK_DIV_CONST:
+				if (size < 1) {
+					return 2;
+				}
+				vm__batch_arithmetic_const((vm_token_type)(TOK_ADD + (op - TOK_ADD_CONST)), lanes[size - 1], t->value, w);
+				break;
+			case TOK_VAR_ADD_CONST: case TOK_VAR_SUB_CONST: case TOK_VAR_MUL_CONST: case TOK_VAR_DIV_CONST:
+				if (size == VM_BATCH_STACK) {
+					return 3;
+				}
+				vm__batch_variable(values, columns, t->id, lanes[size], base, n, w);
+				vm__batch_arithmetic_const((vm_token_type)(TOK_ADD + (op - TOK_VAR_ADD_CONST)), lanes[size], byteCode[++i].value, w);
+				++size;
+				break;
+			case TOK_STORE: case TOK_LOAD: case TOK_OUTPUT:
+				// multi output programs are not supported
+				return 9;
+			case TOK_LT: case TOK_LE: case TOK_GT: case TOK_GE: case TOK_EQ: case TOK_NE: case TOK_MIN: case TOK_MAX:
+				if (size < 2) {
+					return 2;
+				}
+				if (op == TOK_MIN) {
+					vm__batch_min(lanes[size - 2], lanes[size - 1], w);
+				}
+				else if (op == TOK_MAX) {
+					vm__batch_max(lanes[size - 2], lanes[size - 1], w);
+				}
+				else {
+					vm__batch_compare(op, lanes[size - 2], lanes[size - 1], w);
+				}
+				--size;
+				break;
+			case TOK_CLAMP: case TOK_SELECT:
+				if (size < 3) {
+					return 2;
+				}
+				if (op == TOK_CLAMP) {
+					vm__batch_max(lanes[size - 3], lanes[size - 2], w);
+					vm__batch_min(lanes[size - 3], lanes[size - 1], w);
+				}
+				else {
+					vm__batch_select(lanes[size - 3], lanes[size - 2], lanes[size - 1], w);
+				}
+				size -= 2;
+				break;
+			case TOK_BOOL:
+				if (size < 1) {
+					return 2;
+				}
+				vm__batch_bool(lanes[size - 1], w);
+				break;
+			case TOK_JUMP: case TOK_JUMP_IF_FALSE: case TOK_AND_JUMP: case TOK_OR_JUMP:
+				if (t->id <= 0 || t->id > capacity - i || (num_targets > 0 && i + t->id > targets[num_targets - 1]) || num_targets == VM_BATCH_STACK) {
+					return 18;
+				}
+				if (size < 1) {
+					return 2;
+				}
+				// the condition of a ternary stays on the stack until the else branch is done
+				if (op == TOK_JUMP) {
+					targets[num_targets] = i + t->id;
+					merges[num_targets++] = TOK_SELECT;
+				}
+				else if (op != TOK_JUMP_IF_FALSE) {
+					vm__batch_bool(lanes[size - 1], w);
+					targets[num_targets] = i + t->id;
+					merges[num_targets++] = op == TOK_AND_JUMP ? TOK_MIN : TOK_MAX;
+				}
+				break;
+			case TOK_FUNCTION: {
+				const vm_function* f = &functions[t->id];
+				if (size < f->num_parameters) {
+					return 2;
+				}
+				if (!f->function || f->array) {
+					if (f->num_parameters == 0 && size == VM_BATCH_STACK) {
+						return 3;
+					}
+					vm__batch_native(f, lanes, size, n);
+					size -= f->num_parameters - 1;
+					break;
+				}
+				size = vm__batch_call(f->function, lanes, size, n);
+				if (size < 0) {
+					return 2;
+				}
+				break;
+			}
+			default:
+				break;
+		}
+	}
+	if (size == 0) {
+		return 1;
+	}
+	*top = size - 1;
+	return 0;
+}
+
+// ------------------------------------------------------------------
+// run the same bytecode over count elements. columns is indexed by
+// variable id and holds count values per variable. Variables with a
+// NULL column (or all variables if columns is NULL) use the current
+// value stored in the context.
+// ------------------------------------------------------------------
+DSDEF int vm_run_batch(vm_context* ctx, vm_token* byteCode, int capacity, const float** columns, float* results, int count) {
+	float lanes[VM_BATCH_STACK][VM_BATCH_SIZE];
+	for (int base = 0; base < count; base += VM_BATCH_SIZE) {
+		int n = count - base < VM_BATCH_SIZE ? count - base : VM_BATCH_SIZE;
+		int top = 0;
+		int code = vm__batch_block(ctx->functions, ctx->values, byteCode, capacity, columns, base, n, lanes, &top);
+		if (code != 0) {
+			return code;
+		}
+		memcpy(results + base, lanes[top], n * sizeof(float));
+	}
+	return 0;
+}
+
+// ------------------------------------------------------------------
+// Compile cache
+// Maps source text to compiled programs. The entries are kept in a
+// LRU list and evicted once the cache exceeds its memory limit.
+// Every program returned by vm_compile_cached is pinned until it is
+// released, pinned entries are never evicted. Clearing the cache
+// moves them to the detached list until they are released.
+// ------------------------------------------------------------------
+#ifndef VM_CACHE_BUCKETS
+#define VM_CACHE_BUCKETS 1024
+#endif
+
+#ifndef VM_CACHE_DEFAULT_LIMIT
+#define VM_CACHE_DEFAULT_LIMIT (1024 * 1024)
+#endif
+
+struct vm_cache_entry_t {
+	int hash;
+	int length;
+	int bytes;
+	// number of handles which are not released yet
+	int refs;
+	int detached;
+	const char* source;
+	vm_program program;
+	struct vm_cache_entry_t* next_in_bucket;
+	struct vm_cache_entry_t* prev;
+	struct vm_cache_entry_t* next;
+};
+
+typedef struct vm_cache_entry_t vm_cache_entry;
+
+struct vm_cache_t {
+	vm_cache_entry* buckets[VM_CACHE_BUCKETS];
+	vm_cache_entry* head;
+	vm_cache_entry* tail;
+	// entries removed by vm__clear_cache which are still pinned
+	vm_cache_entry* detached;
+	int max_bytes;
+	vm_cache_stats stats;
+};
+
+typedef struct vm_cache_t vm_cache;
+
+static vm_cache* vm__get_cache(vm_context* ctx) {
+	if (!ctx->cache) {
+		vm_cache* cache = (vm_cache*)VM_MALLOC(sizeof(vm_cache));
+		memset(cache, 0, sizeof(vm_cache));
+		cache->max_bytes = VM_CACHE_DEFAULT_LIMIT;
+		ctx->cache = cache;
+	}
+	return ctx->cache;
+}
+
+// ------------------------------------------------------------------
+// internal method to unlink an entry from the LRU list
+// ------------------------------------------------------------------
+static void vm__cache_unlink(vm_cache* cache, vm_cache_entry* e) {
+	if (e->prev) e->prev->next = e->next; else cache->head = e->next;
+	if (e->next) e->next->prev = e->prev; else cache->tail = e->prev;
+	e->prev = 0;
+	e->next = 0;
+}
+
+// ------------------------------------------------------------------
+// internal method to make an entry the most recently used one
+// ------------------------------------------------------------------
+static void vm__cache_push_front(vm_cache* cache, vm_cache_entry* e) {
+	e->prev = 0;
+	e->next = cache->head;
+	if (cache->head) cache->head->prev = e; else cache->tail = e;
+	cache->head = e;
+}
+
+// ------------------------------------------------------------------
+// internal method to remove an entry from the lookup and the LRU
+// list. Pinned entries move to the detached list, all others are
+// freed.
+// ------------------------------------------------------------------
+static void vm__cache_remove(vm_cache* cache, vm_cache_entry* e) {
+	vm_cache_entry** link = &cache->buckets[(unsigned int)e->hash % VM_CACHE_BUCKETS];
+	while (*link != e) {
+		link = &(*link)->next_in_bucket;
+	}
+	*link = e->next_in_bucket;
+	vm__cache_unlink(cache, e);
+	cache->stats.bytes -= e->bytes;
+	--cache->stats.num_entries;
+	if (e->refs > 0) {
+		e->detached = 1;
+		e->next = cache->detached;
+		if (cache->detached) cache->detached->prev = e;
+		cache->detached = e;
+	}
+	else {
+		VM_FREE(e);
+	}
+}
+
+// ------------------------------------------------------------------
+// internal method to evict the least recently used entries which
+// are not pinned until the cache fits into its limit
+// ------------------------------------------------------------------
+static void vm__cache_trim(vm_cache* cache) {
+	vm_cache_entry* e = cache->tail;
+	while (e && cache->stats.bytes > cache->max_bytes) {
+		vm_cache_entry* prev = e->prev;
+		if (e->refs == 0) {
+			++cache->stats.evictions;
+			vm__cache_remove(cache, e);
+		}
+		e = prev;
+	}
+}
+
+// ------------------------------------------------------------------
+// internal method to remove all entries. If destroy is set the
+// detached entries are freed as well.
+// ------------------------------------------------------------------
+static void vm__clear_cache(vm_context* ctx, int destroy) {
+	vm_cache* cache = ctx->cache;
+	if (cache->stats.num_entries > 0) {
+		++cache->stats.invalidations;
+	}
+	while (cache->head) {
+		vm__cache_remove(cache, cache->head);
+	}
+	while (destroy && cache->detached) {
+		vm_cache_entry* e = cache->detached;
+		cache->detached = e->next;
+		VM_FREE(e);
+	}
+}
+
+// ------------------------------------------------------------------
+// compile source or return the cached program. Every call pins the
+// program, it stays valid until it is passed to vm_release_cached
+// as often as it was returned or the context is destroyed.
+// Returns 0 if the source cannot be compiled.
+// ------------------------------------------------------------------
+DSDEF const vm_program* vm_compile_cached(vm_context* ctx, const char* source) {
+	vm_cache* cache = vm__get_cache(ctx);
+	int hash = vm__fnv1a(source);
+	int length = (int)strlen(source);
+	vm_cache_entry** bucket = &cache->buckets[(unsigned int)hash % VM_CACHE_BUCKETS];
+	for (vm_cache_entry* e = *bucket; e; e = e->next_in_bucket) {
+		if (e->hash == hash && e->length == length && memcmp(e->source, source, length) == 0) {
+			++cache->stats.hits;
+			++e->refs;
+			vm__cache_unlink(cache, e);
+			vm__cache_push_front(cache, e);
+			return &e->program;
+		}
+	}
+	++cache->stats.misses;
+	vm_token* tmp = (vm_token*)VM_MALLOC(vm__token_capacity(length) * sizeof(vm_token));
+	int num = vm_parse(ctx, source, tmp, vm__token_capacity(length));
+	if (num < 0) {
+		VM_FREE(tmp);
+		return 0;
+	}
+	int bytes = (int)(sizeof(vm_cache_entry) + num * sizeof(vm_token) + length + 1);
+	vm_cache_entry* e = (vm_cache_entry*)VM_MALLOC(bytes);
+	e->hash = hash;
+	e->length = length;
+	e->bytes = bytes;
+	e->refs = 1;
+	e->detached = 0;
+	memset(&e->program, 0, sizeof(vm_program));
+	e->program.tokens = (vm_token*)(e + 1);
+	e->program.num_tokens = num;
+	e->program.context = ctx;
+	vm__verify(tmp, num, ctx->functions, &e->program.max_stack);
+	memcpy(e->program.tokens, tmp, num * sizeof(vm_token));
+	char* copy = (char*)(e->program.tokens + num);
+	memcpy(copy, source, length + 1);
+	e->source = copy;
+	VM_FREE(tmp);
+	e->next_in_bucket = *bucket;
+	*bucket = e;
+	vm__cache_push_front(cache, e);
+	cache->stats.bytes += bytes;
+	++cache->stats.num_entries;
+	vm__cache_trim(cache);
+	return &e->program;
+}
+
+// ------------------------------------------------------------------
+// release a program returned by vm_compile_cached. Once all handles
+// are released the program can be evicted.
+// ------------------------------------------------------------------
+DSDEF void vm_release_cached(vm_context* ctx, const vm_program* program) {
+	vm_cache* cache = ctx->cache;
+	vm_cache_entry* e = (vm_cache_entry*)((char*)program - offsetof(vm_cache_entry, program));
+	if (--e->refs > 0) {
+		return;
+	}
+	if (e->detached) {
+		if (e->prev) e->prev->next = e->next; else cache->detached = e->next;
+		if (e->next) e->next->prev = e->prev;
+		VM_FREE(e);
+	}
+	else {
+		vm__cache_trim(cache);
+	}
+}
+
+// ------------------------------------------------------------------
+// run program
+// ------------------------------------------------------------------
+DSDEF int vm_run_program(vm_context* ctx, const vm_program* program, float* ret) {
+	if (program->max_stack == 0) {
+		return vm_run(ctx, program->tokens, program->num_tokens, ret);
+	}
+#ifdef DS_VM_PROFILE
+	unsigned long long start = vm__ticks();
+	int code = vm__execute_verified(program->tokens, program->num_tokens, ctx->values, ctx->functions, program->max_stack, ret, ctx->profile);
+	vm__profile_run(ctx->profile, program->tokens, program->num_tokens, vm__ticks() - start);
+	return code;
+#else
+	return vm__execute_verified(program->tokens, program->num_tokens, ctx->values, ctx->functions, program->max_stack, ret);
+#endif
+}
+
+// ------------------------------------------------------------------
+// set the memory limit of the compile cache in bytes
+// ------------------------------------------------------------------
+DSDEF void vm_set_cache_limit(vm_context* ctx, int max_bytes) {
+	vm_cache* cache = vm__get_cache(ctx);
+	cache->max_bytes = max_bytes;
+	vm__cache_trim(cache);
+}
+
+// ------------------------------------------------------------------
+// get the compile cache statistics
+// ------------------------------------------------------------------
+DSDEF void vm_get_cache_stats(vm_context* ctx, vm_cache_stats* stats) {
+	if (ctx->cache) {
+		*stats = ctx->cache->stats;
+	}
+	else {
+		memset(stats, 0, sizeof(vm_cache_stats));
+	}
+}
+
+// ------------------------------------------------------------------
+// Dependency graph
+// A named expression writes its result into the variable with the
+// same name, so other expressions can read it like any variable.
+// Changing a variable marks the expressions reading it as dirty.
+// vm_update runs the dirty expressions in topological order and
+// marks the readers of every result which has changed.
+// ------------------------------------------------------------------
+struct vm__expression_t {
+	int variable;
+	int dirty;
+	vm_token* tokens;
+	int num_tokens;
+	int* inputs;
+	int num_inputs;
+};
+
+typedef struct vm__expression_t vm__expression;
+
+struct vm_graph_t {
+	vm__expression* expressions;
+	int num_expressions;
+	int capacity;
+	// expressions in topological order
+	int* order;
+	// the readers of variable v are readers[first[v]] .. readers[first[v + 1] - 1]
+	int* first;
+	int* readers;
+	int num_variables;
+};
+
+typedef struct vm_graph_t vm_graph;
+
+static vm_graph* vm__get_graph(vm_context* ctx) {
+	if (!ctx->graph) {
+		vm_graph* graph = (vm_graph*)VM_MALLOC(sizeof(vm_graph));
+		memset(graph, 0, sizeof(vm_graph));
+		ctx->graph = graph;
+	}
+	return ctx->graph;
+}
+
+// ------------------------------------------------------------------
+// internal method to mark all readers of a variable as dirty
+// ------------------------------------------------------------------
+static void vm__graph_touch(vm_context* ctx, int id) {
+	vm_graph* graph = ctx->graph;
+	if (id >= graph->num_variables) {
+		return;
+	}
+	for (int i = graph->first[id]; i < graph->first[id + 1]; ++i) {
+		graph->expressions[graph->readers[i]].dirty = 1;
+	}
+}
+
+// ------------------------------------------------------------------
+// internal method to release the arrays built by vm__graph_rebuild
+// ------------------------------------------------------------------
+static void vm__graph_release(vm_graph* graph) {
+	if (graph->order) {
+		VM_FREE(graph->order);
+		VM_FREE(graph->first);
+		VM_FREE(graph->readers);
+	}
+	graph->order = 0;
+	graph->first = 0;
+	graph->readers = 0;
+	graph->num_variables = 0;
+}
+
+// ------------------------------------------------------------------
+// internal method to sort the expressions (Kahn's algorithm) and to
+// build the reader lists. Returns 0 if there is a cycle.
+// ------------------------------------------------------------------
+static int vm__graph_rebuild(vm_context* ctx) {
+	vm_graph* graph = ctx->graph;
+	vm__graph_release(graph);
+	int n = graph->num_expressions;
+	int nv = ctx->num_variables;
+	int* defined_by = (int*)VM_MALLOC((nv + 1) * sizeof(int));
+	int* pending = (int*)VM_MALLOC((n + 1) * sizeof(int));
+	graph->order = (int*)VM_MALLOC((n + 1) * sizeof(int));
+	graph->first = (int*)VM_MALLOC((nv + 1) * sizeof(int));
+	int num_edges = 0;
+	for (int i = 0; i < nv; ++i) {
+		defined_by[i] = -1;
+		graph->first[i] = 0;
+	}
+	for (int i = 0; i < n; ++i) {
+		defined_by[graph->expressions[i].variable] = i;
+		num_edges += graph->expressions[i].num_inputs;
+	}
+	// count the readers per variable and the pending inputs per expression
+	for (int i = 0; i < n; ++i) {
+		const vm__expression* e = &graph->expressions[i];
+		pending[i] = 0;
+		for (int j = 0; j < e->num_inputs; ++j) {
+			++graph->first[e->inputs[j]];
+			if (defined_by[e->inputs[j]] != -1) {
+				++pending[i];
+			}
+		}
+	}
+	int sum = 0;
+	for (int i = 0; i < nv; ++i) {
+		int c = graph->first[i];
+		graph->first[i] = sum;
+		sum += c;
+	}
+	graph->first[nv] = sum;
+	graph->readers = (int*)VM_MALLOC((num_edges + 1) * sizeof(int));
+	for (int i = 0; i < n; ++i) {
+		const vm__expression* e = &graph->expressions[i];
+		for (int j = 0; j < e->num_inputs; ++j) {
+			graph->readers[graph->first[e->inputs[j]]++] = i;
+		}
+	}
+	// first[v] now points to the end of the readers of v
+	for (int i = nv; i > 0; --i) {
+		graph->first[i] = graph->first[i - 1];
+	}
+	graph->first[0] = 0;
+	graph->num_variables = nv;
+	int num_sorted = 0;
+	for (int i = 0; i < n; ++i) {
+		if (pending[i] == 0) {
+			graph->order[num_sorted++] = i;
+		}
+	}
+	for (int k = 0; k < num_sorted; ++k) {
+		int v = graph->expressions[graph->order[k]].variable;
+		for (int i = graph->first[v]; i < graph->first[v + 1]; ++i) {
+			if (--pending[graph->readers[i]] == 0) {
+				graph->order[num_sorted++] = graph->readers[i];
+			}
+		}
+	}
+	VM_FREE(pending);
+	VM_FREE(defined_by);
+	return num_sorted == n;
+}
+
+// ------------------------------------------------------------------
+// internal method to free a graph
+// ------------------------------------------------------------------
+static void vm__destroy_graph(vm_context* ctx) {
+	vm_graph* graph = ctx->graph;
+	for (int i = 0; i < graph->num_expressions; ++i) {
+		VM_FREE(graph->expressions[i].tokens);
+		VM_FREE(graph->expressions[i].inputs);
+	}
+	if (graph->expressions) {
+		VM_FREE(graph->expressions);
+	}
+	vm__graph_release(graph);
+	VM_FREE(graph);
+	ctx->graph = 0;
+}
+
+// ------------------------------------------------------------------
+// internal method to set the expression of a variable without
+// sorting the graph. index is the position of the current expression
+// of the variable or -1. The graph owns tokens afterwards and the
+// replaced expression is stored in previous.
+// Returns the position of the expression.
+// ------------------------------------------------------------------
+static int vm__graph_set(vm_graph* graph, int index, int variable, vm_token* tokens, int num, vm__expression* previous) {
+	int* inputs = (int*)VM_MALLOC((num + 1) * sizeof(int));
+	int num_inputs = 0;
+	for (int i = 0; i < num; ++i) {
+		vm_token_type type = tokens[i].type;
+		if (type == TOK_VARIABLE || (type >= TOK_VAR_ADD_CONST && type <= TOK_VAR_DIV_CONST)) {
+			int j = 0;
+			while (j < num_inputs && inputs[j] != tokens[i].id) {
+				++j;
+			}
+			if (j == num_inputs) {
+				inputs[num_inputs++] = tokens[i].id;
+			}
+			if (type != TOK_VARIABLE) {
+				++i;
+			}
+		}
+	}
+	if (index == -1) {
+		if (graph->num_expressions == graph->capacity) {
+			graph->expressions = (vm__expression*)vm__grow(graph->expressions, graph->num_expressions, &graph->capacity, sizeof(vm__expression));
+		}
+		index = graph->num_expressions++;
+		memset(&graph->expressions[index], 0, sizeof(vm__expression));
+		graph->expressions[index].variable = variable;
+	}
+	vm__expression* e = &graph->expressions[index];
+	*previous = *e;
+	e->tokens = tokens;
+	e->num_tokens = num;
+	e->inputs = inputs;
+	e->num_inputs = num_inputs;
+	e->dirty = 1;
+	return index;
+}
+
+// ------------------------------------------------------------------
+// internal method to undo vm__graph_set. The tokens are left to the
+// caller. New expressions are always the last one when restored.
+// ------------------------------------------------------------------
+static void vm__graph_restore(vm_graph* graph, int index, const vm__expression* previous) {
+	VM_FREE(graph->expressions[index].inputs);
+	graph->expressions[index] = *previous;
+	if (!previous->tokens) {
+		--graph->num_expressions;
+	}
+}
+
+// ------------------------------------------------------------------
+// internal method to define the expression of a variable from parsed
+// tokens which are owned by the graph afterwards.
+// Returns the variable or -8 if there would be a cycle.
+// ------------------------------------------------------------------
+static int vm__define_tokens(vm_context* ctx, int variable, vm_token* tokens, int num) {
+	vm_graph* graph = vm__get_graph(ctx);
+	int index = 0;
+	while (index < graph->num_expressions && graph->expressions[index].variable != variable) {
+		++index;
+	}
+	vm__expression previous;
+	index = vm__graph_set(graph, index < graph->num_expressions ? index : -1, variable, tokens, num, &previous);
+	if (!vm__graph_rebuild(ctx)) {
+		vm__graph_restore(graph, index, &previous);
+		vm__graph_rebuild(ctx);
+		VM_FREE(tokens);
+		return -8;
+	}
+	if (previous.tokens) {
+		VM_FREE(previous.tokens);
+		VM_FREE(previous.inputs);
+	}
+	return variable;
+}
+
+// ------------------------------------------------------------------
+// define or replace a named expression. The result is stored in the
+// variable name by vm_update. Returns the handle of this variable
+// or a negative error code.
+// ------------------------------------------------------------------
+DSDEF int vm_define(vm_context* ctx, const char* name, const char* source) {
+	int length = (int)strlen(source);
+	vm_token* tokens = (vm_token*)VM_MALLOC(vm__token_capacity(length) * sizeof(vm_token));
+	int num = vm_parse(ctx, source, tokens, vm__token_capacity(length));
+	if (num < 0) {
+		VM_FREE(tokens);
+		return num;
+	}
+	int variable = vm__find_variable(name, (int)strlen(name), ctx);
+	if (variable == -1) {
+		variable = vm__add_variable(ctx, name, (int)strlen(name), 0.0f);
+	}
+	return vm__define_tokens(ctx, variable, tokens, num);
+}
+
+// ------------------------------------------------------------------
+// evaluate all named expressions whose inputs have changed. A failed
+// expression keeps its previous value. Returns the number of
+// evaluated expressions.
+// ------------------------------------------------------------------
+DSDEF int vm_update(vm_context* ctx) {
+	vm_graph* graph = ctx->graph;
+	if (!graph) {
+		return 0;
+	}
+	int count = 0;
+	for (int k = 0; k < graph->num_expressions; ++k) {
+		vm__expression* e = &graph->expressions[graph->order[k]];
+		if (!e->dirty) {
+			continue;
+		}
+		e->dirty = 0;
+		++count;
+		float r = 0.0f;
+		if (vm_run(ctx, e->tokens, e->num_tokens, &r) == 0 && memcmp(&r, &ctx->values[e->variable], sizeof(float)) != 0) {
+			ctx->values[e->variable] = r;
+			vm__graph_touch(ctx, e->variable);
+		}
+	}
+	return count;
+}
+
+// ------------------------------------------------------------------
+// Standalone programs
+// vm_compile resolves everything a program needs at compile time.
+// The program is never modified afterwards, so any number of
+// threads can run it at the same time with their own vm_env.
+// ------------------------------------------------------------------
+
+// ------------------------------------------------------------------
+// compile source into a standalone program. Variables of the
+// context become slots with the current value as default, unknown
+// identifiers become slots with the default 0. The context is not
+// modified. Returns 0 and stores the error code in error (if set)
+// if the source cannot be compiled.
+// ------------------------------------------------------------------
+DSDEF vm_program* vm_compile(vm_context* ctx, const char* source, int* error) {
+	int length = (int)strlen(source);
+	vm_token* tokens = (vm_token*)VM_MALLOC(vm__token_capacity(length) * sizeof(vm_token));
+	int size = vm_parse_scratch_size(source);
+	FunctionVMStackItem* scratch = (FunctionVMStackItem*)VM_MALLOC(size);
+	vm__slot_table slots = { 0, 0, 0 };
+	int num = vm__parse(ctx, source, tokens, vm__token_capacity(length), scratch, size / (int)sizeof(FunctionVMStackItem), 0, &slots, 0);
+	VM_FREE(scratch);
+	if (num < 0) {
+		VM_FREE(tokens);
+		if (slots.slots) {
+			VM_FREE(slots.slots);
+		}
+		if (error) {
+			*error = -num;
+		}
+		return 0;
+	}
+	vm_program* program = (vm_program*)VM_MALLOC(sizeof(vm_program));
+	memset(program, 0, sizeof(vm_program));
+	program->tokens = tokens;
+	program->num_tokens = num;
+	vm__verify(tokens, num, ctx->functions, &program->max_stack);
+	program->num_slots = slots.count;
+	if (slots.count > 0) {
+		program->slot_names = (const char**)VM_MALLOC(slots.count * sizeof(const char*));
+		program->slot_defaults = (float*)VM_MALLOC(slots.count * sizeof(float));
+		for (int i = 0; i < slots.count; ++i) {
+			program->slot_names[i] = vm__copy_name(slots.slots[i].name, slots.slots[i].length);
+			program->slot_defaults[i] = slots.slots[i].value;
+		}
+		VM_FREE(slots.slots);
+	}
+	// copy the called functions and renumber the calls
+	int capacity = 0;
+	for (int i = 0; i < num; ++i) {
+		vm_token* t = &tokens[i];
+		if (t->type >= TOK_VAR_ADD_CONST && t->type <= TOK_VAR_DIV_CONST) {
+			++i;
+		}
+		else if (t->type == TOK_FUNCTION) {
+			const vm_function* f = &ctx->functions[t->id];
+			int id = 0;
+			while (id < program->num_functions && (program->functions[id].function != f->function || memcmp(&program->functions[id].native, &f->native, sizeof(vm_native)) != 0 || program->functions[id].array != f->array || program->functions[id].num_parameters != f->num_parameters)) {
+				++id;
+			}
+			if (id == program->num_functions) {
+				if (program->num_functions == capacity) {
+					program->functions = (vm_function*)vm__grow(program->functions, program->num_functions, &capacity, sizeof(vm_function));
+				}
+				vm_function* copy = &program->functions[program->num_functions++];
+				*copy = *f;
+				copy->name = vm__copy_name(f->name, f->length);
+			}
+			t->id = id;
+		}
+	}
+	if (error) {
+		*error = 0;
+	}
+	return program;
+}
+
+// ------------------------------------------------------------------
+// get the slot of a variable or -1 if the program does not use it
+// ------------------------------------------------------------------
+DSDEF int vm_get_slot(const vm_program* program, const char* name) {
+	for (int i = 0; i < program->num_slots; ++i) {
+		if (strcmp(program->slot_names[i], name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// ------------------------------------------------------------------
+// destroy a program created by vm_compile
+// ------------------------------------------------------------------
+DSDEF void vm_destroy_program(vm_program* program) {
+	for (int i = 0; i < program->num_slots; ++i) {
+		VM_FREE((void*)program->slot_names[i]);
+	}
+	if (program->slot_names) {
+		VM_FREE((void*)program->slot_names);
+		VM_FREE(program->slot_defaults);
+	}
+	for (int i = 0; i < program->num_functions; ++i) {
+		VM_FREE((void*)program->functions[i].name);
+	}
+	if (program->functions) {
+		VM_FREE(program->functions);
+	}
+	VM_FREE(program->tokens);
+	VM_FREE(program);
+}
+
+// ------------------------------------------------------------------
+// create an environment holding the default slot values. The
+// values can also be provided by the caller by filling a vm_env.
+// ------------------------------------------------------------------
+DSDEF vm_env* vm_create_env(const vm_program* program) {
+	vm_env* env = (vm_env*)VM_MALLOC(sizeof(vm_env) + program->num_slots * sizeof(float));
+	env->values = (float*)(env + 1);
+	env->num_values = program->num_slots;
+	vm_reset_env(program, env);
+	return env;
+}
+
+// ------------------------------------------------------------------
+// reset all values to the defaults of the program
+// ------------------------------------------------------------------
+DSDEF void vm_reset_env(const vm_program* program, vm_env* env) {
+	if (program->num_slots > 0) {
+		memcpy(env->values, program->slot_defaults, program->num_slots * sizeof(float));
+	}
+}
+
+// ------------------------------------------------------------------
+// destroy an environment created by vm_create_env
+// ------------------------------------------------------------------
+DSDEF void vm_destroy_env(vm_env* env) {
+	VM_FREE(env);
+}
+
+// ------------------------------------------------------------------
+// run a standalone program. Neither program nor env are modified
+// so this can be called from any thread without locking.
+// ------------------------------------------------------------------
+DSDEF int vm_run_env(const vm_program* program, const vm_env* env, float* ret) {
+	if (program->context || env->num_values < program->num_slots) {
+		return 7;
+	}
+	if (program->max_stack > 0) {
+		return vm__execute_verified(program->tokens, program->num_tokens, env->values, program->functions, program->max_stack, ret VM__PROFILE_ARG(0));
+	}
+	return vm__execute(program->tokens, program->num_tokens, env->values, program->functions, ret, 0, 0 VM__PROFILE_ARG(0));
+}
+
+// ------------------------------------------------------------------
+// Program files
+// Standalone programs can be saved into a binary file and loaded
+// again without parsing. The file is mapped into memory and the
+// bytecode and the slot defaults are used in place. Functions are
+// stored by name and resolved in the context while loading.
+//
+// layout (all offsets in bytes from the start of the file):
+// header | program table | per program: tokens, slot names, slot
+// defaults, functions | strings
+// ------------------------------------------------------------------
+#define VM_FILE_VERSION 2
+
+struct vm__file_header_t {
+	char magic[4];
+	unsigned int version;
+	unsigned int endian;
+	unsigned int token_size;
+	unsigned int num_opcodes;
+	unsigned int num_programs;
+	unsigned int strings;
+	unsigned int strings_size;
+	unsigned int file_size;
+	unsigned int checksum;
+};
+
+typedef struct vm__file_header_t vm__file_header;
+
+// string offsets are relative to the strings, ~0 means no name
+struct vm__file_program_t {
+	unsigned int name;
+	unsigned int tokens;
+	unsigned int num_tokens;
+	unsigned int slots;
+	unsigned int num_slots;
+	unsigned int functions;
+	unsigned int num_functions;
+	unsigned int reserved;
+};
+
+typedef struct vm__file_program_t vm__file_program;
+
+struct vm__file_function_t {
+	unsigned int name;
+	int num_parameters;
+};
+
+typedef struct vm__file_function_t vm__file_function;
+
+struct vm_program_file_t {
+	void* data;
+	size_t size;
+	int num_programs;
+	vm_program* programs;
+	const char** names;
+	const char** slot_names;
+	vm_function* functions;
+};
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#define VM_FILE_MAPPING
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define VM_FILE_MAPPING
+#endif
+
+// ------------------------------------------------------------------
+// map a file into memory (or read it if there is no mapping on this
+// platform). An empty file sets data to 0 and size to 0.
+// Returns 0 or error 10 if the file cannot be read.
+// ------------------------------------------------------------------
+DSDEF int vm_map_file(const char* path, void** data, size_t* size) {
+	*data = 0;
+	*size = 0;
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE) {
+		return 10;
+	}
+	LARGE_INTEGER length;
+	int code = 10;
+	if (GetFileSizeEx(file, &length)) {
+		code = 0;
+		if (length.QuadPart > 0) {
+			HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+			if (mapping) {
+				*data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				CloseHandle(mapping);
+			}
+			code = *data ? 0 : 10;
+		}
+	}
+	CloseHandle(file);
+	if (code == 0) {
+		*size = (size_t)length.QuadPart;
+	}
+	return code;
+#elif defined(VM_FILE_MAPPING)
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 10;
+	}
+	struct stat st;
+	int code = 10;
+	if (fstat(fd, &st) == 0) {
+		code = 0;
+		if (st.st_size > 0) {
+			void* mapped = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			*data = mapped == MAP_FAILED ? 0 : mapped;
+			code = *data ? 0 : 10;
+		}
+	}
+	close(fd);
+	if (code == 0) {
+		*size = (size_t)st.st_size;
+	}
+	return code;
+#else
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		return 10;
+	}
+	fseek(f, 0, SEEK_END);
+	long length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	int code = length >= 0 ? 0 : 10;
+	if (length > 0) {
+		*data = VM_MALLOC(length);
+		if (fread(*data, 1, length, f) != (size_t)length) {
+			VM_FREE(*data);
+			*data = 0;
+			code = 10;
+		}
+	}
+	fclose(f);
+	if (code == 0) {
+		*size = (size_t)length;
+	}
+	return code;
+#endif
+}
+
+// ------------------------------------------------------------------
+// release a file mapped with vm_map_file
+// ------------------------------------------------------------------
+DSDEF void vm_unmap_file(void* data, size_t size) {
+	if (!data) {
+		return;
+	}
+#if defined(_WIN32)
+	(void)size;
+	UnmapViewOfFile(data);
+#elif defined(VM_FILE_MAPPING)
+	munmap(data, size);
+#else
+	(void)size;
+	VM_FREE(data);
+#endif
+}
+
+// ------------------------------------------------------------------
+// internal growing byte buffer used to build a file
+// ------------------------------------------------------------------
+struct vm__buffer_t {
+	char* data;
+	int size;
+	int capacity;
+};
+
+typedef struct vm__buffer_t vm__buffer;
+
+static unsigned int vm__buffer_append(vm__buffer* b, const void* data, int size) {
+	while (b->size + size > b->capacity) {
+		b->data = (char*)vm__grow(b->data, b->size, &b->capacity, 1);
+	}
+	unsigned int offset = (unsigned int)b->size;
+	if (data) {
+		memcpy(b->data + b->size, data, size);
+	}
+	else {
+		memset(b->data + b->size, 0, size);
+	}
+	b->size += size;
+	return offset;
+}
+
+static void vm__buffer_align(vm__buffer* b, int alignment) {
+	int padding = (alignment - b->size % alignment) % alignment;
+	vm__buffer_append(b, 0, padding);
+}
+
+// ------------------------------------------------------------------
+// save standalone programs (created by vm_compile) into a file.
+// names is optional and can be used to find the programs later.
+// Returns 0 or an error code.
+// ------------------------------------------------------------------
+DSDEF int vm_save_programs(const char* path, const vm_program** programs, const char** names, int count) {
+	for (int i = 0; i < count; ++i) {
+		if (programs[i]->context) {
+			return 7;
+		}
+	}
+	vm__buffer file = { 0, 0, 0 };
+	vm__buffer strings = { 0, 0, 0 };
+	vm__buffer_append(&file, 0, (int)(sizeof(vm__file_header) + count * sizeof(vm__file_program)));
+	for (int i = 0; i < count; ++i) {
+		const vm_program* p = programs[i];
+		vm__file_program entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.name = names && names[i] ? vm__buffer_append(&strings, names[i], (int)strlen(names[i]) + 1) : ~0u;
+		vm__buffer_align(&file, 8);
+		entry.tokens = vm__buffer_append(&file, p->tokens, p->num_tokens * (int)sizeof(vm_token));
+		entry.num_tokens = (unsigned int)p->num_tokens;
+		entry.slots = (unsigned int)file.size;
+		entry.num_slots = (unsigned int)p->num_slots;
+		for (int j = 0; j < p->num_slots; ++j) {
+			unsigned int name = vm__buffer_append(&strings, p->slot_names[j], (int)strlen(p->slot_names[j]) + 1);
+			vm__buffer_append(&file, &name, sizeof(name));
+		}
+		vm__buffer_append(&file, p->slot_defaults, p->num_slots * (int)sizeof(float));
+		entry.functions = (unsigned int)file.size;
+		entry.num_functions = (unsigned int)p->num_functions;
+		for (int j = 0; j < p->num_functions; ++j) {
+			vm__file_function f;
+			f.name = vm__buffer_append(&strings, p->functions[j].name, p->functions[j].length + 1);
+			f.num_parameters = p->functions[j].num_parameters;
+			vm__buffer_append(&file, &f, sizeof(f));
+		}
+		memcpy(file.data + sizeof(vm__file_header) + i * sizeof(vm__file_program), &entry, sizeof(entry));
+	}
+	vm__file_header header;
+	memcpy(header.magic, "DSVM", 4);
+	header.version = VM_FILE_VERSION;
+	header.endian = 0x01020304;
+	header.token_size = sizeof(vm_token);
+	header.num_opcodes = TOK_NUM_TYPES;
+	header.num_programs = (unsigned int)count;
+	header.strings = vm__buffer_append(&file, strings.data, strings.size);
+	header.strings_size = (unsigned int)strings.size;
+	header.file_size = (unsigned int)file.size;
+	header.checksum = (unsigned int)vm__fnv1a_len(file.data + sizeof(header), file.size - (int)sizeof(header));
+	memcpy(file.data, &header, sizeof(header));
+	int code = 10;
+	FILE* f = fopen(path, "wb");
+	if (f) {
+		code = fwrite(file.data, 1, file.size, f) == (size_t)file.size ? 0 : 10;
+		code = fclose(f) == 0 ? code : 10;
+	}
+	if (strings.data) {
+		VM_FREE(strings.data);
+	}
+	VM_FREE(file.data);
+	return code;
+}
+
+// ------------------------------------------------------------------
+// internal method to check that a range lies inside the file
+// ------------------------------------------------------------------
+static int vm__file_range(const vm__file_header* h, unsigned int offset, unsigned int count, unsigned int size) {
+	return offset <= h->file_size && count <= (h->file_size - offset) / size;
+}
+
+// ------------------------------------------------------------------
+// internal method to get a string of the file or 0 if it is invalid
+// ------------------------------------------------------------------
+static const char* vm__file_string(const char* data, const vm__file_header* h, unsigned int offset) {
+	if (offset >= h->strings_size) {
+		return 0;
+	}
+	const char* s = data + h->strings + offset;
+	if (!memchr(s, 0, h->strings_size - offset)) {
+		return 0;
+	}
+	return s;
+}
+
+// ------------------------------------------------------------------
+// internal method to validate the bytecode of a program
+// ------------------------------------------------------------------
+static int vm__file_check_tokens(const vm_token* tokens, int num, int num_slots, int num_functions) {
+	for (int i = 0; i < num; ++i) {
+		int type = (int)tokens[i].type;
+		if (type < 0 || type >= TOK_NUM_TYPES) {
+			return 0;
+		}
+		if (type == TOK_VARIABLE || (type >= TOK_VAR_ADD_CONST && type <= TOK_VAR_DIV_CONST)) {
+			if (tokens[i].id < 0 || tokens[i].id >= num_slots) {
+				return 0;
+			}
+			if (type != TOK_VARIABLE && ++i == num) {
+				return 0;
+			}
+		}
+		else if (type == TOK_FUNCTION && (tokens[i].id < 0 || tokens[i].id >= num_functions)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// ------------------------------------------------------------------
+// load a file written by vm_save_programs. The functions used by
+// the programs must be registered in ctx, variables need not be.
+// Returns 0 and stores the error code in error (if set) if the file
+// cannot be loaded.
+// ------------------------------------------------------------------
+DSDEF vm_program_file* vm_load_programs(vm_context* ctx, const char* path, int* error) {
+	size_t size = 0;
+	void* mapped = 0;
+	if (vm_map_file(path, &mapped, &size) != 0) {
+		if (error) {
+			*error = 10;
+		}
+		return 0;
+	}
+	char* data = (char*)mapped;
+	vm__file_header h;
+	int code = 11;
+	if (size >= sizeof(h)) {
+		memcpy(&h, data, sizeof(h));
+		if (memcmp(h.magic, "DSVM", 4) == 0 && h.version == VM_FILE_VERSION && h.endian == 0x01020304 && h.token_size == sizeof(vm_token)
+			&& h.num_opcodes == TOK_NUM_TYPES && h.file_size == size && vm__file_range(&h, sizeof(h), h.num_programs, sizeof(vm__file_program))
+			&& vm__file_range(&h, h.strings, h.strings_size, 1)
+			&& (unsigned int)vm__fnv1a_len(data + sizeof(h), (int)size - (int)sizeof(h)) == h.checksum) {
+			code = 0;
+		}
+	}
+	vm_program_file* file = 0;
+	if (code == 0) {
+		const vm__file_program* entries = (const vm__file_program*)(data + sizeof(h));
+		int num_slots = 0;
+		int num_functions = 0;
+		for (unsigned int i = 0; i < h.num_programs && code == 0; ++i) {
+			const vm__file_program* e = &entries[i];
+			if (e->tokens % 8 != 0 || e->slots % 4 != 0 || e->functions % 4 != 0
+				|| !vm__file_range(&h, e->tokens, e->num_tokens, sizeof(vm_token))
+				|| !vm__file_range(&h, e->slots, e->num_slots, sizeof(unsigned int) + sizeof(float))
+				|| !vm__file_range(&h, e->functions, e->num_functions, sizeof(vm__file_function))
+				|| !vm__file_check_tokens((const vm_token*)(data + e->tokens), (int)e->num_tokens, (int)e->num_slots, (int)e->num_functions)) {
+				code = 11;
+			}
+			num_slots += (int)e->num_slots;
+			num_functions += (int)e->num_functions;
+		}
+		if (code == 0) {
+			file = (vm_program_file*)VM_MALLOC(sizeof(vm_program_file));
+			file->data = data;
+			file->size = size;
+			file->num_programs = (int)h.num_programs;
+			file->programs = (vm_program*)VM_MALLOC((h.num_programs + 1) * sizeof(vm_program));
+			file->names = (const char**)VM_MALLOC((h.num_programs + 1) * sizeof(const char*));
+			file->slot_names = (const char**)VM_MALLOC((num_slots + 1) * sizeof(const char*));
+			file->functions = (vm_function*)VM_MALLOC((num_functions + 1) * sizeof(vm_function));
+			const char** slot_names = file->slot_names;
+			vm_function* functions = file->functions;
+			for (unsigned int i = 0; i < h.num_programs && code == 0; ++i) {
+				const vm__file_program* e = &entries[i];
+				vm_program* p = &file->programs[i];
+				memset(p, 0, sizeof(vm_program));
+				p->tokens = (vm_token*)(data + e->tokens);
+				p->num_tokens = (int)e->num_tokens;
+				p->num_slots = (int)e->num_slots;
+				p->slot_names = slot_names;
+				p->slot_defaults = (float*)(data + e->slots + e->num_slots * sizeof(unsigned int));
+				p->num_functions = (int)e->num_functions;
+				p->functions = functions;
+				file->names[i] = e->name == ~0u ? 0 : vm__file_string(data, &h, e->name);
+				if (e->name != ~0u && !file->names[i]) {
+					code = 11;
+				}
+				const unsigned int* names = (const unsigned int*)(data + e->slots);
+				for (unsigned int j = 0; j < e->num_slots && code == 0; ++j) {
+					*slot_names = vm__file_string(data, &h, names[j]);
+					code = *slot_names++ ? 0 : 11;
+				}
+				const vm__file_function* fe = (const vm__file_function*)(data + e->functions);
+				for (unsigned int j = 0; j < e->num_functions && code == 0; ++j) {
+					const char* name = vm__file_string(data, &h, fe[j].name);
+					int id = name ? vm__find_function(ctx, name, (int)strlen(name)) : -1;
+					if (!name) {
+						code = 11;
+					}
+					else if (id == -1) {
+						code = 5;
+					}
+					else if (ctx->functions[id].num_parameters != fe[j].num_parameters) {
+						code = 2;
+					}
+					else {
+						*functions = ctx->functions[id];
+						functions->name = name;
+						++functions;
+					}
+				}
+				if (code == 0 && vm__verify(p->tokens, p->num_tokens, p->functions, &p->max_stack) != 0) {
+					code = 11;
+				}
+			}
+			if (code != 0) {
+				VM_FREE(file->functions);
+				VM_FREE((void*)file->slot_names);
+				VM_FREE((void*)file->names);
+				VM_FREE(file->programs);
+				VM_FREE(file);
+				file = 0;
+			}
+		}
+	}
+	if (!file) {
+		vm_unmap_file(data, size);
+	}
+	if (error) {
+		*error = code;
+	}
+	return file;
+}
+
+// ------------------------------------------------------------------
+// number of programs in a file
+// ------------------------------------------------------------------
+DSDEF int vm_num_programs(const vm_program_file* file) {
+	return file->num_programs;
+}
+
+// ------------------------------------------------------------------
+// get a program of a file. The program stays valid until the file
+// is closed and must not be passed to vm_destroy_program.
+// ------------------------------------------------------------------
+DSDEF const vm_program* vm_get_program(const vm_program_file* file, int index) {
+	return &file->programs[index];
+}
+
+// ------------------------------------------------------------------
+// find a program by the name it was saved with or return -1
+// ------------------------------------------------------------------
+DSDEF int vm_find_program(const vm_program_file* file, const char* name) {
+	for (int i = 0; i < file->num_programs; ++i) {
+		if (file->names[i] && strcmp(file->names[i], name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// ------------------------------------------------------------------
+// release a file and all its programs
+// ------------------------------------------------------------------
+DSDEF void vm_close_programs(vm_program_file* file) {
+	vm_unmap_file(file->data, file->size);
+	VM_FREE(file->functions);
+	VM_FREE((void*)file->slot_names);
+	VM_FREE((void*)file->names);
+	VM_FREE(file->programs);
+	VM_FREE(file);
+}
+
+// ------------------------------------------------------------------
+// Lookup tables
+// A standalone program is sampled at size + 1 evenly spaced points
+// of one slot while all other slots keep their defaults. Cubic
+// tables use Catmull-Rom splines and store one extrapolated value
+// before and after the range. The table is checked between the
+// samples against the program and doubled in size until the error
+// bound is met or VM_LUT_MAX_SIZE is reached.
+// ------------------------------------------------------------------
+#ifndef VM_LUT_MAX_SIZE
+#define VM_LUT_MAX_SIZE 65536
+#endif
+
+// points checked inside every interval
+#define VM_LUT_CHECKS 7
+
+static inline float vm__lut_eval(const vm_lut* lut, float x) {
+	float t = (x - lut->min) * lut->scale;
+	// also catches NaN
+	if (!(t >= 0.0f)) {
+		t = 0.0f;
+	}
+	if (t > (float)lut->size) {
+		t = (float)lut->size;
+	}
+	int i = (int)t;
+	if (i == lut->size) {
+		--i;
+	}
+	float f = t - (float)i;
+	const float* v = lut->values + i;
+	if (lut->interpolation == VM_LUT_LINEAR) {
+		return v[0] + (v[1] - v[0]) * f;
+	}
+	return v[0] + 0.5f * f * (v[1] - v[-1] + f * (2.0f * v[-1] - 5.0f * v[0] + 4.0f * v[1] - v[2] + f * (3.0f * (v[0] - v[1]) + v[2] - v[-1])));
+}
+
+// ------------------------------------------------------------------
+// internal method to run the program for one value of the slot.
+// Returns 0 if the result is not finite.
+// ------------------------------------------------------------------
+static int vm__lut_sample(const vm_program* program, vm_env* env, int slot, float x, float* ret) {
+	env->values[slot] = x;
+	if (vm_run_env(program, env, ret) != 0) {
+		return 0;
+	}
+	// NaN and infinity
+	return *ret - *ret == 0.0f;
+}
+
+// ------------------------------------------------------------------
+// tabulate a standalone program over [min, max] of the variable so
+// that the error stays below max_error. Returns 0 and stores the
+// reason in error (if set) if the program cannot be tabulated:
+// 5 the program does not use the variable
+// 7 the program is bound to a context
+// 13 the expression is not smooth enough for the error bound
+// 14 the range is empty or the expression is not finite in it
+// ------------------------------------------------------------------
+DSDEF vm_lut* vm_create_lut(const vm_program* program, const char* variable, float min, float max, float max_error, int interpolation, int* error) {
+	int code = 0;
+	int slot = -1;
+	if (program->context) {
+		code = 7;
+	}
+	else if ((slot = vm_get_slot(program, variable)) == -1) {
+		code = 5;
+	}
+	else if (!(min < max) || (max - min) - (max - min) != 0.0f) {
+		code = 14;
+	}
+	vm_lut* lut = 0;
+	vm_env* env = code == 0 ? vm_create_env(program) : 0;
+	for (int size = 16; code == 0; size *= 2) {
+		lut = (vm_lut*)VM_MALLOC(sizeof(vm_lut) + (size + 3) * sizeof(float));
+		lut->min = min;
+		lut->max = max;
+		lut->scale = (float)size / (max - min);
+		lut->size = size;
+		lut->interpolation = interpolation;
+		lut->error = 0.0f;
+		lut->values = (float*)(lut + 1) + 1;
+		float step = (max - min) / (float)size;
+		for (int i = 0; i <= size && code == 0; ++i) {
+			float x = i == size ? max : min + step * (float)i;
+			if (!vm__lut_sample(program, env, slot, x, &lut->values[i])) {
+				code = 14;
+			}
+		}
+		if (code == 0) {
+			// quadratic extrapolation for the outer points of the splines
+			const float* v = lut->values;
+			lut->values[-1] = 3.0f * (v[0] - v[1]) + v[2];
+			lut->values[size + 1] = 3.0f * (v[size] - v[size - 1]) + v[size - 2];
+		}
+		for (int i = 0; i < size && code == 0; ++i) {
+			for (int j = 1; j <= VM_LUT_CHECKS; ++j) {
+				float x = min + step * ((float)i + (float)j / (VM_LUT_CHECKS + 1));
+				float expected = 0.0f;
+				if (!vm__lut_sample(program, env, slot, x, &expected)) {
+					code = 14;
+					break;
+				}
+				float e = fabsf(vm__lut_eval(lut, x) - expected);
+				if (e > lut->error) {
+					lut->error = e;
+				}
+			}
+		}
+		if (code == 0 && lut->error <= max_error) {
+			break;
+		}
+		if (code == 0 && size * 2 > VM_LUT_MAX_SIZE) {
+			code = 13;
+		}
+		VM_FREE(lut);
+		lut = 0;
+	}
+	if (env) {
+		vm_destroy_env(env);
+	}
+	if (error) {
+		*error = code;
+	}
+	return lut;
+}
+
+// ------------------------------------------------------------------
+// evaluate a lookup table. x is clamped to the range of the table.
+// ------------------------------------------------------------------
+DSDEF float vm_lut_eval(const vm_lut* lut, float x) {
+	return vm__lut_eval(lut, x);
+}
+
+// ------------------------------------------------------------------
+// evaluate a lookup table for count values
+// ------------------------------------------------------------------
+DSDEF void vm_lut_eval_batch(const vm_lut* lut, const float* x, float* results, int count) {
+	for (int i = 0; i < count; ++i) {
+		results[i] = vm__lut_eval(lut, x[i]);
+	}
+}
+
+// ------------------------------------------------------------------
+// destroy a lookup table
+// ------------------------------------------------------------------
+DSDEF void vm_destroy_lut(vm_lut* lut) {
+	VM_FREE(lut);
+}
+
+// ------------------------------------------------------------------
+// Parallel evaluation
+// Define DS_VM_THREADS to run vm_eval_many on a thread pool
+// (pthreads or Win32). Without it the pool has a single thread and
+// the jobs are evaluated by the calling thread.
+//
+// Every worker owns a range of jobs. It takes grain sized chunks
+// from the front of its own range and once that is empty it steals
+// the back half of the range of another worker. All chunks start at
+// a multiple of the grain size which itself is a multiple of a cache
+// line, so two workers never write into the same line of results.
+// The interpreter stack lives in the frame of every worker.
+// ------------------------------------------------------------------
+#ifndef VM_CACHE_LINE
+#define VM_CACHE_LINE 64
+#endif
+
+#ifndef VM_DEFAULT_GRAIN
+#define VM_DEFAULT_GRAIN 256
+#endif
+
+#ifdef DS_VM_THREADS
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+typedef HANDLE vm__thread;
+typedef CRITICAL_SECTION vm__mutex;
+typedef CONDITION_VARIABLE vm__cond;
+#define VM__ATOMIC_LOAD(p) InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0)
+#define VM__ATOMIC_STORE(p, v) InterlockedExchange64((volatile LONG64*)(p), (v))
+#define VM__ATOMIC_CAS(p, expected, desired) (InterlockedCompareExchange64((volatile LONG64*)(p), (desired), (expected)) == (expected))
+#else
+#include <pthread.h>
+#include <unistd.h>
+typedef pthread_t vm__thread;
+typedef pthread_mutex_t vm__mutex;
+typedef pthread_cond_t vm__cond;
+#define VM__ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define VM__ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define VM__ATOMIC_CAS(p, expected, desired) vm__atomic_cas((p), (expected), (desired))
+
+static int vm__atomic_cas(long long* p, long long expected, long long desired) {
+	return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+#else
+#define VM__ATOMIC_LOAD(p) (*(p))
+#define VM__ATOMIC_STORE(p, v) (*(p) = (v))
+#define VM__ATOMIC_CAS(p, expected, desired) (*(p) == (expected) ? (*(p) = (desired), 1) : 0)
+#endif
+
+// the range of a worker packed as begin | end << 32, padded to a
+// cache line together with the per worker counters
+struct vm__worker_t {
+	long long range;
+	int failed;
+	int index;
+	struct vm_pool_t* pool;
+	char padding[VM_CACHE_LINE - sizeof(long long) - 2 * sizeof(int) - sizeof(void*)];
+};
+
+typedef struct vm__worker_t vm__worker;
+
+// one task of a pool run, worker is the index of the running thread.
+// Returns 0 on success.
+typedef int(*vm__task)(void* arg, int index, int worker);
+
+struct vm_pool_t {
+	int num_threads;
+	void* memory;
+	vm__worker* workers;
+	// the current call
+	vm__task task;
+	void* arg;
+	const vm_job* jobs;
+	float* results;
+	int* codes;
+	int grain;
+#ifdef DS_VM_THREADS
+	vm__thread* threads;
+	vm__mutex lock;
+	vm__cond start;
+	vm__cond done;
+	int generation;
+	int active;
+	int shutdown;
+#endif
+};
+
+static long long vm__pack_range(int begin, int end) {
+	return (long long)(((unsigned long long)(unsigned int)end << 32) | (unsigned int)begin);
+}
+
+// ------------------------------------------------------------------
+// internal method to take the next chunk from the own range
+// ------------------------------------------------------------------
+static int vm__take_chunk(vm__worker* w, int grain, int* begin, int* end) {
+	for (;;) {
+		long long r = VM__ATOMIC_LOAD(&w->range);
+		int b = (int)(r & 0xFFFFFFFF);
+		int e = (int)(r >> 32);
+		if (b >= e) {
+			return 0;
+		}
+		int n = b + grain < e ? b + grain : e;
+		if (VM__ATOMIC_CAS(&w->range, r, vm__pack_range(n, e))) {
+			*begin = b;
+			*end = n;
+			return 1;
+		}
+	}
+}
 
 // ------------------------------------------------------------------
-// strtof
+// internal method to steal the back half of the range of victim
 // ------------------------------------------------------------------
-static float vm__strtof(const char* p, char** endPtr) {
-	while (vm__is_whitespace(*p)) {
+static int vm__steal(vm__worker* victim, vm__worker* thief, int grain) {
+	for (;;) {
+		long long r = VM__ATOMIC_LOAD(&victim->range);
+		int b = (int)(r & 0xFFFFFFFF);
+		int e = (int)(r >> 32);
+		if (b >= e) {
+			return 0;
+		}
+		// keep the split point aligned to the grain
+		int half = ((e - b) / 2 + grain - 1) / grain * grain;
+		int mid = b + half < e ? b + half : b;
+		if (VM__ATOMIC_CAS(&victim->range, r, vm__pack_range(b, mid))) {
+			VM__ATOMIC_STORE(&thief->range, vm__pack_range(mid, e));
+			return 1;
+		}
+	}
+}
+
+// ------------------------------------------------------------------
+// internal method to run tasks until there is nothing left to steal
+// ------------------------------------------------------------------
+static void vm__pool_work(vm_pool* pool, vm__worker* self) {
+	int begin = 0;
+	int end = 0;
+	for (;;) {
+		if (!vm__take_chunk(self, pool->grain, &begin, &end)) {
+			int stolen = 0;
+			for (int i = 1; i < pool->num_threads && !stolen; ++i) {
+				stolen = vm__steal(&pool->workers[(self->index + i) % pool->num_threads], self, pool->grain);
+			}
+			if (!stolen) {
+				return;
+			}
+			continue;
+		}
+		for (int i = begin; i < end; ++i) {
+			if (pool->task(pool->arg, i, self->index) != 0) {
+				++self->failed;
+			}
+		}
+	}
+}
+
+#ifdef DS_VM_THREADS
+#ifdef _WIN32
+static void vm__mutex_init(vm__mutex* m) { InitializeCriticalSection(m); }
+static void vm__mutex_destroy(vm__mutex* m) { DeleteCriticalSection(m); }
+static void vm__mutex_lock(vm__mutex* m) { EnterCriticalSection(m); }
+static void vm__mutex_unlock(vm__mutex* m) { LeaveCriticalSection(m); }
+static void vm__cond_init(vm__cond* c) { InitializeConditionVariable(c); }
+static void vm__cond_destroy(vm__cond* c) { (void)c; }
+static void vm__cond_wait(vm__cond* c, vm__mutex* m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void vm__cond_broadcast(vm__cond* c) { WakeAllConditionVariable(c); }
+static int vm__num_cores() { SYSTEM_INFO info; GetSystemInfo(&info); return (int)info.dwNumberOfProcessors; }
+#else
+static void vm__mutex_init(vm__mutex* m) { pthread_mutex_init(m, 0); }
+static void vm__mutex_destroy(vm__mutex* m) { pthread_mutex_destroy(m); }
+static void vm__mutex_lock(vm__mutex* m) { pthread_mutex_lock(m); }
+static void vm__mutex_unlock(vm__mutex* m) { pthread_mutex_unlock(m); }
+static void vm__cond_init(vm__cond* c) { pthread_cond_init(c, 0); }
+static void vm__cond_destroy(vm__cond* c) { pthread_cond_destroy(c); }
+static void vm__cond_wait(vm__cond* c, vm__mutex* m) { pthread_cond_wait(c, m); }
+static void vm__cond_broadcast(vm__cond* c) { pthread_cond_broadcast(c); }
+static int vm__num_cores() { return (int)sysconf(_SC_NPROCESSORS_ONLN); }
+#endif
+
+// ------------------------------------------------------------------
+// internal thread main. Waits for the next call of vm_eval_many.
+// ------------------------------------------------------------------
+static void vm__pool_thread(vm__worker* self) {
+	vm_pool* pool = self->pool;
+	int generation = 0;
+	for (;;) {
+		vm__mutex_lock(&pool->lock);
+		while (pool->generation == generation && !pool->shutdown) {
+			vm__cond_wait(&pool->start, &pool->lock);
+		}
+		generation = pool->generation;
+		int shutdown = pool->shutdown;
+		vm__mutex_unlock(&pool->lock);
+		if (shutdown) {
+			return;
+		}
+		vm__pool_work(pool, self);
+		vm__mutex_lock(&pool->lock);
+		if (--pool->active == 0) {
+			vm__cond_broadcast(&pool->done);
+		}
+		vm__mutex_unlock(&pool->lock);
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI vm__thread_main(LPVOID arg) { vm__pool_thread((vm__worker*)arg); return 0; }
+#else
+static void* vm__thread_main(void* arg) { vm__pool_thread((vm__worker*)arg); return 0; }
+#endif
+#endif
+
+// ------------------------------------------------------------------
+// create a pool with num_threads threads including the calling
+// thread. 0 uses one thread per core. If a thread cannot be started
+// the pool keeps the threads started so far, vm_pool_size returns
+// the actual number. Without any extra thread all tasks run on the
+// calling thread.
+// ------------------------------------------------------------------
+DSDEF vm_pool* vm_create_pool(int num_threads) {
+	vm_pool* pool = (vm_pool*)VM_MALLOC(sizeof(vm_pool));
+	memset(pool, 0, sizeof(vm_pool));
+#ifdef DS_VM_THREADS
+	if (num_threads <= 0) {
+		num_threads = vm__num_cores();
+	}
+	if (num_threads <= 0) {
+		num_threads = 1;
+	}
+#else
+	num_threads = 1;
+#endif
+	pool->num_threads = num_threads;
+	pool->memory = VM_MALLOC((num_threads + 1) * sizeof(vm__worker));
+	pool->workers = (vm__worker*)(((size_t)pool->memory + VM_CACHE_LINE - 1) & ~(size_t)(VM_CACHE_LINE - 1));
+	memset(pool->workers, 0, num_threads * sizeof(vm__worker));
+	for (int i = 0; i < num_threads; ++i) {
+		pool->workers[i].index = i;
+		pool->workers[i].pool = pool;
+	}
+#ifdef DS_VM_THREADS
+	vm__mutex_init(&pool->lock);
+	vm__cond_init(&pool->start);
+	vm__cond_init(&pool->done);
+	pool->threads = (vm__thread*)VM_MALLOC(num_threads * sizeof(vm__thread));
+	// the calling thread is worker 0
+	for (int i = 1; i < num_threads; ++i) {
+#ifdef _WIN32
+		pool->threads[i] = CreateThread(0, 0, vm__thread_main, &pool->workers[i], 0, 0);
+		int started = pool->threads[i] != 0;
+#else
+		int started = pthread_create(&pool->threads[i], 0, vm__thread_main, &pool->workers[i]) == 0;
+#endif
+		if (!started) {
+			// vm__pool_run only waits for the workers which are running
+			pool->num_threads = i;
+			break;
+		}
+	}
+#endif
+	return pool;
+}
+
+// ------------------------------------------------------------------
+// number of threads of the pool
+// ------------------------------------------------------------------
+DSDEF int vm_pool_size(vm_pool* pool) {
+	return pool->num_threads;
+}
+
+// ------------------------------------------------------------------
+// internal method to run count tasks on all threads of the pool.
+// Returns the number of failed tasks.
+// ------------------------------------------------------------------
+static int vm__pool_run(vm_pool* pool, vm__task task, void* arg, int count, int grain) {
+	pool->task = task;
+	pool->arg = arg;
+	pool->grain = grain;
+	// split the jobs into grain aligned ranges
+	int chunks = (count + grain - 1) / grain;
+	int n = pool->num_threads;
+	for (int i = 0; i < n; ++i) {
+		int b = (int)((long long)chunks * i / n) * grain;
+		int e = (int)((long long)chunks * (i + 1) / n) * grain;
+		pool->workers[i].range = vm__pack_range(b < count ? b : count, e < count ? e : count);
+		pool->workers[i].failed = 0;
+	}
+#ifdef DS_VM_THREADS
+	if (n > 1) {
+		vm__mutex_lock(&pool->lock);
+		pool->active = n - 1;
+		++pool->generation;
+		vm__cond_broadcast(&pool->start);
+		vm__mutex_unlock(&pool->lock);
+	}
+	vm__pool_work(pool, &pool->workers[0]);
+	if (n > 1) {
+		vm__mutex_lock(&pool->lock);
+		while (pool->active > 0) {
+			vm__cond_wait(&pool->done, &pool->lock);
+		}
+		vm__mutex_unlock(&pool->lock);
+	}
+#else
+	vm__pool_work(pool, &pool->workers[0]);
+#endif
+	int failed = 0;
+	for (int i = 0; i < n; ++i) {
+		failed += pool->workers[i].failed;
+	}
+	return failed;
+}
+
+static int vm__eval_job(void* arg, int index, int worker) {
+	vm_pool* pool = (vm_pool*)arg;
+	const vm_job* job = &pool->jobs[index];
+	float r = 0.0f;
+	int code = vm_run_env(job->program, job->env, &r);
+	pool->results[index] = r;
+	if (pool->codes) {
+		pool->codes[index] = code;
+	}
+	(void)worker;
+	return code;
+}
+
+// ------------------------------------------------------------------
+// evaluate count jobs and store the result of job i in results[i].
+// codes is optional and receives the error code of every job.
+// grain is the smallest number of jobs a worker takes at once,
+// 0 selects the default. Returns the number of failed jobs.
+// The pool must not be used by two threads at the same time.
+// ------------------------------------------------------------------
+DSDEF int vm_eval_many(vm_pool* pool, const vm_job* jobs, int count, float* results, int* codes, int grain) {
+	const int line = VM_CACHE_LINE / (int)sizeof(float);
+	if (grain <= 0) {
+		grain = VM_DEFAULT_GRAIN;
+	}
+	grain = (grain + line - 1) / line * line;
+	pool->jobs = jobs;
+	pool->results = results;
+	pool->codes = codes;
+	return vm__pool_run(pool, vm__eval_job, pool, count, grain);
+}
+
+// ------------------------------------------------------------------
+// stop all threads and destroy the pool
+// ------------------------------------------------------------------
+DSDEF void vm_destroy_pool(vm_pool* pool) {
+#ifdef DS_VM_THREADS
+	vm__mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	vm__cond_broadcast(&pool->start);
+	vm__mutex_unlock(&pool->lock);
+	for (int i = 1; i < pool->num_threads; ++i) {
+#ifdef _WIN32
+		WaitForSingleObject(pool->threads[i], INFINITE);
+		CloseHandle(pool->threads[i]);
+#else
+		pthread_join(pool->threads[i], 0);
+#endif
+	}
+	VM_FREE(pool->threads);
+	vm__cond_destroy(&pool->done);
+	vm__cond_destroy(&pool->start);
+	vm__mutex_destroy(&pool->lock);
+#endif
+	VM_FREE(pool->memory);
+	VM_FREE(pool);
+}
+
+// ------------------------------------------------------------------
+// Reductions
+// vm_reduce evaluates a program over columns and reduces the results
+// on the fly. The elements are split into chunks and every chunk is
+// evaluated block by block with vm__batch_block. The results of a
+// block go straight into one accumulator per element of a block, so
+// there are VM_BATCH_SIZE / VM_SIMD_WIDTH independent SIMD registers
+// and no per element output. At the end of a chunk the accumulators
+// are folded pairwise into one partial result per chunk. The partial
+// results are combined in chunk order, so the result does not depend
+// on the number of threads.
+// ------------------------------------------------------------------
+#ifndef VM_REDUCE_CHUNK
+#define VM_REDUCE_CHUNK 4096
+#endif
+
+struct vm__reduce_state_t {
+	const vm_program* program;
+	const float* values;
+	const float** columns;
+	int count;
+	int op;
+	int kahan;
+	// one partial result per chunk
+	float* partials;
+	float* compensations;
+	int* codes;
+};
+
+typedef struct vm__reduce_state_t vm__reduce_state;
+
+static float vm__reduce_neutral(int op) {
+	return op == VM_REDUCE_MIN ? HUGE_VALF : op == VM_REDUCE_MAX ? -HUGE_VALF : 0.0f;
+}
+
+// ------------------------------------------------------------------
+// internal method to combine b into a. n must be a multiple of
+// VM_SIMD_WIDTH.
+// ------------------------------------------------------------------
+static void vm__reduce_lanes(int op, float* a, const float* b, int n) {
+	switch (op) {
+		case VM_REDUCE_MIN: vm__batch_min(a, b, n); break;
+		case VM_REDUCE_MAX: vm__batch_max(a, b, n); break;
+		default: vm__batch_add(a, b, n); break;
+	}
+}
+
+// ------------------------------------------------------------------
+// internal method to add a to sum with Kahan summation. sum minus
+// compensation is the exact sum of all values added so far (as long
+// as all values are finite).
+// ------------------------------------------------------------------
+static void vm__reduce_kahan(float* sum, float* compensation, const float* a, int n) {
+#if VM_SIMD_WIDTH > 1
+	for (int i = 0; i < n; i += VM_SIMD_WIDTH) {
+		vm__vf s = vm__vload(sum + i);
+		vm__vf y = vm__vsub(vm__vload(a + i), vm__vload(compensation + i));
+		vm__vf t = vm__vadd(s, y);
+		vm__vstore(compensation + i, vm__vsub(vm__vsub(t, s), y));
+		vm__vstore(sum + i, t);
+	}
+#else
+	for (int i = 0; i < n; ++i) {
+		float y = a[i] - compensation[i];
+		float t = sum[i] + y;
+		compensation[i] = (t - sum[i]) - y;
+		sum[i] = t;
+	}
+#endif
+}
+
+// ------------------------------------------------------------------
+// internal method to fold n values into the first one by combining
+// both halves until one value is left. Sums are added pairwise which
+// keeps the rounding error at O(log n).
+// ------------------------------------------------------------------
+static float vm__reduce_tree(int op, float* a, int n) {
+	while (n > 1) {
+		// an odd value in the middle stays for the next round
+		int h = n / 2;
+		if (h % VM_SIMD_WIDTH == 0) {
+			vm__reduce_lanes(op, a, a + n - h, h);
+		}
+		else {
+			for (int i = 0; i < h; ++i) {
+				float b = a[n - h + i];
+				a[i] = op == VM_REDUCE_MIN ? (a[i] < b ? a[i] : b) : op == VM_REDUCE_MAX ? (a[i] > b ? a[i] : b) : a[i] + b;
+			}
+		}
+		n -= h;
+	}
+	return a[0];
+}
+
+// ------------------------------------------------------------------
+// internal task to reduce one chunk
+// ------------------------------------------------------------------
+static int vm__reduce_chunk(void* arg, int index, int worker) {
+	vm__reduce_state* state = (vm__reduce_state*)arg;
+	const vm_program* program = state->program;
+	float lanes[VM_BATCH_STACK][VM_BATCH_SIZE];
+	float sum[VM_BATCH_SIZE];
+	float compensation[VM_BATCH_SIZE];
+	float neutral = vm__reduce_neutral(state->op);
+	vm__batch_fill(sum, neutral, VM_BATCH_SIZE);
+	vm__batch_fill(compensation, 0.0f, VM_BATCH_SIZE);
+	int begin = index * VM_REDUCE_CHUNK;
+	int end = state->count - begin < VM_REDUCE_CHUNK ? state->count : begin + VM_REDUCE_CHUNK;
+	for (int base = begin; base < end; base += VM_BATCH_SIZE) {
+		int n = end - base < VM_BATCH_SIZE ? end - base : VM_BATCH_SIZE;
+		int top = 0;
+		int code = vm__batch_block(program->functions, state->values, program->tokens, program->num_tokens, state->columns, base, n, lanes, &top);
+		if (code != 0) {
+			state->codes[index] = code;
+			return code;
+		}
+		// the lanes behind the last element must not change the result
+		vm__batch_fill(lanes[top] + n, neutral, VM_BATCH_SIZE - n);
+		if (state->kahan) {
+			vm__reduce_kahan(sum, compensation, lanes[top], VM_BATCH_SIZE);
+		}
+		else {
+			vm__reduce_lanes(state->op, sum, lanes[top], VM_BATCH_SIZE);
+		}
+	}
+	state->partials[index] = vm__reduce_tree(state->op, sum, VM_BATCH_SIZE);
+	state->compensations[index] = state->kahan ? vm__reduce_tree(VM_REDUCE_SUM, compensation, VM_BATCH_SIZE) : 0.0f;
+	state->codes[index] = 0;
+	(void)worker;
+	return 0;
+}
+
+// ------------------------------------------------------------------
+// evaluate a standalone program for count elements and reduce the
+// results to one value. columns is indexed by slot and holds count
+// values per slot, slots with a NULL column use the value of env (or
+// the default of the program if env is 0). reduction is one of the
+// VM_REDUCE_ values, optionally combined with VM_REDUCE_KAHAN. pool
+// may be 0 to use the calling thread. Returns 0 or an error code,
+// the mean of zero elements is error 19.
+// ------------------------------------------------------------------
+DSDEF int vm_reduce(vm_pool* pool, const vm_program* program, const vm_env* env, const float** columns, int count, int reduction, float* result) {
+	if (program->context || (env && env->num_values < program->num_slots)) {
+		return 7;
+	}
+	if ((reduction & 3) == VM_REDUCE_MEAN && count <= 0) {
+		return 19;
+	}
+	vm__reduce_state state;
+	state.program = program;
+	state.values = env ? env->values : program->slot_defaults;
+	state.columns = columns;
+	state.count = count > 0 ? count : 0;
+	state.op = reduction & 3;
+	state.kahan = (reduction & VM_REDUCE_KAHAN) && (state.op == VM_REDUCE_SUM || state.op == VM_REDUCE_MEAN);
+	int num_chunks = (state.count + VM_REDUCE_CHUNK - 1) / VM_REDUCE_CHUNK;
+	char* memory = (char*)VM_MALLOC(num_chunks * (2 * sizeof(float) + sizeof(int)) + 1);
+	state.partials = (float*)memory;
+	state.compensations = state.partials + num_chunks;
+	state.codes = (int*)(state.compensations + num_chunks);
+	if (pool) {
+		vm__pool_run(pool, vm__reduce_chunk, &state, num_chunks, 1);
+	}
+	else {
+		for (int i = 0; i < num_chunks; ++i) {
+			vm__reduce_chunk(&state, i, 0);
+		}
+	}
+	int code = 0;
+	for (int i = 0; i < num_chunks && code == 0; ++i) {
+		code = state.codes[i];
+	}
+	float r = vm__reduce_neutral(state.op);
+	if (code == 0 && num_chunks > 0) {
+		if (state.kahan) {
+			// Neumaier summation of the partial sums and their compensations
+			float c = 0.0f;
+			r = 0.0f;
+			for (int i = 0; i < 2 * num_chunks; ++i) {
+				float v = i < num_chunks ? state.partials[i] : -state.compensations[i - num_chunks];
+				float t = r + v;
+				c += fabsf(r) >= fabsf(v) ? (r - t) + v : (v - t) + r;
+				r = t;
+			}
+			r += c;
+		}
+		else {
+			r = vm__reduce_tree(state.op, state.partials, num_chunks);
+		}
+	}
+	VM_FREE(memory);
+	if (code != 0) {
+		return code;
+	}
+	*result = state.op == VM_REDUCE_MEAN ? r / (float)state.count : r;
+	return 0;
+}
+
+// ------------------------------------------------------------------
+// Snapshots
+// Once snapshots are enabled the values of the context are only the
+// staging area of one writer thread: vm_set_variable and vm_update
+// change them and vm_publish copies all of them into a buffer which
+// becomes the current snapshot with a single atomic store. Readers
+// never read the values of the context. They pin the current snapshot
+// and evaluate against it with vm_run_snapshot, so they always see
+// the values of one vm_publish and never wait for the writer.
+// Buffers are reclaimed with epochs: while pinning a reader first
+// announces the current epoch, which protects every buffer replaced
+// after it, and then the epoch of the snapshot it actually got, which
+// only protects that buffer. vm_publish reuses a buffer no reader
+// protects and allocates a new one otherwise, so a reader which keeps
+// a snapshot pinned for a long time never blocks the writer.
+// ------------------------------------------------------------------
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define VM__SC_LOAD(p) _InterlockedCompareExchange64((volatile long long*)(p), 0, 0)
+#define VM__SC_STORE(p, v) _InterlockedExchange64((volatile long long*)(p), (v))
+#define VM__RELEASE_STORE(p, v) _InterlockedExchange64((volatile long long*)(p), (v))
+#define VM__SC_LOAD_PTR(p) _InterlockedCompareExchangePointer((void* volatile*)(p), 0, 0)
+#define VM__SC_STORE_PTR(p, v) _InterlockedExchangePointer((void* volatile*)(p), (v))
+#else
+#define VM__SC_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define VM__SC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define VM__RELEASE_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define VM__SC_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define VM__SC_STORE_PTR(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
+struct vm__snapshot_buffer_t {
+	vm_snapshot snapshot;
+	// epoch of the vm_publish which replaced the buffer, 0 if it was never published
+	long long retired;
+	int capacity;
+	float* values;
+};
+
+typedef struct vm__snapshot_buffer_t vm__snapshot_buffer;
+
+// the announced epoch of a reader times two, plus one once it is the
+// epoch of the pinned snapshot. 0 if nothing is pinned. Every reader
+// has its own cache line.
+struct vm__reader_t {
+	long long epoch;
+	char padding[VM_CACHE_LINE - sizeof(long long)];
+};
+
+typedef struct vm__reader_t vm__reader;
+
+struct vm_snapshots_t {
+	// shared with the readers
+	vm__snapshot_buffer* current;
+	long long epoch;
+	// only used by the writer
+	vm__snapshot_buffer** buffers;
+	int num_buffers;
+	int capacity;
+	void* memory;
+	vm__reader* readers;
+	int num_readers;
+};
+
+typedef struct vm_snapshots_t vm_snapshots;
+
+// ------------------------------------------------------------------
+// enable snapshots for up to max_readers reader threads and publish
+// the current values
+// ------------------------------------------------------------------
+DSDEF void vm_enable_snapshots(vm_context* ctx, int max_readers) {
+	if (ctx->snapshots) {
+		return;
+	}
+	vm_snapshots* s = (vm_snapshots*)VM_MALLOC(sizeof(vm_snapshots));
+	memset(s, 0, sizeof(vm_snapshots));
+	s->num_readers = max_readers > 0 ? max_readers : 1;
+	s->memory = VM_MALLOC((s->num_readers + 1) * sizeof(vm__reader));
+	s->readers = (vm__reader*)(((size_t)s->memory + VM_CACHE_LINE - 1) & ~(size_t)(VM_CACHE_LINE - 1));
+	memset(s->readers, 0, s->num_readers * sizeof(vm__reader));
+	ctx->snapshots = s;
+	vm_publish(ctx);
+}
+
+// ------------------------------------------------------------------
+// internal method to free all buffers
+// ------------------------------------------------------------------
+static void vm__destroy_snapshots(vm_context* ctx) {
+	vm_snapshots* s = ctx->snapshots;
+	for (int i = 0; i < s->num_buffers; ++i) {
+		if (s->buffers[i]->values) {
+			VM_FREE(s->buffers[i]->values);
+		}
+		VM_FREE(s->buffers[i]);
+	}
+	if (s->buffers) {
+		VM_FREE(s->buffers);
+	}
+	VM_FREE(s->memory);
+	VM_FREE(s);
+	ctx->snapshots = 0;
+}
+
+// ------------------------------------------------------------------
+// internal method to check if no reader can see a buffer
+// ------------------------------------------------------------------
+static int vm__snapshot_unused(vm_snapshots* s, const vm__snapshot_buffer* b) {
+	if (b == s->current) {
+		return 0;
+	}
+	for (int i = 0; i < s->num_readers; ++i) {
+		long long announced = VM__SC_LOAD(&s->readers[i].epoch);
+		if (announced & 1) {
+			if ((announced >> 1) == b->snapshot.epoch) {
+				return 0;
+			}
+		}
+		else if (announced != 0 && b->retired > (announced >> 1)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// ------------------------------------------------------------------
+// copy the values of all variables into a new snapshot and make it
+// the current one. Must only be called by the thread which changes
+// the variables. Returns the epoch of the snapshot or 0 if snapshots
+// are not enabled.
+// ------------------------------------------------------------------
+DSDEF long long vm_publish(vm_context* ctx) {
+	vm_snapshots* s = ctx->snapshots;
+	if (!s) {
+		return 0;
+	}
+	vm__snapshot_buffer* b = 0;
+	for (int i = 0; i < s->num_buffers && !b; ++i) {
+		if (vm__snapshot_unused(s, s->buffers[i])) {
+			b = s->buffers[i];
+		}
+	}
+	if (!b) {
+		if (s->num_buffers == s->capacity) {
+			s->buffers = (vm__snapshot_buffer**)vm__grow(s->buffers, s->num_buffers, &s->capacity, sizeof(vm__snapshot_buffer*));
+		}
+		b = (vm__snapshot_buffer*)VM_MALLOC(sizeof(vm__snapshot_buffer));
+		memset(b, 0, sizeof(vm__snapshot_buffer));
+		s->buffers[s->num_buffers++] = b;
+	}
+	// no reader can see the buffer, so it can be resized
+	if (b->capacity < ctx->num_variables) {
+		if (b->values) {
+			VM_FREE(b->values);
+		}
+		b->capacity = ctx->variables_capacity;
+		b->values = (float*)VM_MALLOC(b->capacity * sizeof(float));
+	}
+	if (ctx->num_variables > 0) {
+		memcpy(b->values, ctx->values, ctx->num_variables * sizeof(float));
+	}
+	b->snapshot.values = b->values;
+	b->snapshot.num_values = ctx->num_variables;
+	b->snapshot.epoch = s->epoch + 1;
+	vm__snapshot_buffer* previous = s->current;
+	VM__SC_STORE_PTR(&s->current, b);
+	VM__SC_STORE(&s->epoch, b->snapshot.epoch);
+	if (previous) {
+		previous->retired = b->snapshot.epoch;
+	}
+	return b->snapshot.epoch;
+}
+
+// ------------------------------------------------------------------
+// pin the current snapshot for reader (0 to max_readers - 1). The
+// snapshot stays valid until vm_unpin_snapshot is called with the
+// same reader. Every reader must be used by one thread at a time.
+// Returns 0 if snapshots are not enabled.
+// ------------------------------------------------------------------
+DSDEF const vm_snapshot* vm_pin_snapshot(vm_context* ctx, int reader) {
+	vm_snapshots* s = ctx->snapshots;
+	if (!s || reader < 0 || reader >= s->num_readers) {
+		return 0;
+	}
+	vm__reader* r = &s->readers[reader];
+	// announce the epoch before loading the snapshot, so the writer
+	// either sees the announcement or has already published a newer one
+	VM__SC_STORE(&r->epoch, VM__SC_LOAD(&s->epoch) * 2);
+	vm__snapshot_buffer* b = (vm__snapshot_buffer*)VM__SC_LOAD_PTR(&s->current);
+	// from now on only this buffer is protected
+	VM__RELEASE_STORE(&r->epoch, b->snapshot.epoch * 2 + 1);
+	return &b->snapshot;
+}
+
+// ------------------------------------------------------------------
+// release the snapshot pinned by reader
+// ------------------------------------------------------------------
+DSDEF void vm_unpin_snapshot(vm_context* ctx, int reader) {
+	vm_snapshots* s = ctx->snapshots;
+	if (s && reader >= 0 && reader < s->num_readers) {
+		VM__RELEASE_STORE(&s->readers[reader].epoch, 0);
+	}
+}
+
+// ------------------------------------------------------------------
+// run bytecode with the values of a pinned snapshot. Only reads the
+// functions of the context, so it can be called while the writer
+// changes variables. All variables used by the bytecode must exist
+// when the snapshot is published.
+// ------------------------------------------------------------------
+DSDEF int vm_run_snapshot(vm_context* ctx, const vm_snapshot* snapshot, vm_token* byteCode, int capacity, float* ret) {
+	return vm__execute(byteCode, capacity, snapshot->values, ctx->functions, ret, 0, 0 VM__PROFILE_ARG(0));
+}
+
+#undef VM__SC_LOAD
+#undef VM__SC_STORE
+#undef VM__RELEASE_STORE
+#undef VM__SC_LOAD_PTR
+#undef VM__SC_STORE_PTR
+
+// ------------------------------------------------------------------
+// Definition files
+// Every line of a definition file is "name = expression" and gets
+// defined like vm_define. Empty lines and lines starting with # are
+// skipped. The lines are parsed on the threads of a pool with their
+// own slot tables, so the context is only read. Afterwards the slots
+// are turned into variables line by line, which gives the same
+// variables in the same order as calling vm_define for every line.
+// ------------------------------------------------------------------
+struct vm__definition_t {
+	const char* line;
+	int length;
+	const char* name;
+	int name_length;
+	int code;
+	// position of the error in the text
+	const char* error_at;
+	vm_token* tokens;
+	int num_tokens;
+	vm__slot* slots;
+	int num_slots;
+};
+
+typedef struct vm__definition_t vm__definition;
+
+// the memory of one worker which is reused for every line
+struct vm__define_scratch_t {
+	char* text;
+	vm_token* tokens;
+	FunctionVMStackItem* stack;
+	int capacity;
+};
+
+typedef struct vm__define_scratch_t vm__define_scratch;
+
+struct vm__define_state_t {
+	vm_context* ctx;
+	vm__definition* definitions;
+	vm__define_scratch* scratch;
+};
+
+typedef struct vm__define_state_t vm__define_state;
+
+static int vm__is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+// ------------------------------------------------------------------
+// internal task to parse one line
+// ------------------------------------------------------------------
+static int vm__define_line(void* arg, int index, int worker) {
+	vm__define_state* state = (vm__define_state*)arg;
+	vm__definition* d = &state->definitions[index];
+	const char* p = d->line;
+	const char* end = d->line + d->length;
+	while (p < end && vm__is_space(*p)) {
+		++p;
+	}
+	if (p == end || *p == '#') {
+		return 0;
+	}
+	d->name = p;
+	while (p < end && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || *p == '_' || (p > d->name && *p >= '0' && *p <= '9'))) {
+		++p;
+	}
+	d->name_length = (int)(p - d->name);
+	while (p < end && vm__is_space(*p)) {
 		++p;
 	}
-	float sign = 1.0f;
-	if (*p == '-') {
-		sign = -1.0f;
-		++p;
+	if (d->name_length == 0 || p == end || *p != '=') {
+		d->code = 16;
+		d->error_at = p;
+		return d->code;
+	}
+	const char* source = ++p;
+	int length = (int)(end - source);
+	vm__define_scratch* scratch = &state->scratch[worker];
+	if (length + 1 > scratch->capacity) {
+		if (scratch->text) {
+			VM_FREE(scratch->text);
+			VM_FREE(scratch->tokens);
+			VM_FREE(scratch->stack);
+		}
+		scratch->capacity = length + 64;
+		scratch->text = (char*)VM_MALLOC(scratch->capacity);
+		scratch->tokens = (vm_token*)VM_MALLOC(vm__token_capacity(scratch->capacity) * sizeof(vm_token));
+		scratch->stack = (FunctionVMStackItem*)VM_MALLOC(scratch->capacity * sizeof(FunctionVMStackItem));
+	}
+	memcpy(scratch->text, source, length);
+	scratch->text[length] = 0;
+	vm__slot_table slots = { 0, 0, 0 };
+	const char* error_at = 0;
+	int num = vm__parse(state->ctx, scratch->text, scratch->tokens, vm__token_capacity(length), scratch->stack, length + 1, 0, &slots, &error_at);
+	if (num < 0) {
+		if (slots.slots) {
+			VM_FREE(slots.slots);
+		}
+		d->code = -num;
+		d->error_at = source + (error_at - scratch->text);
+		return d->code;
+	}
+	d->tokens = (vm_token*)VM_MALLOC((num + 1) * sizeof(vm_token));
+	memcpy(d->tokens, scratch->tokens, num * sizeof(vm_token));
+	d->num_tokens = num;
+	// the names point into the line instead of the scratch text
+	for (int i = 0; i < slots.count; ++i) {
+		slots.slots[i].name = source + (slots.slots[i].name - scratch->text);
+	}
+	d->slots = slots.slots;
+	d->num_slots = slots.count;
+	return 0;
+}
+
+// ------------------------------------------------------------------
+// define all lines of text. pool may be 0 to use the calling thread.
+// errors receives the first max_errors failed lines in line order.
+// Returns the number of failed lines.
+// ------------------------------------------------------------------
+DSDEF int vm_define_text(vm_context* ctx, vm_pool* pool, const char* text, int length, vm_line_error* errors, int max_errors) {
+	int num_lines = 1;
+	for (const char* p = text; (p = (const char*)memchr(p, '\n', text + length - p)) != 0; ++p) {
+		++num_lines;
+	}
+	vm__definition* definitions = (vm__definition*)VM_MALLOC(num_lines * sizeof(vm__definition));
+	memset(definitions, 0, num_lines * sizeof(vm__definition));
+	const char* line = text;
+	for (int i = 0; i < num_lines; ++i) {
+		const char* next = (const char*)memchr(line, '\n', text + length - line);
+		definitions[i].line = line;
+		definitions[i].length = (int)((next ? next : text + length) - line);
+		line = next ? next + 1 : line;
+	}
+	int num_threads = pool ? vm_pool_size(pool) : 1;
+	vm__define_state state;
+	state.ctx = ctx;
+	state.definitions = definitions;
+	state.scratch = (vm__define_scratch*)VM_MALLOC(num_threads * sizeof(vm__define_scratch));
+	memset(state.scratch, 0, num_threads * sizeof(vm__define_scratch));
+	if (pool) {
+		vm__pool_run(pool, vm__define_line, &state, num_lines, 16);
+	}
+	else {
+		for (int i = 0; i < num_lines; ++i) {
+			vm__define_line(&state, i, 0);
+		}
+	}
+	for (int i = 0; i < num_threads; ++i) {
+		if (state.scratch[i].text) {
+			VM_FREE(state.scratch[i].text);
+			VM_FREE(state.scratch[i].tokens);
+			VM_FREE(state.scratch[i].stack);
+		}
+	}
+	VM_FREE(state.scratch);
+	// turn the slots into variables in the order of the lines
+	int* variables = (int*)VM_MALLOC(num_lines * sizeof(int));
+	for (int i = 0; i < num_lines; ++i) {
+		vm__definition* d = &definitions[i];
+		if (!d->tokens) {
+			continue;
+		}
+		int* ids = (int*)VM_MALLOC((d->num_slots + 1) * sizeof(int));
+		for (int j = 0; j < d->num_slots; ++j) {
+			const vm__slot* slot = &d->slots[j];
+			ids[j] = vm__find_variable(slot->name, slot->length, ctx);
+			if (ids[j] == -1) {
+				ids[j] = vm__add_variable(ctx, slot->name, slot->length, 0.0f);
+			}
+		}
+		for (int j = 0; j < d->num_tokens; ++j) {
+			vm_token_type type = d->tokens[j].type;
+			if (type == TOK_VARIABLE || (type >= TOK_VAR_ADD_CONST && type <= TOK_VAR_DIV_CONST)) {
+				d->tokens[j].id = ids[d->tokens[j].id];
+				if (type != TOK_VARIABLE) {
+					++j;
+				}
+			}
+		}
+		VM_FREE(ids);
+		if (d->slots) {
+			VM_FREE(d->slots);
+		}
+		variables[i] = vm__find_variable(d->name, d->name_length, ctx);
+		if (variables[i] == -1) {
+			variables[i] = vm__add_variable(ctx, d->name, d->name_length, 0.0f);
+		}
+	}
+	// set all expressions and sort the graph once. If there is a cycle
+	// everything is undone and the lines are defined one by one to
+	// find the lines which close a cycle.
+	vm_graph* graph = vm__get_graph(ctx);
+	int* index_of = (int*)VM_MALLOC((ctx->num_variables + 1) * sizeof(int));
+	for (int i = 0; i < ctx->num_variables; ++i) {
+		index_of[i] = -1;
 	}
-	else if (*p == '+') {
-		++p;
+	for (int i = 0; i < graph->num_expressions; ++i) {
+		index_of[graph->expressions[i].variable] = i;
 	}
-	float value = 0.0f;
-	while (vm__is_numeric(*p)) {
-		value *= 10.0f;
-		value = value + (*p - '0');
-		++p;
+	vm__expression* previous = (vm__expression*)VM_MALLOC(num_lines * sizeof(vm__expression));
+	for (int i = 0; i < num_lines; ++i) {
+		if (definitions[i].tokens) {
+			int v = variables[i];
+			index_of[v] = vm__graph_set(graph, index_of[v], v, definitions[i].tokens, definitions[i].num_tokens, &previous[i]);
+		}
 	}
-	if (*p == '.') {
-		++p;
-		float dec = 1.0f;
-		float frac = 0.0f;
-		while (vm__is_numeric(*p)) {
-			frac *= 10.0f;
-			frac = frac + (*p - '0');
-			dec *= 10.0f;
-			++p;
+	if (vm__graph_rebuild(ctx)) {
+		for (int i = 0; i < num_lines; ++i) {
+			if (definitions[i].tokens && previous[i].tokens) {
+				VM_FREE(previous[i].tokens);
+				VM_FREE(previous[i].inputs);
+			}
 		}
-		value = value + (frac / dec);
 	}
-	if (endPtr) {
-		*endPtr = (char *)(p);
+	else {
+		for (int i = num_lines - 1; i >= 0; --i) {
+			if (definitions[i].tokens) {
+				vm__graph_restore(graph, index_of[variables[i]], &previous[i]);
+				index_of[variables[i]] = previous[i].tokens ? index_of[variables[i]] : -1;
+			}
+		}
+		for (int i = 0; i < num_lines; ++i) {
+			if (definitions[i].tokens && vm__define_tokens(ctx, variables[i], definitions[i].tokens, definitions[i].num_tokens) < 0) {
+				definitions[i].code = 8;
+				definitions[i].error_at = definitions[i].name;
+			}
+		}
+		vm__graph_rebuild(ctx);
 	}
-	return value * sign;
+	VM_FREE(previous);
+	VM_FREE(index_of);
+	VM_FREE(variables);
+	int failed = 0;
+	for (int i = 0; i < num_lines; ++i) {
+		vm__definition* d = &definitions[i];
+		if (d->code == 0) {
+			continue;
+		}
+		if (failed < max_errors) {
+			errors[failed].line = i + 1;
+			errors[failed].column = (int)(d->error_at - d->line) + 1;
+			errors[failed].code = d->code;
+		}
+		++failed;
+	}
+	VM_FREE(definitions);
+	return failed;
 }
 
 // ------------------------------------------------------------------
-// Function stack item
+// define all lines of a file (see vm_define_text).
+// Returns the number of failed lines or -10 if the file cannot be
+// read.
 // ------------------------------------------------------------------
-struct FunctionVMStackItem_t {
-	vm_token token;
-	int precedence;
-	int par_level;
+DSDEF int vm_define_file(vm_context* ctx, vm_pool* pool, const char* path, vm_line_error* errors, int max_errors) {
+	size_t size = 0;
+	void* data = 0;
+	if (vm_map_file(path, &data, &size) != 0) {
+		return -10;
+	}
+	if (size == 0) {
+		// an empty file has nothing to define
+		return 0;
+	}
+	int failed = vm_define_text(ctx, pool, (const char*)data, (int)size, errors, max_errors);
+	vm_unmap_file(data, size);
+	return failed;
+}
+
+// ------------------------------------------------------------------
+// JIT
+// Define DS_VM_JIT to translate bytecode into native code on
+// Linux x86-64. On all other platforms (or if a program cannot be
+// translated) vm_jit_call runs the bytecode with vm_run.
+// ------------------------------------------------------------------
+#if defined(DS_VM_JIT) && defined(__x86_64__) && defined(__linux__)
+#define VM_JIT_NATIVE
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifndef MAP_ANONYMOUS
+// not exposed in strict ISO C mode
+#define MAP_ANONYMOUS 0x20
+#endif
+#endif
+
+typedef int(*vm__jit_function)(vm_context*, float*);
+
+struct vm_jit_t {
+	vm_token* tokens;
+	int num_tokens;
+	void* code;
+	size_t code_size;
+	vm__jit_function function;
 };
 
-typedef struct FunctionVMStackItem_t FunctionVMStackItem;
+#ifdef VM_JIT_NATIVE
 
-static int cmp(FunctionVMStackItem t,FunctionVMStackItem f) {
-	if (t.par_level != f.par_level) return t.par_level - f.par_level;
-	return t.precedence - f.precedence;
+// the stack slots live in xmm0 - xmm13, xmm14 and xmm15 are scratch
+#define VM_JIT_MAX_DEPTH 14
+#define VM_JIT_TMP 15
+#define VM_JIT_TMP2 14
+// frame: float[32] spill area followed by a vm_stack
+#define VM_JIT_FRAME 152
+#define VM_JIT_STACK_OFFSET 128
+
+struct vm__jit_buffer_t {
+	unsigned char* data;
+	int size;
+	int capacity;
+};
+
+typedef struct vm__jit_buffer_t vm__jit_buffer;
+
+static void vm__jit_byte(vm__jit_buffer* b, int v) {
+	if (b->size < b->capacity) {
+		b->data[b->size] = (unsigned char)v;
+	}
+	++b->size;
 }
 
-// ------------------------------------------------------------------
-// internal method to create a token
-// ------------------------------------------------------------------
-vm_token vm__create_token(vm_token_type type) {
-	vm_token t;
-	t.type = type;
-	t.value = 0.0f;
-	return t;
+static void vm__jit_int(vm__jit_buffer* b, int v) {
+	unsigned int u = (unsigned int)v;
+	for (int i = 0; i < 4; ++i) {
+		vm__jit_byte(b, (u >> (i * 8)) & 0xff);
+	}
 }
 
-// ------------------------------------------------------------------
-// internal method to create a token
-// ------------------------------------------------------------------
-vm_token vm__create_token_with_value(vm_token_type type, float value) {
-	vm_token t;
-	t.type = type;
-	t.value = value;
-	return t;
+static void vm__jit_ptr(vm__jit_buffer* b, const void* p) {
+	unsigned long long u = (unsigned long long)(size_t)p;
+	for (int i = 0; i < 8; ++i) {
+		vm__jit_byte(b, (int)((u >> (i * 8)) & 0xff));
+	}
+}
+
+// [prefix] [rex] 0F op modrm(11, reg, rm)
+static void vm__jit_rr(vm__jit_buffer* b, int prefix, int op, int reg, int rm) {
+	if (prefix) {
+		vm__jit_byte(b, prefix);
+	}
+	if (reg >= 8 || rm >= 8) {
+		vm__jit_byte(b, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+	}
+	vm__jit_byte(b, 0x0F);
+	vm__jit_byte(b, op);
+	vm__jit_byte(b, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [prefix] [rex] 0F op modrm(10, reg, base) [sib] disp32
+static void vm__jit_rm(vm__jit_buffer* b, int prefix, int op, int reg, int base, int disp) {
+	if (prefix) {
+		vm__jit_byte(b, prefix);
+	}
+	if (reg >= 8 || base >= 8) {
+		vm__jit_byte(b, 0x40 | ((reg >> 3) << 2) | (base >> 3));
+	}
+	vm__jit_byte(b, 0x0F);
+	vm__jit_byte(b, op);
+	vm__jit_byte(b, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == 4) {
+		vm__jit_byte(b, 0x24);
+	}
+	vm__jit_int(b, disp);
+}
+
+#define VM_JIT_RSP 4
+#define VM_JIT_RBX 3
+#define VM_JIT_R12 12
+
+#define VM_JIT_MOVSS_LOAD 0x10
+#define VM_JIT_MOVSS_STORE 0x11
+#define VM_JIT_ADDSS 0x58
+#define VM_JIT_MULSS 0x59
+#define VM_JIT_SUBSS 0x5C
+#define VM_JIT_DIVSS 0x5E
+#define VM_JIT_ANDPS 0x54
+#define VM_JIT_ANDNPS 0x55
+#define VM_JIT_ORPS 0x56
+#define VM_JIT_XORPS 0x57
+#define VM_JIT_MINSS 0x5D
+#define VM_JIT_MAXSS 0x5F
+#define VM_JIT_UCOMISS 0x2E
+#define VM_JIT_CMPSS 0xC2
+// predicates of cmpss
+#define VM_JIT_CMP_EQ 0
+#define VM_JIT_CMP_LT 1
+#define VM_JIT_CMP_LE 2
+#define VM_JIT_CMP_NEQ 4
+
+static void vm__jit_movss(vm__jit_buffer* b, int dst, int src) {
+	if (dst != src) {
+		vm__jit_rr(b, 0xF3, VM_JIT_MOVSS_LOAD, dst, src);
+	}
+}
+
+// mov eax, imm32 ; movd xmm, eax
+static void vm__jit_const(vm__jit_buffer* b, int xmm, float value) {
+	int bits;
+	memcpy(&bits, &value, sizeof(int));
+	vm__jit_byte(b, 0xB8);
+	vm__jit_int(b, bits);
+	vm__jit_rr(b, 0x66, 0x6E, xmm, 0);
+}
+
+static void vm__jit_variable(vm__jit_buffer* b, int xmm, int id) {
+	int disp = (int)(id * sizeof(float));
+	vm__jit_rm(b, 0xF3, VM_JIT_MOVSS_LOAD, xmm, VM_JIT_RBX, disp);
+}
+
+static void vm__jit_arithmetic(vm__jit_buffer* b, vm_token_type op, int dst, int src) {
+	static const int ops[] = { VM_JIT_ADDSS, VM_JIT_SUBSS, VM_JIT_MULSS, VM_JIT_DIVSS };
+	vm__jit_rr(b, 0xF3, ops[op - TOK_ADD], dst, src);
+}
+
+static void vm__jit_spill(vm__jit_buffer* b, int first, int count, int store) {
+	for (int i = first; i < first + count; ++i) {
+		vm__jit_rm(b, 0xF3, store ? VM_JIT_MOVSS_STORE : VM_JIT_MOVSS_LOAD, i, VM_JIT_RSP, i * 4);
+	}
+}
+
+// cmpss dst, src, predicate
+static void vm__jit_cmpss(vm__jit_buffer* b, int dst, int src, int predicate) {
+	vm__jit_rr(b, 0xF3, VM_JIT_CMPSS, dst, src);
+	vm__jit_byte(b, predicate);
+}
+
+// turns the mask in xmm into 1.0 or 0.0
+static void vm__jit_mask_to_one(vm__jit_buffer* b, int xmm) {
+	vm__jit_const(b, VM_JIT_TMP, 1.0f);
+	vm__jit_rr(b, 0, VM_JIT_ANDPS, xmm, VM_JIT_TMP);
+}
+
+// xorps tmp, tmp ; ucomiss xmm, tmp
+static void vm__jit_test_zero(vm__jit_buffer* b, int xmm) {
+	vm__jit_rr(b, 0, VM_JIT_XORPS, VM_JIT_TMP, VM_JIT_TMP);
+	vm__jit_rr(b, 0, VM_JIT_UCOMISS, xmm, VM_JIT_TMP);
+}
+
+// mov rax, imm64 ; call rax
+static void vm__jit_call(vm__jit_buffer* b, const void* func) {
+	vm__jit_byte(b, 0x48);
+	vm__jit_byte(b, 0xB8);
+	vm__jit_ptr(b, func);
+	vm__jit_byte(b, 0xFF);
+	vm__jit_byte(b, 0xD0);
 }
+
+// the helpers use the same expressions as vm_run so the results match
+static float vm__jit_sin(float x) { return sin(x); }
+static float vm__jit_cos(float x) { return cos(x); }
+static float vm__jit_tan(float x) { return tan(x); }
+static float vm__jit_pow(float b, float a) { return pow(b, a); }
+static float vm__jit_exp(float x) { return exp(x); }
+
+// the helper called for a math opcode
+static const void* vm__jit_math(vm_token_type type) {
+	switch (type) {
+		case TOK_SIN: return (const void*)vm__jit_sin;
+		case TOK_COS: return (const void*)vm__jit_cos;
+		case TOK_TAN: return (const void*)vm__jit_tan;
+		case TOK_POW: return (const void*)vm__jit_pow;
+		case TOK_EXP: return (const void*)vm__jit_exp;
+		case TOK_SIN_FAST: return (const void*)vm__sin_fast;
+		case TOK_COS_FAST: return (const void*)vm__cos_fast;
+		case TOK_TAN_FAST: return (const void*)vm__tan_fast;
+		case TOK_POW_FAST: return (const void*)vm__pow_fast;
+		case TOK_EXP_FAST: return (const void*)vm__exp_fast;
+		case TOK_SIN_APPROX: return (const void*)vm__sin_approx;
+		case TOK_COS_APPROX: return (const void*)vm__cos_approx;
+		case TOK_TAN_APPROX: return (const void*)vm__tan_approx;
+		case TOK_POW_APPROX: return (const void*)vm__pow_approx;
+		default: return (const void*)vm__exp_approx;
+	}
+}
+
 // ------------------------------------------------------------------
-// parse
+// internal method to translate the bytecode. Returns 0 if the
+// bytecode cannot be translated.
 // ------------------------------------------------------------------
-DSDEF int vm_parse(vm_context* ctx, const char * source, vm_token * byteCode, int capacity) {
-	int binary = 0;
-	const char* p = source;
-	unsigned num_tokens = 0;
-	unsigned overflow_tokens = 0;
-	vm_token* tokens = (vm_token*)VM_MALLOC(capacity * sizeof(vm_token));
-	while (*p != 0) {
-		vm_token token;
-		token.type = TOK_EMPTY;
-		if (*p >= '0' && *p <= '9') {
-			char *out;
-			token = vm__create_token_with_value(TOK_NUMBER, vm__strtof(p, &out));
-			p = out;
-			binary = 1;
-		}
-		else if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p == '_')) {
-			const char *identifier = p;
-			while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p == '_') || (*p >= '0' && *p <= '9'))
-				p++;
-			token = vm__token_for_identifier(ctx, identifier, p - identifier);
-			binary = 1;
+static int vm__jit_emit(vm_context* ctx, const vm_token* byteCode, int capacity, vm__jit_buffer* b) {
+	int error_jumps[256];
+	int num_error_jumps = 0;
+	int depth = 0;
+	vm__jump_target targets[VM_MAX_JUMPS];
+	int num_targets = 0;
+	// conditionals are only translated if every path has a known stack depth
+	for (int i = 0; i < capacity; ++i) {
+		if (vm__is_jump(byteCode[i].type)) {
+			int max_stack = 0;
+			if (vm__verify(byteCode, capacity, ctx->functions, &max_stack) != 0) {
+				return 0;
+			}
+			break;
 		}
-		else {
-			switch (*p) {
-				case '(': token = vm__create_token(TOK_LEFT_PARENTHESIS); binary = 0; break;
-				case ')': token = vm__create_token(TOK_RIGHT_PARENTHESIS); binary = 1; break;
-				case ' ': case '\t': case '\n': case '\r': break;
-				case '-': token = vm__token_for_identifier2(ctx, binary == 1 ? "-" : "u-"); binary = 0; break;
-				case '+': token = vm__token_for_identifier2(ctx, binary == 1 ? "+" : "u+"); binary = 0; break;
-				default: {
-					char s1[2] = { *p,0 };
-					char s2[3] = { *p, *(p + 1), 0 };
-					if (s2[1] && vm__has_function(ctx, s2)) {
-						token = vm__token_for_identifier(ctx, s2,2);
-						++p;
-					}
-					else {
-						token = vm__token_for_identifier(ctx, s1, 1);
-					}
-					binary = 0;
-					break;
-				}
+	}
+	// push rbx ; push r12 ; mov rbx, [rdi + values] ; mov r12, rsi ; sub rsp, frame
+	vm__jit_byte(b, 0x53);
+	vm__jit_byte(b, 0x41); vm__jit_byte(b, 0x54);
+	vm__jit_byte(b, 0x48); vm__jit_byte(b, 0x8B); vm__jit_byte(b, 0x9F); vm__jit_int(b, (int)offsetof(vm_context, values));
+	vm__jit_byte(b, 0x49); vm__jit_byte(b, 0x89); vm__jit_byte(b, 0xF4);
+	vm__jit_byte(b, 0x48); vm__jit_byte(b, 0x81); vm__jit_byte(b, 0xEC); vm__jit_int(b, VM_JIT_FRAME);
+	for (int i = 0; i <= capacity; ++i) {
+		// the jumps to this instruction, every path has the same depth
+		while (num_targets > 0 && targets[num_targets - 1].target == i) {
+			const vm__jump_target* j = &targets[--num_targets];
+			if (j->fixup + 4 <= b->capacity) {
+				int rel = b->size - (j->fixup + 4);
+				memcpy(b->data + j->fixup, &rel, sizeof(int));
 			}
-			++p;
+			depth = j->depth;
 		}
-
-		if (token.type != TOK_EMPTY) {
-			if (num_tokens == capacity)
-				++overflow_tokens;
-			else
-				tokens[num_tokens++] = token;
+		if (i == capacity) {
+			break;
 		}
-	}
-
-	int num_rpl = 0;
-	FunctionVMStackItem function_stack[256];
-
-	unsigned num_function_stack = 0;
-
-	int par_level = 0;
-	for (unsigned i = 0; i<num_tokens; ++i) {
-		vm_token token = tokens[i];
-		switch (token.type) {
+		const vm_token* t = &byteCode[i];
+		int top = depth - 1;
+		switch (t->type) {
+			case TOK_EMPTY: case TOK_LEFT_PARENTHESIS: case TOK_RIGHT_PARENTHESIS:
+				break;
+			case TOK_LT: case TOK_LE: case TOK_EQ: case TOK_NE:
+				if (depth < 2) {
+					return 0;
+				}
+				vm__jit_cmpss(b, top - 1, top, t->type == TOK_LT ? VM_JIT_CMP_LT : (t->type == TOK_LE ? VM_JIT_CMP_LE : (t->type == TOK_EQ ? VM_JIT_CMP_EQ : VM_JIT_CMP_NEQ)));
+				vm__jit_mask_to_one(b, top - 1);
+				--depth;
+				break;
+			case TOK_GT: case TOK_GE:
+				if (depth < 2) {
+					return 0;
+				}
+				// b > a is a < b
+				vm__jit_movss(b, VM_JIT_TMP2, top);
+				vm__jit_cmpss(b, VM_JIT_TMP2, top - 1, t->type == TOK_GT ? VM_JIT_CMP_LT : VM_JIT_CMP_LE);
+				vm__jit_movss(b, top - 1, VM_JIT_TMP2);
+				vm__jit_mask_to_one(b, top - 1);
+				--depth;
+				break;
+			case TOK_MIN: case TOK_MAX:
+				if (depth < 2) {
+					return 0;
+				}
+				vm__jit_rr(b, 0xF3, t->type == TOK_MIN ? VM_JIT_MINSS : VM_JIT_MAXSS, top - 1, top);
+				--depth;
+				break;
+			case TOK_CLAMP:
+				if (depth < 3) {
+					return 0;
+				}
+				vm__jit_rr(b, 0xF3, VM_JIT_MAXSS, top - 2, top - 1);
+				vm__jit_rr(b, 0xF3, VM_JIT_MINSS, top - 2, top);
+				depth -= 2;
+				break;
+			case TOK_BOOL:
+				if (depth < 1) {
+					return 0;
+				}
+				vm__jit_rr(b, 0, VM_JIT_XORPS, VM_JIT_TMP, VM_JIT_TMP);
+				vm__jit_cmpss(b, top, VM_JIT_TMP, VM_JIT_CMP_NEQ);
+				vm__jit_mask_to_one(b, top);
+				break;
+			case TOK_SELECT:
+				if (depth < 3) {
+					return 0;
+				}
+				// mask = c != 0 ; (a & mask) | (b & ~mask)
+				vm__jit_rr(b, 0, VM_JIT_XORPS, VM_JIT_TMP, VM_JIT_TMP);
+				vm__jit_cmpss(b, VM_JIT_TMP, top - 2, VM_JIT_CMP_NEQ);
+				vm__jit_rr(b, 0, VM_JIT_ANDPS, top - 1, VM_JIT_TMP);
+				vm__jit_rr(b, 0, VM_JIT_ANDNPS, VM_JIT_TMP, top);
+				vm__jit_rr(b, 0, VM_JIT_ORPS, top - 1, VM_JIT_TMP);
+				vm__jit_movss(b, top - 2, top - 1);
+				depth -= 2;
+				break;
+			case TOK_JUMP: case TOK_JUMP_IF_FALSE: case TOK_AND_JUMP: case TOK_OR_JUMP:
+				if (num_targets == VM_MAX_JUMPS) {
+					return 0;
+				}
+				if (t->type == TOK_JUMP) {
+					// jmp rel32
+					vm__jit_byte(b, 0xE9);
+				}
+				else if (t->type == TOK_OR_JUMP) {
+					// jumps unless the value is 0.0 (NaN is true): jp +2 ; je +5 ; jmp rel32
+					vm__jit_test_zero(b, top);
+					vm__jit_byte(b, 0x7A); vm__jit_byte(b, 0x02);
+					vm__jit_byte(b, 0x74); vm__jit_byte(b, 0x05);
+					vm__jit_byte(b, 0xE9);
+				}
+				else {
+					// jumps if the value is 0.0: jp +6 ; je rel32
+					vm__jit_test_zero(b, top);
+					vm__jit_byte(b, 0x7A); vm__jit_byte(b, 0x06);
+					vm__jit_byte(b, 0x0F); vm__jit_byte(b, 0x84);
+				}
+				num_targets = vm__add_jump_target(targets, num_targets, i + t->id, depth - (t->type == TOK_JUMP_IF_FALSE), b->size);
+				vm__jit_int(b, 0);
+				if (t->type != TOK_JUMP) {
+					--depth;
+				}
+				break;
 			case TOK_NUMBER:
 			case TOK_VARIABLE:
-				byteCode[num_rpl++] = token;
+				if (depth == VM_JIT_MAX_DEPTH) {
+					return 0;
+				}
+				if (t->type == TOK_NUMBER) {
+					vm__jit_const(b, depth, t->value);
+				}
+				else {
+					vm__jit_variable(b, depth, t->id);
+				}
+				++depth;
 				break;
-			case TOK_LEFT_PARENTHESIS:
-				++par_level;
+			case TOK_ADD: case TOK_SUB: case TOK_MUL: case TOK_DIV:
+				if (depth < 2) {
+					return 0;
+				}
+				vm__jit_arithmetic(b, t->type, top - 1, top);
+				--depth;
 				break;
-			case TOK_RIGHT_PARENTHESIS:
-				--par_level;
+			case TOK_NEG:
+			case TOK_ABS:
+				if (depth < 1) {
+					return 0;
+				}
+				// flip or clear the sign bit
+				vm__jit_byte(b, 0xB8);
+				vm__jit_int(b, t->type == TOK_NEG ? (int)0x80000000 : 0x7fffffff);
+				vm__jit_rr(b, 0x66, 0x6E, VM_JIT_TMP, 0);
+				vm__jit_rr(b, 0, t->type == TOK_NEG ? VM_JIT_XORPS : VM_JIT_ANDPS, top, VM_JIT_TMP);
+				break;
+			case TOK_SIN: case TOK_COS: case TOK_TAN: case TOK_EXP:
+			case TOK_SIN_FAST: case TOK_COS_FAST: case TOK_TAN_FAST: case TOK_EXP_FAST:
+			case TOK_SIN_APPROX: case TOK_COS_APPROX: case TOK_TAN_APPROX: case TOK_EXP_APPROX:
+				if (depth < 1) {
+					return 0;
+				}
+				vm__jit_spill(b, 0, top, 1);
+				vm__jit_movss(b, 0, top);
+				vm__jit_call(b, vm__jit_math(t->type));
+				vm__jit_movss(b, top, 0);
+				vm__jit_spill(b, 0, top, 0);
+				break;
+			case TOK_POW: case TOK_POW_FAST: case TOK_POW_APPROX:
+				if (depth < 2) {
+					return 0;
+				}
+				vm__jit_spill(b, 0, top - 1, 1);
+				vm__jit_movss(b, VM_JIT_TMP, top);
+				vm__jit_movss(b, 0, top - 1);
+				vm__jit_movss(b, 1, VM_JIT_TMP);
+				vm__jit_call(b, vm__jit_math(t->type));
+				vm__jit_movss(b, top - 1, 0);
+				vm__jit_spill(b, 0, top - 1, 0);
+				--depth;
+				break;
+			case TOK_LERP:
+				if (depth < 3) {
+					return 0;
+				}
+				// (1 - t) * b + t * a
+				vm__jit_const(b, VM_JIT_TMP, 1.0f);
+				vm__jit_rr(b, 0xF3, VM_JIT_SUBSS, VM_JIT_TMP, top);
+				vm__jit_rr(b, 0xF3, VM_JIT_MULSS, VM_JIT_TMP, top - 2);
+				vm__jit_movss(b, VM_JIT_TMP2, top);
+				vm__jit_rr(b, 0xF3, VM_JIT_MULSS, VM_JIT_TMP2, top - 1);
+				vm__jit_rr(b, 0xF3, VM_JIT_ADDSS, VM_JIT_TMP, VM_JIT_TMP2);
+				vm__jit_movss(b, top - 2, VM_JIT_TMP);
+				depth -= 2;
+				break;
+			case TOK_DUP:
+				if (depth < 1 || depth == VM_JIT_MAX_DEPTH) {
+					return 0;
+				}
+				vm__jit_movss(b, depth, top);
+				++depth;
+				break;
+			case TOK_ADD_CONST: case TOK_SUB_CONST: case TOK_MUL_CONST: case TOK_DIV_CONST:
+				if (depth < 1) {
+					return 0;
+				}
+				vm__jit_const(b, VM_JIT_TMP, t->value);
+				vm__jit_arithmetic(b, (vm_token_type)(TOK_ADD + (t->type - TOK_ADD_CONST)), top, VM_JIT_TMP);
+				break;
+			case TOK_VAR_ADD_CONST: case TOK_VAR_SUB_CONST: case TOK_VAR_MUL_CONST: case TOK_VAR_DIV_CONST:
+				if (depth == VM_JIT_MAX_DEPTH || i + 1 >= capacity) {
+					return 0;
+				}
+				vm__jit_variable(b, depth, t->id);
+				vm__jit_const(b, VM_JIT_TMP, byteCode[++i].value);
+				vm__jit_arithmetic(b, (vm_token_type)(TOK_ADD + (t->type - TOK_VAR_ADD_CONST)), depth, VM_JIT_TMP);
+				++depth;
 				break;
 			case TOK_FUNCTION: {
-				FunctionVMStackItem f;
-				f.token = token;
-				f.precedence = ctx->functions[token.id].precedence;
-				f.par_level = par_level;
-				while (num_function_stack>0 && cmp(function_stack[num_function_stack - 1],f) >= 0)
-					byteCode[num_rpl++] = function_stack[--num_function_stack].token;
-				function_stack[num_function_stack++] = f;
+				const vm_function* f = &ctx->functions[t->id];
+				int expected = depth - f->num_parameters + 1;
+				if (depth < f->num_parameters || expected > VM_JIT_MAX_DEPTH || num_error_jumps == 256) {
+					return 0;
+				}
+				if (!f->function) {
+					// typed functions take the parameters in xmm0 - xmm3
+					int first = depth - f->num_parameters;
+					vm__jit_spill(b, 0, first, 1);
+					for (int p = 0; p < f->num_parameters; ++p) {
+						vm__jit_movss(b, p, first + p);
+					}
+					vm__jit_call(b, (const void*)f->native.f1);
+					vm__jit_movss(b, first, 0);
+					vm__jit_spill(b, 0, first, 0);
+					depth = expected;
+					break;
+				}
+				vm__jit_spill(b, 0, depth, 1);
+				// lea rax, [rsp] ; mov [rsp + 128], rax
+				vm__jit_byte(b, 0x48); vm__jit_byte(b, 0x8D); vm__jit_byte(b, 0x04); vm__jit_byte(b, 0x24);
+				vm__jit_byte(b, 0x48); vm__jit_byte(b, 0x89); vm__jit_byte(b, 0x84); vm__jit_byte(b, 0x24); vm__jit_int(b, VM_JIT_STACK_OFFSET);
+				// mov dword [rsp + 136], depth ; mov dword [rsp + 140], 32
+				vm__jit_byte(b, 0xC7); vm__jit_byte(b, 0x84); vm__jit_byte(b, 0x24); vm__jit_int(b, VM_JIT_STACK_OFFSET + 8); vm__jit_int(b, depth);
+				vm__jit_byte(b, 0xC7); vm__jit_byte(b, 0x84); vm__jit_byte(b, 0x24); vm__jit_int(b, VM_JIT_STACK_OFFSET + 12); vm__jit_int(b, 32);
+				// lea rdi, [rsp + 128]
+				vm__jit_byte(b, 0x48); vm__jit_byte(b, 0x8D); vm__jit_byte(b, 0xBC); vm__jit_byte(b, 0x24); vm__jit_int(b, VM_JIT_STACK_OFFSET);
+				vm__jit_call(b, (const void*)f->function);
+				// cmp dword [rsp + 136], expected ; jne error
+				vm__jit_byte(b, 0x81); vm__jit_byte(b, 0xBC); vm__jit_byte(b, 0x24); vm__jit_int(b, VM_JIT_STACK_OFFSET + 8); vm__jit_int(b, expected);
+				vm__jit_byte(b, 0x0F); vm__jit_byte(b, 0x85);
+				error_jumps[num_error_jumps++] = b->size;
+				vm__jit_int(b, 0);
+				depth = expected;
+				vm__jit_spill(b, 0, depth, 0);
 				break;
 			}
+			default:
+				return 0;
 		}
 	}
-
-	while (num_function_stack > 0) {
-		byteCode[num_rpl++] = function_stack[--num_function_stack].token;
+	if (depth == 0) {
+		return 0;
 	}
-	VM_FREE(tokens);
-	return num_rpl;
-
+	// movss [r12], top ; xor eax, eax
+	vm__jit_rm(b, 0xF3, VM_JIT_MOVSS_STORE, depth - 1, VM_JIT_R12, 0);
+	vm__jit_byte(b, 0x31); vm__jit_byte(b, 0xC0);
+	int epilogue = b->size;
+	// add rsp, frame ; pop r12 ; pop rbx ; ret
+	vm__jit_byte(b, 0x48); vm__jit_byte(b, 0x81); vm__jit_byte(b, 0xC4); vm__jit_int(b, VM_JIT_FRAME);
+	vm__jit_byte(b, 0x41); vm__jit_byte(b, 0x5C);
+	vm__jit_byte(b, 0x5B);
+	vm__jit_byte(b, 0xC3);
+	if (num_error_jumps > 0) {
+		// mov eax, 2 ; jmp epilogue
+		int error = b->size;
+		vm__jit_byte(b, 0xB8); vm__jit_int(b, 2);
+		vm__jit_byte(b, 0xE9); vm__jit_int(b, epilogue - (b->size + 4));
+		for (int i = 0; i < num_error_jumps; ++i) {
+			int at = error_jumps[i];
+			if (at + 4 <= b->capacity) {
+				int rel = error - (at + 4);
+				memcpy(b->data + at, &rel, sizeof(int));
+			}
+		}
+	}
+	return 1;
 }
 
+#endif
+
 // ------------------------------------------------------------------
-// run
+// compile bytecode into native code. The bytecode is copied so the
+// caller can release it afterwards.
 // ------------------------------------------------------------------
-DSDEF int vm_run(vm_context* ctx, vm_token* byteCode, int capacity, float* ret) {
-	float stack_data[32] = { 0.0f };
-	vm_stack stack = { stack_data, 0, 32 };
-	for (int i = 0; i < capacity; ++i) {
-		if (byteCode[i].type == TOK_NUMBER) {
-			VM_PUSH(&stack,byteCode[i].value);
-		}
-		else if (byteCode[i].type == TOK_VARIABLE) {
-			VM_PUSH(&stack,ctx->variables[byteCode[i].id].value);
-		}
-		else if (byteCode[i].type == TOK_FUNCTION) {
-			int id = byteCode[i].id;
-			vm_function f = ctx->functions[id];
-			if (stack.size >= f.num_parameters) {
-				(f.function)(&stack);
+DSDEF vm_jit* vm_jit_compile(vm_context* ctx, vm_token* byteCode, int capacity) {
+	vm_jit* jit = (vm_jit*)VM_MALLOC(sizeof(vm_jit));
+	jit->tokens = (vm_token*)VM_MALLOC((capacity > 0 ? capacity : 1) * sizeof(vm_token));
+	memcpy(jit->tokens, byteCode, capacity * sizeof(vm_token));
+	jit->num_tokens = capacity;
+	jit->code = 0;
+	jit->code_size = 0;
+	jit->function = 0;
+#ifdef VM_JIT_NATIVE
+	vm__jit_buffer b = { 0, 0, 0 };
+	// first pass measures the code size
+	if (vm__jit_emit(ctx, byteCode, capacity, &b)) {
+		b.capacity = b.size;
+		b.size = 0;
+		b.data = (unsigned char*)VM_MALLOC(b.capacity);
+		vm__jit_emit(ctx, byteCode, capacity, &b);
+		size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		size_t size = ((size_t)b.size + page - 1) / page * page;
+		void* code = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (code != MAP_FAILED) {
+			memcpy(code, b.data, b.size);
+			if (mprotect(code, size, PROT_READ | PROT_EXEC) == 0) {
+				jit->code = code;
+				jit->code_size = size;
+				jit->function = (vm__jit_function)code;
 			}
 			else {
-				return 2;
+				munmap(code, size);
 			}
 		}
+		VM_FREE(b.data);
 	}
-	if (stack.size > 0) {
-		*ret = VM_POP(&stack);
-		return 0;
+#else
+	(void)ctx;
+#endif
+	return jit;
+}
+
+// ------------------------------------------------------------------
+// run compiled code (or the interpreter as fallback)
+// ------------------------------------------------------------------
+DSDEF int vm_jit_call(vm_jit* jit, vm_context* ctx, float* ret) {
+	if (jit->function) {
+		return (jit->function)(ctx, ret);
 	}
-	return 1;
+	return vm_run(ctx, jit->tokens, jit->num_tokens, ret);
+}
+
+// ------------------------------------------------------------------
+// returns 1 if the program runs as native code
+// ------------------------------------------------------------------
+DSDEF int vm_jit_is_native(vm_jit* jit) {
+	return jit->function != 0;
+}
+
+// ------------------------------------------------------------------
+// release compiled code
+// ------------------------------------------------------------------
+DSDEF void vm_jit_free(vm_jit* jit) {
+#ifdef VM_JIT_NATIVE
+	if (jit->code) {
+		munmap(jit->code, jit->code_size);
+	}
+#endif
+	VM_FREE(jit->tokens);
+	VM_FREE(jit);
 }
 
 DSDEF void vm_debug(vm_context* ctx, vm_token* tokens, int num) {
 	printf("bytecode: \n");
 	for (int i = 0; i < num; ++i) {
 		printf("%d : %s ", i, TOKEN_NAMES[tokens[i].type]);
-		if (tokens[i].type == TOK_FUNCTION) {
+		if (tokens[i].type == TOK_FUNCTION || (tokens[i].type >= TOK_ADD && tokens[i].type <= TOK_EXP_APPROX)) {
 			printf("%s\n", ctx->functions[tokens[i].id].name);
 		}
+		else if (tokens[i].type >= TOK_ADD_CONST && tokens[i].type <= TOK_DIV_CONST) {
+			printf("%g\n", tokens[i].value);
+		}
+		else if (tokens[i].type >= TOK_VAR_ADD_CONST && tokens[i].type <= TOK_VAR_DIV_CONST) {
+			printf("%s %g\n", ctx->variables[tokens[i].id].name, tokens[i + 1].value);
+			++i;
+		}
 		else if (tokens[i].type == TOK_NUMBER) {
 			printf("%g\n", tokens[i].value);
 		}
 		else if (tokens[i].type == TOK_VARIABLE) {
-			printf("%s %g\n", ctx->variables[tokens[i].id].name, tokens[i].value);
+			printf("%s %g\n", ctx->variables[tokens[i].id].name, ctx->values[tokens[i].id]);
+		}
+		else if (tokens[i].type >= TOK_STORE && tokens[i].type <= TOK_OUTPUT) {
+			printf("%d\n", tokens[i].id);
+		}
+		else if (vm__is_jump(tokens[i].type)) {
+			printf("-> %d\n", i + tokens[i].id);
+		}
+		else {
+			printf("\n");
 		}
 	}
 }
@@ -0,0 +1,267 @@
+// ------------------------------------------------------------------
+// ds_vm_eval - evaluates one expression over columns of raw floats
+//
+// usage: ds_vm_eval [options] expression NAME=file ...
+//   -o file        write the results to file (default stdout)
+//   -c rows        rows per chunk (default 16384)
+//   -v NAME=value  use a constant value for a variable
+//   -s             print the throughput to stderr
+//
+// Every column is a file of little endian 32 bit floats and all
+// columns must have the same number of rows. The output contains one
+// float per row in the same format. The columns are mapped into
+// memory and evaluated with vm_run_batch one chunk at a time. Pages
+// behind the current chunk are released again and the results are
+// written by a second thread from two buffers, so the memory use
+// does not depend on the size of the input.
+// ------------------------------------------------------------------
+#define DS_VM_IMPLEMENTATION
+#include "ds_vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#define EVAL_MAX_COLUMNS 64
+#define EVAL_DEFAULT_CHUNK 16384
+
+struct eval_column {
+	const char* name;
+	const char* path;
+	int id;
+	float* data;
+	size_t size;
+	// bytes at the start which are already released
+	size_t released;
+};
+
+// ------------------------------------------------------------------
+// the results of a chunk are written by the writer thread while the
+// next chunk is evaluated into the other buffer
+// ------------------------------------------------------------------
+struct eval_writer {
+	FILE* file;
+	float* buffers[2];
+	size_t counts[2];
+	int ready[2];
+	int done;
+	int failed;
+	std::mutex mutex;
+	std::condition_variable cond;
+};
+
+static void eval_write_thread(eval_writer* w) {
+	int current = 0;
+	std::unique_lock<std::mutex> lock(w->mutex);
+	for (;;) {
+		w->cond.wait(lock, [&] { return w->ready[current] || w->done; });
+		if (!w->ready[current]) {
+			break;
+		}
+		lock.unlock();
+		size_t written = fwrite(w->buffers[current], sizeof(float), w->counts[current], w->file);
+		lock.lock();
+		if (written != w->counts[current]) {
+			w->failed = 1;
+		}
+		w->ready[current] = 0;
+		w->cond.notify_all();
+		current ^= 1;
+	}
+}
+
+// ------------------------------------------------------------------
+// tell the system that the first bytes of a column are not needed
+// anymore. Only whole pages are released.
+// ------------------------------------------------------------------
+static void eval_release(eval_column* c, size_t bytes) {
+#if defined(__unix__) || defined(__APPLE__)
+	static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	bytes = bytes / page * page;
+	if (bytes > c->released) {
+		madvise((char*)c->data + c->released, bytes - c->released, MADV_DONTNEED);
+		c->released = bytes;
+	}
+#else
+	(void)c;
+	(void)bytes;
+#endif
+}
+
+static void eval_usage() {
+	fprintf(stderr, "usage: ds_vm_eval [-o output] [-c rows] [-v NAME=value] [-s] expression NAME=file ...\n");
+}
+
+static int eval_is_little_endian() {
+	unsigned int value = 1;
+	unsigned char first;
+	memcpy(&first, &value, 1);
+	return first == 1;
+}
+
+int main(int argc, char** argv) {
+	const char* output = 0;
+	const char* source = 0;
+	int chunk = EVAL_DEFAULT_CHUNK;
+	int stats = 0;
+	eval_column columns[EVAL_MAX_COLUMNS];
+	int num_columns = 0;
+	vm_context* ctx = vm_create_context();
+	for (int i = 1; i < argc; ++i) {
+		const char* arg = argv[i];
+		const char* eq = strchr(arg, '=');
+		if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+			output = argv[++i];
+		}
+		else if (strcmp(arg, "-c") == 0 && i + 1 < argc) {
+			chunk = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "-v") == 0 && i + 1 < argc && strchr(argv[i + 1], '=')) {
+			char name[256];
+			const char* value = strchr(argv[++i], '=');
+			snprintf(name, sizeof(name), "%.*s", (int)(value - argv[i]), argv[i]);
+			vm_add_variable(ctx, name, (float)atof(value + 1));
+		}
+		else if (strcmp(arg, "-s") == 0) {
+			stats = 1;
+		}
+		else if (!source) {
+			source = arg;
+		}
+		else if (eq && num_columns < EVAL_MAX_COLUMNS) {
+			eval_column* c = &columns[num_columns++];
+			// the name is terminated in place
+			argv[i][eq - arg] = '\0';
+			c->name = arg;
+			c->path = eq + 1;
+			c->id = vm_add_variable(ctx, c->name, 0.0f);
+			c->released = 0;
+		}
+		else {
+			eval_usage();
+			return 1;
+		}
+	}
+	if (!source || chunk <= 0) {
+		eval_usage();
+		return 1;
+	}
+	if (!eval_is_little_endian()) {
+		fprintf(stderr, "ds_vm_eval only supports little endian machines\n");
+		return 1;
+	}
+	// every variable known at this point has a column or a value
+	int num_variables = ctx->num_variables;
+	// every token takes at least one character, only the labels of the conditionals do not
+	int capacity = (int)strlen(source) * 2 + 1;
+	vm_token* tokens = (vm_token*)malloc(capacity * sizeof(vm_token));
+	int num = vm_parse(ctx, source, tokens, capacity);
+	if (num < 0) {
+		fprintf(stderr, "%s: %s\n", source, vm_get_error(-num));
+		return 1;
+	}
+	for (int i = 0; i < num; ++i) {
+		vm_token_type type = tokens[i].type;
+		if ((type == TOK_VARIABLE || (type >= TOK_VAR_ADD_CONST && type <= TOK_VAR_DIV_CONST)) && tokens[i].id >= num_variables) {
+			const vm_variable* v = &ctx->variables[tokens[i].id];
+			fprintf(stderr, "no column or value for %.*s\n", v->length, v->name);
+			return 1;
+		}
+	}
+	size_t rows = 0;
+	const float** mapped = (const float**)calloc(ctx->num_variables, sizeof(float*));
+	for (int i = 0; i < num_columns; ++i) {
+		eval_column* c = &columns[i];
+		// an empty column maps to 0 with a size of 0
+		void* data = 0;
+		int error = vm_map_file(c->path, &data, &c->size);
+		c->data = (float*)data;
+		if (error != 0) {
+			fprintf(stderr, "%s: %s\n", c->path, vm_get_error(error));
+			return 1;
+		}
+		if (c->size % sizeof(float) != 0) {
+			fprintf(stderr, "%s: size is not a multiple of %d bytes\n", c->path, (int)sizeof(float));
+			return 1;
+		}
+		if (i > 0 && c->size / sizeof(float) != rows) {
+			fprintf(stderr, "%s has %zu rows but %s has %zu\n", c->path, c->size / sizeof(float), columns[0].path, rows);
+			return 1;
+		}
+		rows = c->size / sizeof(float);
+#if defined(__unix__) || defined(__APPLE__)
+		if (c->data) {
+			madvise(c->data, c->size, MADV_SEQUENTIAL);
+		}
+#endif
+	}
+	FILE* file = output ? fopen(output, "wb") : stdout;
+	if (!file) {
+		fprintf(stderr, "%s: %s\n", output, vm_get_error(10));
+		return 1;
+	}
+	eval_writer writer;
+	writer.file = file;
+	writer.buffers[0] = (float*)malloc(2 * chunk * sizeof(float));
+	writer.buffers[1] = writer.buffers[0] + chunk;
+	writer.ready[0] = writer.ready[1] = 0;
+	writer.done = 0;
+	writer.failed = 0;
+	std::thread thread(eval_write_thread, &writer);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int code = 0;
+	int current = 0;
+	for (size_t base = 0; base < rows && code == 0; base += chunk) {
+		int count = rows - base < (size_t)chunk ? (int)(rows - base) : chunk;
+		{
+			std::unique_lock<std::mutex> lock(writer.mutex);
+			writer.cond.wait(lock, [&] { return !writer.ready[current]; });
+		}
+		for (int i = 0; i < num_columns; ++i) {
+			mapped[columns[i].id] = columns[i].data + base;
+		}
+		code = vm_run_batch(ctx, tokens, num, mapped, writer.buffers[current], count);
+		for (int i = 0; i < num_columns; ++i) {
+			eval_release(&columns[i], base * sizeof(float));
+		}
+		{
+			std::lock_guard<std::mutex> lock(writer.mutex);
+			writer.counts[current] = count;
+			writer.ready[current] = 1;
+		}
+		writer.cond.notify_all();
+		current ^= 1;
+	}
+	{
+		std::lock_guard<std::mutex> lock(writer.mutex);
+		writer.done = 1;
+	}
+	writer.cond.notify_all();
+	thread.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (code != 0) {
+		fprintf(stderr, "%s: %s\n", source, vm_get_error(code));
+	}
+	else if (writer.failed || fflush(file) != 0) {
+		fprintf(stderr, "%s: %s\n", output ? output : "stdout", vm_get_error(10));
+		code = 10;
+	}
+	if (stats && code == 0) {
+		double bytes = (double)rows * (num_columns + 1) * sizeof(float);
+		fprintf(stderr, "%zu rows in %.3f s: %.1f M rows/s, %.1f MB/s\n", rows, seconds, rows / seconds / 1e6, bytes / seconds / 1e6);
+	}
+	if (output) {
+		fclose(file);
+	}
+	for (int i = 0; i < num_columns; ++i) {
+		vm_unmap_file(columns[i].data, columns[i].size);
+	}
+	free(writer.buffers[0]);
+	free(mapped);
+	free(tokens);
+	vm_destroy_context(ctx);
+	return code == 0 ? 0 : 1;
+}
@@ -1,7 +1,11 @@
 #include <stdio.h>
 #define DS_VM_IMPLEMENTATION
 #define DS_VM_STATIC
+#define DS_VM_JIT
+#define DS_VM_THREADS
 #include "ds_vm.h"
+#include <atomic>
+#include <thread>
 
 void test_method(vm_stack* stack) {
 	float a = VM_POP(stack);
@@ -83,7 +87,1274 @@ int test_basic_unary_expression(vm_context* ctx) {
 	return assertEquals(ctx, tokens, ret, 246.363f);
 }
 
-void run_test(testFunction func, const char* method) {
+int test_unary_minus(vm_context* ctx) {
+	vm_add_variable(ctx, "X", 3.0f);
+	vm_token tokens[64];
+	int ret = vm_parse(ctx, "2 * -X + 1", tokens, 64);
+	return assertEquals(ctx, tokens, ret, -5.0f);
+}
+
+int test_superinstructions(vm_context* ctx) {
+	vm_add_variable(ctx, "X", 3.0f);
+	vm_token tokens[64];
+	int ret = vm_parse(ctx, "X * 4 + 2 * X - X / 2 + 7 - 1", tokens, 64);
+	if (ret != 10) {
+		printf("Error: expected 10 tokens but got %d\n", ret);
+		return 0;
+	}
+	return assertEquals(ctx, tokens, ret, 22.5f);
+}
+
+void pure_method(vm_stack* stack) {
+	float a = VM_POP(stack);
+	VM_PUSH(stack, a * 3.0f);
+}
+
+int test_constant_folding(vm_context* ctx) {
+	vm_token tokens[64];
+	int ret = vm_parse(ctx, "10 + ( 4 * 3 + 8 / 2)", tokens, 64);
+	if (ret != 1 || tokens[0].type != TOK_NUMBER) {
+		printf("Error: expected a single constant but got %d tokens\n", ret);
+		return 0;
+	}
+	return assertEquals(ctx, tokens, ret, 26.0f);
+}
+
+int test_pure_function(vm_context* ctx) {
+	vm_add_function_ex(ctx, "TRIPLE", pure_method, 17, 1, VM_FUNCTION_PURE);
+	vm_add_function(ctx, "IMPURE", pure_method, 17, 1);
+	vm_token tokens[64];
+	int ret = vm_parse(ctx, "TRIPLE(2) + 1", tokens, 64);
+	if (ret != 1) {
+		printf("Error: expected a single constant but got %d tokens\n", ret);
+		return 0;
+	}
+	ret = vm_parse(ctx, "IMPURE(2) + 1", tokens, 64);
+	if (ret != 3) {
+		printf("Error: expected 3 tokens but got %d\n", ret);
+		return 0;
+	}
+	return assertEquals(ctx, tokens, ret, 7.0f);
+}
+
+int test_simplification(vm_context* ctx) {
+	vm_add_variable(ctx, "X", 3.0f);
+	vm_token tokens[64];
+	int ret = vm_parse(ctx, "(X * 1 + 0) * (1 * X - 0) / 1 + pow(X + 1, 2) + - - X + 0 * X", tokens, 64);
+	return assertEquals(ctx, tokens, ret, 28.0f);
+}
+
+int test_parse_with_scratch(vm_context* ctx) {
+	vm_add_variable(ctx, "TIMER", 4.0f);
+	const char* source = "15.0 * cos(TIMER * -6.0) + 240.0";
+	char scratch[1024];
+	int size = vm_parse_scratch_size(source);
+	if (size > 1024) {
+		printf("Error: scratch size %d is too large\n", size);
+		return 0;
+	}
+	vm_token tokens[64];
+	// '*', 'cos', '*' and the unary '-' are pending at the same time
+	int depth = 4 * (int)sizeof(FunctionVMStackItem);
+	if (vm_parse_with_scratch(ctx, source, tokens, 64, scratch, depth - 1) != -6) {
+		printf("Error: expected '%s'\n", vm_get_error(6));
+		return 0;
+	}
+	int ret = vm_parse_with_scratch(ctx, source, tokens, 64, scratch, depth);
+	if (depth >= size || ret < 0 || !assertEquals(ctx, tokens, ret, 246.363f)) {
+		printf("Error: scratch of the real depth (%d of %d bytes) is not accepted\n", depth, size);
+		return 0;
+	}
+	if (vm_parse_with_scratch(ctx, "TIMER + UNKNOWN", tokens, 64, scratch, 1024) != -5) {
+		printf("Error: expected '%s'\n", vm_get_error(5));
+		return 0;
+	}
+	if (vm_parse(ctx, "TIMER + 1 + TIMER * 2", tokens, 2) != -4) {
+		printf("Error: expected '%s'\n", vm_get_error(4));
+		return 0;
+	}
+	ret = vm_parse_with_scratch(ctx, source, tokens, 64, scratch, size);
+	return assertEquals(ctx, tokens, ret, 246.363f);
+}
+
+int test_compile_cache(vm_context* ctx) {
+	vm_add_variable(ctx, "TIMER", 4.0f);
+	const vm_program* a = vm_compile_cached(ctx, "15.0 * cos(TIMER * -6.0) + 240.0");
+	const vm_program* b = vm_compile_cached(ctx, "15.0 * cos(TIMER * -6.0) + 240.0");
+	vm_cache_stats stats;
+	vm_get_cache_stats(ctx, &stats);
+	if (a != b || stats.hits != 1 || stats.misses != 1) {
+		printf("Error: expected 1 hit and 1 miss but got %d / %d\n", stats.hits, stats.misses);
+		return 0;
+	}
+	vm_add_function(ctx, "FOO", test_method, 17, 2);
+	vm_get_cache_stats(ctx, &stats);
+	if (stats.num_entries != 0 || stats.invalidations != 1) {
+		printf("Error: cache has not been invalidated\n");
+		return 0;
+	}
+	vm_set_cache_limit(ctx, 512);
+	const vm_program* p = vm_compile_cached(ctx, "2 + FOO(10,20)");
+	char source[32];
+	for (int i = 0; i < 16; ++i) {
+		sprintf(source, "TIMER * %d", i);
+		vm_release_cached(ctx, vm_compile_cached(ctx, source));
+	}
+	vm_get_cache_stats(ctx, &stats);
+	if (stats.bytes > 512 || stats.evictions == 0) {
+		printf("Error: cache exceeds the limit %d bytes\n", stats.bytes);
+		return 0;
+	}
+	// pinned programs survive the evictions and the invalidation
+	vm_add_function(ctx, "BAR", test_method, 17, 2);
+	float r = 0.0f;
+	float t = 0.0f;
+	if (vm_run_program(ctx, p, &r) != 0 || r != 302.0f || vm_run_program(ctx, a, &t) != 0 || fabsf(t - 246.363f) > 0.01f) {
+		printf("Error: expected: 302 and 246.363 but got %g and %g\n", r, t);
+		return 0;
+	}
+	vm_release_cached(ctx, p);
+	vm_release_cached(ctx, a);
+	vm_release_cached(ctx, b);
+	vm_set_cache_limit(ctx, 0);
+	vm_get_cache_stats(ctx, &stats);
+	if (stats.num_entries != 0 || stats.bytes != 0) {
+		printf("Error: released programs are still cached\n");
+		return 0;
+	}
+	return 1;
+}
+
+int test_jit(vm_context* ctx) {
+	const char* expressions[] = {
+		"10 + ( 4 * 3 + 8 / 2)",
+		"2 + FOO(10,20)",
+		"2 + lerp(4,8,0.25)",
+		"2 + pow((2+2),2)",
+		"2 + abs(-2)",
+		"2 + 4 + TEST",
+		"15.0 * cos(TIMER * -6.0) + 240.0",
+		"lerp(sin(TIMER), tan(TEST), abs(-TIMER / 8)) * pow(TEST, TIMER / 3) - FOO(TIMER, 2 * TEST)"
+	};
+	vm_add_function(ctx, "FOO", test_method, 17, 2);
+	vm_add_variable(ctx, "TEST", 4.0f);
+	vm_add_variable(ctx, "TIMER", 1.5f);
+	for (int i = 0; i < 8; ++i) {
+		vm_token tokens[64];
+		int num = vm_parse(ctx, expressions[i], tokens, 64);
+		vm_jit* jit = vm_jit_compile(ctx, tokens, num);
+		float expected = 0.0f;
+		float r = 0.0f;
+		int expected_code = vm_run(ctx, tokens, num, &expected);
+		int code = vm_jit_call(jit, ctx, &r);
+		vm_jit_free(jit);
+		if (code != expected_code || memcmp(&r, &expected, sizeof(float)) != 0) {
+			printf("Error: '%s' expected: %g but got %g\n", expressions[i], expected, r);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int test_run_batch(vm_context* ctx) {
+	vm_add_function(ctx, "FOO", test_method, 17, 2);
+	int x = vm_add_variable(ctx, "X", 0.0f);
+	vm_token tokens[64];
+	int num = vm_parse(ctx, "2 + lerp(sin(X), cos(X), 0.25) * pow(abs(X) + 1, 2) / tan(X * 0.1) - FOO(X,3)", tokens, 64);
+	const int count = 1000;
+	float values[count];
+	float results[count];
+	for (int i = 0; i < count; ++i) {
+		values[i] = (i - count / 2) * 0.37f;
+	}
+	const float* columns[32] = { 0 };
+	columns[x] = values;
+	int code = vm_run_batch(ctx, tokens, num, columns, results, count);
+	if (code != 0) {
+		printf("Error: %s\n", vm_get_error(code));
+		return 0;
+	}
+	for (int i = 0; i < count; ++i) {
+		vm_set_variable(ctx, "X", values[i]);
+		float expected = 0.0f;
+		vm_run(ctx, tokens, num, &expected);
+		float d = fabsf(expected - results[i]);
+		if (d > 0.0001f * (1.0f + fabsf(expected))) {
+			printf("Error: element %d expected: %g but got %g\n", i, expected, results[i]);
+			return 0;
+		}
+	}
+	// programs as deep as the stack of vm_run, the innermost operator runs at depth 32
+	int y = vm_add_variable(ctx, "Y", 0.0f);
+	float ys[count];
+	for (int i = 0; i < count; ++i) {
+		values[i] = i % 2 ? 1.0f : -1.0f;
+		ys[i] = (float)(i % 3 - 1);
+	}
+	columns[y] = ys;
+	const char* innermost[] = { "-Y", "-sin(Y)", "(Y + 1)", "(Y * 3)", "(sin(Y) - 1)" };
+	for (int k = 0; k < 5; ++k) {
+		char source[512];
+		int len = 0;
+		for (int i = 0; i < 31; ++i) {
+			len += sprintf(source + len, "X * (");
+		}
+		len += sprintf(source + len, "%s", innermost[k]);
+		for (int i = 0; i < 31; ++i) {
+			len += sprintf(source + len, ")");
+		}
+		vm_token deep[256];
+		num = vm_parse(ctx, source, deep, 256);
+		code = vm_run_batch(ctx, deep, num, columns, results, count);
+		if (code != 0) {
+			printf("Error: depth 32 with %s: %s\n", innermost[k], vm_get_error(code));
+			return 0;
+		}
+		for (int i = 0; i < count; ++i) {
+			vm_set_variable_by_handle(ctx, x, values[i]);
+			vm_set_variable_by_handle(ctx, y, ys[i]);
+			float expected = 0.0f;
+			vm_run(ctx, deep, num, &expected);
+			// without sin the results match bit for bit, including -0
+			int exact = strstr(innermost[k], "sin") == 0;
+			if (exact ? memcmp(&expected, &results[i], sizeof(float)) != 0 : fabsf(expected - results[i]) > 0.0001f) {
+				printf("Error: depth 32 with %s element %d expected: %g but got %g\n", innermost[k], i, expected, results[i]);
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+int test_run_env(vm_context* ctx) {
+	vm_add_function(ctx, "FOO", test_method, 17, 2);
+	vm_add_variable(ctx, "TIMER", 0.5f);
+	int error = 0;
+	vm_program* p = vm_compile(ctx, "FOO(TIMER, SPEED) + TIMER * 2 + SPEED", &error);
+	if (!p) {
+		printf("Error: %s\n", vm_get_error(error));
+		return 0;
+	}
+	if (ctx->num_variables != 1) {
+		printf("Error: vm_compile added variables to the context\n");
+		vm_destroy_program(p);
+		return 0;
+	}
+	// the context can change without affecting the program
+	vm_add_function(ctx, "FOO", test_method, 17, 1);
+	vm_env* a = vm_create_env(p);
+	vm_env* b = vm_create_env(p);
+	b->values[vm_get_slot(p, "TIMER")] = 2.0f;
+	b->values[vm_get_slot(p, "SPEED")] = 3.0f;
+	float ra = 0.0f;
+	float rb = 0.0f;
+	int ok = vm_run_env(p, a, &ra) == 0 && vm_run_env(p, b, &rb) == 0;
+	if (!ok || ra != 6.0f || rb != 57.0f) {
+		printf("Error: expected: 6 and 57 but got %g and %g\n", ra, rb);
+		ok = 0;
+	}
+	if (vm_get_slot(p, "UNKNOWN") != -1) {
+		printf("Error: found slot for unknown variable\n");
+		ok = 0;
+	}
+	vm_destroy_env(a);
+	vm_destroy_env(b);
+	vm_destroy_program(p);
+	return ok;
+}
+
+int test_eval_many(vm_context* ctx) {
+	const char* expressions[] = {
+		"15.0 * cos(TIMER * -6.0) + 240.0",
+		"lerp(sin(TIMER), X, 0.25) * pow(abs(X), 2)",
+		"TIMER / (X + 2)"
+	};
+	vm_program* programs[3];
+	for (int i = 0; i < 3; ++i) {
+		programs[i] = vm_compile(ctx, expressions[i], 0);
+	}
+	const int count = 10000;
+	vm_env* envs = (vm_env*)malloc(count * sizeof(vm_env));
+	float* values = (float*)malloc(count * 2 * sizeof(float));
+	vm_job* jobs = (vm_job*)malloc(count * sizeof(vm_job));
+	float* results = (float*)malloc(count * sizeof(float));
+	int* codes = (int*)malloc(count * sizeof(int));
+	for (int i = 0; i < count; ++i) {
+		const vm_program* p = programs[i % 3];
+		envs[i].values = values + i * 2;
+		envs[i].num_values = p->num_slots;
+		for (int j = 0; j < p->num_slots; ++j) {
+			envs[i].values[j] = (i % 100) * 0.1f - 5.0f + j;
+		}
+		jobs[i].program = p;
+		jobs[i].env = &envs[i];
+	}
+	// a program bound to a context cannot run on an environment
+	jobs[count - 1].program = vm_compile_cached(ctx, "TIMER");
+	int ok = 1;
+	vm_pool* pool = vm_create_pool(4);
+	int grains[] = { 0, 1, 1000, 100000 };
+	for (int g = 0; g < 4 && ok; ++g) {
+		memset(results, 0, count * sizeof(float));
+		int failed = vm_eval_many(pool, jobs, count, results, codes, grains[g]);
+		if (failed != 1 || codes[count - 1] != 7) {
+			printf("Error: expected one failed job but got %d\n", failed);
+			ok = 0;
+		}
+		for (int i = 0; i < count - 1 && ok; ++i) {
+			float expected = 0.0f;
+			vm_run_env(jobs[i].program, jobs[i].env, &expected);
+			if (codes[i] != 0 || memcmp(&expected, &results[i], sizeof(float)) != 0) {
+				printf("Error: job %d expected: %g but got %g\n", i, expected, results[i]);
+				ok = 0;
+			}
+		}
+	}
+	vm_destroy_pool(pool);
+	for (int i = 0; i < 3; ++i) {
+		vm_destroy_program(programs[i]);
+	}
+	free(codes);
+	free(results);
+	free(jobs);
+	free(values);
+	free(envs);
+	return ok;
+}
+
+int test_dependency_graph(vm_context* ctx) {
+	vm_add_variable(ctx, "TIMER", 1.0f);
+	vm_add_variable(ctx, "SCALE", 2.0f);
+	// uses SPEED before it is defined
+	vm_define(ctx, "POS", "SPEED * TIMER + OFFSET");
+	vm_define(ctx, "SPEED", "SCALE * 3");
+	vm_define(ctx, "OFFSET", "10");
+	vm_define(ctx, "OTHER", "SCALE + 1");
+	int evaluated = vm_update(ctx);
+	if (evaluated != 4 || vm_get_variable(ctx, "POS") != 16.0f) {
+		printf("Error: expected: 4 and 16 but got %d and %g\n", evaluated, vm_get_variable(ctx, "POS"));
+		return 0;
+	}
+	if (vm_update(ctx) != 0) {
+		printf("Error: clean expressions have been evaluated\n");
+		return 0;
+	}
+	// only POS reads TIMER
+	vm_set_variable(ctx, "TIMER", 2.0f);
+	evaluated = vm_update(ctx);
+	if (evaluated != 1 || vm_get_variable(ctx, "POS") != 22.0f) {
+		printf("Error: expected: 1 and 22 but got %d and %g\n", evaluated, vm_get_variable(ctx, "POS"));
+		return 0;
+	}
+	// SCALE changes SPEED and OTHER, SPEED changes POS
+	vm_set_variable(ctx, "SCALE", 1.0f);
+	evaluated = vm_update(ctx);
+	if (evaluated != 3 || vm_get_variable(ctx, "POS") != 16.0f) {
+		printf("Error: expected: 3 and 16 but got %d and %g\n", evaluated, vm_get_variable(ctx, "POS"));
+		return 0;
+	}
+	if (vm_define(ctx, "SPEED", "POS * 2") != -8) {
+		printf("Error: cycle has not been detected\n");
+		return 0;
+	}
+	vm_set_variable(ctx, "SCALE", 4.0f);
+	vm_update(ctx);
+	if (vm_get_variable(ctx, "POS") != 34.0f) {
+		printf("Error: expected: 34 but got %g\n", vm_get_variable(ctx, "POS"));
+		return 0;
+	}
+	return 1;
+}
+
+int test_define_file(vm_context* ctx) {
+	vm_add_variable(ctx, "TIMER", 1.0f);
+	vm_add_variable(ctx, "SCALE", 2.0f);
+	const char* text =
+		"# uses SPEED before it is defined\n"
+		"POS = SPEED * TIMER + OFFSET\r\n"
+		"\n"
+		"  SPEED= SCALE * 3\n"
+		"OFFSET =10\n"
+		"BROKEN 3\n"
+		"OTHER = sin(1, 2) + 3\n"
+		"A = B + 1\n"
+		"B = A * 2 + SCALE\n"
+		"LAST = POS + NEW * 2";
+	vm_line_error errors[8];
+	int failed = vm_define_text(ctx, 0, text, (int)strlen(text), errors, 8);
+	const vm_line_error expected[] = { { 6, 8, 16 }, { 7, 17, 15 }, { 9, 1, 8 } };
+	if (failed != 3) {
+		printf("Error: expected 3 failed lines but got %d\n", failed);
+		return 0;
+	}
+	for (int i = 0; i < 3; ++i) {
+		if (errors[i].line != expected[i].line || errors[i].column != expected[i].column || errors[i].code != expected[i].code) {
+			printf("Error: expected error %d at %d:%d but got %d at %d:%d\n", expected[i].code, expected[i].line, expected[i].column, errors[i].code, errors[i].line, errors[i].column);
+			return 0;
+		}
+	}
+	vm_update(ctx);
+	if (vm_get_variable(ctx, "POS") != 16.0f || vm_get_variable(ctx, "A") != 1.0f || vm_get_variable(ctx, "LAST") != 16.0f) {
+		printf("Error: expected: 16, 1 and 16 but got %g, %g and %g\n", vm_get_variable(ctx, "POS"), vm_get_variable(ctx, "A"), vm_get_variable(ctx, "LAST"));
+		return 0;
+	}
+	// a large file on four threads gives the same variables as vm_define
+	const char* path = "ds_vm_test_definitions.txt";
+	FILE* f = fopen(path, "w");
+	for (int i = 0; i < 2000; ++i) {
+		fprintf(f, "D%d = sin(V%d * %d) + D%d * 0.5 + U%d\n", i + 1, i % 37, i, (i + 1) / 2, i % 11);
+	}
+	fclose(f);
+	vm_pool* pool = vm_create_pool(4);
+	vm_context* sequential = vm_create_context();
+	int ok = vm_define_file(ctx, pool, path, errors, 8) == 0;
+	char name[32];
+	char source[128];
+	for (int i = 0; i < 2000; ++i) {
+		sprintf(name, "D%d", i + 1);
+		sprintf(source, "sin(V%d * %d) + D%d * 0.5 + U%d", i % 37, i, (i + 1) / 2, i % 11);
+		ok &= vm_define(sequential, name, source) >= 0;
+	}
+	vm_destroy_pool(pool);
+	remove(path);
+	if (!ok || vm_define_file(ctx, 0, path, 0, 0) != -10) {
+		printf("Error: vm_define_file failed\n");
+		vm_destroy_context(sequential);
+		return 0;
+	}
+	// an empty file is mapped as no data, a missing file is an error
+	void* data = &ok;
+	size_t size = 1;
+	ok = vm_map_file(path, &data, &size) == 10 && !data && size == 0;
+	fclose(fopen(path, "w"));
+	ok &= vm_map_file(path, &data, &size) == 0 && !data && size == 0 && vm_define_file(ctx, 0, path, 0, 0) == 0;
+	remove(path);
+	if (!ok) {
+		printf("Error: expected an empty mapping\n");
+		vm_destroy_context(sequential);
+		return 0;
+	}
+	int offset = ctx->num_variables - sequential->num_variables;
+	for (int i = 0; i < sequential->num_variables && ok; ++i) {
+		if (strcmp(ctx->variables[offset + i].name, sequential->variables[i].name) != 0) {
+			printf("Error: expected variable %s but got %s\n", sequential->variables[i].name, ctx->variables[offset + i].name);
+			ok = 0;
+		}
+	}
+	vm_set_variable(ctx, "V3", 0.25f);
+	vm_set_variable(sequential, "V3", 0.25f);
+	vm_update(ctx);
+	vm_update(sequential);
+	if (vm_get_variable(ctx, "D2000") != vm_get_variable(sequential, "D2000")) {
+		printf("Error: expected: %g but got %g\n", vm_get_variable(sequential, "D2000"), vm_get_variable(ctx, "D2000"));
+		ok = 0;
+	}
+	vm_destroy_context(sequential);
+	return ok;
+}
+
+int test_multiple_outputs(vm_context* ctx) {
+	const char* sources[] = {
+		"15.0 * cos(TIMER * 4) + sin(TIMER * 2) * 3",
+		"cos(TIMER * 4) * pow(sin(TIMER * 2), 2) - 1",
+		"lerp(cos(TIMER * 4), sin(TIMER * 2), 0.5) + FOO(TIMER, 1)",
+		"TIMER"
+	};
+	vm_add_function(ctx, "FOO", test_method, 17, 2);
+	vm_add_variable(ctx, "TIMER", 0.7f);
+	vm_token tokens[128];
+	int num = vm_parse_many(ctx, sources, 4, tokens, 128);
+	if (num < 0) {
+		printf("Error: %s\n", vm_get_error(-num));
+		return 0;
+	}
+	int cos_count = 0;
+	for (int i = 0; i < num; ++i) {
+		cos_count += tokens[i].type == TOK_COS;
+	}
+	if (cos_count != 1) {
+		printf("Error: expected one cos but found %d\n", cos_count);
+		return 0;
+	}
+	float outputs[4];
+	int code = vm_run_many(ctx, tokens, num, outputs, 4);
+	if (code != 0) {
+		printf("Error: %s\n", vm_get_error(code));
+		return 0;
+	}
+	for (int i = 0; i < 4; ++i) {
+		vm_token single[64];
+		int n = vm_parse(ctx, sources[i], single, 64);
+		if (!assertEquals(ctx, single, n, outputs[i])) {
+			return 0;
+		}
+	}
+	if (vm_run_many(ctx, tokens, num, outputs, 2) != 9) {
+		printf("Error: missing outputs have not been reported\n");
+		return 0;
+	}
+	return 1;
+}
+
+int test_program_file(vm_context* ctx) {
+	vm_add_function(ctx, "FOO", test_method, 17, 2);
+	const char* expressions[] = {
+		"FOO(TIMER, SPEED) + TIMER * 2 + SPEED",
+		"15.0 * cos(TIMER * -6.0) + 240.0",
+		"lerp(X, 2, 0.25) - 4"
+	};
+	const char* names[] = { "foo", "wave", 0 };
+	const vm_program* programs[3];
+	float expected[3];
+	for (int i = 0; i < 3; ++i) {
+		programs[i] = vm_compile(ctx, expressions[i], 0);
+		vm_env* env = vm_create_env(programs[i]);
+		vm_run_env(programs[i], env, &expected[i]);
+		vm_destroy_env(env);
+	}
+	const char* path = "ds_vm_test_programs.bin";
+	int ok = vm_save_programs(path, programs, names, 3) == 0;
+	for (int i = 0; i < 3; ++i) {
+		vm_destroy_program((vm_program*)programs[i]);
+	}
+	// functions are resolved by name in the loading context
+	vm_context* other = vm_create_context();
+	int error = 0;
+	if (vm_load_programs(other, path, &error) != 0 || error != 5) {
+		printf("Error: loaded a file with an unknown function\n");
+		ok = 0;
+	}
+	vm_add_function(other, "FOO", test_method, 17, 2);
+	vm_program_file* file = vm_load_programs(other, path, &error);
+	if (!file) {
+		printf("Error: %s\n", vm_get_error(error));
+		vm_destroy_context(other);
+		remove(path);
+		return 0;
+	}
+	if (vm_num_programs(file) != 3 || vm_find_program(file, "wave") != 1 || vm_find_program(file, "none") != -1) {
+		printf("Error: wrong programs in file\n");
+		ok = 0;
+	}
+	for (int i = 0; i < vm_num_programs(file); ++i) {
+		const vm_program* p = vm_get_program(file, i);
+		vm_env* env = vm_create_env(p);
+		float r = 0.0f;
+		if (vm_run_env(p, env, &r) != 0 || r != expected[i]) {
+			printf("Error: expected: %g but got %g\n", expected[i], r);
+			ok = 0;
+		}
+		vm_destroy_env(env);
+	}
+	vm_close_programs(file);
+	// a damaged file is rejected
+	FILE* f = fopen(path, "r+b");
+	fseek(f, -3, SEEK_END);
+	fputc('#', f);
+	fclose(f);
+	if (vm_load_programs(other, path, &error) != 0 || error != 11) {
+		printf("Error: loaded a damaged file\n");
+		ok = 0;
+	}
+	vm_destroy_context(other);
+	remove(path);
+	return ok;
+}
+
+// declares one parameter but leaves two values on the stack
+void unbalanced_method(vm_stack* stack) {
+	float a = VM_POP(stack);
+	VM_PUSH(stack, a);
+	VM_PUSH(stack, a);
+}
+
+int test_verify(vm_context* ctx) {
+	vm_token tokens[64];
+	int ok = 1;
+	if (vm_parse(ctx, "1, 2", tokens, 64) != -12 || vm_parse(ctx, "2 + sin", tokens, 64) != -2 || vm_parse(ctx, "2 + sin()", tokens, 64) != -15) {
+		printf("Error: accepted an invalid expression\n");
+		ok = 0;
+	}
+	// deeper than the stack of vm_run
+	char source[1024];
+	int len = 0;
+	for (int i = 0; i < 80; ++i) {
+		len += sprintf(source + len, "X + (");
+	}
+	len += sprintf(source + len, "X");
+	for (int i = 0; i < 80; ++i) {
+		len += sprintf(source + len, ")");
+	}
+	vm_add_variable(ctx, "X", 0.5f);
+	vm_token deep[256];
+	float r = 0.0f;
+	int num = vm_parse(ctx, source, deep, 256);
+	if (vm_run(ctx, deep, num, &r) != 3) {
+		printf("Error: expected '%s'\n", vm_get_error(3));
+		ok = 0;
+	}
+	vm_program* p = vm_compile(ctx, source, 0);
+	vm_env* env = vm_create_env(p);
+	if (p->max_stack != 81 || vm_run_env(p, env, &r) != 0 || r != 40.5f) {
+		printf("Error: expected: 40.5 with a stack of 81 but got %g with %d\n", r, p->max_stack);
+		ok = 0;
+	}
+	vm_destroy_env(env);
+	vm_destroy_program(p);
+	// the result of a function is checked against its declaration
+	vm_add_function(ctx, "BAD", unbalanced_method, 17, 1);
+	p = vm_compile(ctx, "BAD(X) * 2", 0);
+	env = vm_create_env(p);
+	num = vm_parse(ctx, "BAD(X) * 2", deep, 256);
+	vm_packed* packed = vm_pack(ctx, deep, num, 0);
+	if (vm_run(ctx, deep, num, &r) != 2 || vm_run_env(p, env, &r) != 2 || vm_run_packed(ctx, packed, &r) != 2) {
+		printf("Error: expected '%s' for an unbalanced function\n", vm_get_error(2));
+		ok = 0;
+	}
+	vm_destroy_packed(packed);
+	vm_destroy_env(env);
+	vm_destroy_program(p);
+	return ok;
+}
+
+int compare_packed(vm_context* ctx, const char* source) {
+	vm_token tokens[256];
+	int num = vm_parse(ctx, source, tokens, 256);
+	float expected = 0.0f;
+	float r = 0.0f;
+	vm_run(ctx, tokens, num, &expected);
+	int error = 0;
+	vm_packed* packed = vm_pack(ctx, tokens, num, &error);
+	if (packed == 0 || vm_run_packed(ctx, packed, &r) != 0 || memcmp(&r, &expected, sizeof(float)) != 0) {
+		printf("Error: '%s' expected: %g but got %g (error %d)\n", source, expected, r, error);
+		vm_destroy_packed(packed);
+		return 0;
+	}
+	vm_destroy_packed(packed);
+	return 1;
+}
+
+int test_packed(vm_context* ctx) {
+	vm_add_variable(ctx, "X", 1.5f);
+	vm_add_variable(ctx, "Y", -2.0f);
+	int ok = compare_packed(ctx, "X * 2.5 + Y * 2.5 + 2.5");
+	ok &= compare_packed(ctx, "lerp(X, Y, 0.25) - abs(Y) / 3");
+	ok &= compare_packed(ctx, "sin(X) * cos(Y) + tan(0.5) - pow(X, 2)");
+	ok &= compare_packed(ctx, "-(X - 4) * (X - 4)");
+	vm_token tokens[64];
+	int num = vm_parse(ctx, "X * 2 + Y * 2 + 2", tokens, 64);
+	vm_packed* packed = vm_pack(ctx, tokens, num, 0);
+	if (packed->num_constants != 1 || packed->code_size >= num * (int)sizeof(vm_token)) {
+		printf("Error: expected 1 constant but got %d\n", packed->num_constants);
+		ok = 0;
+	}
+	vm_destroy_packed(packed);
+	// variable ids above 255 need 2 byte operands
+	char name[16];
+	for (int i = 0; i < 300; ++i) {
+		sprintf(name, "V%d", i);
+		vm_add_variable(ctx, name, (float)i);
+	}
+	ok &= compare_packed(ctx, "V299 * 3 + V256 - V1 / 7");
+	int error = 0;
+	tokens[0].type = TOK_NUMBER;
+	tokens[0].value = 1.0f;
+	tokens[1] = tokens[0];
+	if (vm_pack(ctx, tokens, 2, &error) != 0 || error != 12) {
+		printf("Error: expected '%s'\n", vm_get_error(12));
+		ok = 0;
+	}
+	return ok;
+}
+
+int test_lut(vm_context* ctx) {
+	int ok = 1;
+	int error = 0;
+	vm_program* p = vm_compile(ctx, "sin(TIMER) * 2 + 1", 0);
+	vm_env* env = vm_create_env(p);
+	int sizes[2] = { 0 };
+	for (int interpolation = VM_LUT_LINEAR; interpolation <= VM_LUT_CUBIC; ++interpolation) {
+		vm_lut* lut = vm_create_lut(p, "TIMER", 0.0f, 6.3f, 0.001f, interpolation, &error);
+		if (!lut || error != 0) {
+			printf("Error: no lookup table (%s)\n", vm_get_error(error));
+			vm_destroy_program(p);
+			vm_destroy_env(env);
+			return 0;
+		}
+		sizes[interpolation] = lut->size;
+		for (int i = 0; i <= 1000; ++i) {
+			float x = i * 0.0063f;
+			float expected = 0.0f;
+			env->values[vm_get_slot(p, "TIMER")] = x;
+			vm_run_env(p, env, &expected);
+			float r = vm_lut_eval(lut, x);
+			if (fabsf(r - expected) > 0.001f) {
+				printf("Error: %g expected: %g but got %g\n", x, expected, r);
+				ok = 0;
+				break;
+			}
+		}
+		float x[3] = { -1.0f, 3.0f, 7.0f };
+		float r[3];
+		vm_lut_eval_batch(lut, x, r, 3);
+		if (r[0] != vm_lut_eval(lut, 0.0f) || r[1] != vm_lut_eval(lut, 3.0f) || r[2] != vm_lut_eval(lut, 6.3f)) {
+			printf("Error: values outside of the range are not clamped\n");
+			ok = 0;
+		}
+		vm_destroy_lut(lut);
+	}
+	if (sizes[VM_LUT_CUBIC] >= sizes[VM_LUT_LINEAR]) {
+		printf("Error: cubic table with %d entries is not smaller than %d\n", sizes[VM_LUT_CUBIC], sizes[VM_LUT_LINEAR]);
+		ok = 0;
+	}
+	vm_destroy_env(env);
+	vm_destroy_program(p);
+	// refused tables
+	const char* sources[] = { "X / abs(X)", "1 / X", "X * 2", "Y * 2" };
+	const float ranges[] = { -1.0f, 1.3f, 0.0f, 1.0f, 1.0f, 1.0f, 0.0f, 1.0f };
+	const int codes[] = { 13, 14, 14, 5 };
+	for (int i = 0; i < 4; ++i) {
+		p = vm_compile(ctx, sources[i], 0);
+		if (vm_create_lut(p, "X", ranges[i * 2], ranges[i * 2 + 1], 0.001f, VM_LUT_LINEAR, &error) != 0 || error != codes[i]) {
+			printf("Error: '%s' expected '%s' but got '%s'\n", sources[i], vm_get_error(codes[i]), vm_get_error(error));
+			ok = 0;
+		}
+		vm_destroy_program(p);
+	}
+	return ok;
+}
+
+// largest error of a function in ulp (fast) or relative to
+// max(1, |reference|) (approx) over a grid of inputs
+double precision_error(vm_context* ctx, const char* source, float from, float to, int ulp) {
+	vm_token tokens[16];
+	int num = vm_parse(ctx, source, tokens, 16);
+	int x = vm_get_variable_handle(ctx, "X");
+	double max_error = 0.0;
+	for (int i = 0; i <= 10000; ++i) {
+		float v = from + (to - from) * i / 10000.0f;
+		vm_set_variable_by_handle(ctx, x, v);
+		float r = 0.0f;
+		vm_run(ctx, tokens, num, &r);
+		double expected = source[0] == 's' ? sin((double)v) : source[0] == 'c' ? cos((double)v) : source[0] == 't' ? tan((double)v) : source[0] == 'e' ? exp((double)v) : pow((double)v, (double)1.7f);
+		float f = (float)fabs(expected);
+		double scale = ulp ? (double)(nextafterf(f, 3.4e38f) - f) : (fabs(expected) > 1.0 ? fabs(expected) : 1.0);
+		double e = fabs(r - expected) / scale;
+		if (e > max_error) {
+			max_error = e;
+		}
+	}
+	return max_error;
+}
+
+int test_precision(vm_context* ctx) {
+	int ok = 1;
+	vm_token tokens[16];
+	float r = 0.0f;
+	int num = vm_parse(ctx, "exp(1)", tokens, 16);
+	if (vm_run(ctx, tokens, num, &r) != 0 || r != (float)exp(1.0)) {
+		printf("Error: exp(1) expected: %g but got %g\n", exp(1.0), r);
+		ok = 0;
+	}
+	const char* sources[] = { "sin(X)", "cos(X)", "tan(X)", "exp(X)", "pow(X, 1.7)" };
+	const float ranges[] = { -50.0f, 50.0f, -50.0f, 50.0f, -1.5f, 1.5f, -80.0f, 80.0f, 0.001f, 1000.0f };
+	for (int mode = VM_PRECISION_FAST; mode <= VM_PRECISION_APPROX; ++mode) {
+		vm_context* precise = vm_create_context_ex(mode);
+		vm_add_variable(precise, "X", 0.0f);
+		for (int i = 0; i < 5; ++i) {
+			double e = precision_error(precise, sources[i], ranges[i * 2], ranges[i * 2 + 1], mode == VM_PRECISION_FAST);
+			if (e > (mode == VM_PRECISION_FAST ? 3.0 : 5e-4)) {
+				printf("Error: '%s' with precision %d has an error of %g\n", sources[i], mode, e);
+				ok = 0;
+			}
+		}
+		// the precision variants are folded and optimized like the exact ones
+		num = vm_parse(precise, "pow(X, 2) + sin(0)", tokens, 16);
+		if (num != 3 || tokens[2].type != TOK_MUL) {
+			printf("Error: expected 3 tokens but got %d\n", num);
+			ok = 0;
+		}
+		vm_destroy_context(precise);
+	}
+	return ok;
+}
+
+float typed_square(float a) {
+	return a * a;
+}
+
+float typed_hypot(float a, float b) {
+	return sqrtf(a * a + b * b);
+}
+
+float typed_mad(float a, float b, float c) {
+	return a * b + c;
+}
+
+float typed_sum(float a, float b, float c, float d) {
+	return a + b * 2.0f + c * 3.0f + d * 4.0f;
+}
+
+static int array_calls = 0;
+
+void typed_hypot_array(const float* const* args, float* out, int n) {
+	++array_calls;
+	for (int i = 0; i < n; ++i) {
+		out[i] = sqrtf(args[0][i] * args[0][i] + args[1][i] * args[1][i]);
+	}
+}
+
+int test_typed_functions(vm_context* ctx) {
+	vm_add_function_1(ctx, "SQ", typed_square, VM_FUNCTION_PURE);
+	vm_add_function_2(ctx, "HYP", typed_hypot, 0);
+	vm_add_function_3(ctx, "MAD", typed_mad, 0);
+	vm_add_function_4(ctx, "SUM", typed_sum, 0);
+	int x = vm_add_variable(ctx, "X", 3.0f);
+	int ok = 1;
+	vm_token tokens[64];
+	const char* source = "HYP(SQ(X), MAD(X, 2, lerp(1, 2, 0.5))) + SUM(1, X, SQ(2), -X)";
+	int num = vm_parse(ctx, source, tokens, 64);
+	ok &= assertEquals(ctx, tokens, num, sqrtf(81.0f + 56.25f) + 1.0f + 6.0f + 12.0f - 12.0f);
+	// pure typed functions are folded
+	if (vm_parse(ctx, "SQ(4)", tokens, 64) != 1 || tokens[0].value != 16.0f) {
+		printf("Error: SQ(4) was not folded\n");
+		ok = 0;
+	}
+	// the number of arguments is checked for every call
+	const char* invalid[] = { "HYP(1)", "HYP(1, 2, 3)", "2 * SQ()", "1 + lerp(1, 2)", "MAD(1, (2, 3))" };
+	for (int i = 0; i < 5; ++i) {
+		int code = vm_parse(ctx, invalid[i], tokens, 64);
+		if (code != -15) {
+			printf("Error: '%s' expected: -15 but got %d\n", invalid[i], code);
+			ok = 0;
+		}
+	}
+	num = vm_parse(ctx, source, tokens, 64);
+	float expected = 0.0f;
+	vm_run(ctx, tokens, num, &expected);
+	float r = 0.0f;
+	vm_packed* packed = vm_pack(ctx, tokens, num, 0);
+	if (vm_run_packed(ctx, packed, &r) != 0 || r != expected) {
+		printf("Error: packed expected: %g but got %g\n", expected, r);
+		ok = 0;
+	}
+	vm_destroy_packed(packed);
+	vm_jit* jit = vm_jit_compile(ctx, tokens, num);
+	if (vm_jit_call(jit, ctx, &r) != 0 || r != expected) {
+		printf("Error: jit expected: %g but got %g\n", expected, r);
+		ok = 0;
+	}
+	vm_jit_free(jit);
+	// typed functions are told apart by their pointers
+	vm_program* p = vm_compile(ctx, source, 0);
+	vm_env* env = vm_create_env(p);
+	if (p->num_functions != 4 || vm_run_env(p, env, &r) != 0 || r != expected) {
+		printf("Error: program expected: %g but got %g\n", expected, r);
+		ok = 0;
+	}
+	vm_destroy_env(env);
+	vm_destroy_program(p);
+	// the array variant is called once per batch
+	float values[200];
+	float results[200];
+	const float* columns[16] = { 0 };
+	columns[x] = values;
+	for (int i = 0; i < 200; ++i) {
+		values[i] = i * 0.25f - 10.0f;
+	}
+	for (int pass = 0; pass < 2; ++pass) {
+		if (pass == 1 && vm_set_array_function(ctx, "HYP", typed_hypot_array) != 0) {
+			printf("Error: cannot set the array function\n");
+			ok = 0;
+		}
+		num = vm_parse(ctx, source, tokens, 64);
+		if (vm_run_batch(ctx, tokens, num, columns, results, 200) != 0) {
+			printf("Error: batch failed\n");
+			ok = 0;
+		}
+		for (int i = 0; i < 200; ++i) {
+			vm_set_variable_by_handle(ctx, x, values[i]);
+			vm_run(ctx, tokens, num, &expected);
+			if (fabsf(results[i] - expected) > 1e-4f * fabsf(expected)) {
+				printf("Error: batch expected: %g but got %g\n", expected, results[i]);
+				ok = 0;
+				break;
+			}
+		}
+	}
+	if (array_calls != 4 || vm_set_array_function(ctx, "sin", typed_hypot_array) != 5) {
+		printf("Error: expected 4 calls of the array function but got %d\n", array_calls);
+		ok = 0;
+	}
+	return ok;
+}
+
+static int counted_calls = 0;
+
+void counted_method(vm_stack* stack) {
+	++counted_calls;
+	VM_PUSH(stack, VM_POP(stack) * 2.0f);
+}
+
+int test_conditionals(vm_context* ctx) {
+	vm_add_function(ctx, "COUNT", counted_method, 17, 1);
+	int x = vm_add_variable(ctx, "X", 3.0f);
+	int ok = 1;
+	vm_token tokens[64];
+	struct conditional_case {
+		const char* source;
+		float expected;
+	};
+	const conditional_case cases[] = {
+		{ "X < 4", 1.0f }, { "X <= 3", 1.0f }, { "X > 3", 0.0f }, { "X >= 3", 1.0f }, { "X == 3", 1.0f }, { "X != 3", 0.0f },
+		{ "1 + X < 2 * X", 1.0f },
+		{ "X > 2 == 1", 1.0f },
+		{ "X > 2 ? 10 : 20", 10.0f },
+		{ "X > 2 ? 1 : 2 + 10", 1.0f },
+		{ "(X > 2 ? 1 : 2) + 10", 11.0f },
+		{ "X > 5 ? 10 : X > 2 ? 30 : 40", 30.0f },
+		{ "X < 5 ? X > 4 ? 1 : 2 : 3", 2.0f },
+		{ "lerp(X > 2 ? 0 : 1, 10, 0.5)", 5.0f },
+		{ "X > 2 && X < 4", 1.0f },
+		{ "X > 2 && 5", 1.0f },
+		{ "X > 5 || X", 1.0f },
+		{ "X > 5 || 0", 0.0f },
+		{ "X && 0 || 2", 1.0f },
+		{ "min(X, 2) + max(X, 5) + clamp(X * 4, 0, 10)", 17.0f },
+		{ "select(X - 3, 1, 2) + select(X, 10, 20)", 12.0f }
+	};
+	int num_cases = sizeof(cases) / sizeof(cases[0]);
+	for (int i = 0; i < num_cases; ++i) {
+		int num = vm_parse(ctx, cases[i].source, tokens, 64);
+		float r = -1.0f;
+		if (num <= 0 || vm_run(ctx, tokens, num, &r) != 0 || r != cases[i].expected) {
+			printf("Error: '%s' expected: %g but got %g (%d)\n", cases[i].source, cases[i].expected, r, num);
+			ok = 0;
+		}
+	}
+	// constant conditions keep only the taken branch
+	if (vm_parse(ctx, "2 > 1 ? X : COUNT(X)", tokens, 64) != 1 || vm_parse(ctx, "0 && COUNT(X)", tokens, 64) != 1 || tokens[0].value != 0.0f) {
+		printf("Error: constant conditions were not folded\n");
+		ok = 0;
+	}
+	// the branch which is not taken is never evaluated
+	const char* lazy[] = { "X > 2 ? X : COUNT(X)", "X < 2 ? COUNT(X) : X", "X < 2 && COUNT(X)", "X > 2 || COUNT(X)" };
+	for (int i = 0; i < 4; ++i) {
+		int num = vm_parse(ctx, lazy[i], tokens, 64);
+		float r = 0.0f;
+		vm_run(ctx, tokens, num, &r);
+		vm_packed* packed = vm_pack(ctx, tokens, num, 0);
+		vm_run_packed(ctx, packed, &r);
+		vm_destroy_packed(packed);
+		vm_jit* jit = vm_jit_compile(ctx, tokens, num);
+		vm_jit_call(jit, ctx, &r);
+		vm_jit_free(jit);
+	}
+	if (counted_calls != 0) {
+		printf("Error: the branch which is not taken was called %d times\n", counted_calls);
+		ok = 0;
+	}
+	const char* invalid[] = { "X ? 1", "X : 1", "(X ? 1) : 2", "X ? 1 : 2 : 3" };
+	for (int i = 0; i < 4; ++i) {
+		int code = vm_parse(ctx, invalid[i], tokens, 64);
+		if (code != -17) {
+			printf("Error: '%s' expected: -17 but got %d\n", invalid[i], code);
+			ok = 0;
+		}
+	}
+	// every backend agrees with vm_run
+	const char* source = "X > 0 ? sin(X) * 2 : X < -5 && COUNT(X) < -12 ? clamp(X, -7, -6) : max(X, -2) + (X == -3)";
+	float values[200];
+	float results[200];
+	const float* columns[16] = { 0 };
+	columns[x] = values;
+	for (int i = 0; i < 200; ++i) {
+		values[i] = i * 0.125f - 12.0f;
+	}
+	int num = vm_parse(ctx, source, tokens, 64);
+	if (vm_run_batch(ctx, tokens, num, columns, results, 200) != 0) {
+		printf("Error: batch failed\n");
+		ok = 0;
+	}
+	int error = 0;
+	vm_packed* packed = vm_pack(ctx, tokens, num, &error);
+	vm_jit* jit = vm_jit_compile(ctx, tokens, num);
+	vm_program* p = vm_compile(ctx, source, 0);
+	vm_env* env = vm_create_env(p);
+	for (int i = 0; i < 200 && ok; ++i) {
+		vm_set_variable_by_handle(ctx, x, values[i]);
+		env->values[vm_get_slot(p, "X")] = values[i];
+		float expected = 0.0f;
+		float r[4] = { 0.0f };
+		vm_run(ctx, tokens, num, &expected);
+		vm_run_packed(ctx, packed, &r[0]);
+		vm_jit_call(jit, ctx, &r[1]);
+		vm_run_env(p, env, &r[2]);
+		r[3] = results[i];
+		for (int j = 0; j < 4; ++j) {
+			if (fabsf(r[j] - expected) > 1e-5f) {
+				printf("Error: X = %g expected: %g but got %g (backend %d)\n", values[i], expected, r[j], j);
+				ok = 0;
+			}
+		}
+	}
+	vm_destroy_env(env);
+	vm_destroy_program(p);
+	vm_jit_free(jit);
+	vm_destroy_packed(packed);
+	return ok;
+}
+
+int test_reduce(vm_context* ctx) {
+	vm_program* p = vm_compile(ctx, "X > 0 ? X * X * 0.5 - Y * X : Y - X", 0);
+	vm_env* env = vm_create_env(p);
+	int x = vm_get_slot(p, "X");
+	env->values[vm_get_slot(p, "Y")] = 3.0f;
+	const int count = 100003;
+	float* values = (float*)malloc(count * sizeof(float));
+	double sum = 0.0;
+	float lo = HUGE_VALF;
+	float hi = -HUGE_VALF;
+	for (int i = 0; i < count; ++i) {
+		values[i] = i * 0.01f - 500.0f;
+		float r = 0.0f;
+		env->values[x] = values[i];
+		vm_run_env(p, env, &r);
+		sum += r;
+		lo = r < lo ? r : lo;
+		hi = r > hi ? r : hi;
+	}
+	const float* columns[2] = { 0 };
+	columns[x] = values;
+	int ok = 1;
+	vm_pool* pool = vm_create_pool(4);
+	const double expected[] = { sum, lo, hi, sum / count };
+	for (int reduction = 0; reduction < 8; ++reduction) {
+		float r = 0.0f;
+		float parallel = 0.0f;
+		if (vm_reduce(0, p, env, columns, count, reduction, &r) != 0 || vm_reduce(pool, p, env, columns, count, reduction, &parallel) != 0) {
+			printf("Error: reduction %d failed\n", reduction);
+			ok = 0;
+			continue;
+		}
+		// the result does not depend on the number of threads
+		double e = expected[reduction & 3];
+		double error = fabs(r - e) / fabs(e);
+		if (memcmp(&r, &parallel, sizeof(float)) != 0 || error > ((reduction & VM_REDUCE_KAHAN) ? 1e-7 : 1e-5)) {
+			printf("Error: reduction %d expected: %.9g but got %.9g and %.9g\n", reduction, e, r, parallel);
+			ok = 0;
+		}
+	}
+	float r = 1.0f;
+	if (vm_reduce(pool, p, env, columns, 0, VM_REDUCE_SUM, &r) != 0 || r != 0.0f || vm_reduce(0, p, env, columns, 0, VM_REDUCE_MIN, &r) != 0 || r != HUGE_VALF) {
+		printf("Error: expected the neutral element but got %g\n", r);
+		ok = 0;
+	}
+	if (vm_reduce(pool, p, env, columns, 0, VM_REDUCE_MEAN, &r) != 19 || vm_reduce(0, p, env, columns, 0, VM_REDUCE_MEAN | VM_REDUCE_KAHAN, &r) != 19) {
+		printf("Error: expected '%s'\n", vm_get_error(19));
+		ok = 0;
+	}
+	if (vm_reduce(pool, vm_compile_cached(ctx, "X"), 0, columns, count, VM_REDUCE_SUM, &r) != 7) {
+		printf("Error: expected '%s'\n", vm_get_error(7));
+		ok = 0;
+	}
+	vm_destroy_pool(pool);
+	vm_destroy_env(env);
+	vm_destroy_program(p);
+	free(values);
+	return ok;
+}
+
+int test_snapshots(vm_context* ctx) {
+	const int num_variables = 64;
+	const int num_readers = 3;
+	const int generations = 20000;
+	char name[16];
+	for (int i = 0; i < num_variables; ++i) {
+		sprintf(name, "V%d", i);
+		vm_add_variable(ctx, name, 0.0f);
+	}
+	vm_token tokens[64];
+	int num = vm_parse(ctx, "V0 - V63 + V31 * (V7 == V8)", tokens, 64);
+	int ok = 1;
+	if (vm_pin_snapshot(ctx, 0) != 0 || vm_publish(ctx) != 0) {
+		printf("Error: snapshots are not enabled\n");
+		ok = 0;
+	}
+	vm_enable_snapshots(ctx, num_readers);
+	std::atomic<int> done(0);
+	std::atomic<int> mixed(0);
+	std::atomic<int> reads(0);
+	std::thread readers[num_readers];
+	for (int r = 0; r < num_readers; ++r) {
+		readers[r] = std::thread([&, r]() {
+			long long last = 0;
+			while (!done.load()) {
+				const vm_snapshot* s = vm_pin_snapshot(ctx, r);
+				// generation g is published with epoch g + 1
+				float g = (float)(s->epoch - 1);
+				int error = s->epoch < last || s->num_values != num_variables;
+				for (int i = 0; i < s->num_values; ++i) {
+					error |= s->values[i] != g;
+				}
+				float result = 0.0f;
+				error |= vm_run_snapshot(ctx, s, tokens, num, &result) != 0 || result != g;
+				last = s->epoch;
+				vm_unpin_snapshot(ctx, r);
+				mixed += error;
+				++reads;
+			}
+		});
+	}
+	while (reads < num_readers) {
+		std::this_thread::yield();
+	}
+	for (int g = 1; g <= generations; ++g) {
+		for (int i = 0; i < num_variables; ++i) {
+			vm_set_variable_by_handle(ctx, i, (float)g);
+		}
+		vm_publish(ctx);
+		// let the readers run on machines with few cores
+		if (g % 64 == 0) {
+			std::this_thread::yield();
+		}
+	}
+	done = 1;
+	for (int r = 0; r < num_readers; ++r) {
+		readers[r].join();
+	}
+	if (mixed != 0 || reads == 0) {
+		printf("Error: %d of %d reads saw mixed values\n", mixed.load(), reads.load());
+		ok = 0;
+	}
+	// without pinned snapshots the buffers are reused
+	int num_buffers = ctx->snapshots->num_buffers;
+	for (int g = 0; g < 100; ++g) {
+		vm_publish(ctx);
+	}
+	const vm_snapshot* s = vm_pin_snapshot(ctx, 0);
+	if (ctx->snapshots->num_buffers != num_buffers || num_buffers > generations / 2 || s->epoch != generations + 101) {
+		printf("Error: expected %d buffers but got %d\n", num_buffers, ctx->snapshots->num_buffers);
+		ok = 0;
+	}
+	vm_unpin_snapshot(ctx, 0);
+	return ok;
+}
+
+#ifdef DS_VM_COMPILE_TIME
+typedef ds_vm::function<"FOO", 2> foo_function;
+
+template<typename E>
+int compare_compiled(vm_context* ctx, const E& e, const char* source) {
+	vm_token tokens[64];
+	int num = vm_parse(ctx, source, tokens, 64);
+	float expected = 0.0f;
+	vm_run(ctx, tokens, num, &expected);
+	const char* names[] = { "TEST", "TIMER", "X", "SPEED" };
+	float values[16] = { 0.0f };
+	for (int i = 0; i < 4; ++i) {
+		int index = E::find_variable(names[i]);
+		if (index != -1) {
+			values[index] = vm_get_variable(ctx, names[i]);
+		}
+	}
+	float r = e(values);
+	if (memcmp(&r, &expected, sizeof(float)) != 0) {
+		printf("Error: '%s' expected: %g but got %g\n", source, expected, r);
+		return 0;
+	}
+	return 1;
+}
+
+#define COMPARE_COMPILED(source) compare_compiled(ctx, ds_vm::compile<source, foo_function>(test_method), source)
+
+int test_compile_time(vm_context* ctx) {
+	vm_add_function(ctx, "FOO", test_method, 17, 2);
+	vm_add_variable(ctx, "TEST", 4.0f);
+	vm_add_variable(ctx, "TIMER", 1.5f);
+	vm_add_variable(ctx, "X", 3.0f);
+	vm_add_variable(ctx, "SPEED", -2.0f);
+	int ok = 1;
+	ok &= COMPARE_COMPILED("10 + ( 4 * 3 + 8 / 2)");
+	ok &= COMPARE_COMPILED("2 + FOO(10,20)");
+	ok &= COMPARE_COMPILED("2 + lerp(4,8,0.25)");
+	ok &= COMPARE_COMPILED("2 + pow((2+2),2)");
+	ok &= COMPARE_COMPILED("2 + abs(-2)");
+	ok &= COMPARE_COMPILED("2 + 4 + TEST");
+	ok &= COMPARE_COMPILED("15.0 * cos(TIMER * -6.0) + 240.0");
+	ok &= COMPARE_COMPILED("2 * -X + 1");
+	ok &= COMPARE_COMPILED("X * 4 + 2 * X - X / 2 + 7 - 1");
+	ok &= COMPARE_COMPILED("(X * 1 + 0) * (1 * X - 0) / 1 + pow(X + 1, 2) + - - X + 0 * X");
+	ok &= COMPARE_COMPILED("lerp(sin(TIMER), tan(TEST), abs(-TIMER / 8)) * pow(TEST, TIMER / 3) - FOO(TIMER, 2 * TEST)");
+	ok &= COMPARE_COMPILED("2 + lerp(sin(X), cos(X), 0.25) * pow(abs(X) + 1, 2) / tan(X * 0.1) - FOO(X,3)");
+	ok &= COMPARE_COMPILED("lerp(sin(TIMER), X, 0.25) * pow(abs(X), 2)");
+	ok &= COMPARE_COMPILED("cos(TIMER * 4) * pow(sin(TIMER * 2), 2) - 1");
+	ok &= COMPARE_COMPILED("FOO(TIMER, SPEED) + TIMER * 2 + SPEED");
+	ok &= COMPARE_COMPILED("TIMER / (X + 2)");
+	ok &= COMPARE_COMPILED("exp(TIMER * 0.5) - exp(-X)");
+	ok &= COMPARE_COMPILED("X > 2 ? FOO(X, 1) : TIMER * 2");
+	ok &= COMPARE_COMPILED("SPEED < 0 ? X < 0 ? 1 : 2 : 3");
+	ok &= COMPARE_COMPILED("clamp(X, 0, 2) + min(TIMER, X) - max(SPEED, -1)");
+	ok &= COMPARE_COMPILED("X < 4 && TIMER >= 1.5 || SPEED == 0");
+	ok &= COMPARE_COMPILED("select(X != 3, TEST, 1 > 2 ? 5 : 6)");
+	// variables are bound by name at compile time
+	constexpr auto e = ds_vm::compile<"X * 2 - TIMER">();
+	static_assert(e.num_variables == 2 && e.variable<"TIMER">() == 1, "wrong variables");
+	if (e(3.0f, 1.0f) != 5.0f) {
+		printf("Error: expected: 5 but got %g\n", e(3.0f, 1.0f));
+		ok = 0;
+	}
+	// typed functions are called with their operands
+	vm_add_function_3(ctx, "MAD", typed_mad, 0);
+	auto mad = ds_vm::compile<"MAD(X, TIMER, FOO(X, 1)) * 2", ds_vm::typed_function<"MAD", 3>, foo_function>(typed_mad, test_method);
+	ok &= compare_compiled(ctx, mad, "MAD(X, TIMER, FOO(X, 1)) * 2");
+	return ok;
+}
+#endif
+
+#ifdef DS_VM_PROFILE
+int test_profile(vm_context* ctx) {
+	vm_add_function(ctx, "FOO", test_method, 17, 2);
+	vm_add_variable(ctx, "X", 0.5f);
+	vm_token tokens[64];
+	int num = vm_parse(ctx, "sin(X) + FOO(X, 2)", tokens, 64);
+	vm_profile_reset(ctx);
+	for (int i = 0; i < 100; ++i) {
+		float r = 0.0f;
+		vm_run(ctx, tokens, num, &r);
+	}
+	vm_profile_report(ctx);
+	vm_profile_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	const char* names[] = { "sin", "FOO", "+", "TOK_VARIABLE" };
+	const unsigned long long counts[] = { 100, 100, 100, 200 };
+	for (int i = 0; i < 4; ++i) {
+		if (!vm_get_profile(ctx, names[i], &stats) || stats.count != counts[i]) {
+			printf("Error: expected %llu calls of %s but got %llu\n", counts[i], names[i], stats.count);
+			return 0;
+		}
+	}
+	// the same buffer reused for another program gets its own entry
+	vm_token first[64];
+	memcpy(first, tokens, num * sizeof(vm_token));
+	int other = vm_parse(ctx, "X * 3", tokens, 64);
+	for (int i = 0; i < 10; ++i) {
+		float r = 0.0f;
+		vm_run(ctx, tokens, other, &r);
+	}
+	vm_profile_report(ctx);
+	vm_profile_stats program;
+	memset(&program, 0, sizeof(program));
+	if (!vm_get_program_profile(ctx, first, num, &stats) || stats.count != 100 || !vm_get_program_profile(ctx, tokens, other, &program) || program.count != 10) {
+		printf("Error: expected 100 and 10 runs but got %llu and %llu\n", stats.count, program.count);
+		return 0;
+	}
+	return 1;
+}
+#endif
+
+// returns 1 if the test has failed
+int run_test(testFunction func, const char* method) {
 	printf("executing '%s'\n", method);
 	vm_context* ctx = vm_create_context();
 	int ret = (func)(ctx);
@@ -94,15 +1365,48 @@ void run_test(testFunction func, const char* method) {
 		printf("=> OK\n");
 	}
 	vm_destroy_context(ctx);
+	return ret == 0;
 }
 
 int main() {
-	run_test(test_basic_expression, "test_basic_expression");
-	run_test(test_add_function, "test_add_function");
-	run_test(test_lerp_function, "test_lerp_function");
-	run_test(test_pow_function, "test_pow_function");
-	run_test(test_abs_function, "test_abs_function");
-	run_test(test_variable, "test_variable");
-	run_test(test_basic_unary_expression, "test_basic_unary_expression");
-	run_test(test_unknown_variable, "test_unknown_variable");	
-}
\ No newline at end of file
+	int failed = 0;
+	failed += run_test(test_basic_expression, "test_basic_expression");
+	failed += run_test(test_add_function, "test_add_function");
+	failed += run_test(test_lerp_function, "test_lerp_function");
+	failed += run_test(test_pow_function, "test_pow_function");
+	failed += run_test(test_abs_function, "test_abs_function");
+	failed += run_test(test_variable, "test_variable");
+	failed += run_test(test_basic_unary_expression, "test_basic_unary_expression");
+	failed += run_test(test_unknown_variable, "test_unknown_variable");
+	failed += run_test(test_unary_minus, "test_unary_minus");
+	failed += run_test(test_superinstructions, "test_superinstructions");
+	failed += run_test(test_constant_folding, "test_constant_folding");
+	failed += run_test(test_pure_function, "test_pure_function");
+	failed += run_test(test_simplification, "test_simplification");
+	failed += run_test(test_parse_with_scratch, "test_parse_with_scratch");
+	failed += run_test(test_compile_cache, "test_compile_cache");
+	failed += run_test(test_jit, "test_jit");
+	failed += run_test(test_run_batch, "test_run_batch");
+	failed += run_test(test_run_env, "test_run_env");
+	failed += run_test(test_eval_many, "test_eval_many");
+	failed += run_test(test_dependency_graph, "test_dependency_graph");
+	failed += run_test(test_define_file, "test_define_file");
+	failed += run_test(test_multiple_outputs, "test_multiple_outputs");
+	failed += run_test(test_program_file, "test_program_file");
+	failed += run_test(test_verify, "test_verify");
+	failed += run_test(test_packed, "test_packed");
+	failed += run_test(test_lut, "test_lut");
+	failed += run_test(test_precision, "test_precision");
+	failed += run_test(test_typed_functions, "test_typed_functions");
+	failed += run_test(test_conditionals, "test_conditionals");
+	failed += run_test(test_reduce, "test_reduce");
+	failed += run_test(test_snapshots, "test_snapshots");
+#ifdef DS_VM_COMPILE_TIME
+	failed += run_test(test_compile_time, "test_compile_time");
+#endif
+#ifdef DS_VM_PROFILE
+	failed += run_test(test_profile, "test_profile");
+#endif
+	printf("%d tests failed\n", failed);
+	return failed;
+}